@@ -0,0 +1,672 @@
+#include "Bvh.hpp"
+#include "CpuProfiler.hpp"
+
+#include <emmintrin.h>
+
+#include <algorithm>
+#include <cfloat>
+#include <chrono>
+#include <cmath>
+#include <cstring>
+#include <functional>
+
+namespace gps {
+
+    // centroid bins per axis the split planes are picked from
+    static const int SAH_BINS = 16;
+    // past this depth the binary tree splits at the median, which halves what is left every level and bounds the
+    // traversal stack (each level pushes at most 3 siblings)
+    static const int MAX_BUILD_DEPTH = 48;
+    static const int STACK_SIZE = 3 * (MAX_BUILD_DEPTH + 32) + 1;
+
+    struct BuildNode {
+        glm::vec3 boxMin;
+        glm::vec3 boxMax;
+        // children, -1 for a leaf
+        int left;
+        int right;
+        int first;
+        int count;
+    };
+
+    struct BuildState {
+        const glm::vec3* boxMins;
+        const glm::vec3* boxMaxs;
+        std::vector<glm::vec3> centers;
+        std::vector<int>* order;
+        int maxLeafSize;
+        std::vector<BuildNode> nodes;
+    };
+
+    // half the surface area, 0 for an empty box
+    static GLfloat halfArea(const glm::vec3& boxMin, const glm::vec3& boxMax)
+    {
+        glm::vec3 size = glm::max(boxMax - boxMin, glm::vec3(0.0f));
+        return size.x * size.y + size.y * size.z + size.z * size.x;
+    }
+
+    static int binOf(GLfloat center, GLfloat start, GLfloat scale)
+    {
+        return std::min(SAH_BINS - 1, std::max(0, (int)((center - start) * scale)));
+    }
+
+    // Binary node over order[first, first + count): split where the binned surface area heuristic is cheapest.
+    // Whatever fits in a leaf stays one, its primitives are tested side by side for the price of one.
+    static int buildBinary(BuildState& state, int first, int count, int depth)
+    {
+        std::vector<int>& order = *state.order;
+        BuildNode node;
+        node.boxMin = glm::vec3(FLT_MAX);
+        node.boxMax = glm::vec3(-FLT_MAX);
+        glm::vec3 centerMin(FLT_MAX);
+        glm::vec3 centerMax(-FLT_MAX);
+        for (int i = first; i < first + count; i++) {
+            int primitive = order[i];
+            node.boxMin = glm::min(node.boxMin, state.boxMins[primitive]);
+            node.boxMax = glm::max(node.boxMax, state.boxMaxs[primitive]);
+            centerMin = glm::min(centerMin, state.centers[primitive]);
+            centerMax = glm::max(centerMax, state.centers[primitive]);
+        }
+        node.left = -1;
+        node.right = -1;
+        node.first = first;
+        node.count = count;
+        int index = (int)state.nodes.size();
+        state.nodes.push_back(node);
+        if (count <= 1)
+            return index;
+
+        int bestAxis = -1;
+        int bestBin = 0;
+        GLfloat bestCost = FLT_MAX;
+        if (depth < MAX_BUILD_DEPTH) {
+            for (int axis = 0; axis < 3; axis++) {
+                GLfloat extent = centerMax[axis] - centerMin[axis];
+                if (extent <= 0.0f)
+                    continue;
+                GLfloat scale = (GLfloat)SAH_BINS / extent;
+                glm::vec3 binMins[SAH_BINS];
+                glm::vec3 binMaxs[SAH_BINS];
+                int binCounts[SAH_BINS];
+                for (int b = 0; b < SAH_BINS; b++) {
+                    binMins[b] = glm::vec3(FLT_MAX);
+                    binMaxs[b] = glm::vec3(-FLT_MAX);
+                    binCounts[b] = 0;
+                }
+                for (int i = first; i < first + count; i++) {
+                    int primitive = order[i];
+                    int b = binOf(state.centers[primitive][axis], centerMin[axis], scale);
+                    binMins[b] = glm::min(binMins[b], state.boxMins[primitive]);
+                    binMaxs[b] = glm::max(binMaxs[b], state.boxMaxs[primitive]);
+                    binCounts[b]++;
+                }
+                // areas and counts left of each plane, then swept from the right
+                GLfloat leftAreas[SAH_BINS - 1];
+                int leftCounts[SAH_BINS - 1];
+                glm::vec3 sweepMin(FLT_MAX);
+                glm::vec3 sweepMax(-FLT_MAX);
+                int sweepCount = 0;
+                for (int b = 0; b < SAH_BINS - 1; b++) {
+                    sweepMin = glm::min(sweepMin, binMins[b]);
+                    sweepMax = glm::max(sweepMax, binMaxs[b]);
+                    sweepCount += binCounts[b];
+                    leftAreas[b] = halfArea(sweepMin, sweepMax);
+                    leftCounts[b] = sweepCount;
+                }
+                sweepMin = glm::vec3(FLT_MAX);
+                sweepMax = glm::vec3(-FLT_MAX);
+                sweepCount = 0;
+                for (int b = SAH_BINS - 1; b > 0; b--) {
+                    sweepMin = glm::min(sweepMin, binMins[b]);
+                    sweepMax = glm::max(sweepMax, binMaxs[b]);
+                    sweepCount += binCounts[b];
+                    if (leftCounts[b - 1] == 0 || sweepCount == 0)
+                        continue;
+                    GLfloat cost = leftAreas[b - 1] * leftCounts[b - 1] + halfArea(sweepMin, sweepMax) * sweepCount;
+                    if (cost < bestCost) {
+                        bestCost = cost;
+                        bestAxis = axis;
+                        bestBin = b - 1;
+                    }
+                }
+            }
+        }
+
+        int middle;
+        if (bestAxis >= 0) {
+            if (count <= state.maxLeafSize)
+                return index;
+            GLfloat start = centerMin[bestAxis];
+            GLfloat scale = (GLfloat)SAH_BINS / (centerMax[bestAxis] - start);
+            int axis = bestAxis;
+            int splitBin = bestBin;
+            const std::vector<glm::vec3>& centers = state.centers;
+            middle = (int)(std::partition(order.begin() + first, order.begin() + first + count,
+                [&](int primitive) { return binOf(centers[primitive][axis], start, scale) <= splitBin; }) - order.begin());
+        } else {
+            // every center in one point, or too deep: the largest axis split at the median
+            if (count <= state.maxLeafSize)
+                return index;
+            glm::vec3 extent = centerMax - centerMin;
+            int axis = extent.x >= extent.y && extent.x >= extent.z ? 0 : (extent.y >= extent.z ? 1 : 2);
+            middle = first + count / 2;
+            const std::vector<glm::vec3>& centers = state.centers;
+            std::nth_element(order.begin() + first, order.begin() + middle, order.begin() + first + count,
+                [&](int a, int b) { return centers[a][axis] < centers[b][axis]; });
+        }
+
+        int left = buildBinary(state, first, middle - first, depth + 1);
+        int right = buildBinary(state, middle, first + count - middle, depth + 1);
+        state.nodes[index].left = left;
+        state.nodes[index].right = right;
+        return index;
+    }
+
+    static void setSlot(BvhNode& node, int slot, const glm::vec3& boxMin, const glm::vec3& boxMax)
+    {
+        node.minX[slot] = boxMin.x;
+        node.minY[slot] = boxMin.y;
+        node.minZ[slot] = boxMin.z;
+        node.maxX[slot] = boxMax.x;
+        node.maxY[slot] = boxMax.y;
+        node.maxZ[slot] = boxMax.z;
+    }
+
+    // 4-wide node from a binary one: its children, then the biggest inner ones among them replaced by theirs until
+    // there are 4. Nodes are stored parents first.
+    static int collapse(const BuildState& state, int binary, int parent, int parentSlot,
+        std::vector<BvhNode>& nodes, std::vector<BvhLeaf>& leaves)
+    {
+        int index = (int)nodes.size();
+        nodes.push_back(BvhNode());
+        nodes[index].parent = parent;
+        nodes[index].parentSlot = parentSlot;
+
+        int children[4];
+        int count = 0;
+        const BuildNode& node = state.nodes[binary];
+        if (node.left < 0) {
+            children[count++] = binary;
+        } else {
+            children[count++] = node.left;
+            children[count++] = node.right;
+            while (count < 4) {
+                int widest = -1;
+                GLfloat widestArea = -1.0f;
+                for (int k = 0; k < count; k++) {
+                    const BuildNode& child = state.nodes[children[k]];
+                    GLfloat area = halfArea(child.boxMin, child.boxMax);
+                    if (child.left >= 0 && area > widestArea) {
+                        widest = k;
+                        widestArea = area;
+                    }
+                }
+                if (widest < 0)
+                    break;
+                const BuildNode& child = state.nodes[children[widest]];
+                children[widest] = child.left;
+                children[count++] = child.right;
+            }
+        }
+
+        for (int slot = 0; slot < 4; slot++) {
+            if (slot >= count) {
+                setSlot(nodes[index], slot, glm::vec3(FLT_MAX), glm::vec3(-FLT_MAX));
+                nodes[index].children[slot] = BvhNode::EMPTY;
+                continue;
+            }
+            const BuildNode& child = state.nodes[children[slot]];
+            setSlot(nodes[index], slot, child.boxMin, child.boxMax);
+            if (child.left < 0) {
+                BvhLeaf leaf = { child.first, child.count, index, slot };
+                nodes[index].children[slot] = ~(int)leaves.size();
+                leaves.push_back(leaf);
+            } else {
+                int childIndex = collapse(state, children[slot], index, slot, nodes, leaves);
+                nodes[index].children[slot] = childIndex;
+            }
+        }
+        return index;
+    }
+
+    // 4-wide tree over count boxes, order gets the primitives of each leaf back to back
+    static void buildTree(const glm::vec3* boxMins, const glm::vec3* boxMaxs, int count, int maxLeafSize,
+        std::vector<int>& order, std::vector<BvhNode>& nodes, std::vector<BvhLeaf>& leaves)
+    {
+        nodes.clear();
+        leaves.clear();
+        order.resize(count);
+        if (count == 0)
+            return;
+
+        BuildState state;
+        state.boxMins = boxMins;
+        state.boxMaxs = boxMaxs;
+        state.order = &order;
+        state.maxLeafSize = maxLeafSize;
+        state.centers.resize(count);
+        for (int i = 0; i < count; i++) {
+            order[i] = i;
+            state.centers[i] = (boxMins[i] + boxMaxs[i]) * 0.5f;
+        }
+        state.nodes.reserve(2 * count);
+        buildBinary(state, 0, count, 0);
+        nodes.reserve(state.nodes.size() / 2 + 1);
+        collapse(state, 0, -1, 0, nodes, leaves);
+    }
+
+    // the ray splatted across the lanes
+    struct TraversalRay {
+        __m128 origin[3];
+        __m128 direction[3];
+        __m128 inverseDirection[3];
+    };
+
+    static void prepareRay(const Ray& ray, TraversalRay* prepared)
+    {
+        for (int axis = 0; axis < 3; axis++) {
+            // a direction parallel to an axis would give infinite slab distances and NaNs on the slab's planes
+            GLfloat direction = ray.direction[axis];
+            GLfloat slabDirection = fabsf(direction) < 1e-12f ? (direction < 0.0f ? -1e-12f : 1e-12f) : direction;
+            prepared->origin[axis] = _mm_set1_ps(ray.origin[axis]);
+            prepared->direction[axis] = _mm_set1_ps(direction);
+            prepared->inverseDirection[axis] = _mm_set1_ps(1.0f / slabDirection);
+        }
+    }
+
+    // slab test of the 4 children up to maxDistance: bit k set if child k is hit, entry distances in entries
+    static inline int intersectNode(const BvhNode& node, const TraversalRay& ray, __m128 maxDistance, GLfloat* entries)
+    {
+        __m128 nearX = _mm_mul_ps(_mm_sub_ps(_mm_loadu_ps(node.minX), ray.origin[0]), ray.inverseDirection[0]);
+        __m128 farX = _mm_mul_ps(_mm_sub_ps(_mm_loadu_ps(node.maxX), ray.origin[0]), ray.inverseDirection[0]);
+        __m128 nearY = _mm_mul_ps(_mm_sub_ps(_mm_loadu_ps(node.minY), ray.origin[1]), ray.inverseDirection[1]);
+        __m128 farY = _mm_mul_ps(_mm_sub_ps(_mm_loadu_ps(node.maxY), ray.origin[1]), ray.inverseDirection[1]);
+        __m128 nearZ = _mm_mul_ps(_mm_sub_ps(_mm_loadu_ps(node.minZ), ray.origin[2]), ray.inverseDirection[2]);
+        __m128 farZ = _mm_mul_ps(_mm_sub_ps(_mm_loadu_ps(node.maxZ), ray.origin[2]), ray.inverseDirection[2]);
+        __m128 entry = _mm_max_ps(_mm_max_ps(_mm_min_ps(nearX, farX), _mm_min_ps(nearY, farY)),
+            _mm_max_ps(_mm_min_ps(nearZ, farZ), _mm_setzero_ps()));
+        __m128 exit = _mm_min_ps(_mm_min_ps(_mm_max_ps(nearX, farX), _mm_max_ps(nearY, farY)),
+            _mm_min_ps(_mm_max_ps(nearZ, farZ), maxDistance));
+        _mm_storeu_ps(entries, entry);
+        return _mm_movemask_ps(_mm_cmple_ps(entry, exit));
+    }
+
+    // Moller-Trumbore on the 4 triangles of a leaf, both faces. The closest hit before maxDistance shortens it.
+    static inline bool intersectTriangles(const BvhTriangles& leaf, const TraversalRay& ray, GLfloat* maxDistance, int* triangle)
+    {
+        __m128 e1x = _mm_loadu_ps(leaf.edge1[0]);
+        __m128 e1y = _mm_loadu_ps(leaf.edge1[1]);
+        __m128 e1z = _mm_loadu_ps(leaf.edge1[2]);
+        __m128 e2x = _mm_loadu_ps(leaf.edge2[0]);
+        __m128 e2y = _mm_loadu_ps(leaf.edge2[1]);
+        __m128 e2z = _mm_loadu_ps(leaf.edge2[2]);
+        const __m128* d = ray.direction;
+
+        // p = d x edge2, det = edge1 . p
+        __m128 px = _mm_sub_ps(_mm_mul_ps(d[1], e2z), _mm_mul_ps(d[2], e2y));
+        __m128 py = _mm_sub_ps(_mm_mul_ps(d[2], e2x), _mm_mul_ps(d[0], e2z));
+        __m128 pz = _mm_sub_ps(_mm_mul_ps(d[0], e2y), _mm_mul_ps(d[1], e2x));
+        __m128 det = _mm_add_ps(_mm_add_ps(_mm_mul_ps(e1x, px), _mm_mul_ps(e1y, py)), _mm_mul_ps(e1z, pz));
+
+        // s = origin - v0, q = s x edge1
+        __m128 sx = _mm_sub_ps(ray.origin[0], _mm_loadu_ps(leaf.v0[0]));
+        __m128 sy = _mm_sub_ps(ray.origin[1], _mm_loadu_ps(leaf.v0[1]));
+        __m128 sz = _mm_sub_ps(ray.origin[2], _mm_loadu_ps(leaf.v0[2]));
+        __m128 qx = _mm_sub_ps(_mm_mul_ps(sy, e1z), _mm_mul_ps(sz, e1y));
+        __m128 qy = _mm_sub_ps(_mm_mul_ps(sz, e1x), _mm_mul_ps(sx, e1z));
+        __m128 qz = _mm_sub_ps(_mm_mul_ps(sx, e1y), _mm_mul_ps(sy, e1x));
+
+        // null edges (unused lanes, degenerate triangles) divide by 0 and fail every comparison below
+        __m128 inverseDet = _mm_div_ps(_mm_set1_ps(1.0f), det);
+        __m128 u = _mm_mul_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(sx, px), _mm_mul_ps(sy, py)), _mm_mul_ps(sz, pz)), inverseDet);
+        __m128 v = _mm_mul_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(d[0], qx), _mm_mul_ps(d[1], qy)), _mm_mul_ps(d[2], qz)), inverseDet);
+        __m128 t = _mm_mul_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(e2x, qx), _mm_mul_ps(e2y, qy)), _mm_mul_ps(e2z, qz)), inverseDet);
+
+        __m128 zero = _mm_setzero_ps();
+        __m128 hit = _mm_and_ps(_mm_cmpneq_ps(det, zero), _mm_cmpge_ps(u, zero));
+        hit = _mm_and_ps(hit, _mm_cmpge_ps(v, zero));
+        hit = _mm_and_ps(hit, _mm_cmple_ps(_mm_add_ps(u, v), _mm_set1_ps(1.0f)));
+        hit = _mm_and_ps(hit, _mm_cmpgt_ps(t, zero));
+        hit = _mm_and_ps(hit, _mm_cmplt_ps(t, _mm_set1_ps(*maxDistance)));
+        int mask = _mm_movemask_ps(hit);
+        if (mask == 0)
+            return false;
+
+        GLfloat distances[4];
+        _mm_storeu_ps(distances, t);
+        for (int k = 0; k < 4; k++) {
+            if ((mask & (1 << k)) && distances[k] < *maxDistance) {
+                *maxDistance = distances[k];
+                *triangle = leaf.triangles[k];
+            }
+        }
+        return true;
+    }
+
+    // Walks the tree nearest child first. testLeaf(leaf, maxDistance) returns whether the leaf was hit and shortens
+    // maxDistance to the hit; anyHit stops at the first one.
+    template <typename LeafTest>
+    static bool traverse(const std::vector<BvhNode>& nodes, const TraversalRay& ray, GLfloat* maxDistance, bool anyHit,
+        LeafTest testLeaf)
+    {
+        if (nodes.empty())
+            return false;
+        int stack[STACK_SIZE];
+        GLfloat stackEntries[STACK_SIZE];
+        int top = 0;
+        stack[top] = 0;
+        stackEntries[top++] = 0.0f;
+        bool found = false;
+        while (top > 0) {
+            top--;
+            if (stackEntries[top] > *maxDistance)
+                continue;
+            int item = stack[top];
+            if (item < 0) {
+                if (testLeaf(~item, maxDistance)) {
+                    found = true;
+                    if (anyHit)
+                        return true;
+                }
+                continue;
+            }
+
+            const BvhNode& node = nodes[item];
+            GLfloat entries[4];
+            int mask = intersectNode(node, ray, _mm_set1_ps(*maxDistance), entries);
+            // hit children sorted far to near, so the nearest is popped first
+            int hits[4];
+            int hitCount = 0;
+            for (int k = 0; k < 4; k++) {
+                if (!(mask & (1 << k)) || node.children[k] == BvhNode::EMPTY)
+                    continue;
+                int position = hitCount++;
+                while (position > 0 && entries[hits[position - 1]] < entries[k]) {
+                    hits[position] = hits[position - 1];
+                    position--;
+                }
+                hits[position] = k;
+            }
+            for (int h = 0; h < hitCount; h++) {
+                stack[top] = node.children[hits[h]];
+                stackEntries[top++] = entries[hits[h]];
+            }
+        }
+        return found;
+    }
+
+    static void fillStats(BvhStats& stats, const std::vector<BvhNode>& nodes, int leafCount)
+    {
+        stats.nodes = (unsigned int)nodes.size();
+        stats.leaves = (unsigned int)leafCount;
+    }
+
+    MeshBvh::MeshBvh()
+    {
+        this->boxMin = glm::vec3(0.0f);
+        this->boxMax = glm::vec3(0.0f);
+        this->triangleCount = 0;
+        std::memset(&this->stats, 0, sizeof(BvhStats));
+    }
+
+    void MeshBvh::build(const std::vector<glm::vec3>& triangles)
+    {
+        gps::CpuZone zone("MeshBvh::build");
+        std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+
+        int count = (int)(triangles.size() / 3);
+        std::vector<glm::vec3> boxMins(count);
+        std::vector<glm::vec3> boxMaxs(count);
+        this->boxMin = glm::vec3(FLT_MAX);
+        this->boxMax = glm::vec3(-FLT_MAX);
+        for (int i = 0; i < count; i++) {
+            const glm::vec3* vertices = &triangles[3 * i];
+            boxMins[i] = glm::min(vertices[0], glm::min(vertices[1], vertices[2]));
+            boxMaxs[i] = glm::max(vertices[0], glm::max(vertices[1], vertices[2]));
+            this->boxMin = glm::min(this->boxMin, boxMins[i]);
+            this->boxMax = glm::max(this->boxMax, boxMaxs[i]);
+        }
+        if (count == 0) {
+            this->boxMin = glm::vec3(0.0f);
+            this->boxMax = glm::vec3(0.0f);
+        }
+        this->triangleCount = count;
+
+        std::vector<int> order;
+        std::vector<BvhLeaf> leaves;
+        buildTree(boxMins.data(), boxMaxs.data(), count, 4, order, this->nodes, leaves);
+
+        this->leafTriangles.resize(leaves.size());
+        for (size_t l = 0; l < leaves.size(); l++) {
+            BvhTriangles& leaf = this->leafTriangles[l];
+            std::memset(&leaf, 0, sizeof(BvhTriangles));
+            for (int k = 0; k < 4; k++) {
+                leaf.triangles[k] = -1;
+                if (k >= leaves[l].count)
+                    continue;
+                int triangle = order[leaves[l].first + k];
+                const glm::vec3* vertices = &triangles[3 * triangle];
+                glm::vec3 edge1 = vertices[1] - vertices[0];
+                glm::vec3 edge2 = vertices[2] - vertices[0];
+                for (int axis = 0; axis < 3; axis++) {
+                    leaf.v0[axis][k] = vertices[0][axis];
+                    leaf.edge1[axis][k] = edge1[axis];
+                    leaf.edge2[axis][k] = edge2[axis];
+                }
+                leaf.triangles[k] = triangle;
+            }
+        }
+
+        fillStats(this->stats, this->nodes, (int)leaves.size());
+        this->stats.builds++;
+        this->stats.buildMs = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+    }
+
+    bool MeshBvh::intersect(const Ray& ray, RayHit* hit) const
+    {
+        TraversalRay prepared;
+        prepareRay(ray, &prepared);
+        GLfloat distance = ray.maxDistance;
+        int triangle = -1;
+        const std::vector<BvhTriangles>& leafTriangles = this->leafTriangles;
+        bool found = traverse(this->nodes, prepared, &distance, false, [&](int leaf, GLfloat* maxDistance) {
+            return intersectTriangles(leafTriangles[leaf], prepared, maxDistance, &triangle);
+        });
+        if (!found)
+            return false;
+        hit->distance = distance;
+        hit->triangle = triangle;
+        hit->instance = -1;
+        return true;
+    }
+
+    bool MeshBvh::occluded(const Ray& ray) const
+    {
+        TraversalRay prepared;
+        prepareRay(ray, &prepared);
+        GLfloat distance = ray.maxDistance;
+        int triangle = -1;
+        const std::vector<BvhTriangles>& leafTriangles = this->leafTriangles;
+        return traverse(this->nodes, prepared, &distance, true, [&](int leaf, GLfloat* maxDistance) {
+            return intersectTriangles(leafTriangles[leaf], prepared, maxDistance, &triangle);
+        });
+    }
+
+    void MeshBvh::getBounds(glm::vec3* minimum, glm::vec3* maximum) const
+    {
+        *minimum = this->boxMin;
+        *maximum = this->boxMax;
+    }
+
+    int MeshBvh::getTriangleCount() const
+    {
+        return this->triangleCount;
+    }
+
+    BvhStats MeshBvh::getStats() const
+    {
+        return this->stats;
+    }
+
+    SceneBvh::SceneBvh()
+    {
+        std::memset(&this->stats, 0, sizeof(BvhStats));
+    }
+
+    void SceneBvh::setModel(int model, const gps::MeshBvh* bvh)
+    {
+        if ((int)this->meshes.size() <= model)
+            this->meshes.resize(model + 1, NULL);
+        this->meshes[model] = bvh;
+    }
+
+    const gps::MeshBvh* SceneBvh::getMesh(int instance) const
+    {
+        int model = this->models[instance];
+        return model >= 0 && model < (int)this->meshes.size() ? this->meshes[model] : NULL;
+    }
+
+    // world box of the model's box under transform, and the inverse rays enter the instance with
+    void SceneBvh::fitInstance(int instance, const glm::mat4& transform)
+    {
+        const gps::MeshBvh* mesh = getMesh(instance);
+        glm::vec3 boxMin(0.0f);
+        glm::vec3 boxMax(0.0f);
+        if (mesh != NULL)
+            mesh->getBounds(&boxMin, &boxMax);
+        glm::vec3 center = glm::vec3(transform * glm::vec4((boxMin + boxMax) * 0.5f, 1.0f));
+        glm::vec3 halfSize = (boxMax - boxMin) * 0.5f;
+        glm::vec3 extent(0.0f);
+        for (int column = 0; column < 3; column++)
+            extent += glm::abs(glm::vec3(transform[column])) * halfSize[column];
+        this->boxMins[instance] = center - extent;
+        this->boxMaxs[instance] = center + extent;
+        this->inverseTransforms[instance] = glm::inverse(transform);
+    }
+
+    void SceneBvh::update(const glm::mat4* transforms, const int* models, const unsigned int* revisions, int count)
+    {
+        gps::CpuZone zone("SceneBvh::update");
+        std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+
+        bool rebuild = count != (int)this->models.size();
+        for (int i = 0; i < count && !rebuild; i++)
+            rebuild = this->models[i] != models[i];
+
+        if (rebuild) {
+            this->models.assign(models, models + count);
+            this->revisions.assign(revisions, revisions + count);
+            this->inverseTransforms.resize(count);
+            this->boxMins.resize(count);
+            this->boxMaxs.resize(count);
+            for (int i = 0; i < count; i++)
+                fitInstance(i, transforms[i]);
+            buildTree(this->boxMins.data(), this->boxMaxs.data(), count, 1, this->order, this->nodes, this->leaves);
+            this->instanceLeaves.resize(count);
+            for (size_t l = 0; l < this->leaves.size(); l++)
+                this->instanceLeaves[this->order[this->leaves[l].first]] = (int)l;
+            this->dirtyNodes.assign(this->nodes.size(), 0);
+
+            fillStats(this->stats, this->nodes, (int)this->leaves.size());
+            this->stats.builds++;
+            this->stats.refitted = 0;
+            this->stats.buildMs = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+            return;
+        }
+
+        unsigned int refitted = 0;
+        for (int i = 0; i < count; i++) {
+            if (revisions[i] != NO_REVISION && this->revisions[i] == revisions[i])
+                continue;
+            this->revisions[i] = revisions[i];
+            fitInstance(i, transforms[i]);
+            const BvhLeaf& leaf = this->leaves[this->instanceLeaves[i]];
+            setSlot(this->nodes[leaf.node], leaf.slot, this->boxMins[i], this->boxMaxs[i]);
+            // the leaf's node and every node above it, up to one already listed
+            for (int node = leaf.node; node >= 0 && !this->dirtyNodes[node]; node = this->nodes[node].parent) {
+                this->dirtyNodes[node] = 1;
+                this->dirtyList.push_back(node);
+            }
+            refitted++;
+        }
+        if (refitted > 0)
+            refit();
+        this->stats.refitted = refitted;
+        this->stats.refitMs = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+    }
+
+    // Parents come before their children in the node array, so going through the listed nodes from the last one
+    // refits every child before its parent reads it
+    void SceneBvh::refit()
+    {
+        std::sort(this->dirtyList.begin(), this->dirtyList.end(), std::greater<int>());
+        for (size_t i = 0; i < this->dirtyList.size(); i++) {
+            int index = this->dirtyList[i];
+            BvhNode& node = this->nodes[index];
+            this->dirtyNodes[index] = 0;
+            if (node.parent < 0)
+                continue;
+            // unused slots are inverted boxes, they drop out of the union
+            glm::vec3 boxMin(FLT_MAX);
+            glm::vec3 boxMax(-FLT_MAX);
+            for (int k = 0; k < 4; k++) {
+                boxMin = glm::min(boxMin, glm::vec3(node.minX[k], node.minY[k], node.minZ[k]));
+                boxMax = glm::max(boxMax, glm::vec3(node.maxX[k], node.maxY[k], node.maxZ[k]));
+            }
+            setSlot(this->nodes[node.parent], node.parentSlot, boxMin, boxMax);
+        }
+        this->dirtyList.clear();
+    }
+
+    bool SceneBvh::intersect(const Ray& ray, RayHit* hit) const
+    {
+        TraversalRay prepared;
+        prepareRay(ray, &prepared);
+        GLfloat distance = ray.maxDistance;
+        RayHit closest;
+        bool found = traverse(this->nodes, prepared, &distance, false, [&](int leaf, GLfloat* maxDistance) {
+            int instance = this->order[this->leaves[leaf].first];
+            const gps::MeshBvh* mesh = getMesh(instance);
+            if (mesh == NULL)
+                return false;
+            const glm::mat4& inverse = this->inverseTransforms[instance];
+            Ray local;
+            local.origin = glm::vec3(inverse * glm::vec4(ray.origin, 1.0f));
+            local.direction = glm::mat3(inverse) * ray.direction;
+            local.maxDistance = *maxDistance;
+            if (!mesh->intersect(local, &closest))
+                return false;
+            *maxDistance = closest.distance;
+            closest.instance = instance;
+            return true;
+        });
+        if (!found)
+            return false;
+        *hit = closest;
+        return true;
+    }
+
+    bool SceneBvh::occluded(const Ray& ray) const
+    {
+        TraversalRay prepared;
+        prepareRay(ray, &prepared);
+        GLfloat distance = ray.maxDistance;
+        return traverse(this->nodes, prepared, &distance, true, [&](int leaf, GLfloat* maxDistance) {
+            int instance = this->order[this->leaves[leaf].first];
+            const gps::MeshBvh* mesh = getMesh(instance);
+            if (mesh == NULL)
+                return false;
+            const glm::mat4& inverse = this->inverseTransforms[instance];
+            Ray local;
+            local.origin = glm::vec3(inverse * glm::vec4(ray.origin, 1.0f));
+            local.direction = glm::mat3(inverse) * ray.direction;
+            local.maxDistance = *maxDistance;
+            return mesh->occluded(local);
+        });
+    }
+
+    BvhStats SceneBvh::getStats() const
+    {
+        return this->stats;
+    }
+}
@@ -0,0 +1,145 @@
+#ifndef Bvh_hpp
+#define Bvh_hpp
+
+#include <GL/glew.h>
+#include <glm/glm.hpp>
+
+#include <vector>
+
+namespace gps {
+
+struct Ray {
+    glm::vec3 origin;
+    glm::vec3 direction;            // any length, distances are in multiples of it
+    GLfloat maxDistance;
+};
+
+struct RayHit {
+    GLfloat distance;
+    int triangle;                   // index into the triangles the mesh's BVH was built from
+    int instance;                   // the caller's index of the instance, scene queries only
+};
+
+struct BvhStats {
+    double buildMs;                 // last full build
+    double refitMs;                 // last refit, scene BVH only
+    unsigned int nodes;
+    unsigned int leaves;
+    unsigned int builds;
+    unsigned int refitted;          // instances refitted by the last update
+};
+
+// Node of the 4-wide trees: the boxes of the 4 children side by side, so a ray is tested against all of them
+// with one SSE slab test
+struct BvhNode {
+    static const int EMPTY = -0x7fffffff - 1;
+
+    GLfloat minX[4];
+    GLfloat minY[4];
+    GLfloat minZ[4];
+    GLfloat maxX[4];
+    GLfloat maxY[4];
+    GLfloat maxZ[4];
+    // >= 0 child node, < 0 ~leaf, EMPTY for an unused slot (its box is inverted)
+    int children[4];
+    int parent;                     // -1 for the root
+    int parentSlot;
+};
+
+// primitives first to first + count - 1 of the build order, and the node slot that points at them
+struct BvhLeaf {
+    int first;
+    int count;
+    int node;
+    int slot;
+};
+
+// Up to 4 triangles of a leaf as one vertex and two edges each, side by side for the SSE intersection test.
+// Unused lanes have null edges and never hit.
+struct BvhTriangles {
+    GLfloat v0[3][4];
+    GLfloat edge1[3][4];
+    GLfloat edge2[3][4];
+    int triangles[4];
+};
+
+// Bounding volume hierarchy over the triangles of one model, in model space. Built once: a binary tree split by
+// the surface area heuristic over binned centroids, then collapsed into 4-wide nodes whose leaves hold up to 4
+// triangles. Rays walk the nodes front to back, closest child first.
+class MeshBvh
+{
+public:
+    MeshBvh();
+
+    //3 model space vertices per triangle (Model3D::GetTriangles)
+    void build(const std::vector<glm::vec3>& triangles);
+    //closest hit closer than the ray's maxDistance
+    bool intersect(const Ray& ray, RayHit* hit) const;
+    //any hit closer than the ray's maxDistance, for line of sight
+    bool occluded(const Ray& ray) const;
+
+    void getBounds(glm::vec3* minimum, glm::vec3* maximum) const;
+    int getTriangleCount() const;
+    BvhStats getStats() const;
+
+private:
+    std::vector<BvhNode> nodes;
+    // one per leaf, in leaf order
+    std::vector<BvhTriangles> leafTriangles;
+    glm::vec3 boxMin;
+    glm::vec3 boxMax;
+    int triangleCount;
+    BvhStats stats;
+};
+
+// Top level over the instances of the scene, each a model's MeshBvh under a transform. The tree is built the same
+// way over the instances' world boxes, one instance per leaf. After that update() only refits: the instances whose
+// revision moved get new boxes, and the nodes above them are refitted bottom up. Rays enter an instance in its
+// model space, so hit distances stay in units of the world ray.
+// The tree keeps the shape of its last build, instances that wander far from where they were make it looser until
+// the next one (the instance count or a model changes).
+class SceneBvh
+{
+public:
+    static const unsigned int NO_REVISION = 0;
+
+    SceneBvh();
+
+    //BVH the instances of a model are traced against, NULL leaves them out
+    void setModel(int model, const gps::MeshBvh* bvh);
+    //Rebuilt when the instance count or a model changed, else the instances whose revision isn't the one they were
+    //last fitted with are refitted. NO_REVISION is never up to date.
+    void update(const glm::mat4* transforms, const int* models, const unsigned int* revisions, int count);
+    bool intersect(const Ray& ray, RayHit* hit) const;
+    bool occluded(const Ray& ray) const;
+
+    BvhStats getStats() const;
+
+private:
+    std::vector<const gps::MeshBvh*> meshes;
+
+    std::vector<BvhNode> nodes;
+    std::vector<BvhLeaf> leaves;
+    // instance of each leaf (build order) and leaf of each instance
+    std::vector<int> order;
+    std::vector<int> instanceLeaves;
+
+    // per instance, as of the last update
+    std::vector<int> models;
+    std::vector<unsigned int> revisions;
+    std::vector<glm::mat4> inverseTransforms;
+    std::vector<glm::vec3> boxMins;
+    std::vector<glm::vec3> boxMaxs;
+
+    std::vector<unsigned char> dirtyNodes;
+    std::vector<int> dirtyList;
+    BvhStats stats;
+
+    const gps::MeshBvh* getMesh(int instance) const;
+    void fitInstance(int instance, const glm::mat4& transform);
+    void refit();
+};
+
+}
+
+#endif /* Bvh_hpp */
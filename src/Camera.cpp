@@ -20,6 +20,18 @@ namespace gps {
         return glm::lookAt(cameraPosition, cameraTarget, cameraUpDirection);
     }
 
+    glm::vec3 Camera::getPosition() {
+        return cameraPosition;
+    }
+
+    glm::vec3 Camera::getTarget() {
+        return cameraTarget;
+    }
+
+    glm::vec3 Camera::getUpDirection() {
+        return cameraUpDirection;
+    }
+
     //update the camera internal parameters following a camera move event
     void Camera::move(MOVE_DIRECTION direction, float speed) {
         //TODO
@@ -0,0 +1,139 @@
+#include "CpuProfiler.hpp"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+
+namespace gps {
+
+    CpuProfiler::ThreadBuffer CpuProfiler::unregistered;
+    thread_local CpuProfiler::ThreadBuffer* CpuProfiler::threadBuffer = &CpuProfiler::unregistered;
+    std::mutex CpuProfiler::buffersMutex;
+    std::vector<CpuProfiler::ThreadBuffer*> CpuProfiler::buffers;
+
+    namespace {
+        // clock reading taken at init, against which the ticks are calibrated
+        unsigned long long baseTicks = 0;
+        std::chrono::steady_clock::time_point baseTime;
+
+        void writeEscaped(FILE* file, const std::string& text) {
+            for (size_t i = 0; i < text.size(); i++) {
+                char c = text[i];
+                if (c == '"' || c == '\\')
+                    fputc('\\', file);
+                fputc((unsigned char)c < 0x20 ? ' ' : c, file);
+            }
+        }
+    }
+
+    void CpuProfiler::init() {
+        baseTime = std::chrono::steady_clock::now();
+        baseTicks = now();
+        setThreadName("main");
+    }
+
+    CpuProfiler::ThreadBuffer* CpuProfiler::registerThread() {
+        ThreadBuffer* buffer = new ThreadBuffer();
+        buffer->count.store(0, std::memory_order_relaxed);
+        buffer->next = NULL;
+        buffer->chunkEnd = NULL;
+        for (int i = 0; i < MAX_CHUNKS; i++)
+            buffer->chunks[i] = NULL;
+
+        std::lock_guard<std::mutex> lock(buffersMutex);
+        buffer->id = (int)buffers.size();
+        buffer->name = "thread " + std::to_string(buffer->id);
+        buffers.push_back(buffer);
+        threadBuffer = buffer;
+        return buffer;
+    }
+
+    CpuProfiler::ThreadBuffer* CpuProfiler::getThreadBuffer() {
+        ThreadBuffer* buffer = threadBuffer;
+        if (buffer == &unregistered)
+            buffer = registerThread();
+        return buffer;
+    }
+
+    CpuProfiler::ThreadBuffer* CpuProfiler::nextChunk() {
+        ThreadBuffer* buffer = getThreadBuffer();
+        // the cursor only reaches the end of a chunk when it is full, so the count is a whole number of chunks
+        size_t chunk = buffer->count.load(std::memory_order_relaxed) / CHUNK_EVENTS;
+        if (chunk >= MAX_CHUNKS)
+            return NULL;
+        if (buffer->chunks[chunk] == NULL)
+            buffer->chunks[chunk] = new CpuZoneEvent[CHUNK_EVENTS];
+        buffer->next = buffer->chunks[chunk];
+        buffer->chunkEnd = buffer->chunks[chunk] + CHUNK_EVENTS;
+        return buffer;
+    }
+
+    void CpuProfiler::reserve(size_t zones) {
+        ThreadBuffer* buffer = getThreadBuffer();
+        size_t count = buffer->count.load(std::memory_order_relaxed);
+        size_t lastChunk = std::min((count + zones + CHUNK_EVENTS - 1) / CHUNK_EVENTS, (size_t)MAX_CHUNKS);
+        for (size_t chunk = count / CHUNK_EVENTS; chunk < lastChunk; chunk++) {
+            // zeroed so the pages are faulted in now rather than by the zones
+            if (buffer->chunks[chunk] == NULL)
+                buffer->chunks[chunk] = new CpuZoneEvent[CHUNK_EVENTS]();
+        }
+    }
+
+    void CpuProfiler::setThreadName(const std::string& name) {
+        ThreadBuffer* buffer = getThreadBuffer();
+        std::lock_guard<std::mutex> lock(buffersMutex);
+        buffer->name = name;
+    }
+
+    unsigned long long CpuProfiler::getZoneCount() {
+        std::lock_guard<std::mutex> lock(buffersMutex);
+        unsigned long long zones = 0;
+        for (size_t i = 0; i < buffers.size(); i++)
+            zones += buffers[i]->count.load(std::memory_order_acquire);
+        return zones;
+    }
+
+    bool CpuProfiler::writeChromeTrace(const std::string& fileName) {
+        // ticks per microsecond over everything since init, the longer the run the better the estimate
+        double elapsedUs = std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - baseTime).count();
+        unsigned long long elapsedTicks = now() - baseTicks;
+        double ticksPerUs = elapsedUs > 0.0 && elapsedTicks > 0 ? elapsedTicks / elapsedUs : 1000.0;
+
+        FILE* file = fopen(fileName.c_str(), "w");
+        if (file == NULL) {
+            fprintf(stderr, "Could not write the CPU trace to %s\n", fileName.c_str());
+            return false;
+        }
+
+        std::lock_guard<std::mutex> lock(buffersMutex);
+        fprintf(file, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n");
+        bool first = true;
+        unsigned long long zones = 0;
+        for (size_t t = 0; t < buffers.size(); t++) {
+            ThreadBuffer* buffer = buffers[t];
+
+            fprintf(file, "%s{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%d,\"args\":{\"name\":\"", first ? "" : ",\n", buffer->id);
+            writeEscaped(file, buffer->name);
+            fprintf(file, "\"}}");
+            first = false;
+
+            // only the events published before this point, the owner may still be appending
+            size_t count = buffer->count.load(std::memory_order_acquire);
+            for (size_t i = 0; i < count; i++) {
+                const CpuZoneEvent& event = buffer->chunks[i / CHUNK_EVENTS][i % CHUNK_EVENTS];
+                double start = (long long)(event.start - baseTicks) / ticksPerUs;
+                double duration = (event.end - event.start) / ticksPerUs;
+                fprintf(file, ",\n{\"name\":\"");
+                writeEscaped(file, event.name);
+                fprintf(file, "\",\"ph\":\"X\",\"pid\":1,\"tid\":%d,\"ts\":%.3f,\"dur\":%.3f}", buffer->id, start, duration);
+            }
+            zones += count;
+        }
+        fprintf(file, "\n]}\n");
+        fclose(file);
+
+        fprintf(stdout, "CPU trace: %llu zones written to %s\n", zones, fileName.c_str());
+        return true;
+    }
+
+}
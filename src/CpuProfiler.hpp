@@ -0,0 +1,118 @@
+#ifndef CpuProfiler_hpp
+#define CpuProfiler_hpp
+
+#include <atomic>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#if defined(_MSC_VER)
+#include <intrin.h>
+#elif defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#else
+#include <chrono>
+#endif
+
+namespace gps {
+
+struct CpuZoneEvent {
+    // string literal, only the pointer is stored
+    const char* name;
+    unsigned long long start;
+    unsigned long long end;
+};
+
+// Scoped CPU timing zones, written out as a Chrome trace (chrome://tracing, Perfetto).
+// Every thread appends its zones to its own buffer: a zone is two counter reads and one store through the
+// thread's write cursor, with no locks and no allocation outside of the first zone of a thread and one new chunk
+// every CHUNK_EVENTS zones (none when reserved ahead).
+// Times are in TSC ticks on x86 (steady_clock elsewhere), converted to microseconds when the trace is written.
+// The buffers are never cleared, so the trace covers the whole run (up to MAX_CHUNKS chunks per thread).
+class CpuProfiler
+{
+public:
+    static const int CHUNK_EVENTS = 16384;
+    static const int MAX_CHUNKS = 1024;
+
+    //starts the clock calibration, call once before the first zone
+    static void init();
+    //name of the calling thread in the trace
+    static void setThreadName(const std::string& name);
+    //writes the zones of every thread recorded so far, can be called while the other threads keep recording
+    static bool writeChromeTrace(const std::string& fileName);
+    //zones recorded so far, all threads
+    static unsigned long long getZoneCount();
+    //allocates and touches the chunks for the next zones of the calling thread, so a burst of zones doesn't pay
+    //for the allocation and the page faults
+    static void reserve(size_t zones);
+
+    static unsigned long long now() {
+#if defined(_MSC_VER) || defined(__x86_64__) || defined(__i386__)
+        return __rdtsc();
+#else
+        return (unsigned long long)std::chrono::duration_cast<std::chrono::nanoseconds>(
+            std::chrono::steady_clock::now().time_since_epoch()).count();
+#endif
+    }
+
+    static void record(const char* name, unsigned long long start, unsigned long long end) {
+        // one compare covers the first zone of the thread (the unregistered buffer has no room) and a full chunk
+        ThreadBuffer* buffer = threadBuffer;
+        CpuZoneEvent* event = buffer->next;
+        if (event == buffer->chunkEnd) {
+            buffer = nextChunk();
+            if (buffer == NULL)
+                return;
+            event = buffer->next;
+        }
+
+        event->name = name;
+        event->start = start;
+        event->end = end;
+        buffer->next = event + 1;
+        // publishes the event (and a new chunk) to writeChromeTrace
+        buffer->count.store(buffer->count.load(std::memory_order_relaxed) + 1, std::memory_order_release);
+    }
+
+private:
+    struct ThreadBuffer {
+        std::string name;
+        int id;
+        std::atomic<size_t> count;
+        // where the next event goes and the end of its chunk, owner thread only
+        CpuZoneEvent* next;
+        CpuZoneEvent* chunkEnd;
+        CpuZoneEvent* chunks[MAX_CHUNKS];
+    };
+
+    // every thread starts on the unregistered buffer, its first zone registers it
+    static ThreadBuffer unregistered;
+    static thread_local ThreadBuffer* threadBuffer;
+    // every thread that recorded a zone, kept until exit so finished threads stay in the trace
+    static std::mutex buffersMutex;
+    static std::vector<ThreadBuffer*> buffers;
+    static ThreadBuffer* registerThread();
+    static ThreadBuffer* getThreadBuffer();
+    //moves the cursor of the calling thread to its next chunk, NULL when all MAX_CHUNKS are full
+    static ThreadBuffer* nextChunk();
+};
+
+// Times the enclosing block, the name must outlive the profiler (use a literal)
+class CpuZone
+{
+public:
+    explicit CpuZone(const char* name) : name(name), start(CpuProfiler::now()) {}
+    ~CpuZone() { CpuProfiler::record(name, start, CpuProfiler::now()); }
+
+private:
+    const char* name;
+    unsigned long long start;
+
+    CpuZone(const CpuZone&);
+    CpuZone& operator=(const CpuZone&);
+};
+
+}
+
+#endif /* CpuProfiler_hpp */
@@ -0,0 +1,236 @@
+#include "DeferredRenderer.hpp"
+#include "GLState.hpp"
+
+#include <cmath>
+#include <cstddef>
+#include <iostream>
+#include <vector>
+
+namespace gps {
+
+    static const int SPHERE_SECTORS = 12;
+    static const int SPHERE_STACKS = 8;
+
+    GLuint DeferredRenderer::createTexture(GLint internalFormat, GLenum format, GLenum type)
+    {
+        GLuint texture;
+        glGenTextures(1, &texture);
+        GLState::bindTexture(GL_TEXTURE_2D, texture);
+        glTexImage2D(GL_TEXTURE_2D, 0, internalFormat, this->width, this->height, 0, format, type, NULL);
+        // read with texelFetch/one texel per pixel, never filtered
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+        return texture;
+    }
+
+    void DeferredRenderer::createTargets()
+    {
+        this->albedoSpecTexture = createTexture(GL_RGBA8, GL_RGBA, GL_UNSIGNED_BYTE);
+        this->normalTexture = createTexture(GL_RG16, GL_RG, GL_UNSIGNED_SHORT);
+        this->depthTexture = createTexture(GL_DEPTH_COMPONENT24, GL_DEPTH_COMPONENT, GL_FLOAT);
+        this->lightTexture = createTexture(GL_RGBA16F, GL_RGBA, GL_FLOAT);
+
+        glGenFramebuffers(1, &this->gBuffer);
+        GLState::bindFramebuffer(this->gBuffer);
+        glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, this->albedoSpecTexture, 0);
+        glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT1, GL_TEXTURE_2D, this->normalTexture, 0);
+        glFramebufferTexture2D(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, GL_TEXTURE_2D, this->depthTexture, 0);
+        GLenum drawBuffers[] = { GL_COLOR_ATTACHMENT0, GL_COLOR_ATTACHMENT1 };
+        glDrawBuffers(2, drawBuffers);
+        if (glCheckFramebufferStatus(GL_FRAMEBUFFER) != GL_FRAMEBUFFER_COMPLETE)
+            std::cout << "G-buffer framebuffer is incomplete" << std::endl;
+
+        // the volumes sample the G-buffer depth, attaching that same texture would be a feedback loop,
+        // so they are depth tested against a copy of it
+        glGenRenderbuffers(1, &this->lightDepthRenderbuffer);
+        glBindRenderbuffer(GL_RENDERBUFFER, this->lightDepthRenderbuffer);
+        glRenderbufferStorage(GL_RENDERBUFFER, GL_DEPTH_COMPONENT24, this->width, this->height);
+        glBindRenderbuffer(GL_RENDERBUFFER, 0);
+
+        glGenFramebuffers(1, &this->lightFramebuffer);
+        GLState::bindFramebuffer(this->lightFramebuffer);
+        glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, this->lightTexture, 0);
+        glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, GL_RENDERBUFFER, this->lightDepthRenderbuffer);
+        if (glCheckFramebufferStatus(GL_FRAMEBUFFER) != GL_FRAMEBUFFER_COMPLETE)
+            std::cout << "Light buffer framebuffer is incomplete" << std::endl;
+
+        GLState::bindFramebuffer(0);
+    }
+
+    void DeferredRenderer::deleteTargets()
+    {
+        // the names may come back for the new targets, the cache must not think they are still bound
+        for (GLuint i = 0; i < 4; i++)
+            GLState::bindTexture(TEXTURE_UNIT + i, GL_TEXTURE_2D, 0);
+
+        GLuint textures[] = { this->albedoSpecTexture, this->normalTexture, this->depthTexture, this->lightTexture };
+        glDeleteTextures(4, textures);
+        GLuint framebuffers[] = { this->gBuffer, this->lightFramebuffer };
+        glDeleteFramebuffers(2, framebuffers);
+        glDeleteRenderbuffers(1, &this->lightDepthRenderbuffer);
+    }
+
+    // UV sphere pushed out so its flat faces still enclose the unit sphere
+    void DeferredRenderer::createSphere(GLuint lightBuffer)
+    {
+        GLfloat scale = 1.0f / (cosf(glm::radians(180.0f / SPHERE_SECTORS)) * cosf(glm::radians(180.0f / SPHERE_STACKS)));
+
+        std::vector<glm::vec3> vertices;
+        for (int stack = 0; stack <= SPHERE_STACKS; stack++) {
+            GLfloat phi = glm::radians(180.0f * stack / SPHERE_STACKS);
+            for (int sector = 0; sector <= SPHERE_SECTORS; sector++) {
+                GLfloat theta = glm::radians(360.0f * sector / SPHERE_SECTORS);
+                vertices.push_back(scale * glm::vec3(sinf(phi) * cosf(theta), cosf(phi), sinf(phi) * sinf(theta)));
+            }
+        }
+
+        std::vector<GLuint> indices;
+        for (int stack = 0; stack < SPHERE_STACKS; stack++) {
+            for (int sector = 0; sector < SPHERE_SECTORS; sector++) {
+                GLuint a = stack * (SPHERE_SECTORS + 1) + sector;
+                GLuint b = a + SPHERE_SECTORS + 1;
+                // counter clockwise seen from outside
+                indices.push_back(a);
+                indices.push_back(a + 1);
+                indices.push_back(b);
+                indices.push_back(b);
+                indices.push_back(a + 1);
+                indices.push_back(b + 1);
+            }
+        }
+        this->sphereIndexCount = (GLsizei)indices.size();
+
+        glGenVertexArrays(1, &this->sphereVAO);
+        glGenBuffers(1, &this->sphereVBO);
+        glGenBuffers(1, &this->sphereEBO);
+
+        GLState::bindVertexArray(this->sphereVAO);
+        glBindBuffer(GL_ARRAY_BUFFER, this->sphereVBO);
+        glBufferData(GL_ARRAY_BUFFER, vertices.size() * sizeof(glm::vec3), vertices.data(), GL_STATIC_DRAW);
+        glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, this->sphereEBO);
+        glBufferData(GL_ELEMENT_ARRAY_BUFFER, indices.size() * sizeof(GLuint), indices.data(), GL_STATIC_DRAW);
+
+        glEnableVertexAttribArray(0);
+        glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, sizeof(glm::vec3), (GLvoid*)0);
+
+        // position + radius on location 3, color + outer cone on 4, direction + inner cone on 5, one light per instance
+        glBindBuffer(GL_ARRAY_BUFFER, lightBuffer);
+        glEnableVertexAttribArray(3);
+        glVertexAttribPointer(3, 4, GL_FLOAT, GL_FALSE, sizeof(PointLight), (GLvoid*)offsetof(PointLight, position));
+        glVertexAttribDivisor(3, 1);
+        glEnableVertexAttribArray(4);
+        glVertexAttribPointer(4, 4, GL_FLOAT, GL_FALSE, sizeof(PointLight), (GLvoid*)offsetof(PointLight, color));
+        glVertexAttribDivisor(4, 1);
+        glEnableVertexAttribArray(5);
+        glVertexAttribPointer(5, 4, GL_FLOAT, GL_FALSE, sizeof(PointLight), (GLvoid*)offsetof(PointLight, direction));
+        glVertexAttribDivisor(5, 1);
+
+        GLState::bindVertexArray(0);
+        glBindBuffer(GL_ARRAY_BUFFER, 0);
+    }
+
+    void DeferredRenderer::init(GLsizei width, GLsizei height, GLuint lightBuffer)
+    {
+        this->width = width;
+        this->height = height;
+        createTargets();
+        createSphere(lightBuffer);
+        glGenVertexArrays(1, &this->emptyVAO);
+    }
+
+    void DeferredRenderer::resize(GLsizei width, GLsizei height)
+    {
+        if (width == this->width && height == this->height)
+            return;
+        if (width <= 0 || height <= 0)
+            return;
+
+        deleteTargets();
+        this->width = width;
+        this->height = height;
+        createTargets();
+    }
+
+    void DeferredRenderer::beginGeometryPass()
+    {
+        GLState::bindFramebuffer(this->gBuffer);
+        GLState::viewport(0, 0, this->width, this->height);
+        // per attachment clears leave the scene's clear color alone, empty pixels keep a depth of 1
+        // and are skipped by every lighting pass
+        const GLfloat zero[] = { 0.0f, 0.0f, 0.0f, 0.0f };
+        const GLfloat farDepth = 1.0f;
+        glClearBufferfv(GL_COLOR, 0, zero);
+        glClearBufferfv(GL_COLOR, 1, zero);
+        glClearBufferfv(GL_DEPTH, 0, &farDepth);
+    }
+
+    void DeferredRenderer::endGeometryPass()
+    {
+        GLState::bindFramebuffer(0);
+    }
+
+    void DeferredRenderer::beginLightPass()
+    {
+        GLState::bindFramebuffers(this->gBuffer, this->lightFramebuffer);
+        glBlitFramebuffer(0, 0, this->width, this->height, 0, 0, this->width, this->height, GL_DEPTH_BUFFER_BIT, GL_NEAREST);
+        GLState::bindFramebuffer(this->lightFramebuffer);
+        const GLfloat zero[] = { 0.0f, 0.0f, 0.0f, 0.0f };
+        glClearBufferfv(GL_COLOR, 0, zero);
+
+        for (GLuint i = 0; i < 3; i++)
+            GLState::bindTexture(TEXTURE_UNIT + i, GL_TEXTURE_2D,
+                i == 0 ? this->albedoSpecTexture : i == 1 ? this->normalTexture : this->depthTexture);
+
+        // back faces are still there when the camera is inside a volume, only the ones behind
+        // the stored surface can light it (the shader rejects the surfaces in front of the volume)
+        GLState::depthFunc(GL_GEQUAL);
+        GLState::depthMask(GL_FALSE);
+        glCullFace(GL_FRONT);
+        glEnable(GL_BLEND);
+        glBlendFunc(GL_ONE, GL_ONE);
+    }
+
+    void DeferredRenderer::drawLightVolumes(GLsizei count)
+    {
+        if (count <= 0)
+            return;
+        GLState::bindVertexArray(this->sphereVAO);
+        glDrawElementsInstanced(GL_TRIANGLES, this->sphereIndexCount, GL_UNSIGNED_INT, 0, count);
+    }
+
+    void DeferredRenderer::endLightPass()
+    {
+        glDisable(GL_BLEND);
+        glCullFace(GL_BACK);
+        GLState::depthFunc(GL_LESS);
+        GLState::depthMask(GL_TRUE);
+    }
+
+    void DeferredRenderer::beginCompositePass()
+    {
+        GLState::bindFramebuffer(0);
+        GLState::viewport(0, 0, this->width, this->height);
+        glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+
+        GLState::bindTexture(TEXTURE_UNIT + 0, GL_TEXTURE_2D, this->albedoSpecTexture);
+        GLState::bindTexture(TEXTURE_UNIT + 1, GL_TEXTURE_2D, this->normalTexture);
+        GLState::bindTexture(TEXTURE_UNIT + 2, GL_TEXTURE_2D, this->depthTexture);
+        GLState::bindTexture(TEXTURE_UNIT + 3, GL_TEXTURE_2D, this->lightTexture);
+
+        // every pixel is written, with the depth the G-buffer had there
+        GLState::depthFunc(GL_ALWAYS);
+    }
+
+    void DeferredRenderer::drawFullScreen()
+    {
+        GLState::bindVertexArray(this->emptyVAO);
+        glDrawArrays(GL_TRIANGLES, 0, 3);
+    }
+
+    void DeferredRenderer::endCompositePass()
+    {
+        GLState::depthFunc(GL_LESS);
+    }
+}
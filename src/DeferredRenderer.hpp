@@ -0,0 +1,76 @@
+#ifndef DeferredRenderer_hpp
+#define DeferredRenderer_hpp
+
+#include <GL/glew.h>
+#include <glm/glm.hpp>
+
+#include "PointLights.hpp"
+
+namespace gps {
+
+// Targets and passes of the deferred shading path, the caller binds the programs and draws the geometry.
+//
+// G-buffer, 12 bytes per pixel:
+//   albedo rgb + specular intensity  RGBA8
+//   view space normal                RG16, octahedral mapping
+//   depth                            24 bit, view space position is rebuilt from it and the projection
+// Point lights are drawn as instanced spheres into a float light buffer, one shading per covered pixel
+// and light, without drawing the scene again. The composite pass adds the sun (with the shared shadow map),
+// fog and the light buffer, and writes the G-buffer depth so the skybox can be drawn after it.
+class DeferredRenderer
+{
+public:
+    // G-buffer albedo/specular, normal, depth and the light buffer are read from 4 consecutive units
+    static const GLuint TEXTURE_UNIT = 5;
+
+    //lightBuffer holds the view space gps::PointLight array the volumes are instanced from
+    void init(GLsizei width, GLsizei height, GLuint lightBuffer);
+    //reallocates the targets when the window size changed
+    void resize(GLsizei width, GLsizei height);
+
+    //binds and clears the G-buffer, draw the scene with the G-buffer programs after it
+    void beginGeometryPass();
+    void endGeometryPass();
+
+    //copies the depth, binds and clears the light buffer, additive blending, volumes are shaded from their back faces
+    void beginLightPass();
+    //the light volume program must already be in use
+    void drawLightVolumes(GLsizei count);
+    void endLightPass();
+
+    //binds the default framebuffer and every target for reading, the composite program writes depth too
+    void beginCompositePass();
+    //one triangle over the whole screen
+    void drawFullScreen();
+    void endCompositePass();
+
+private:
+    GLsizei width;
+    GLsizei height;
+
+    GLuint gBuffer;
+    GLuint albedoSpecTexture;
+    GLuint normalTexture;
+    GLuint depthTexture;
+    GLuint lightFramebuffer;
+    GLuint lightTexture;
+    // copy of the G-buffer depth the volumes are depth tested against
+    GLuint lightDepthRenderbuffer;
+
+    // low poly sphere enclosing the unit sphere, one instance per light (spot lights too, the shader applies the cone)
+    GLuint sphereVAO;
+    GLuint sphereVBO;
+    GLuint sphereEBO;
+    GLsizei sphereIndexCount;
+    // the full screen triangle is generated from gl_VertexID, core profile still wants a VAO
+    GLuint emptyVAO;
+
+    void createTargets();
+    void deleteTargets();
+    GLuint createTexture(GLint internalFormat, GLenum format, GLenum type);
+    void createSphere(GLuint lightBuffer);
+};
+
+}
+
+#endif /* DeferredRenderer_hpp */
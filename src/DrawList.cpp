@@ -0,0 +1,238 @@
+#include "DrawList.hpp"
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstring>
+
+namespace gps {
+
+    void DrawList::init(gps::ThreadPool* threadPool)
+    {
+        this->threadPool = threadPool;
+        this->minPixelRadius = 0.5f;
+        this->occlusion = NULL;
+        this->queries = NULL;
+        std::memset(&this->stats, 0, sizeof(DrawListStats));
+    }
+
+    void DrawList::setMinPixelRadius(GLfloat pixels)
+    {
+        this->minPixelRadius = pixels;
+    }
+
+    void DrawList::setOcclusion(gps::OcclusionBuffer* occlusion)
+    {
+        this->occlusion = occlusion;
+    }
+
+    void DrawList::setQueries(gps::OcclusionQueries* queries)
+    {
+        this->queries = queries;
+    }
+
+    void DrawList::build(const RenderObject* objects, int objectCount, const glm::mat4* viewProjections, int viewCount,
+        bool nearPlane, const glm::vec3& eye, GLfloat pixelScale)
+    {
+        std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+
+        // planes of each view, a row of the matrix plus or minus the w row
+        this->frustums.resize(viewCount);
+        for (int v = 0; v < viewCount; v++) {
+            const glm::mat4& m = viewProjections[v];
+            glm::vec4 rows[4];
+            for (int r = 0; r < 4; r++)
+                rows[r] = glm::vec4(m[0][r], m[1][r], m[2][r], m[3][r]);
+            for (int p = 0; p < 6; p++) {
+                glm::vec4 plane = (p % 2 == 0) ? rows[3] + rows[p / 2] : rows[3] - rows[p / 2];
+                this->frustums[v].planes[p] = plane / glm::length(glm::vec3(plane));
+            }
+        }
+
+        int listCount = std::max(1, std::min(this->threadPool->getThreadCount(),
+            (objectCount + MIN_OBJECTS_PER_LIST - 1) / MIN_OBJECTS_PER_LIST));
+        if ((int)this->commandLists.size() < listCount)
+            this->commandLists.resize(listCount);
+        this->listCulled.assign(listCount, 0);
+        this->listTooSmall.assign(listCount, 0);
+        this->listTested.assign(listCount, 0);
+        this->listOccluded.assign(listCount, 0);
+        this->listQueryHidden.assign(listCount, 0);
+        if ((int)this->listQueryObjects.size() < listCount)
+            this->listQueryObjects.resize(listCount);
+
+        // one chunk per list, each list owns a contiguous range of objects
+        this->threadPool->parallelFor(listCount, [&](int begin, int end) {
+            for (int list = begin; list < end; list++) {
+                int first = (int)((long long)objectCount * list / listCount);
+                int last = (int)((long long)objectCount * (list + 1) / listCount);
+                buildList(objects, list, first, last, nearPlane, eye, pixelScale);
+            }
+        });
+        for (int list = listCount; list < (int)this->commandLists.size(); list++)
+            this->commandLists[list].clear();
+        this->queryObjects.clear();
+        for (int list = 0; list < listCount; list++) {
+            const std::vector<int>& listObjects = this->listQueryObjects[list];
+            this->queryObjects.insert(this->queryObjects.end(), listObjects.begin(), listObjects.end());
+        }
+
+        std::chrono::steady_clock::time_point prepared = std::chrono::steady_clock::now();
+        merge();
+
+        this->stats.prepMs = std::chrono::duration<double, std::milli>(prepared - start).count();
+        this->stats.mergeMs = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - prepared).count();
+        this->stats.objects = objectCount;
+        this->stats.culled = 0;
+        this->stats.tooSmall = 0;
+        this->stats.occluded = 0;
+        this->stats.queryHidden = 0;
+        unsigned int tested = 0;
+        for (int list = 0; list < listCount; list++) {
+            this->stats.culled += this->listCulled[list];
+            this->stats.tooSmall += this->listTooSmall[list];
+            this->stats.occluded += this->listOccluded[list];
+            this->stats.queryHidden += this->listQueryHidden[list];
+            tested += this->listTested[list];
+        }
+        if (this->occlusion)
+            this->occlusion->countTests(tested, this->stats.occluded);
+        if (this->queries)
+            this->queries->countHidden(this->stats.queryHidden);
+        this->stats.instances = (unsigned int)this->instances.size();
+        this->stats.batches = (unsigned int)this->batches.size();
+    }
+
+    void DrawList::buildList(const RenderObject* objects, int list, int begin, int end,
+        bool nearPlane, const glm::vec3& eye, GLfloat pixelScale)
+    {
+        std::vector<DrawCommand>& commands = this->commandLists[list];
+        commands.clear();
+        std::vector<int>& queryObjects = this->listQueryObjects[list];
+        queryObjects.clear();
+
+        for (int i = begin; i < end; i++) {
+            const RenderObject& object = objects[i];
+            const glm::mat4& transform = object.transform;
+
+            // world space sphere, scaled by the longest axis
+            glm::vec3 center = glm::vec3(transform * glm::vec4(glm::vec3(object.bounds), 1.0f));
+            GLfloat scale = std::max(glm::length(glm::vec3(transform[0])),
+                std::max(glm::length(glm::vec3(transform[1])), glm::length(glm::vec3(transform[2]))));
+            GLfloat radius = object.bounds.w * scale;
+
+            bool visible = false;
+            for (size_t v = 0; v < this->frustums.size() && !visible; v++) {
+                const glm::vec4* planes = this->frustums[v].planes;
+                bool inside = true;
+                for (int p = 0; p < 6 && inside; p++) {
+                    if (p == 4 && !nearPlane)
+                        continue;
+                    inside = glm::dot(glm::vec3(planes[p]), center) + planes[p].w >= -radius;
+                }
+                visible = inside;
+            }
+            if (!visible) {
+                this->listCulled[list]++;
+                continue;
+            }
+
+            GLfloat distance = glm::length(center - eye);
+            if (pixelScale > 0.0f && distance > radius && radius * pixelScale < this->minPixelRadius * distance) {
+                this->listTooSmall[list]++;
+                continue;
+            }
+
+            if (this->occlusion) {
+                this->listTested[list]++;
+                if (this->occlusion->isOccluded(object.boxMin, object.boxMax, transform)) {
+                    this->listOccluded[list]++;
+                    continue;
+                }
+            }
+
+            // tested again this frame whatever last frame's result was, that is how a hidden object comes back
+            GLuint query = 0;
+            if (this->queries && this->queries->isTracked(object.model)) {
+                queryObjects.push_back(i);
+                if (this->queries->isHidden(object.id)) {
+                    this->listQueryHidden[list]++;
+                    continue;
+                }
+                query = this->queries->getConditionalQuery(object.id);
+                if (query)
+                    this->listQueryHidden[list]++;
+            }
+
+            DrawCommand command;
+            // positive floats sort like their bits, the conditional draws of a model after its instanced ones
+            GLfloat keyDistance = std::max(distance, 0.0f);
+            unsigned int distanceBits;
+            std::memcpy(&distanceBits, &keyDistance, sizeof(distanceBits));
+            command.sortKey = ((unsigned long long)object.model << 33) | ((unsigned long long)(query != 0) << 32) | distanceBits;
+            command.model = object.model;
+            command.distance = distance;
+            command.query = query;
+            command.instance.model = transform;
+            command.instance.normalMatrix = object.normalMatrix;
+            commands.push_back(command);
+        }
+    }
+
+    void DrawList::merge()
+    {
+        this->order.clear();
+        for (size_t list = 0; list < this->listCulled.size(); list++) {
+            const std::vector<DrawCommand>& commands = this->commandLists[list];
+            for (size_t c = 0; c < commands.size(); c++) {
+                SortEntry entry;
+                entry.sortKey = commands[c].sortKey;
+                entry.list = (int)list;
+                entry.command = (int)c;
+                this->order.push_back(entry);
+            }
+        }
+        std::sort(this->order.begin(), this->order.end(), [](const SortEntry& a, const SortEntry& b) {
+            return a.sortKey < b.sortKey;
+        });
+
+        this->instances.resize(this->order.size());
+        this->batches.clear();
+        for (size_t i = 0; i < this->order.size(); i++) {
+            const DrawCommand& command = this->commandLists[this->order[i].list][this->order[i].command];
+            this->instances[i] = command.instance;
+            // a conditional draw is a batch of its own
+            if (this->batches.empty() || this->batches.back().model != command.model || command.query ||
+                this->batches.back().query) {
+                DrawBatch batch;
+                batch.model = command.model;
+                batch.first = (int)i;
+                batch.count = 0;
+                batch.depth = command.distance;
+                batch.query = command.query;
+                this->batches.push_back(batch);
+            }
+            this->batches.back().count++;
+        }
+    }
+
+    const std::vector<DrawBatch>& DrawList::getBatches()
+    {
+        return this->batches;
+    }
+
+    const gps::InstanceData* DrawList::getInstances()
+    {
+        return this->instances.data();
+    }
+
+    const std::vector<int>& DrawList::getQueryObjects()
+    {
+        return this->queryObjects;
+    }
+
+    DrawListStats DrawList::getStats()
+    {
+        return this->stats;
+    }
+}
@@ -0,0 +1,133 @@
+#ifndef DrawList_hpp
+#define DrawList_hpp
+
+#include <GL/glew.h>
+#include <glm/glm.hpp>
+
+#include "Mesh.hpp"
+#include "OcclusionBuffer.hpp"
+#include "OcclusionQueries.hpp"
+#include "ThreadPool.hpp"
+
+#include <vector>
+
+namespace gps {
+
+// one object handed to the render prep
+struct RenderObject {
+    int model;              // index into the caller's model table
+    unsigned int id;        // the caller's id of the object, the same from frame to frame (occlusion queries)
+    glm::mat4 transform;
+    glm::mat3 normalMatrix;
+    glm::vec4 bounds;       // model space bounding sphere, center in xyz and radius in w
+    glm::vec3 boxMin;       // model space bounding box, for the occlusion test
+    glm::vec3 boxMax;
+};
+
+// consecutive instances of one model, drawn with a single instanced call per mesh
+struct DrawBatch {
+    int model;
+    int first;
+    int count;
+    GLfloat depth;          // distance of the nearest instance to the eye
+    GLuint query;           // drawn under conditional render on this query, 0 for none
+};
+
+struct DrawListStats {
+    double prepMs;                  // culling, matrices and keys on the workers
+    double mergeMs;                 // sorting and gathering the lists on the calling thread
+    unsigned int objects;
+    unsigned int culled;            // outside every view
+    unsigned int tooSmall;          // closer to nothing than to a pixel
+    unsigned int occluded;          // behind the occluders of the occlusion buffer
+    unsigned int queryHidden;       // occluded as of last frame's occlusion queries (skipped or conditional)
+    unsigned int instances;
+    unsigned int batches;
+};
+
+// Render prep for one pass. The objects are split in one range per thread and each worker culls its range
+// (bounding sphere against the frustum planes of the views), drops the objects too small to cover a pixel
+// and the ones the occlusion buffer hides (bounding box against it), and writes the instance data and the
+// sort key into its own command list, so nothing is shared while they run. The calling thread then sorts the
+// keys of every list together and gathers the instance data in that order: the batches are contiguous runs of
+// one model, front to back inside it. With occlusion queries, the tracked objects left are also listed for
+// the next round of queries, and the ones last frame's queries found occluded are left out, or get a batch of
+// their own drawn under conditional render.
+class DrawList
+{
+public:
+    // ranges smaller than this aren't worth a worker
+    static const int MIN_OBJECTS_PER_LIST = 256;
+
+    void init(gps::ThreadPool* threadPool);
+    //projected radius (pixels) under which an object is dropped, 0 keeps everything in the views
+    void setMinPixelRadius(GLfloat pixels);
+    //rasterized buffer the objects left after the frustum and size tests are tested against, NULL for none
+    void setOcclusion(gps::OcclusionBuffer* occlusion);
+    //hardware queries of last frame consulted for the tracked models, NULL for none
+    void setQueries(gps::OcclusionQueries* queries);
+
+    //an object is kept if its sphere touches any of the views. Without the near plane, objects between the eye
+    //and the view still count (depth clamped passes). pixelScale is the projected size of a unit at distance 1,
+    //0 turns the size test off. Keys sort by model, then by distance to the eye.
+    void build(const RenderObject* objects, int objectCount, const glm::mat4* viewProjections, int viewCount,
+        bool nearPlane, const glm::vec3& eye, GLfloat pixelScale);
+
+    const std::vector<DrawBatch>& getBatches();
+    //instance data of every batch, back to back
+    const gps::InstanceData* getInstances();
+    //objects of the tracked models that passed every other test in the last build, indices into its objects
+    const std::vector<int>& getQueryObjects();
+
+    //counters of the last build
+    DrawListStats getStats();
+
+private:
+    struct DrawCommand {
+        unsigned long long sortKey;
+        int model;
+        GLfloat distance;
+        GLuint query;
+        gps::InstanceData instance;
+    };
+
+    struct SortEntry {
+        unsigned long long sortKey;
+        int list;
+        int command;
+    };
+
+    // left, right, bottom, top, near, far
+    struct Frustum {
+        glm::vec4 planes[6];
+    };
+
+    gps::ThreadPool* threadPool;
+    GLfloat minPixelRadius;
+    gps::OcclusionBuffer* occlusion;
+    gps::OcclusionQueries* queries;
+
+    std::vector<Frustum> frustums;
+    std::vector<std::vector<DrawCommand> > commandLists;
+    // culled, too small, occlusion tested, occluded and query hidden counts of each list
+    std::vector<unsigned int> listCulled;
+    std::vector<unsigned int> listTooSmall;
+    std::vector<unsigned int> listTested;
+    std::vector<unsigned int> listOccluded;
+    std::vector<unsigned int> listQueryHidden;
+    std::vector<std::vector<int> > listQueryObjects;
+    std::vector<int> queryObjects;
+
+    std::vector<SortEntry> order;
+    std::vector<gps::InstanceData> instances;
+    std::vector<DrawBatch> batches;
+    DrawListStats stats;
+
+    void buildList(const RenderObject* objects, int list, int begin, int end,
+        bool nearPlane, const glm::vec3& eye, GLfloat pixelScale);
+    void merge();
+};
+
+}
+
+#endif /* DrawList_hpp */
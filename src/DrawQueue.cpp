@@ -0,0 +1,93 @@
+#include "DrawQueue.hpp"
+
+#include <algorithm>
+#include <cstring>
+
+namespace gps {
+
+    unsigned long long DrawQueue::makeKey(unsigned int pass, unsigned int program, unsigned int material,
+        unsigned int vertexArray, GLfloat depth, GLfloat maxDepth)
+    {
+        const unsigned int depthSteps = (1u << DEPTH_BITS) - 1;
+        GLfloat t = std::min(std::max(depth / maxDepth, 0.0f), 1.0f);
+        unsigned long long key = pass & ((1u << PASS_BITS) - 1);
+        key = (key << PROGRAM_BITS) | (program & ((1u << PROGRAM_BITS) - 1));
+        key = (key << MATERIAL_BITS) | (material & ((1u << MATERIAL_BITS) - 1));
+        key = (key << VERTEX_ARRAY_BITS) | (vertexArray & ((1u << VERTEX_ARRAY_BITS) - 1));
+        key = (key << DEPTH_BITS) | (unsigned int)(t * depthSteps);
+        return key;
+    }
+
+    unsigned int DrawQueue::passOf(unsigned long long sortKey)
+    {
+        return (unsigned int)(sortKey >> (64 - PASS_BITS));
+    }
+
+    void DrawQueue::clear()
+    {
+        this->draws.clear();
+    }
+
+    void DrawQueue::push(unsigned long long sortKey, unsigned long long payload)
+    {
+        QueuedDraw draw;
+        draw.sortKey = sortKey;
+        draw.payload = payload;
+        this->draws.push_back(draw);
+    }
+
+    void DrawQueue::sort()
+    {
+        size_t count = this->draws.size();
+        if (count < 2)
+            return;
+
+        // bytes that differ somewhere, the others can't change the order
+        unsigned long long differing = 0;
+        for (size_t i = 1; i < count; i++)
+            differing |= this->draws[i].sortKey ^ this->draws[0].sortKey;
+
+        this->scratch.resize(count);
+        for (int shift = 0; shift < 64; shift += 8) {
+            if (((differing >> shift) & 0xff) == 0)
+                continue;
+
+            unsigned int offsets[256];
+            std::memset(offsets, 0, sizeof(offsets));
+            for (size_t i = 0; i < count; i++)
+                offsets[(this->draws[i].sortKey >> shift) & 0xff]++;
+            unsigned int sum = 0;
+            for (int b = 0; b < 256; b++) {
+                unsigned int bucket = offsets[b];
+                offsets[b] = sum;
+                sum += bucket;
+            }
+            for (size_t i = 0; i < count; i++)
+                this->scratch[offsets[(this->draws[i].sortKey >> shift) & 0xff]++] = this->draws[i];
+            this->draws.swap(this->scratch);
+        }
+    }
+
+    void DrawQueue::passRange(unsigned int pass, int* begin, int* end)
+    {
+        int count = (int)this->draws.size();
+        int first = 0;
+        while (first < count && passOf(this->draws[first].sortKey) != pass)
+            first++;
+        int last = first;
+        while (last < count && passOf(this->draws[last].sortKey) == pass)
+            last++;
+        *begin = first;
+        *end = last;
+    }
+
+    int DrawQueue::size()
+    {
+        return (int)this->draws.size();
+    }
+
+    const QueuedDraw& DrawQueue::operator[](int index)
+    {
+        return this->draws[index];
+    }
+}
@@ -0,0 +1,52 @@
+#ifndef DrawQueue_hpp
+#define DrawQueue_hpp
+
+#include <GL/glew.h>
+
+#include <vector>
+
+namespace gps {
+
+struct QueuedDraw {
+    unsigned long long sortKey;
+    // whatever the submitter needs to find the draw again, 64 bits fit in the padding after the key
+    unsigned long long payload;
+};
+
+// Every draw of the frame with a 64-bit key, most significant field first:
+//   pass (4 bits) | program (12) | material (16) | vertex array (16) | depth (16)
+// so sorting the keys groups the draws by pass, then by what they bind, then front to back.
+// The sort is an LSD radix sort, one byte per round; rounds whose byte is the same in every key are skipped,
+// which leaves only a few of them when most fields have a handful of values.
+class DrawQueue
+{
+public:
+    static const int PASS_BITS = 4;
+    static const int PROGRAM_BITS = 12;
+    static const int MATERIAL_BITS = 16;
+    static const int VERTEX_ARRAY_BITS = 16;
+    static const int DEPTH_BITS = 16;
+
+    //depth is quantized over [0, maxDepth], further draws clamp to the last step
+    static unsigned long long makeKey(unsigned int pass, unsigned int program, unsigned int material,
+        unsigned int vertexArray, GLfloat depth, GLfloat maxDepth);
+    static unsigned int passOf(unsigned long long sortKey);
+
+    void clear();
+    void push(unsigned long long sortKey, unsigned long long payload);
+    //orders the draws by key, stable
+    void sort();
+
+    //[begin, end) of the draws of one pass, the draws must be grouped by pass (sorted, or pushed pass by pass)
+    void passRange(unsigned int pass, int* begin, int* end);
+    int size();
+    const QueuedDraw& operator[](int index);
+
+private:
+    std::vector<QueuedDraw> draws;
+    std::vector<QueuedDraw> scratch;
+};
+
+}
+
+#endif /* DrawQueue_hpp */
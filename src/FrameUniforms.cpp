@@ -0,0 +1,144 @@
+#include "FrameUniforms.hpp"
+
+#include <cstring>
+#include <sstream>
+
+namespace gps {
+
+    void FrameUniforms::init()
+    {
+        this->data = FrameData();
+        this->dirty = true;
+
+        glGenBuffers(1, &this->ubo);
+        glBindBuffer(GL_UNIFORM_BUFFER, this->ubo);
+        glBufferData(GL_UNIFORM_BUFFER, sizeof(FrameData), NULL, GL_DYNAMIC_DRAW);
+        glBindBuffer(GL_UNIFORM_BUFFER, 0);
+
+        // the buffer stays on its binding point for the whole run
+        glBindBufferBase(GL_UNIFORM_BUFFER, BINDING_POINT, this->ubo);
+    }
+
+    std::string FrameUniforms::blockSource()
+    {
+        std::stringstream source;
+        source << "layout(std140) uniform FrameData {\n"
+            << "    mat4 view;\n"
+            << "    mat4 projection;\n"
+            << "    mat4 lightSpaceTrMatrices[" << MAX_SHADOW_CASCADES << "];\n"
+            << "    vec4 cascadeSplits;\n"
+            << "    vec4 cascadeDepthBias;\n"
+            << "    vec4 lightDir;\n"
+            << "    vec4 lightColor;\n"
+            << "    float lightColorCoeff;\n"
+            << "    bool fogEnabled;\n"
+            << "    int cascadeCount;\n"
+            << "    int pointLightCount;\n"
+            << "};\n";
+        return source.str();
+    }
+
+    void FrameUniforms::attach(gps::Shader shader)
+    {
+        //block queries need the linked program
+        shader.finishLoad();
+        GLuint blockIndex = glGetUniformBlockIndex(shader.shaderProgram, "FrameData");
+        if (blockIndex == GL_INVALID_INDEX) {
+            std::cout << "Shader program " << shader.shaderProgram << " has no FrameData block" << std::endl;
+            return;
+        }
+        glUniformBlockBinding(shader.shaderProgram, blockIndex, BINDING_POINT);
+    }
+
+    void FrameUniforms::setView(const glm::mat4& view)
+    {
+        if (std::memcmp(&this->data.view, &view, sizeof(glm::mat4)) != 0) {
+            this->data.view = view;
+            this->dirty = true;
+        }
+    }
+
+    void FrameUniforms::setProjection(const glm::mat4& projection)
+    {
+        if (std::memcmp(&this->data.projection, &projection, sizeof(glm::mat4)) != 0) {
+            this->data.projection = projection;
+            this->dirty = true;
+        }
+    }
+
+    void FrameUniforms::setShadowCascades(gps::ShadowCascades& cascades)
+    {
+        int count = cascades.getCascadeCount();
+        glm::vec4 splits = cascades.getSplits();
+        glm::vec4 depthBias = cascades.getDepthBias();
+        if (this->data.cascadeCount != count ||
+            std::memcmp(this->data.lightSpaceTrMatrices, cascades.getLightSpaceTrMatrices(), count * sizeof(glm::mat4)) != 0 ||
+            std::memcmp(&this->data.cascadeSplits, &splits, sizeof(glm::vec4)) != 0 ||
+            std::memcmp(&this->data.cascadeDepthBias, &depthBias, sizeof(glm::vec4)) != 0) {
+            std::memcpy(this->data.lightSpaceTrMatrices, cascades.getLightSpaceTrMatrices(), count * sizeof(glm::mat4));
+            this->data.cascadeSplits = splits;
+            this->data.cascadeDepthBias = depthBias;
+            this->data.cascadeCount = count;
+            this->dirty = true;
+        }
+    }
+
+    void FrameUniforms::setLightDir(const glm::vec3& lightDir)
+    {
+        glm::vec4 value(lightDir, 0.0f);
+        if (std::memcmp(&this->data.lightDir, &value, sizeof(glm::vec4)) != 0) {
+            this->data.lightDir = value;
+            this->dirty = true;
+        }
+    }
+
+    void FrameUniforms::setLightColor(const glm::vec3& lightColor)
+    {
+        glm::vec4 value(lightColor, 1.0f);
+        if (std::memcmp(&this->data.lightColor, &value, sizeof(glm::vec4)) != 0) {
+            this->data.lightColor = value;
+            this->dirty = true;
+        }
+    }
+
+    void FrameUniforms::setLightColorCoeff(GLfloat lightColorCoeff)
+    {
+        if (this->data.lightColorCoeff != lightColorCoeff) {
+            this->data.lightColorCoeff = lightColorCoeff;
+            this->dirty = true;
+        }
+    }
+
+    void FrameUniforms::setFogEnabled(bool fogEnabled)
+    {
+        GLint value = fogEnabled ? 1 : 0;
+        if (this->data.fogEnabled != value) {
+            this->data.fogEnabled = value;
+            this->dirty = true;
+        }
+    }
+
+    void FrameUniforms::setPointLightCount(GLint count)
+    {
+        if (this->data.pointLightCount != count) {
+            this->data.pointLightCount = count;
+            this->dirty = true;
+        }
+    }
+
+    const FrameData& FrameUniforms::getData()
+    {
+        return this->data;
+    }
+
+    void FrameUniforms::upload()
+    {
+        if (!this->dirty)
+            return;
+
+        glBindBuffer(GL_UNIFORM_BUFFER, this->ubo);
+        glBufferSubData(GL_UNIFORM_BUFFER, 0, sizeof(FrameData), &this->data);
+        glBindBuffer(GL_UNIFORM_BUFFER, 0);
+        this->dirty = false;
+    }
+}
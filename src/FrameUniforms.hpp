@@ -0,0 +1,65 @@
+#ifndef FrameUniforms_hpp
+#define FrameUniforms_hpp
+
+#include <GL/glew.h>
+#include <glm/glm.hpp>
+
+#include <string>
+
+#include "Shader.hpp"
+#include "ShadowCascades.hpp"
+
+namespace gps {
+
+// CPU mirror of the std140 "FrameData" uniform block, see FrameUniforms::blockSource()
+// member order and padding must match the GLSL declaration
+struct FrameData {
+    glm::mat4 view;
+    glm::mat4 projection;
+    glm::mat4 lightSpaceTrMatrices[MAX_SHADOW_CASCADES];
+    glm::vec4 cascadeSplits;    // view space distance where each cascade ends
+    glm::vec4 cascadeDepthBias;
+    glm::vec4 lightDir;   // xyz used
+    glm::vec4 lightColor; // rgb used
+    GLfloat lightColorCoeff;
+    GLint fogEnabled;
+    GLint cascadeCount;
+    GLint pointLightCount;
+};
+
+// Per-frame values shared by every shader program through one uniform buffer.
+// Setters only touch the CPU copy and mark it dirty when a value actually changes,
+// upload() sends it to the GPU at most once per frame.
+class FrameUniforms
+{
+public:
+    static const GLuint BINDING_POINT = 0;
+
+    //GLSL declaration of the FrameData block, gps::Shader inserts it after #version in every stage
+    static std::string blockSource();
+
+    void init();
+    // connects the program's FrameData block to the binding point (GLSL 4.10 has no layout(binding) for blocks)
+    void attach(gps::Shader shader);
+
+    void setView(const glm::mat4& view);
+    void setProjection(const glm::mat4& projection);
+    void setShadowCascades(gps::ShadowCascades& cascades);
+    void setLightDir(const glm::vec3& lightDir);
+    void setLightColor(const glm::vec3& lightColor);
+    void setLightColorCoeff(GLfloat lightColorCoeff);
+    void setFogEnabled(bool fogEnabled);
+    void setPointLightCount(GLint count);
+
+    const FrameData& getData();
+    void upload();
+
+private:
+    FrameData data;
+    bool dirty;
+    GLuint ubo;
+};
+
+}
+
+#endif /* FrameUniforms_hpp */
@@ -0,0 +1,249 @@
+#include "GLState.hpp"
+
+namespace gps {
+
+    // value that never matches a real GL name/enum, forces the next call to be issued
+    static const GLuint UNKNOWN = 0xFFFFFFFFu;
+
+    GLuint GLState::program = UNKNOWN;
+    GLuint GLState::vao = UNKNOWN;
+    GLuint GLState::activeUnit = UNKNOWN;
+    GLuint GLState::textures[GLState::MAX_TEXTURE_UNITS][GLState::TRACKED_TEXTURE_TARGETS];
+    GLuint GLState::readFbo = UNKNOWN;
+    GLuint GLState::drawFbo = UNKNOWN;
+    GLuint GLState::defaultFbo = 0;
+    GLenum GLState::depthFuncValue = UNKNOWN;
+    GLint GLState::depthMaskValue = -1;
+    GLint GLState::colorMaskValue = -1;
+    GLint GLState::viewportValue[4] = { -1, -1, -1, -1 };
+    GLenum GLState::polygonModeValue = UNKNOWN;
+
+    GLStateStats GLState::frame = { 0, 0 };
+    GLStateStats GLState::lastFrame = { 0, 0 };
+    GLStateStats GLState::total = { 0, 0 };
+
+    int GLState::targetIndex(GLenum target)
+    {
+        switch (target) {
+        case GL_TEXTURE_2D:
+            return 0;
+        case GL_TEXTURE_CUBE_MAP:
+            return 1;
+        case GL_TEXTURE_2D_ARRAY:
+            return 2;
+        case GL_TEXTURE_BUFFER:
+            return 3;
+        default:
+            return -1;
+        }
+    }
+
+    void GLState::issued()
+    {
+        frame.issued++;
+        total.issued++;
+    }
+
+    void GLState::skipped()
+    {
+        frame.skipped++;
+        total.skipped++;
+    }
+
+    void GLState::useProgram(GLuint program)
+    {
+        if (GLState::program == program) {
+            skipped();
+            return;
+        }
+        glUseProgram(program);
+        GLState::program = program;
+        issued();
+    }
+
+    void GLState::bindVertexArray(GLuint vao)
+    {
+        if (GLState::vao == vao) {
+            skipped();
+            return;
+        }
+        glBindVertexArray(vao);
+        GLState::vao = vao;
+        issued();
+    }
+
+    void GLState::activeTexture(GLuint unit)
+    {
+        if (activeUnit == unit) {
+            skipped();
+            return;
+        }
+        glActiveTexture(GL_TEXTURE0 + unit);
+        activeUnit = unit;
+        issued();
+    }
+
+    void GLState::bindTexture(GLenum target, GLuint texture)
+    {
+        int t = targetIndex(target);
+        if (t < 0 || activeUnit >= MAX_TEXTURE_UNITS) {
+            // untracked target or unit, always pass it through
+            glBindTexture(target, texture);
+            issued();
+            return;
+        }
+        if (textures[activeUnit][t] == texture) {
+            skipped();
+            return;
+        }
+        glBindTexture(target, texture);
+        textures[activeUnit][t] = texture;
+        issued();
+    }
+
+    void GLState::bindTexture(GLuint unit, GLenum target, GLuint texture)
+    {
+        int t = targetIndex(target);
+        // don't even switch the active unit if the texture is already there
+        if (t >= 0 && unit < MAX_TEXTURE_UNITS && textures[unit][t] == texture) {
+            skipped();
+            return;
+        }
+        activeTexture(unit);
+        bindTexture(target, texture);
+    }
+
+    void GLState::bindFramebuffer(GLuint fbo)
+    {
+        if (fbo == 0)
+            fbo = defaultFbo;
+        if (readFbo == fbo && drawFbo == fbo) {
+            skipped();
+            return;
+        }
+        glBindFramebuffer(GL_FRAMEBUFFER, fbo);
+        readFbo = fbo;
+        drawFbo = fbo;
+        issued();
+    }
+
+    void GLState::bindFramebuffers(GLuint readFbo, GLuint drawFbo)
+    {
+        if (readFbo == 0)
+            readFbo = defaultFbo;
+        if (drawFbo == 0)
+            drawFbo = defaultFbo;
+        if (GLState::readFbo == readFbo) {
+            skipped();
+        } else {
+            glBindFramebuffer(GL_READ_FRAMEBUFFER, readFbo);
+            GLState::readFbo = readFbo;
+            issued();
+        }
+        if (GLState::drawFbo == drawFbo) {
+            skipped();
+        } else {
+            glBindFramebuffer(GL_DRAW_FRAMEBUFFER, drawFbo);
+            GLState::drawFbo = drawFbo;
+            issued();
+        }
+    }
+
+    void GLState::setDefaultFramebuffer(GLuint fbo)
+    {
+        defaultFbo = fbo;
+        bindFramebuffer(0);
+    }
+
+    void GLState::depthFunc(GLenum func)
+    {
+        if (depthFuncValue == func) {
+            skipped();
+            return;
+        }
+        glDepthFunc(func);
+        depthFuncValue = func;
+        issued();
+    }
+
+    void GLState::depthMask(GLboolean write)
+    {
+        if (depthMaskValue == write) {
+            skipped();
+            return;
+        }
+        glDepthMask(write);
+        depthMaskValue = write;
+        issued();
+    }
+
+    void GLState::colorMask(GLboolean write)
+    {
+        if (colorMaskValue == write) {
+            skipped();
+            return;
+        }
+        glColorMask(write, write, write, write);
+        colorMaskValue = write;
+        issued();
+    }
+
+    void GLState::viewport(GLint x, GLint y, GLsizei width, GLsizei height)
+    {
+        if (viewportValue[0] == x && viewportValue[1] == y && viewportValue[2] == width && viewportValue[3] == height) {
+            skipped();
+            return;
+        }
+        glViewport(x, y, width, height);
+        viewportValue[0] = x;
+        viewportValue[1] = y;
+        viewportValue[2] = width;
+        viewportValue[3] = height;
+        issued();
+    }
+
+    void GLState::polygonMode(GLenum mode)
+    {
+        if (polygonModeValue == mode) {
+            skipped();
+            return;
+        }
+        glPolygonMode(GL_FRONT_AND_BACK, mode);
+        polygonModeValue = mode;
+        issued();
+    }
+
+    void GLState::invalidate()
+    {
+        program = UNKNOWN;
+        vao = UNKNOWN;
+        activeUnit = UNKNOWN;
+        for (GLuint i = 0; i < MAX_TEXTURE_UNITS; i++)
+            for (int t = 0; t < TRACKED_TEXTURE_TARGETS; t++)
+                textures[i][t] = UNKNOWN;
+        readFbo = UNKNOWN;
+        drawFbo = UNKNOWN;
+        depthFuncValue = UNKNOWN;
+        depthMaskValue = -1;
+        colorMaskValue = -1;
+        viewportValue[0] = viewportValue[1] = viewportValue[2] = viewportValue[3] = -1;
+        polygonModeValue = UNKNOWN;
+    }
+
+    void GLState::beginFrame()
+    {
+        lastFrame = frame;
+        frame.issued = 0;
+        frame.skipped = 0;
+    }
+
+    GLStateStats GLState::getFrameStats()
+    {
+        return lastFrame;
+    }
+
+    GLStateStats GLState::getTotalStats()
+    {
+        return total;
+    }
+}
@@ -0,0 +1,77 @@
+#ifndef GLState_hpp
+#define GLState_hpp
+
+#include <GL/glew.h>
+
+namespace gps {
+
+struct GLStateStats {
+    unsigned int issued;
+    unsigned int skipped;
+};
+
+// Thin cache over the bindings the renderer touches every frame.
+// A call that would not change the current GL state is dropped and counted as skipped.
+// All program/VAO/texture/FBO binds, depth func, depth/color masks, viewport and polygon mode changes must go through here,
+// otherwise the cache gets out of sync with the driver (call invalidate() after foreign GL code).
+class GLState
+{
+public:
+    static void useProgram(GLuint program);
+    static void bindVertexArray(GLuint vao);
+    static void activeTexture(GLuint unit);
+    //binds on the currently active texture unit
+    static void bindTexture(GLenum target, GLuint texture);
+    static void bindTexture(GLuint unit, GLenum target, GLuint texture);
+    //0 stands for the default framebuffer below
+    static void bindFramebuffer(GLuint fbo);
+    //separate read/draw bindings, for blits
+    static void bindFramebuffers(GLuint readFbo, GLuint drawFbo);
+    //what the frame ends up in, 0 (the window) unless rendering offscreen; binds it
+    static void setDefaultFramebuffer(GLuint fbo);
+    static void depthFunc(GLenum func);
+    //glClear only clears depth while depth writes are on
+    static void depthMask(GLboolean write);
+    //same flag for all four channels
+    static void colorMask(GLboolean write);
+    static void viewport(GLint x, GLint y, GLsizei width, GLsizei height);
+    //core profile only accepts GL_FRONT_AND_BACK as face
+    static void polygonMode(GLenum mode);
+
+    //forget every cached value, the next call of each kind is always issued
+    static void invalidate();
+
+    //closes the counters of the previous frame and starts new ones
+    static void beginFrame();
+    static GLStateStats getFrameStats();
+    static GLStateStats getTotalStats();
+
+private:
+    static const GLuint MAX_TEXTURE_UNITS = 16;
+    static const int TRACKED_TEXTURE_TARGETS = 4;
+
+    static GLuint program;
+    static GLuint vao;
+    static GLuint activeUnit;
+    static GLuint textures[MAX_TEXTURE_UNITS][TRACKED_TEXTURE_TARGETS];
+    static GLuint readFbo;
+    static GLuint drawFbo;
+    static GLuint defaultFbo;
+    static GLenum depthFuncValue;
+    static GLint depthMaskValue;
+    static GLint colorMaskValue;
+    static GLint viewportValue[4];
+    static GLenum polygonModeValue;
+
+    static GLStateStats frame;
+    static GLStateStats lastFrame;
+    static GLStateStats total;
+
+    static int targetIndex(GLenum target);
+    static void issued();
+    static void skipped();
+};
+
+}
+
+#endif /* GLState_hpp */
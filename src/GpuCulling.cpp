@@ -0,0 +1,340 @@
+#include "GpuCulling.hpp"
+#include "GLState.hpp"
+#include "Mesh.hpp"
+
+#include <algorithm>
+#include <chrono>
+#include <cstring>
+#include <sstream>
+
+namespace gps {
+
+    // invocations per work group, the same in the shaders
+    static const int CULL_GROUP_SIZE = 64;
+    static const int PYRAMID_GROUP_SIZE = 8;
+
+    // left, right, bottom, top, near, far: a row of the matrix plus or minus the w row
+    static void framePlanes(const glm::mat4& m, bool nearPlane, glm::vec4* planes)
+    {
+        glm::vec4 rows[4];
+        for (int r = 0; r < 4; r++)
+            rows[r] = glm::vec4(m[0][r], m[1][r], m[2][r], m[3][r]);
+        for (int p = 0; p < 6; p++) {
+            glm::vec4 plane = (p % 2 == 0) ? rows[3] + rows[p / 2] : rows[3] - rows[p / 2];
+            planes[p] = plane / glm::length(glm::vec3(plane));
+        }
+        // a plane nothing is ever behind
+        if (!nearPlane)
+            planes[4] = glm::vec4(0.0f, 0.0f, 0.0f, 1.0f);
+    }
+
+    static double elapsedMs(std::chrono::steady_clock::time_point start)
+    {
+        return std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+    }
+
+    bool GpuCulling::isSupported()
+    {
+        // the shaders are #version 430 and the buffers use glClearBufferData, glTexStorage2D and glBindImageTexture
+        return GLEW_VERSION_4_3;
+    }
+
+    std::string GpuCulling::shaderDefines()
+    {
+        std::ostringstream defines;
+        defines << "#define MAX_MODELS " << MAX_MODELS << "\n";
+        defines << "#define MAX_SHADOW_VIEWS " << MAX_SHADOW_VIEWS << "\n";
+        return defines.str();
+    }
+
+    void GpuCulling::init(gps::Shader cullShader, gps::Shader commandShader, gps::Shader pyramidShader)
+    {
+        this->cullShader = cullShader;
+        this->commandShader = commandShader;
+        this->pyramidShader = pyramidShader;
+        this->commandCount = 0;
+        this->instanceCount = 0;
+        this->hiZEnabled = false;
+        this->pyramidReady = false;
+        this->depthTexture = 0;
+        this->depthFramebuffer = 0;
+        this->pyramidTexture = 0;
+        this->pyramidWidth = 0;
+        this->pyramidHeight = 0;
+        this->pyramidLevels = 0;
+        this->screenWidth = 0;
+        this->screenHeight = 0;
+        std::memset(this->commandFirst, 0, sizeof(this->commandFirst));
+        std::memset(this->modelBases, 0, sizeof(this->modelBases));
+        std::memset(this->instanceCounts, 0, sizeof(this->instanceCounts));
+        std::memset(&this->stats, 0, sizeof(GpuCullingStats));
+
+        glGenBuffers(1, &this->instanceBuffer);
+        glGenBuffers(VIEW_COUNT, this->visibleBuffers);
+        glGenBuffers(1, &this->countBuffer);
+        glGenBuffers(1, &this->commandBuffer);
+        glGenBuffers(1, &this->commandModelBuffer);
+
+        glBindBuffer(GL_SHADER_STORAGE_BUFFER, this->countBuffer);
+        glBufferData(GL_SHADER_STORAGE_BUFFER, VIEW_COUNT * MAX_MODELS * sizeof(GLuint), NULL, GL_DYNAMIC_DRAW);
+        glBindBuffer(GL_SHADER_STORAGE_BUFFER, 0);
+
+        // the program uniforms that never change
+        this->cullShader.useShaderProgram();
+        glUniform1i(glGetUniformLocation(this->cullShader.shaderProgram, "depthPyramid"), TEXTURE_UNIT);
+        this->pyramidShader.useShaderProgram();
+        glUniform1i(glGetUniformLocation(this->pyramidShader.shaderProgram, "source"), TEXTURE_UNIT);
+    }
+
+    void GpuCulling::setModel(int model, const std::vector<GLsizei>& meshIndexCounts)
+    {
+        this->meshIndexCounts[model] = meshIndexCounts;
+    }
+
+    void GpuCulling::setInstances(const GpuInstance* instances, int count)
+    {
+        // each model gets a range of the visible buffers as big as all its instances, in model order
+        int modelCounts[MAX_MODELS] = {};
+        std::memset(this->instanceCounts, 0, sizeof(this->instanceCounts));
+        for (int i = 0; i < count; i++) {
+            modelCounts[instances[i].model]++;
+            for (int v = 0; v < VIEW_COUNT; v++)
+                if (instances[i].viewMask & (1u << v))
+                    this->instanceCounts[v][instances[i].model]++;
+        }
+        GLuint base = 0;
+        for (int m = 0; m < MAX_MODELS; m++) {
+            this->modelBases[m] = base;
+            base += modelCounts[m];
+        }
+        this->instanceCount = count;
+
+        glBindBuffer(GL_SHADER_STORAGE_BUFFER, this->instanceBuffer);
+        glBufferData(GL_SHADER_STORAGE_BUFFER, std::max(count, 1) * sizeof(GpuInstance), instances, GL_DYNAMIC_DRAW);
+        for (int v = 0; v < VIEW_COUNT; v++) {
+            glBindBuffer(GL_SHADER_STORAGE_BUFFER, this->visibleBuffers[v]);
+            glBufferData(GL_SHADER_STORAGE_BUFFER, std::max(count, 1) * sizeof(InstanceData), NULL, GL_DYNAMIC_COPY);
+        }
+
+        // one command per mesh of every model, camera view first; the culling only writes the instance counts
+        std::vector<DrawCommand> commands;
+        std::vector<GLuint> commandModels;
+        for (int m = 0; m < MAX_MODELS; m++) {
+            this->commandFirst[m] = (int)commands.size();
+            for (size_t mesh = 0; mesh < this->meshIndexCounts[m].size(); mesh++) {
+                DrawCommand command = { (GLuint)this->meshIndexCounts[m][mesh], 0, 0, 0, this->modelBases[m] };
+                commands.push_back(command);
+                commandModels.push_back(m);
+            }
+        }
+        this->commandCount = (int)commands.size();
+        for (int v = 1; v < VIEW_COUNT; v++)
+            commands.insert(commands.end(), commands.begin(), commands.begin() + this->commandCount);
+
+        glBindBuffer(GL_SHADER_STORAGE_BUFFER, this->commandBuffer);
+        glBufferData(GL_SHADER_STORAGE_BUFFER, std::max<size_t>(commands.size(), 1) * sizeof(DrawCommand),
+            commands.data(), GL_DYNAMIC_DRAW);
+        glBindBuffer(GL_SHADER_STORAGE_BUFFER, this->commandModelBuffer);
+        glBufferData(GL_SHADER_STORAGE_BUFFER, std::max<size_t>(commandModels.size(), 1) * sizeof(GLuint),
+            commandModels.data(), GL_STATIC_DRAW);
+        glBindBuffer(GL_SHADER_STORAGE_BUFFER, 0);
+
+        this->stats.instances = count;
+        this->stats.commands = this->commandCount;
+    }
+
+    void GpuCulling::updateInstances(int first, const GpuInstance* instances, int count)
+    {
+        glBindBuffer(GL_SHADER_STORAGE_BUFFER, this->instanceBuffer);
+        glBufferSubData(GL_SHADER_STORAGE_BUFFER, first * sizeof(GpuInstance), count * sizeof(GpuInstance), instances);
+        glBindBuffer(GL_SHADER_STORAGE_BUFFER, 0);
+    }
+
+    int GpuCulling::getInstanceCount(View view, int model)
+    {
+        return this->instanceCounts[view][model];
+    }
+
+    void GpuCulling::setHiZ(bool enabled)
+    {
+        this->hiZEnabled = enabled;
+    }
+
+    bool GpuCulling::isHiZEnabled()
+    {
+        return this->hiZEnabled;
+    }
+
+    void GpuCulling::cull(const glm::mat4& cameraViewProjection, const glm::mat4* shadowViewProjections, int shadowViewCount)
+    {
+        std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+        if (this->commandCount == 0)
+            return;
+
+        glBindBuffer(GL_SHADER_STORAGE_BUFFER, this->countBuffer);
+        glClearBufferData(GL_SHADER_STORAGE_BUFFER, GL_R32UI, GL_RED_INTEGER, GL_UNSIGNED_INT, NULL);
+        glBindBuffer(GL_SHADER_STORAGE_BUFFER, 0);
+
+        glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 0, this->instanceBuffer);
+        glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 1, this->visibleBuffers[CAMERA_VIEW]);
+        glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 2, this->visibleBuffers[SHADOW_VIEW]);
+        glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 3, this->countBuffer);
+        glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 4, this->commandBuffer);
+        glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 5, this->commandModelBuffer);
+
+        if (this->instanceCount > 0) {
+            glm::vec4 cameraPlanes[6];
+            glm::vec4 shadowPlanes[6 * MAX_SHADOW_VIEWS];
+            framePlanes(cameraViewProjection, true, cameraPlanes);
+            shadowViewCount = std::min(shadowViewCount, MAX_SHADOW_VIEWS);
+            for (int v = 0; v < shadowViewCount; v++)
+                framePlanes(shadowViewProjections[v], false, shadowPlanes + 6 * v);
+
+            bool hiZ = this->hiZEnabled && this->pyramidReady;
+            GLuint program = this->cullShader.shaderProgram;
+            this->cullShader.useShaderProgram();
+            glUniform1ui(glGetUniformLocation(program, "instanceCount"), (GLuint)this->instanceCount);
+            glUniform1uiv(glGetUniformLocation(program, "modelBases"), MAX_MODELS, this->modelBases);
+            glUniform4fv(glGetUniformLocation(program, "cameraPlanes"), 6, &cameraPlanes[0][0]);
+            if (shadowViewCount > 0)
+                glUniform4fv(glGetUniformLocation(program, "shadowPlanes"), 6 * shadowViewCount, &shadowPlanes[0][0]);
+            glUniform1i(glGetUniformLocation(program, "shadowViewCount"), shadowViewCount);
+            glUniform1i(glGetUniformLocation(program, "hiZEnabled"), hiZ ? 1 : 0);
+            if (hiZ) {
+                glUniformMatrix4fv(glGetUniformLocation(program, "hiZViewProjection"), 1, GL_FALSE,
+                    &this->pyramidViewProjection[0][0]);
+                glUniform2f(glGetUniformLocation(program, "screenSize"), (GLfloat)this->screenWidth, (GLfloat)this->screenHeight);
+                glUniform1i(glGetUniformLocation(program, "pyramidLevels"), this->pyramidLevels);
+                glUniform2i(glGetUniformLocation(program, "pyramidSize"), this->pyramidWidth, this->pyramidHeight);
+                GLState::bindTexture(TEXTURE_UNIT, GL_TEXTURE_2D, this->pyramidTexture);
+            }
+            glDispatchCompute((this->instanceCount + CULL_GROUP_SIZE - 1) / CULL_GROUP_SIZE, 1, 1);
+            glMemoryBarrier(GL_SHADER_STORAGE_BARRIER_BIT);
+        }
+
+        this->commandShader.useShaderProgram();
+        glUniform1ui(glGetUniformLocation(this->commandShader.shaderProgram, "commandCount"), (GLuint)this->commandCount);
+        glDispatchCompute((VIEW_COUNT * this->commandCount + CULL_GROUP_SIZE - 1) / CULL_GROUP_SIZE, 1, 1);
+        // the draws read the commands and the instance attributes the dispatches wrote
+        glMemoryBarrier(GL_COMMAND_BARRIER_BIT | GL_VERTEX_ATTRIB_ARRAY_BARRIER_BIT);
+
+        for (int binding = 0; binding < 6; binding++)
+            glBindBufferBase(GL_SHADER_STORAGE_BUFFER, binding, 0);
+
+        this->stats.cullMs = elapsedMs(start);
+    }
+
+    void GpuCulling::resizePyramid(int width, int height)
+    {
+        if (this->depthTexture != 0) {
+            // the names may come back for the new textures, the cache must not think they are still bound
+            GLState::bindTexture(TEXTURE_UNIT, GL_TEXTURE_2D, 0);
+            glDeleteTextures(1, &this->depthTexture);
+            glDeleteTextures(1, &this->pyramidTexture);
+            glDeleteFramebuffers(1, &this->depthFramebuffer);
+        }
+        this->screenWidth = width;
+        this->screenHeight = height;
+
+        // the blit needs the format of the default framebuffer's depth
+        glGenTextures(1, &this->depthTexture);
+        GLState::bindTexture(GL_TEXTURE_2D, this->depthTexture);
+        glTexStorage2D(GL_TEXTURE_2D, 1, GL_DEPTH24_STENCIL8, width, height);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_COMPARE_MODE, GL_NONE);
+
+        glGenFramebuffers(1, &this->depthFramebuffer);
+        GLState::bindFramebuffer(this->depthFramebuffer);
+        glFramebufferTexture2D(GL_FRAMEBUFFER, GL_DEPTH_STENCIL_ATTACHMENT, GL_TEXTURE_2D, this->depthTexture, 0);
+        glDrawBuffer(GL_NONE);
+        glReadBuffer(GL_NONE);
+        GLState::bindFramebuffer(0);
+
+        // level 0 is half the screen, every texel the farthest depth under it
+        this->pyramidWidth = std::max(1, (width + 1) / 2);
+        this->pyramidHeight = std::max(1, (height + 1) / 2);
+        this->pyramidLevels = 1;
+        for (int size = std::max(this->pyramidWidth, this->pyramidHeight); size > 1; size /= 2)
+            this->pyramidLevels++;
+        glGenTextures(1, &this->pyramidTexture);
+        GLState::bindTexture(GL_TEXTURE_2D, this->pyramidTexture);
+        glTexStorage2D(GL_TEXTURE_2D, this->pyramidLevels, GL_R32F, this->pyramidWidth, this->pyramidHeight);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST_MIPMAP_NEAREST);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+        GLState::bindTexture(GL_TEXTURE_2D, 0);
+    }
+
+    void GpuCulling::buildDepthPyramid(const glm::mat4& viewProjection, int width, int height)
+    {
+        std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+        if (width <= 0 || height <= 0)
+            return;
+        if (width != this->screenWidth || height != this->screenHeight)
+            resizePyramid(width, height);
+
+        GLState::bindFramebuffers(0, this->depthFramebuffer);
+        glBlitFramebuffer(0, 0, width, height, 0, 0, width, height, GL_DEPTH_BUFFER_BIT, GL_NEAREST);
+        GLState::bindFramebuffer(0);
+
+        // every level takes the max of the texels of the one above under it, the depth buffer for level 0
+        GLuint program = this->pyramidShader.shaderProgram;
+        this->pyramidShader.useShaderProgram();
+        int sourceWidth = width;
+        int sourceHeight = height;
+        int levelWidth = this->pyramidWidth;
+        int levelHeight = this->pyramidHeight;
+        for (int level = 0; level < this->pyramidLevels; level++) {
+            if (level == 0) {
+                GLState::bindTexture(TEXTURE_UNIT, GL_TEXTURE_2D, this->depthTexture);
+                glUniform1i(glGetUniformLocation(program, "sourceLevel"), 0);
+            } else {
+                GLState::bindTexture(TEXTURE_UNIT, GL_TEXTURE_2D, this->pyramidTexture);
+                glUniform1i(glGetUniformLocation(program, "sourceLevel"), level - 1);
+            }
+            glUniform2i(glGetUniformLocation(program, "sourceSize"), sourceWidth, sourceHeight);
+            glBindImageTexture(0, this->pyramidTexture, level, GL_FALSE, 0, GL_WRITE_ONLY, GL_R32F);
+            glDispatchCompute((levelWidth + PYRAMID_GROUP_SIZE - 1) / PYRAMID_GROUP_SIZE,
+                (levelHeight + PYRAMID_GROUP_SIZE - 1) / PYRAMID_GROUP_SIZE, 1);
+            glMemoryBarrier(GL_TEXTURE_FETCH_BARRIER_BIT);
+            sourceWidth = levelWidth;
+            sourceHeight = levelHeight;
+            levelWidth = std::max(1, levelWidth / 2);
+            levelHeight = std::max(1, levelHeight / 2);
+        }
+        glBindImageTexture(0, 0, 0, GL_FALSE, 0, GL_WRITE_ONLY, GL_R32F);
+
+        this->pyramidViewProjection = viewProjection;
+        this->pyramidReady = true;
+        this->stats.pyramidMs = elapsedMs(start);
+    }
+
+    GLuint GpuCulling::getInstanceBuffer(View view)
+    {
+        return this->visibleBuffers[view];
+    }
+
+    void GpuCulling::bindCommands()
+    {
+        glBindBuffer(GL_DRAW_INDIRECT_BUFFER, this->commandBuffer);
+    }
+
+    GLintptr GpuCulling::getCommandOffset(View view, int model, int mesh)
+    {
+        return (GLintptr)((view * this->commandCount + this->commandFirst[model] + mesh) * sizeof(DrawCommand));
+    }
+
+    void GpuCulling::readVisibleCounts(View view, unsigned int* counts)
+    {
+        glBindBuffer(GL_SHADER_STORAGE_BUFFER, this->countBuffer);
+        glGetBufferSubData(GL_SHADER_STORAGE_BUFFER, view * MAX_MODELS * sizeof(GLuint), MAX_MODELS * sizeof(GLuint), counts);
+        glBindBuffer(GL_SHADER_STORAGE_BUFFER, 0);
+    }
+
+    GpuCullingStats GpuCulling::getStats()
+    {
+        return this->stats;
+    }
+}
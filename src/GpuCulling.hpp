@@ -0,0 +1,131 @@
+#ifndef GpuCulling_hpp
+#define GpuCulling_hpp
+
+#include <GL/glew.h>
+#include <glm/glm.hpp>
+
+#include "Shader.hpp"
+
+#include <vector>
+
+namespace gps {
+
+// one instance as the culling shader reads it, std430 layout
+struct GpuInstance {
+    glm::mat4 transform;
+    glm::vec4 normalMatrix[3];      // columns, w unused
+    glm::vec4 boxMin;               // model space bounding box, w unused
+    glm::vec4 boxMax;
+    GLuint model;                   // index into the model table
+    GLuint viewMask;                // bit of every view the instance can be drawn in (1 << GpuCulling::View)
+    GLuint padding[2];
+};
+
+struct GpuCullingStats {
+    double cullMs;                  // CPU time of the last cull, both dispatches
+    double pyramidMs;               // CPU time of the last depth pyramid
+    unsigned int instances;
+    unsigned int commands;          // draw commands per view, one per mesh of every model
+};
+
+// Frustum culling (and optionally Hi-Z occlusion culling) of every instance on the GPU, for scenes too big to walk
+// on the CPU every frame. The instances live in a shader storage buffer the caller only updates where they moved.
+// One compute dispatch tests each instance against the camera and the shadow views and appends the visible ones
+// to the instance buffer of each view, every model in its own range; a second one writes the instance counts into
+// the indirect draw commands, one DrawElementsIndirectCommand per mesh of every model and view. The CPU never sees
+// the results: it issues the same dispatches and the same indirect draws whatever the instance count is.
+// The Hi-Z test reads a max depth pyramid built from the previous frame's depth buffer and that frame's
+// view-projection, so an object the camera turned towards can show up a frame late.
+class GpuCulling
+{
+public:
+    static const int MAX_MODELS = 8;
+    static const int MAX_SHADOW_VIEWS = 4;
+    // the depth pyramid is read from this unit
+    static const GLuint TEXTURE_UNIT = 12;
+
+    enum View { CAMERA_VIEW, SHADOW_VIEW, VIEW_COUNT };
+
+    //compute shaders, shader storage buffers and indirect draws, GL 4.3
+    static bool isSupported();
+    //defines the shaders must be loaded with
+    static std::string shaderDefines();
+
+    //programs from cull.comp, cullCommands.comp and depthPyramid.comp
+    void init(gps::Shader cullShader, gps::Shader commandShader, gps::Shader pyramidShader);
+    //index counts of the meshes of a model of the table, before setInstances
+    void setModel(int model, const std::vector<GLsizei>& meshIndexCounts);
+    //the whole instance set, whenever instances are added, removed or change model
+    void setInstances(const GpuInstance* instances, int count);
+    //instances first to first + count - 1 moved, their models didn't change
+    void updateInstances(int first, const GpuInstance* instances, int count);
+    //instances of a model that can be drawn in a view
+    int getInstanceCount(View view, int model);
+
+    void setHiZ(bool enabled);
+    bool isHiZEnabled();
+
+    //writes the visible instances and the draw commands of both views. The camera is culled with its near plane
+    //(and the pyramid), the shadow views without theirs, an instance in any of them is drawn.
+    void cull(const glm::mat4& cameraViewProjection, const glm::mat4* shadowViewProjections, int shadowViewCount);
+    //max depth pyramid of the default framebuffer's depth as drawn with viewProjection, for the next cull
+    void buildDepthPyramid(const glm::mat4& viewProjection, int width, int height);
+
+    //gps::InstanceData of the instances of a view that passed, what the meshes' instance attributes read
+    GLuint getInstanceBuffer(View view);
+    //the commands of both views as GL_DRAW_INDIRECT_BUFFER
+    void bindCommands();
+    GLintptr getCommandOffset(View view, int model, int mesh);
+
+    //visible instances of each model in a view as of the last cull, waits for the GPU (benchmarks and stats)
+    void readVisibleCounts(View view, unsigned int* counts);
+    GpuCullingStats getStats();
+
+private:
+    struct DrawCommand {
+        GLuint count;
+        GLuint instanceCount;
+        GLuint firstIndex;
+        GLint baseVertex;
+        GLuint baseInstance;
+    };
+
+    gps::Shader cullShader;
+    gps::Shader commandShader;
+    gps::Shader pyramidShader;
+
+    std::vector<GLsizei> meshIndexCounts[MAX_MODELS];
+    // first command of each model, commands of all models back to back in each view
+    int commandFirst[MAX_MODELS];
+    int commandCount;
+    GLuint modelBases[MAX_MODELS];
+    int instanceCounts[VIEW_COUNT][MAX_MODELS];
+    int instanceCount;
+
+    GLuint instanceBuffer;
+    GLuint visibleBuffers[VIEW_COUNT];
+    GLuint countBuffer;
+    GLuint commandBuffer;
+    GLuint commandModelBuffer;
+
+    bool hiZEnabled;
+    // valid once a pyramid was built
+    bool pyramidReady;
+    GLuint depthTexture;
+    GLuint depthFramebuffer;
+    GLuint pyramidTexture;
+    int pyramidWidth;
+    int pyramidHeight;
+    int pyramidLevels;
+    int screenWidth;
+    int screenHeight;
+    glm::mat4 pyramidViewProjection;
+
+    GpuCullingStats stats;
+
+    void resizePyramid(int width, int height);
+};
+
+}
+
+#endif /* GpuCulling_hpp */
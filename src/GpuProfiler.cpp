@@ -0,0 +1,232 @@
+#include "GpuProfiler.hpp"
+
+#include <algorithm>
+
+namespace gps {
+
+    void GpuProfiler::init() {
+        enabled = true;
+        inFrame = false;
+        currentFrame = 0;
+        droppedFrames = 0;
+        for (int i = 0; i < FRAME_LATENCY; i++) {
+            frames[i].usedQueries = 0;
+            frames[i].pending = false;
+        }
+        scopes.clear();
+        scopeIds.clear();
+        openRecords.clear();
+    }
+
+    void GpuProfiler::setEnabled(bool enabled) {
+        //a frame already started keeps its queries, the flag is looked at by the next beginFrame
+        this->enabled = enabled;
+    }
+
+    bool GpuProfiler::isEnabled() {
+        return enabled;
+    }
+
+    void GpuProfiler::beginFrame() {
+        FrameSlot& frame = frames[currentFrame];
+        if (frame.pending) {
+            collect(frame);
+        }
+        frame.usedQueries = 0;
+        frame.records.clear();
+        openRecords.clear();
+
+        inFrame = enabled;
+        beginScope("frame");
+    }
+
+    void GpuProfiler::endFrame() {
+        if (!inFrame) {
+            return;
+        }
+        while (!openRecords.empty()) {
+            endScope();
+        }
+        inFrame = false;
+        frames[currentFrame].pending = true;
+        currentFrame = (currentFrame + 1) % FRAME_LATENCY;
+    }
+
+    void GpuProfiler::beginScope(const std::string& name) {
+        if (!inFrame) {
+            return;
+        }
+        FrameSlot& frame = frames[currentFrame];
+        int parent = openRecords.empty() ? -1 : frame.records[openRecords.back()].scope;
+
+        Record record;
+        record.scope = findScope(parent, name);
+        record.beginQuery = timestamp();
+        record.endQuery = -1;
+        openRecords.push_back((int)frame.records.size());
+        frame.records.push_back(record);
+    }
+
+    void GpuProfiler::endScope() {
+        if (!inFrame || openRecords.empty()) {
+            return;
+        }
+        frames[currentFrame].records[openRecords.back()].endQuery = timestamp();
+        openRecords.pop_back();
+    }
+
+    void GpuProfiler::flush() {
+        glFinish();
+        // oldest first, the current slot is the next one to be reused
+        for (int i = 0; i < FRAME_LATENCY; i++) {
+            FrameSlot& frame = frames[(currentFrame + i) % FRAME_LATENCY];
+            if (frame.pending) {
+                collect(frame);
+            }
+        }
+    }
+
+    int GpuProfiler::findScope(int parent, const std::string& name) {
+        std::pair<int, std::string> key(parent, name);
+        std::map<std::pair<int, std::string>, int>::iterator it = scopeIds.find(key);
+        if (it != scopeIds.end()) {
+            return it->second;
+        }
+
+        Scope scope;
+        scope.name = name;
+        scope.parent = parent;
+        scope.depth = parent < 0 ? 0 : scopes[parent].depth + 1;
+        scope.historyNext = 0;
+        scope.samples = 0;
+        int id = (int)scopes.size();
+        scopes.push_back(scope);
+        if (parent >= 0) {
+            scopes[parent].children.push_back(id);
+        }
+        scopeIds[key] = id;
+        return id;
+    }
+
+    GLint GpuProfiler::timestamp() {
+        FrameSlot& frame = frames[currentFrame];
+        if (frame.usedQueries == (int)frame.queries.size()) {
+            GLuint query;
+            glGenQueries(1, &query);
+            frame.queries.push_back(query);
+        }
+        int index = frame.usedQueries++;
+        glQueryCounter(frame.queries[index], GL_TIMESTAMP);
+        return index;
+    }
+
+    void GpuProfiler::collect(FrameSlot& frame) {
+        frame.pending = false;
+        if (frame.usedQueries == 0) {
+            return;
+        }
+
+        //queries complete in order, the last one being back means the whole frame is
+        GLint available = 0;
+        glGetQueryObjectiv(frame.queries[frame.usedQueries - 1], GL_QUERY_RESULT_AVAILABLE, &available);
+        if (!available) {
+            droppedFrames++;
+            return;
+        }
+
+        frameTotals.assign(scopes.size(), -1.0);
+        for (size_t i = 0; i < frame.records.size(); i++) {
+            const Record& record = frame.records[i];
+            if (record.endQuery < 0) {
+                continue;
+            }
+            GLuint64 begin = 0;
+            GLuint64 end = 0;
+            glGetQueryObjectui64v(frame.queries[record.beginQuery], GL_QUERY_RESULT, &begin);
+            glGetQueryObjectui64v(frame.queries[record.endQuery], GL_QUERY_RESULT, &end);
+            double ms = end > begin ? (end - begin) / 1.0e6 : 0.0;
+            frameTotals[record.scope] = std::max(frameTotals[record.scope], 0.0) + ms;
+        }
+
+        for (size_t i = 0; i < scopes.size(); i++) {
+            if (frameTotals[i] < 0.0) {
+                continue;
+            }
+            Scope& scope = scopes[i];
+            if ((int)scope.history.size() < HISTORY) {
+                scope.history.push_back(frameTotals[i]);
+            } else {
+                scope.history[scope.historyNext] = frameTotals[i];
+            }
+            scope.historyNext = (scope.historyNext + 1) % HISTORY;
+            scope.samples++;
+        }
+    }
+
+    std::vector<GpuScopeStats> GpuProfiler::getStats() {
+        std::vector<GpuScopeStats> stats;
+        for (size_t i = 0; i < scopes.size(); i++) {
+            if (scopes[i].parent < 0) {
+                appendStats((int)i, stats);
+            }
+        }
+        return stats;
+    }
+
+    void GpuProfiler::appendStats(int id, std::vector<GpuScopeStats>& stats) {
+        const Scope& scope = scopes[id];
+        GpuScopeStats entry;
+        entry.name = scope.name;
+        entry.depth = scope.depth;
+        entry.samples = (unsigned int)scope.history.size();
+        entry.minMs = 0.0;
+        entry.avgMs = 0.0;
+        entry.p99Ms = 0.0;
+
+        if (!scope.history.empty()) {
+            std::vector<double> sorted = scope.history;
+            std::sort(sorted.begin(), sorted.end());
+            double sum = 0.0;
+            for (size_t i = 0; i < sorted.size(); i++) {
+                sum += sorted[i];
+            }
+            entry.minMs = sorted.front();
+            entry.avgMs = sum / sorted.size();
+            entry.p99Ms = sorted[std::min(sorted.size() - 1, (size_t)(sorted.size() * 0.99))];
+        }
+        stats.push_back(entry);
+
+        for (size_t i = 0; i < scope.children.size(); i++) {
+            appendStats(scope.children[i], stats);
+        }
+    }
+
+    void GpuProfiler::dumpStats(FILE* out) {
+        std::vector<GpuScopeStats> stats = getStats();
+        fprintf(out, "GPU profile (last %d frames, %u dropped)\n", HISTORY, droppedFrames);
+        fprintf(out, "  %-32s %8s %8s %8s %8s\n", "scope", "min ms", "avg ms", "p99 ms", "frames");
+        for (size_t i = 0; i < stats.size(); i++) {
+            std::string name = std::string(2 * stats[i].depth, ' ') + stats[i].name;
+            fprintf(out, "  %-32s %8.3f %8.3f %8.3f %8u\n", name.c_str(),
+                stats[i].minMs, stats[i].avgMs, stats[i].p99Ms, stats[i].samples);
+        }
+        fflush(out);
+    }
+
+    unsigned int GpuProfiler::getDroppedFrames() {
+        return droppedFrames;
+    }
+
+    GpuScope::GpuScope(GpuProfiler* profiler, const std::string& name) : profiler(profiler) {
+        if (profiler != NULL) {
+            profiler->beginScope(name);
+        }
+    }
+
+    GpuScope::~GpuScope() {
+        if (profiler != NULL) {
+            profiler->endScope();
+        }
+    }
+
+}
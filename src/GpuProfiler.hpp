@@ -0,0 +1,110 @@
+#ifndef GpuProfiler_hpp
+#define GpuProfiler_hpp
+
+#include <GL/glew.h>
+
+#include <cstdio>
+#include <map>
+#include <string>
+#include <utility>
+#include <vector>
+
+namespace gps {
+
+struct GpuScopeStats {
+    std::string name;
+    int depth;              // 0 for the frame, 1 for the passes, ...
+    unsigned int samples;   // frames in the rolling window that ran the scope
+    double minMs;
+    double avgMs;
+    double p99Ms;
+};
+
+// Scoped GPU timing built on GL_TIMESTAMP queries, so scopes can nest (GL_TIME_ELAPSED queries can't).
+// Every frame gets its own set of queries in a ring of FRAME_LATENCY frames. A frame is read back when its
+// slot comes around again, by then the GPU is long done with it, so reading never stalls the pipeline
+// (a frame whose results still aren't there is dropped). Scopes are identified by their name and parent,
+// a scope that runs several times in a frame (one mesh in two passes) is summed for that frame.
+class GpuProfiler
+{
+public:
+    static const int FRAME_LATENCY = 4;
+    // rolling window of the stats, in frames
+    static const int HISTORY = 300;
+
+    //also drops every scope and its history, so it can be called again to start over
+    void init();
+    void setEnabled(bool enabled);
+    bool isEnabled();
+
+    //reads back the oldest frame of the ring and opens the "frame" scope, scopes outside a frame are ignored
+    void beginFrame();
+    void endFrame();
+
+    void beginScope(const std::string& name);
+    void endScope();
+
+    //waits for the frames still in the ring and adds them to the stats (end of a benchmark)
+    void flush();
+
+    //scopes in tree order
+    std::vector<GpuScopeStats> getStats();
+    void dumpStats(FILE* out);
+    unsigned int getDroppedFrames();
+
+private:
+    struct Scope {
+        std::string name;
+        int parent;
+        int depth;
+        std::vector<int> children;
+        std::vector<double> history;  // ms per frame, ring of HISTORY
+        int historyNext;
+        unsigned int samples;
+    };
+
+    struct Record {
+        int scope;
+        int beginQuery;
+        int endQuery;
+    };
+
+    struct FrameSlot {
+        std::vector<GLuint> queries;
+        int usedQueries;
+        std::vector<Record> records;
+        bool pending;
+    };
+
+    bool enabled;
+    bool inFrame;
+    FrameSlot frames[FRAME_LATENCY];
+    int currentFrame;
+    unsigned int droppedFrames;
+
+    std::vector<Scope> scopes;
+    std::map<std::pair<int, std::string>, int> scopeIds;
+    // open records of the current frame
+    std::vector<int> openRecords;
+    std::vector<double> frameTotals;
+
+    int findScope(int parent, const std::string& name);
+    GLint timestamp();
+    void collect(FrameSlot& frame);
+    void appendStats(int scope, std::vector<GpuScopeStats>& stats);
+};
+
+// Times the enclosing block, does nothing without a profiler
+class GpuScope
+{
+public:
+    GpuScope(GpuProfiler* profiler, const std::string& name);
+    ~GpuScope();
+
+private:
+    GpuProfiler* profiler;
+};
+
+}
+
+#endif /* GpuProfiler_hpp */
@@ -0,0 +1,176 @@
+#include "InputRecorder.hpp"
+
+#include <cstring>
+
+namespace gps {
+
+    // "GPSI" and the format version
+    static const unsigned char MAGIC[4] = { 'G', 'P', 'S', 'I' };
+    static const unsigned int VERSION = 2;
+
+    InputRecorder::InputRecorder()
+    {
+        file = NULL;
+        recording = false;
+        replaying = false;
+        frameCount = 0;
+    }
+
+    InputRecorder::~InputRecorder()
+    {
+        stop();
+    }
+
+    bool InputRecorder::startRecording(const std::string& fileName)
+    {
+        stop();
+        file = fopen(fileName.c_str(), "wb");
+        if (file == NULL) {
+            fprintf(stderr, "Could not create the input recording %s\n", fileName.c_str());
+            return false;
+        }
+        fwrite(MAGIC, 1, sizeof(MAGIC), file);
+        writeU16(VERSION);
+        writeU16(MAX_KEYS);
+
+        keyState.assign(MAX_KEYS, GL_FALSE);
+        frameCount = 0;
+        recording = true;
+        return true;
+    }
+
+    bool InputRecorder::startReplay(const std::string& fileName)
+    {
+        stop();
+        file = fopen(fileName.c_str(), "rb");
+        if (file == NULL) {
+            fprintf(stderr, "Could not open the input recording %s\n", fileName.c_str());
+            return false;
+        }
+
+        unsigned char magic[4];
+        unsigned int version = 0;
+        unsigned int keyCount = 0;
+        if (fread(magic, 1, sizeof(magic), file) != sizeof(magic) || memcmp(magic, MAGIC, sizeof(MAGIC)) != 0 ||
+            !readU16(&version) || version != VERSION || !readU16(&keyCount) || keyCount != MAX_KEYS) {
+            fprintf(stderr, "%s is not an input recording this build can replay\n", fileName.c_str());
+            stop();
+            return false;
+        }
+
+        keyState.assign(MAX_KEYS, GL_FALSE);
+        frameCount = 0;
+        replaying = true;
+        return true;
+    }
+
+    void InputRecorder::stop()
+    {
+        if (file != NULL) {
+            fclose(file);
+            file = NULL;
+        }
+        recording = false;
+        replaying = false;
+    }
+
+    bool InputRecorder::isRecording()
+    {
+        return recording;
+    }
+
+    bool InputRecorder::isReplaying()
+    {
+        return replaying;
+    }
+
+    unsigned int InputRecorder::getFrameCount()
+    {
+        return frameCount;
+    }
+
+    void InputRecorder::recordFrame(const GLboolean* keys, int activeObject, float frameSeconds)
+    {
+        if (!recording)
+            return;
+
+        changes.clear();
+        for (int key = 0; key < MAX_KEYS; key++) {
+            if ((keys[key] != GL_FALSE) != (keyState[key] != GL_FALSE)) {
+                changes.push_back((unsigned short)key);
+                keyState[key] = keys[key] ? GL_TRUE : GL_FALSE;
+            }
+        }
+
+        fputc(activeObject & 0xFF, file);
+        writeFloat(frameSeconds);
+        writeU16((unsigned int)changes.size());
+        for (size_t i = 0; i < changes.size(); i++)
+            writeU16(changes[i]);
+        frameCount++;
+    }
+
+    bool InputRecorder::replayFrame(GLboolean* keys, int* activeObject, float* frameSeconds)
+    {
+        if (!replaying)
+            return false;
+
+        int object = fgetc(file);
+        float seconds = 0.0f;
+        unsigned int changeCount = 0;
+        if (object == EOF || !readFloat(&seconds) || !readU16(&changeCount)) {
+            // end of the recording, nothing stays held
+            memset(keys, 0, MAX_KEYS * sizeof(GLboolean));
+            stop();
+            return false;
+        }
+        for (unsigned int i = 0; i < changeCount; i++) {
+            unsigned int key = 0;
+            if (!readU16(&key) || key >= MAX_KEYS)
+                break;
+            keyState[key] = keyState[key] ? GL_FALSE : GL_TRUE;
+        }
+
+        memcpy(keys, keyState.data(), MAX_KEYS * sizeof(GLboolean));
+        *activeObject = object;
+        *frameSeconds = seconds;
+        frameCount++;
+        return true;
+    }
+
+    void InputRecorder::writeU16(unsigned int value)
+    {
+        fputc(value & 0xFF, file);
+        fputc((value >> 8) & 0xFF, file);
+    }
+
+    void InputRecorder::writeFloat(float value)
+    {
+        unsigned int bits;
+        memcpy(&bits, &value, sizeof(bits));
+        writeU16(bits & 0xFFFF);
+        writeU16(bits >> 16);
+    }
+
+    bool InputRecorder::readFloat(float* value)
+    {
+        unsigned int low = 0;
+        unsigned int high = 0;
+        if (!readU16(&low) || !readU16(&high))
+            return false;
+        unsigned int bits = low | (high << 16);
+        memcpy(value, &bits, sizeof(bits));
+        return true;
+    }
+
+    bool InputRecorder::readU16(unsigned int* value)
+    {
+        int low = fgetc(file);
+        int high = fgetc(file);
+        if (low == EOF || high == EOF)
+            return false;
+        *value = (unsigned int)low | ((unsigned int)high << 8);
+        return true;
+    }
+
+}
@@ -0,0 +1,57 @@
+#ifndef InputRecorder_hpp
+#define InputRecorder_hpp
+
+#include <GL/glew.h>
+
+#include <cstdio>
+#include <string>
+#include <vector>
+
+namespace gps {
+
+// Records the key state of every frame to a file and plays it back in place of the real input.
+// The file is a small header followed by one record per frame: the active object, the frame time the
+// simulation advanced by, the number of keys that changed since the previous frame and their codes,
+// so a frame where nothing changes takes 7 bytes. All values are little endian.
+// Replaying the frame times too runs the same simulation steps in every frame, not just the same input.
+class InputRecorder
+{
+public:
+    static const int MAX_KEYS = 1024;
+
+    InputRecorder();
+    ~InputRecorder();
+
+    bool startRecording(const std::string& fileName);
+    bool startReplay(const std::string& fileName);
+    //closes the file, a recording is complete at any point
+    void stop();
+
+    bool isRecording();
+    bool isReplaying();
+    //frames recorded or replayed so far
+    unsigned int getFrameCount();
+
+    //appends the state the frame is about to run with
+    void recordFrame(const GLboolean* keys, int activeObject, float frameSeconds);
+    //overwrites keys, activeObject and frameSeconds with the next recorded frame, false once the recording is over
+    bool replayFrame(GLboolean* keys, int* activeObject, float* frameSeconds);
+
+private:
+    FILE* file;
+    bool recording;
+    bool replaying;
+    unsigned int frameCount;
+    // state of the previous frame, what the changes are relative to
+    std::vector<GLboolean> keyState;
+    std::vector<unsigned short> changes;
+
+    void writeU16(unsigned int value);
+    bool readU16(unsigned int* value);
+    void writeFloat(float value);
+    bool readFloat(float* value);
+};
+
+}
+
+#endif /* InputRecorder_hpp */
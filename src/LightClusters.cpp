@@ -0,0 +1,272 @@
+#include "LightClusters.hpp"
+#include "GLState.hpp"
+
+#include <emmintrin.h>
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstring>
+
+namespace gps {
+
+    void LightClusters::init(gps::ThreadPool* threadPool, GLfloat zNear, GLfloat sliceFar)
+    {
+        this->threadPool = threadPool;
+        this->zNear = zNear;
+        this->sliceFar = sliceFar;
+        this->planesProjection = glm::mat4(0.0f);
+        this->data = ClusterData();
+        std::memset(&this->lastFrame, 0, sizeof(ClusterStats));
+        std::memset(&this->total, 0, sizeof(ClusterStats));
+        this->buildCount = 0;
+
+        this->clusterCounts.resize(CLUSTER_COUNT);
+        this->clusterRanges.resize(2 * CLUSTER_COUNT);
+
+        glGenBuffers(1, &this->ubo);
+        glBindBuffer(GL_UNIFORM_BUFFER, this->ubo);
+        glBufferData(GL_UNIFORM_BUFFER, sizeof(ClusterData), NULL, GL_DYNAMIC_DRAW);
+        glBindBuffer(GL_UNIFORM_BUFFER, 0);
+        glBindBufferBase(GL_UNIFORM_BUFFER, BINDING_POINT, this->ubo);
+
+        // (first index, count) per cluster, empty until the first build
+        glGenBuffers(1, &this->rangeBuffer);
+        glBindBuffer(GL_TEXTURE_BUFFER, this->rangeBuffer);
+        glBufferData(GL_TEXTURE_BUFFER, 2 * CLUSTER_COUNT * sizeof(GLuint), this->clusterRanges.data(), GL_STREAM_DRAW);
+        glGenTextures(1, &this->rangeTexture);
+        GLState::bindTexture(TEXTURE_UNIT, GL_TEXTURE_BUFFER, this->rangeTexture);
+        glTexBuffer(GL_TEXTURE_BUFFER, GL_RG32UI, this->rangeBuffer);
+
+        // grows with the number of light references, never shrinks
+        this->indexBufferSize = CLUSTER_COUNT * sizeof(GLuint);
+        glGenBuffers(1, &this->indexBuffer);
+        glBindBuffer(GL_TEXTURE_BUFFER, this->indexBuffer);
+        glBufferData(GL_TEXTURE_BUFFER, this->indexBufferSize, NULL, GL_STREAM_DRAW);
+        glGenTextures(1, &this->indexTexture);
+        GLState::bindTexture(TEXTURE_UNIT + 1, GL_TEXTURE_BUFFER, this->indexTexture);
+        glTexBuffer(GL_TEXTURE_BUFFER, GL_R32UI, this->indexBuffer);
+        glBindBuffer(GL_TEXTURE_BUFFER, 0);
+    }
+
+    void LightClusters::attach(gps::Shader shader)
+    {
+        shader.finishLoad();
+        GLuint blockIndex = glGetUniformBlockIndex(shader.shaderProgram, "ClusterData");
+        if (blockIndex == GL_INVALID_INDEX)
+            return;
+        glUniformBlockBinding(shader.shaderProgram, blockIndex, BINDING_POINT);
+    }
+
+    // planes through the eye and the tile edges, a point is right of (above) plane k when a * x + b * z > 0
+    void LightClusters::updatePlanes(const glm::mat4& projection)
+    {
+        const int tiles[2] = { GRID_X, GRID_Y };
+        for (int axis = 0; axis < 2; axis++) {
+            GLfloat p = projection[axis][axis];
+            this->planeA[axis].resize(tiles[axis] + 1);
+            this->planeB[axis].resize(tiles[axis] + 1);
+            for (int k = 0; k <= tiles[axis]; k++) {
+                GLfloat ndc = -1.0f + 2.0f * k / tiles[axis];
+                GLfloat length = sqrtf(p * p + ndc * ndc);
+                this->planeA[axis][k] = p / length;
+                this->planeB[axis][k] = ndc / length;
+            }
+        }
+        this->planesProjection = projection;
+    }
+
+    int LightClusters::depthSlice(GLfloat depth)
+    {
+        if (depth <= this->zNear)
+            return 0;
+        int slice = (int)floorf(logf(depth / this->zNear) * this->data.scale.z);
+        return std::min(std::max(slice, 0), GRID_Z - 1);
+    }
+
+    // tile ranges of 4 lights at a time: count the interior planes each sphere is entirely past
+    void LightClusters::computeBounds(const std::vector<PointLight>& lights, int begin, int end)
+    {
+        const int tiles[2] = { GRID_X, GRID_Y };
+
+        for (int first = begin; first < end; first += 4) {
+            // the missing lanes of the last group repeat its last light
+            GLfloat x[4], y[4], z[4], r[4];
+            for (int lane = 0; lane < 4; lane++) {
+                const PointLight& light = lights[std::min(first + lane, end - 1)];
+                x[lane] = light.position.x;
+                y[lane] = light.position.y;
+                z[lane] = light.position.z;
+                r[lane] = light.radius;
+            }
+            __m128 lightZ = _mm_loadu_ps(z);
+            __m128 radius = _mm_loadu_ps(r);
+            __m128 negRadius = _mm_sub_ps(_mm_setzero_ps(), radius);
+
+            int low[2][4], high[2][4], outside[4];
+            __m128 outsideMask = _mm_setzero_ps();
+            for (int axis = 0; axis < 2; axis++) {
+                __m128 lightCoord = _mm_loadu_ps(axis == 0 ? x : y);
+                __m128i before = _mm_setzero_si128();
+                __m128i after = _mm_setzero_si128();
+                int planes = tiles[axis];
+                for (int k = 0; k <= planes; k++) {
+                    __m128 distance = _mm_add_ps(
+                        _mm_mul_ps(_mm_set1_ps(this->planeA[axis][k]), lightCoord),
+                        _mm_mul_ps(_mm_set1_ps(this->planeB[axis][k]), lightZ));
+                    __m128 pastPlane = _mm_cmpgt_ps(distance, radius);
+                    __m128 beforePlane = _mm_cmplt_ps(distance, negRadius);
+                    if (k == 0) {
+                        outsideMask = _mm_or_ps(outsideMask, beforePlane);
+                    }
+                    else if (k == planes) {
+                        outsideMask = _mm_or_ps(outsideMask, pastPlane);
+                    }
+                    else {
+                        // true lanes are all ones, -1 as integers
+                        after = _mm_sub_epi32(after, _mm_castps_si128(pastPlane));
+                        before = _mm_sub_epi32(before, _mm_castps_si128(beforePlane));
+                    }
+                }
+                _mm_storeu_si128((__m128i*)low[axis], after);
+                _mm_storeu_si128((__m128i*)high[axis], before);
+            }
+            _mm_storeu_si128((__m128i*)outside, _mm_castps_si128(outsideMask));
+
+            for (int lane = 0; lane < 4 && first + lane < end; lane++) {
+                LightBounds& b = this->bounds[first + lane];
+                GLfloat depth = -z[lane];
+                if (outside[lane] || depth + r[lane] < this->zNear) {
+                    b.x0 = 1;
+                    b.x1 = 0;
+                    continue;
+                }
+                b.x0 = low[0][lane];
+                b.x1 = GRID_X - 1 - high[0][lane];
+                b.y0 = low[1][lane];
+                b.y1 = GRID_Y - 1 - high[1][lane];
+                b.z0 = depthSlice(depth - r[lane]);
+                b.z1 = depthSlice(depth + r[lane]);
+            }
+        }
+    }
+
+    void LightClusters::build(const std::vector<PointLight>& viewSpaceLights, const glm::mat4& projection, GLsizei width, GLsizei height)
+    {
+        std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+
+        ClusterData newData;
+        newData.grid[0] = GRID_X;
+        newData.grid[1] = GRID_Y;
+        newData.grid[2] = GRID_Z;
+        newData.grid[3] = 0;
+        GLfloat zScale = GRID_Z / logf(this->sliceFar / this->zNear);
+        newData.scale = glm::vec4((GLfloat)GRID_X / width, (GLfloat)GRID_Y / height, zScale, -logf(this->zNear) * zScale);
+        bool dataChanged = std::memcmp(&newData, &this->data, sizeof(ClusterData)) != 0;
+        this->data = newData;
+        if (std::memcmp(&projection, &this->planesProjection, sizeof(glm::mat4)) != 0)
+            updatePlanes(projection);
+
+        int lightCount = (int)viewSpaceLights.size();
+        this->bounds.resize(lightCount);
+        this->threadPool->parallelFor(lightCount, [&](int begin, int end) {
+            computeBounds(viewSpaceLights, begin, end);
+        }, 64);
+
+        // slice by slice, so no two threads ever touch the same cluster
+        std::fill(this->clusterCounts.begin(), this->clusterCounts.end(), 0);
+        this->threadPool->parallelFor(GRID_Z, [&](int begin, int end) {
+            for (int i = 0; i < lightCount; i++) {
+                const LightBounds& b = this->bounds[i];
+                if (b.x0 > b.x1)
+                    continue;
+                for (int z = std::max(b.z0, begin); z <= std::min(b.z1, end - 1); z++)
+                    for (int y = b.y0; y <= b.y1; y++)
+                        for (int x = b.x0; x <= b.x1; x++)
+                            this->clusterCounts[(z * GRID_Y + y) * GRID_X + x]++;
+            }
+        });
+
+        ClusterStats stats;
+        std::memset(&stats, 0, sizeof(ClusterStats));
+        GLuint offset = 0;
+        for (int c = 0; c < CLUSTER_COUNT; c++) {
+            GLuint count = this->clusterCounts[c];
+            this->clusterRanges[2 * c] = offset;
+            this->clusterRanges[2 * c + 1] = count;
+            offset += count;
+            if (count > 0)
+                stats.occupiedClusters++;
+            stats.maxLightsPerCluster = std::max(stats.maxLightsPerCluster, count);
+        }
+        this->lightIndices.resize(offset);
+
+        // same walk again, writing the indices, the counts become the write cursors
+        this->threadPool->parallelFor(GRID_Z, [&](int begin, int end) {
+            for (int c = begin * GRID_X * GRID_Y; c < end * GRID_X * GRID_Y; c++)
+                this->clusterCounts[c] = 0;
+            for (int i = 0; i < lightCount; i++) {
+                const LightBounds& b = this->bounds[i];
+                if (b.x0 > b.x1)
+                    continue;
+                for (int z = std::max(b.z0, begin); z <= std::min(b.z1, end - 1); z++)
+                    for (int y = b.y0; y <= b.y1; y++)
+                        for (int x = b.x0; x <= b.x1; x++) {
+                            int c = (z * GRID_Y + y) * GRID_X + x;
+                            this->lightIndices[this->clusterRanges[2 * c] + this->clusterCounts[c]++] = (GLuint)i;
+                        }
+            }
+        });
+
+        stats.assignMs = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+        stats.lights = lightCount;
+        stats.lightIndices = offset;
+        this->lastFrame = stats;
+        this->total.assignMs += stats.assignMs;
+        this->total.lights += stats.lights;
+        this->total.lightIndices += stats.lightIndices;
+        this->total.occupiedClusters += stats.occupiedClusters;
+        this->total.maxLightsPerCluster = std::max(this->total.maxLightsPerCluster, stats.maxLightsPerCluster);
+        this->buildCount++;
+
+        // upload, orphaning the old storage so draws still reading it don't stall us
+        if (dataChanged) {
+            glBindBuffer(GL_UNIFORM_BUFFER, this->ubo);
+            glBufferSubData(GL_UNIFORM_BUFFER, 0, sizeof(ClusterData), &this->data);
+            glBindBuffer(GL_UNIFORM_BUFFER, 0);
+        }
+
+        glBindBuffer(GL_TEXTURE_BUFFER, this->rangeBuffer);
+        glBufferData(GL_TEXTURE_BUFFER, 2 * CLUSTER_COUNT * sizeof(GLuint), this->clusterRanges.data(), GL_STREAM_DRAW);
+
+        GLsizeiptr indexSize = offset * sizeof(GLuint);
+        glBindBuffer(GL_TEXTURE_BUFFER, this->indexBuffer);
+        if (indexSize > this->indexBufferSize)
+            this->indexBufferSize = indexSize;
+        glBufferData(GL_TEXTURE_BUFFER, this->indexBufferSize, NULL, GL_STREAM_DRAW);
+        if (indexSize > 0)
+            glBufferSubData(GL_TEXTURE_BUFFER, 0, indexSize, this->lightIndices.data());
+        glBindBuffer(GL_TEXTURE_BUFFER, 0);
+    }
+
+    void LightClusters::bind()
+    {
+        GLState::bindTexture(TEXTURE_UNIT, GL_TEXTURE_BUFFER, this->rangeTexture);
+        GLState::bindTexture(TEXTURE_UNIT + 1, GL_TEXTURE_BUFFER, this->indexTexture);
+    }
+
+    ClusterStats LightClusters::getFrameStats()
+    {
+        return this->lastFrame;
+    }
+
+    ClusterStats LightClusters::getTotalStats()
+    {
+        return this->total;
+    }
+
+    unsigned int LightClusters::getBuildCount()
+    {
+        return this->buildCount;
+    }
+}
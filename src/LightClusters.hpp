@@ -0,0 +1,100 @@
+#ifndef LightClusters_hpp
+#define LightClusters_hpp
+
+#include <GL/glew.h>
+#include <glm/glm.hpp>
+
+#include "Shader.hpp"
+#include "PointLights.hpp"
+#include "ThreadPool.hpp"
+
+#include <vector>
+
+namespace gps {
+
+struct ClusterStats {
+    double assignMs;                  // CPU time of the light to cluster assignment
+    unsigned int lights;
+    unsigned long long lightIndices;  // sum of the light counts of every cluster
+    unsigned int occupiedClusters;
+    unsigned int maxLightsPerCluster;
+};
+
+// CPU built froxel grid for clustered forward shading.
+// The view frustum is split in GRID_X x GRID_Y screen tiles and GRID_Z slices that grow exponentially with depth
+// (the last slice reaches to infinity). Every frame each light's sphere is tested against the tile planes,
+// four lights at a time with SSE, then the clusters are filled slice by slice on the worker threads.
+// The GPU gets a (first index, count) pair per cluster and the light indices back to back, read through
+// texture buffers, plus the grid parameters in the "ClusterData" uniform block.
+class LightClusters
+{
+public:
+    static const int GRID_X = 16;
+    static const int GRID_Y = 12;
+    static const int GRID_Z = 24;
+    static const int CLUSTER_COUNT = GRID_X * GRID_Y * GRID_Z;
+    static const GLuint BINDING_POINT = 1;
+    // cluster ranges and light indices are read from this unit and the next one
+    static const GLuint TEXTURE_UNIT = 9;
+
+    //zNear must be the camera's, the slices are spread between zNear and sliceFar
+    void init(gps::ThreadPool* threadPool, GLfloat zNear, GLfloat sliceFar);
+    //connects the program's ClusterData block to the binding point, programs without it are skipped
+    void attach(gps::Shader shader);
+
+    //assigns the view space lights to the clusters and uploads the result
+    void build(const std::vector<PointLight>& viewSpaceLights, const glm::mat4& projection, GLsizei width, GLsizei height);
+    //binds the two texture buffers on their units
+    void bind();
+
+    //counters of the last build, and of every build so far (assignMs summed)
+    ClusterStats getFrameStats();
+    ClusterStats getTotalStats();
+    unsigned int getBuildCount();
+
+private:
+    // std140 mirror of the ClusterData block
+    struct ClusterData {
+        GLuint grid[4];           // tiles in x, y, slices, unused
+        glm::vec4 scale;          // tiles per pixel in x and y, log(depth) to slice scale and bias
+    };
+
+    // clusters touched by one light, inclusive, x0 > x1 when the light is outside the frustum
+    struct LightBounds {
+        int x0, x1, y0, y1, z0, z1;
+    };
+
+    gps::ThreadPool* threadPool;
+    GLfloat zNear;
+    GLfloat sliceFar;
+
+    // view space tile planes through the eye, as (a, b) of a * x + b * z (resp. y) already normalized
+    glm::mat4 planesProjection;
+    std::vector<GLfloat> planeA[2];
+    std::vector<GLfloat> planeB[2];
+
+    std::vector<LightBounds> bounds;
+    std::vector<GLuint> clusterCounts;
+    std::vector<GLuint> clusterRanges;
+    std::vector<GLuint> lightIndices;
+
+    ClusterData data;
+    GLuint ubo;
+    GLuint rangeBuffer;
+    GLuint rangeTexture;
+    GLuint indexBuffer;
+    GLuint indexTexture;
+    GLsizeiptr indexBufferSize;
+
+    ClusterStats lastFrame;
+    ClusterStats total;
+    unsigned int buildCount;
+
+    void updatePlanes(const glm::mat4& projection);
+    void computeBounds(const std::vector<PointLight>& lights, int begin, int end);
+    int depthSlice(GLfloat depth);
+};
+
+}
+
+#endif /* LightClusters_hpp */
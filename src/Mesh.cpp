@@ -15,30 +15,93 @@ namespace gps {
 	    return this->buffers;
 	}
 
+	bool Mesh::hasTexture(const std::string& type) const
+	{
+		for (size_t i = 0; i < textures.size(); i++)
+			if (textures[i].type == type)
+				return true;
+		return false;
+	}
+
 	/* Mesh drawing function - also applies associated textures */
-	void Mesh::Draw(gps::Shader shader)
+	void Mesh::Draw(gps::Shader shader, GLsizei instanceCount)
+	{
+		bindMaterial(shader);
+		glDrawElementsInstanced(GL_TRIANGLES, this->indices.size(), GL_UNSIGNED_INT, 0, instanceCount);
+	}
+
+	void Mesh::DrawIndirect(gps::Shader shader, GLintptr command)
+	{
+		bindMaterial(shader);
+		glDrawElementsIndirect(GL_TRIANGLES, GL_UNSIGNED_INT, (const GLvoid*)command);
+	}
+
+	void Mesh::bindMaterial(gps::Shader shader)
 	{
 		shader.useShaderProgram();
 
 		//set textures
 		for (GLuint i = 0; i < textures.size(); i++)
 		{
-			glActiveTexture(GL_TEXTURE0 + i);
 			glUniform1i(glGetUniformLocation(shader.shaderProgram, this->textures[i].type.c_str()), i);
-			glBindTexture(GL_TEXTURE_2D, this->textures[i].id);
+			GLState::bindTexture(i, GL_TEXTURE_2D, this->textures[i].id);
+		}
+		//material units this mesh doesn't use stay empty, like they used to be after the previous mesh unbound them
+		for (GLuint i = textures.size(); i < MATERIAL_TEXTURE_UNITS; i++)
+		{
+			GLState::bindTexture(i, GL_TEXTURE_2D, 0);
 		}
 
-		glBindVertexArray(this->buffers.VAO);
-		glDrawElements(GL_TRIANGLES, this->indices.size(), GL_UNSIGNED_INT, 0);
-		glBindVertexArray(0);
+		GLState::bindVertexArray(this->buffers.VAO);
+    }
 
-        for(GLuint i = 0; i < this->textures.size(); i++)
-        {
-            glActiveTexture(GL_TEXTURE0 + i);
-            glBindTexture(GL_TEXTURE_2D, 0);
-        }
+	/* Depth only drawing, reads 12 bytes per vertex instead of 32 */
+	void Mesh::DrawDepth(GLsizei instanceCount)
+	{
+		GLState::bindVertexArray(this->buffers.positionVAO);
+		glDrawElementsInstanced(GL_TRIANGLES, this->indices.size(), GL_UNSIGNED_INT, 0, instanceCount);
+	}
 
-    }
+	void Mesh::DrawDepthIndirect(GLintptr command)
+	{
+		GLState::bindVertexArray(this->buffers.positionVAO);
+		glDrawElementsIndirect(GL_TRIANGLES, GL_UNSIGNED_INT, (const GLvoid*)command);
+	}
+
+	void Mesh::setupInstanceAttributes(GLuint instanceVBO)
+	{
+		GLState::bindVertexArray(this->buffers.VAO);
+		glBindBuffer(GL_ARRAY_BUFFER, instanceVBO);
+
+		// Model matrix, one vec4 per column
+		for (GLuint i = 0; i < 4; i++)
+		{
+			glEnableVertexAttribArray(3 + i);
+			glVertexAttribPointer(3 + i, 4, GL_FLOAT, GL_FALSE, sizeof(InstanceData),
+				(GLvoid*)(offsetof(InstanceData, model) + i * sizeof(glm::vec4)));
+			glVertexAttribDivisor(3 + i, 1);
+		}
+		// Normal matrix, one vec3 per column
+		for (GLuint i = 0; i < 3; i++)
+		{
+			glEnableVertexAttribArray(7 + i);
+			glVertexAttribPointer(7 + i, 3, GL_FLOAT, GL_FALSE, sizeof(InstanceData),
+				(GLvoid*)(offsetof(InstanceData, normalMatrix) + i * sizeof(glm::vec3)));
+			glVertexAttribDivisor(7 + i, 1);
+		}
+
+		// The position-only VAO just needs the model matrix
+		GLState::bindVertexArray(this->buffers.positionVAO);
+		for (GLuint i = 0; i < 4; i++)
+		{
+			glEnableVertexAttribArray(3 + i);
+			glVertexAttribPointer(3 + i, 4, GL_FLOAT, GL_FALSE, sizeof(InstanceData),
+				(GLvoid*)(offsetof(InstanceData, model) + i * sizeof(glm::vec4)));
+			glVertexAttribDivisor(3 + i, 1);
+		}
+
+		GLState::bindVertexArray(0);
+	}
 
 	// Initializes all the buffer objects/arrays
 	void Mesh::setupMesh(){
@@ -47,7 +110,7 @@ namespace gps {
 		glGenBuffers(1, &this->buffers.VBO);
 		glGenBuffers(1, &this->buffers.EBO);
 
-		glBindVertexArray(this->buffers.VAO);
+		GLState::bindVertexArray(this->buffers.VAO);
 		// Load data into vertex buffers
 		glBindBuffer(GL_ARRAY_BUFFER, this->buffers.VBO);
 		glBufferData(GL_ARRAY_BUFFER, this->vertices.size() * sizeof(Vertex), &this->vertices[0], GL_STATIC_DRAW);
@@ -66,6 +129,22 @@ namespace gps {
 		glEnableVertexAttribArray(2);
 		glVertexAttribPointer(2, 2, GL_FLOAT, GL_FALSE, sizeof(Vertex), (GLvoid*)offsetof(Vertex, TexCoords));
 
-		glBindVertexArray(0);
+		// Position-only stream for the depth passes
+		std::vector<glm::vec3> positions(this->vertices.size());
+		for (size_t i = 0; i < this->vertices.size(); i++)
+			positions[i] = this->vertices[i].Position;
+
+		glGenVertexArrays(1, &this->buffers.positionVAO);
+		glGenBuffers(1, &this->buffers.positionVBO);
+
+		GLState::bindVertexArray(this->buffers.positionVAO);
+		glBindBuffer(GL_ARRAY_BUFFER, this->buffers.positionVBO);
+		glBufferData(GL_ARRAY_BUFFER, positions.size() * sizeof(glm::vec3), &positions[0], GL_STATIC_DRAW);
+		glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, this->buffers.EBO);
+
+		glEnableVertexAttribArray(0);
+		glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, sizeof(glm::vec3), (GLvoid*)0);
+
+		GLState::bindVertexArray(0);
 	}
 }
@@ -5,6 +5,7 @@
 #include "glm/glm.hpp"
 
 #include "Shader.hpp"
+#include "GLState.hpp"
 
 #include <string>
 #include <vector>
@@ -12,6 +13,9 @@
 
 namespace gps {
 
+// ambient, diffuse and specular maps are bound on units 0..2
+const GLuint MATERIAL_TEXTURE_UNITS = 3;
+
 struct Vertex
 {
     glm::vec3 Position;
@@ -19,6 +23,14 @@ struct Vertex
     glm::vec2 TexCoords;
 };
 
+// Per-instance attributes, streamed next to the mesh vertices
+// model matrix on locations 3-6, normal matrix on locations 7-9
+struct InstanceData
+{
+    glm::mat4 model;
+    glm::mat3 normalMatrix;
+};
+
 struct Texture
 {
     GLuint id;
@@ -38,6 +50,9 @@ struct Buffers {
     GLuint VAO;
     GLuint VBO;
     GLuint EBO;
+    // tightly packed positions sharing the EBO, for depth-only passes
+    GLuint positionVAO;
+    GLuint positionVBO;
 };
 
 class Mesh
@@ -51,7 +66,22 @@ public:
 
 	Buffers getBuffers();
 
-	void Draw(gps::Shader shader);
+	void Draw(gps::Shader shader, GLsizei instanceCount = 1);
+
+	// Draws only the positions (location 0) and the instance model matrix, no textures are bound
+	// The depth-only program must already be in use
+	void DrawDepth(GLsizei instanceCount = 1);
+
+	// Same two draws with the counts taken from the DrawElementsIndirectCommand at this offset
+	// of the bound GL_DRAW_INDIRECT_BUFFER
+	void DrawIndirect(gps::Shader shader, GLintptr command);
+	void DrawDepthIndirect(GLintptr command);
+
+	// true if the material has a texture of this type (ambientTexture, diffuseTexture, specularTexture)
+	bool hasTexture(const std::string& type) const;
+
+	// Adds the per-instance attributes stored in instanceVBO to this mesh's VAOs
+	void setupInstanceAttributes(GLuint instanceVBO);
 
 private:
     /*  Render data  */
@@ -60,6 +90,9 @@ private:
 	// Initializes all the buffer objects/arrays
 	void setupMesh();
 
+	// Program, material textures and VAO of Draw
+	void bindMaterial(gps::Shader shader);
+
 };
 
 }
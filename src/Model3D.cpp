@@ -1,7 +1,30 @@
 #include "Model3D.hpp"
+#include "CpuProfiler.hpp"
+
+#include <algorithm>
+#include <cfloat>
+#include <cmath>
+#include <cstring>
 
 namespace gps {
 
+	// Occluders of up to this many triangles are the model itself
+	const size_t MAX_OCCLUDER_TRIANGLES = 32;
+	// Voxels along each side of the bounding box, and how many boxes fill the inside of the bigger models
+	const int OCCLUDER_GRID = 24;
+	const int MAX_OCCLUDER_BOXES = 8;
+
+	Model3D::Model3D()
+	{
+		instanceVBO = 0;
+		instanceBufferSize = 0;
+		boundInstanceBuffer = 0;
+		profiler = NULL;
+		bounds = glm::vec4(0.0f);
+		boxMin = glm::vec3(0.0f);
+		boxMax = glm::vec3(0.0f);
+	}
+
 	void Model3D::LoadModel(std::string fileName)
 	{
         std::string basePath = fileName.substr(0, fileName.find_last_of('/')) + "/";
@@ -14,14 +37,413 @@ namespace gps {
 	}
 
 	// Draw each mesh from the model
-	void Model3D::Draw(gps::Shader shaderProgram)
+	void Model3D::Draw(gps::Shader shaderProgram, const glm::mat4& transform)
+	{
+		DrawInstanced(shaderProgram, &transform, 1);
+	}
+
+	// Draw each mesh from the model once per transform
+	void Model3D::DrawInstanced(gps::Shader shaderProgram, const glm::mat4* transforms, GLsizei count)
+	{
+		if (count <= 0)
+			return;
+
+		UpdateInstances(transforms, count);
+
+		for (size_t i = 0; i < meshes.size(); i++) {
+			gps::GpuScope scope(profiler, profiler != NULL ? meshNames[i] : std::string());
+			meshes[i].Draw(shaderProgram, count);
+		}
+	}
+
+	void Model3D::Draw(gps::ShaderVariants& variants, unsigned int features, const glm::mat4& transform)
+	{
+		DrawInstanced(variants, features, &transform, 1);
+	}
+
+	void Model3D::DrawInstanced(gps::ShaderVariants& variants, unsigned int features, const glm::mat4* transforms, GLsizei count)
+	{
+		if (count <= 0)
+			return;
+
+		UpdateInstances(transforms, count);
+		DrawMeshes(variants, features, count);
+	}
+
+	void Model3D::DrawMeshes(gps::ShaderVariants& variants, unsigned int features, GLsizei count)
+	{
+		features &= ~gps::FEATURE_SPECULAR_MAP;
+		for (size_t i = 0; i < meshes.size(); i++) {
+			unsigned int meshFeatures = features;
+			if (meshes[i].hasTexture("specularTexture"))
+				meshFeatures |= gps::FEATURE_SPECULAR_MAP;
+			// consecutive meshes with the same material features keep the bound program
+			gps::GpuScope scope(profiler, profiler != NULL ? meshNames[i] : std::string());
+			meshes[i].Draw(variants.use(meshFeatures), count);
+		}
+	}
+
+	void Model3D::DrawDepth(gps::Shader shaderProgram, const glm::mat4& transform)
+	{
+		DrawDepthInstanced(shaderProgram, &transform, 1);
+	}
+
+	void Model3D::DrawDepthInstanced(gps::Shader shaderProgram, const glm::mat4* transforms, GLsizei count)
+	{
+		if (count <= 0)
+			return;
+
+		UpdateInstances(transforms, count);
+		DrawMeshesDepth(shaderProgram, count);
+	}
+
+	void Model3D::DrawMeshesDepth(gps::Shader shaderProgram, GLsizei count)
+	{
+		shaderProgram.useShaderProgram();
+		for (size_t i = 0; i < meshes.size(); i++) {
+			gps::GpuScope scope(profiler, profiler != NULL ? meshNames[i] : std::string());
+			meshes[i].DrawDepth(count);
+		}
+	}
+
+	void Model3D::SetProfiler(gps::GpuProfiler* profiler)
+	{
+		this->profiler = profiler;
+	}
+
+	glm::vec4 Model3D::GetBounds()
+	{
+		return bounds;
+	}
+
+	void Model3D::GetBoundingBox(glm::vec3* minimum, glm::vec3* maximum)
+	{
+		*minimum = boxMin;
+		*maximum = boxMax;
+	}
+
+	const std::vector<glm::vec3>& Model3D::GetOccluderTriangles()
+	{
+		return occluderTriangles;
+	}
+
+	void Model3D::GetTriangles(std::vector<glm::vec3>* triangles)
+	{
+		triangles->clear();
+		for (size_t m = 0; m < meshes.size(); m++) {
+			for (size_t i = 0; i < meshes[m].indices.size() / 3 * 3; i++)
+				triangles->push_back(meshes[m].vertices[meshes[m].indices[i]].Position);
+		}
+	}
+
+	void Model3D::PrepareInstances(const gps::InstanceData* instances, GLsizei count)
+	{
+		if (count <= 0)
+			return;
+
+		UploadInstances(instances, count);
+		// the buffer no longer holds transforms the cache could match
+		uploadedTransforms.clear();
+	}
+
+	void Model3D::DrawMesh(gps::Shader shaderProgram, int mesh, GLsizei count)
+	{
+		gps::GpuScope scope(profiler, profiler != NULL ? meshNames[mesh] : std::string());
+		meshes[mesh].Draw(shaderProgram, count);
+	}
+
+	void Model3D::DrawMeshDepth(int mesh, GLsizei count)
+	{
+		gps::GpuScope scope(profiler, profiler != NULL ? meshNames[mesh] : std::string());
+		meshes[mesh].DrawDepth(count);
+	}
+
+	int Model3D::GetMeshCount()
+	{
+		return (int)meshes.size();
+	}
+
+	GLsizei Model3D::GetMeshIndexCount(int mesh)
 	{
-		for (int i = 0; i < meshes.size(); i++)
-			meshes[i].Draw(shaderProgram);
+		return (GLsizei)meshes[mesh].indices.size();
+	}
+
+	void Model3D::UseInstanceBuffer(GLuint buffer)
+	{
+		if (buffer == 0)
+			buffer = instanceVBO;
+		if (buffer == boundInstanceBuffer)
+			return;
+		for (size_t i = 0; i < meshes.size(); i++)
+			meshes[i].setupInstanceAttributes(buffer);
+		boundInstanceBuffer = buffer;
+	}
+
+	void Model3D::DrawMeshIndirect(gps::Shader shaderProgram, int mesh, GLintptr command)
+	{
+		gps::GpuScope scope(profiler, profiler != NULL ? meshNames[mesh] : std::string());
+		meshes[mesh].DrawIndirect(shaderProgram, command);
+	}
+
+	void Model3D::DrawMeshDepthIndirect(int mesh, GLintptr command)
+	{
+		gps::GpuScope scope(profiler, profiler != NULL ? meshNames[mesh] : std::string());
+		meshes[mesh].DrawDepthIndirect(command);
+	}
+
+	unsigned int Model3D::GetMeshFeatures(int mesh)
+	{
+		return meshes[mesh].hasTexture("specularTexture") ? gps::FEATURE_SPECULAR_MAP : 0;
+	}
+
+	const std::vector<gps::Texture>& Model3D::GetMeshTextures(int mesh)
+	{
+		return meshes[mesh].textures;
+	}
+
+	GLuint Model3D::GetMeshVertexArray(int mesh, bool depthOnly)
+	{
+		gps::Buffers buffers = meshes[mesh].getBuffers();
+		return depthOnly ? buffers.positionVAO : buffers.VAO;
+	}
+
+	// Sphere around the bounding box of every vertex, loose but cheap to test
+	void Model3D::ComputeBounds()
+	{
+		glm::vec3 minimum(FLT_MAX);
+		glm::vec3 maximum(-FLT_MAX);
+		for (size_t m = 0; m < meshes.size(); m++) {
+			for (size_t v = 0; v < meshes[m].vertices.size(); v++) {
+				minimum = glm::min(minimum, meshes[m].vertices[v].Position);
+				maximum = glm::max(maximum, meshes[m].vertices[v].Position);
+			}
+		}
+		if (minimum.x > maximum.x) {
+			bounds = glm::vec4(0.0f);
+			boxMin = glm::vec3(0.0f);
+			boxMax = glm::vec3(0.0f);
+			return;
+		}
+		glm::vec3 center = (minimum + maximum) * 0.5f;
+		bounds = glm::vec4(center, glm::length(maximum - center));
+		boxMin = minimum;
+		boxMax = maximum;
+	}
+
+	// Adds 1 to the votes of the voxels whose center has an odd number of the mesh's triangles crossing the line
+	// along axis before it. Voxel (x, y, z) is at (z * n + y) * n + x.
+	static void VoteInside(const gps::Mesh& mesh, int axis, const glm::vec3& origin, const glm::vec3& voxel, int n,
+		std::vector<unsigned char>& votes)
+	{
+		int u = (axis + 1) % 3;
+		int w = (axis + 2) % 3;
+		int strides[3] = { 1, n, n * n };
+		std::vector<unsigned char> parity(n * n * n, 0);
+		for (size_t i = 0; i + 2 < mesh.indices.size(); i += 3) {
+			glm::vec3 a = mesh.vertices[mesh.indices[i]].Position;
+			glm::vec3 b = mesh.vertices[mesh.indices[i + 1]].Position;
+			glm::vec3 c = mesh.vertices[mesh.indices[i + 2]].Position;
+			GLfloat d = (b[u] - a[u]) * (c[w] - a[w]) - (c[u] - a[u]) * (b[w] - a[w]);
+			if (d == 0.0f)
+				continue;
+			// lines whose centers fall in the triangle's bounds across the axis
+			int u0 = std::max(0, (int)ceilf((std::min(a[u], std::min(b[u], c[u])) - origin[u]) / voxel[u] - 0.5f));
+			int u1 = std::min(n - 1, (int)floorf((std::max(a[u], std::max(b[u], c[u])) - origin[u]) / voxel[u] - 0.5f));
+			int w0 = std::max(0, (int)ceilf((std::min(a[w], std::min(b[w], c[w])) - origin[w]) / voxel[w] - 0.5f));
+			int w1 = std::min(n - 1, (int)floorf((std::max(a[w], std::max(b[w], c[w])) - origin[w]) / voxel[w] - 0.5f));
+			for (int lw = w0; lw <= w1; lw++) {
+				GLfloat pw = origin[w] + (lw + 0.5f) * voxel[w];
+				for (int lu = u0; lu <= u1; lu++) {
+					GLfloat pu = origin[u] + (lu + 0.5f) * voxel[u];
+					GLfloat s = ((pu - a[u]) * (c[w] - a[w]) - (c[u] - a[u]) * (pw - a[w])) / d;
+					GLfloat t = ((b[u] - a[u]) * (pw - a[w]) - (pu - a[u]) * (b[w] - a[w])) / d;
+					if (s < 0.0f || t < 0.0f || s + t > 1.0f)
+						continue;
+					GLfloat crossing = a[axis] + s * (b[axis] - a[axis]) + t * (c[axis] - a[axis]);
+					int first = std::max(0, (int)ceilf((crossing - origin[axis]) / voxel[axis] - 0.5f));
+					int line = lu * strides[u] + lw * strides[w];
+					for (int k = first; k < n; k++)
+						parity[line + k * strides[axis]] ^= 1;
+				}
+			}
+		}
+		for (size_t v = 0; v < votes.size(); v++)
+			votes[v] += parity[v];
+	}
+
+	// Voxelizes the meshes over the bounding box and fills the inside voxels with a few boxes
+	void Model3D::ComputeOccluder()
+	{
+		gps::CpuZone zone("Model3D::ComputeOccluder");
+		occluderTriangles.clear();
+		size_t triangleCount = 0;
+		for (size_t m = 0; m < meshes.size(); m++)
+			triangleCount += meshes[m].indices.size() / 3;
+		if (triangleCount == 0)
+			return;
+		if (triangleCount <= MAX_OCCLUDER_TRIANGLES) {
+			for (size_t m = 0; m < meshes.size(); m++) {
+				for (size_t i = 0; i < meshes[m].indices.size() / 3 * 3; i++)
+					occluderTriangles.push_back(meshes[m].vertices[meshes[m].indices[i]].Position);
+			}
+			return;
+		}
+
+		// A voxel is inside a mesh when most of the three axis lines through its center have an odd number of the
+		// mesh's triangles on one side. The vote gets over the holes of open meshes (spouts, necklines), and each
+		// mesh counts on its own because the shells of a model often overlap.
+		const int n = OCCLUDER_GRID;
+		glm::vec3 voxel = (boxMax - boxMin) / (float)n;
+		if (voxel.x <= 0.0f || voxel.y <= 0.0f || voxel.z <= 0.0f)
+			return;
+		std::vector<unsigned char> solid(n * n * n, 0);
+		std::vector<unsigned char> votes(n * n * n);
+		for (size_t m = 0; m < meshes.size(); m++) {
+			std::fill(votes.begin(), votes.end(), 0);
+			for (int axis = 0; axis < 3; axis++)
+				VoteInside(meshes[m], axis, boxMin, voxel, n, votes);
+			for (size_t v = 0; v < solid.size(); v++)
+				solid[v] |= votes[v] >= 2 ? 1 : 0;
+		}
+
+		// 1 + how many erosions each inside voxel survives. The first erosion takes off the voxels the centers
+		// got wrong, so the box only takes voxels of depth 2 or more and starts from the deepest one.
+		std::vector<int> depth(n * n * n, 0);
+		for (size_t v = 0; v < solid.size(); v++)
+			depth[v] = solid[v] ? 1 : 0;
+		for (int level = 1; level < n / 2; level++) {
+			std::vector<int> next = depth;
+			bool any = false;
+			for (int z = 1; z < n - 1; z++) {
+				for (int y = 1; y < n - 1; y++) {
+					for (int x = 1; x < n - 1; x++) {
+						int v = (z * n + y) * n + x;
+						if (depth[v] < level || depth[v - 1] < level || depth[v + 1] < level || depth[v - n] < level ||
+							depth[v + n] < level || depth[v - n * n] < level || depth[v + n * n] < level)
+							continue;
+						next[v] = level + 1;
+						any = true;
+					}
+				}
+			}
+			depth.swap(next);
+			if (!any)
+				break;
+		}
+		int insideVoxels = 0;
+		for (size_t v = 0; v < depth.size(); v++)
+			insideVoxels += depth[v] >= 2 ? 1 : 0;
+
+		// Each box starts from the deepest voxel no box covers yet and grows one layer at a time on every side that
+		// stays inside. Boxes are added until they cover most of the inside or the next one adds too little.
+		std::vector<unsigned char> covered(n * n * n, 0);
+		int coveredVoxels = 0;
+		for (int box = 0; box < MAX_OCCLUDER_BOXES && coveredVoxels * 10 < insideVoxels * 9; box++) {
+			int seed = -1;
+			for (int v = 0; v < n * n * n; v++) {
+				if (depth[v] >= 2 && !covered[v] && (seed < 0 || depth[v] > depth[seed]))
+					seed = v;
+			}
+			if (seed < 0)
+				break;
+
+			int low[3] = { seed % n, (seed / n) % n, seed / (n * n) };
+			int high[3] = { low[0], low[1], low[2] };
+			bool grown = true;
+			while (grown) {
+				grown = false;
+				for (int side = 0; side < 6; side++) {
+					int axis = side / 2;
+					int layer = (side % 2 == 0) ? low[axis] - 1 : high[axis] + 1;
+					if (layer < 0 || layer >= n)
+						continue;
+					int from[3] = { low[0], low[1], low[2] };
+					int to[3] = { high[0], high[1], high[2] };
+					from[axis] = layer;
+					to[axis] = layer;
+					bool inside = true;
+					for (int z = from[2]; z <= to[2] && inside; z++)
+						for (int y = from[1]; y <= to[1] && inside; y++)
+							for (int x = from[0]; x <= to[0] && inside; x++)
+								inside = depth[(z * n + y) * n + x] >= 2;
+					if (!inside)
+						continue;
+					if (side % 2 == 0)
+						low[axis] = layer;
+					else
+						high[axis] = layer;
+					grown = true;
+				}
+			}
+
+			int added = 0;
+			for (int z = low[2]; z <= high[2]; z++) {
+				for (int y = low[1]; y <= high[1]; y++) {
+					for (int x = low[0]; x <= high[0]; x++) {
+						unsigned char& voxelCovered = covered[(z * n + y) * n + x];
+						added += voxelCovered ? 0 : 1;
+						voxelCovered = 1;
+					}
+				}
+			}
+			if (box > 0 && added * 50 < insideVoxels)
+				break;
+			coveredVoxels += added;
+
+			glm::vec3 minimum = boxMin + glm::vec3((float)low[0], (float)low[1], (float)low[2]) * voxel;
+			glm::vec3 maximum = boxMin + glm::vec3((float)(high[0] + 1), (float)(high[1] + 1), (float)(high[2] + 1)) * voxel;
+			// corners by bits x, y, z, two triangles per face
+			const int faces[6][4] = { { 0, 2, 6, 4 }, { 1, 5, 7, 3 }, { 0, 4, 5, 1 }, { 2, 3, 7, 6 }, { 0, 1, 3, 2 }, { 4, 6, 7, 5 } };
+			glm::vec3 corners[8];
+			for (int i = 0; i < 8; i++)
+				corners[i] = glm::vec3((i & 1) ? maximum.x : minimum.x, (i & 2) ? maximum.y : minimum.y, (i & 4) ? maximum.z : minimum.z);
+			for (int f = 0; f < 6; f++) {
+				occluderTriangles.push_back(corners[faces[f][0]]);
+				occluderTriangles.push_back(corners[faces[f][1]]);
+				occluderTriangles.push_back(corners[faces[f][2]]);
+				occluderTriangles.push_back(corners[faces[f][0]]);
+				occluderTriangles.push_back(corners[faces[f][2]]);
+				occluderTriangles.push_back(corners[faces[f][3]]);
+			}
+		}
+	}
+
+	// Computes the normal matrices and streams the instance data, unless these exact transforms are already on the GPU
+	void Model3D::UpdateInstances(const glm::mat4* transforms, GLsizei count)
+	{
+		if (uploadedTransforms.size() == (size_t)count &&
+			memcmp(uploadedTransforms.data(), transforms, count * sizeof(glm::mat4)) == 0)
+			return;
+
+		uploadedTransforms.assign(transforms, transforms + count);
+		instanceData.resize(count);
+		for (GLsizei i = 0; i < count; i++) {
+			instanceData[i].model = transforms[i];
+			instanceData[i].normalMatrix = glm::mat3(glm::inverseTranspose(transforms[i]));
+		}
+		UploadInstances(instanceData.data(), count);
+	}
+
+	void Model3D::UploadInstances(const gps::InstanceData* instances, GLsizei count)
+	{
+		GLsizeiptr size = count * sizeof(gps::InstanceData);
+		glBindBuffer(GL_ARRAY_BUFFER, instanceVBO);
+		if (size > instanceBufferSize) {
+			// grow the buffer, the VAOs keep pointing at the same buffer name
+			glBufferData(GL_ARRAY_BUFFER, size, instances, GL_STREAM_DRAW);
+			instanceBufferSize = size;
+		}
+		else {
+			// orphan the old storage so the driver doesn't wait for draws still reading it
+			glBufferData(GL_ARRAY_BUFFER, instanceBufferSize, NULL, GL_STREAM_DRAW);
+			glBufferSubData(GL_ARRAY_BUFFER, 0, size, instances);
+		}
+		glBindBuffer(GL_ARRAY_BUFFER, 0);
 	}
 
 	// Does the parsing of the .obj file and fills in the data structure
 	void Model3D::ReadOBJ(std::string fileName, std::string basePath){
+		gps::CpuZone zone("Model3D::ReadOBJ");
 
         std::cout << "Loading : " << fileName << std::endl;
 		tinyobj::attrib_t attrib;
@@ -30,7 +452,11 @@ namespace gps {
 		int materialId;
 
 		std::string err;
-		bool ret = tinyobj::LoadObj(&attrib, &shapes, &materials, &err, fileName.c_str(), basePath.c_str(), GL_TRUE);
+		bool ret;
+		{
+			gps::CpuZone parseZone("tinyobj::LoadObj");
+			ret = tinyobj::LoadObj(&attrib, &shapes, &materials, &err, fileName.c_str(), basePath.c_str(), GL_TRUE);
+		}
 
 		if (!err.empty()) { // `err` may contain warning message.
 			std::cerr << err << std::endl;
@@ -133,11 +559,23 @@ namespace gps {
 			}
 
 			meshes.push_back(gps::Mesh(vertices, indices, textures));
+			meshNames.push_back(shapes[s].name.empty() ? "mesh " + std::to_string(s) : shapes[s].name);
 		}
+
+		// Instance buffer shared by all meshes, filled on the first draw
+		if (instanceVBO == 0)
+			glGenBuffers(1, &instanceVBO);
+		for (size_t i = 0; i < meshes.size(); i++)
+			meshes[i].setupInstanceAttributes(instanceVBO);
+		boundInstanceBuffer = instanceVBO;
+
+		ComputeBounds();
+		ComputeOccluder();
 	}
 
 	// Retrieves a texture associated with the object - by its name and type
 	gps::Texture Model3D::LoadTexture(std::string path, std::string type) {
+			gps::CpuZone zone("Model3D::LoadTexture");
 
 			for (int i = 0; i < loadedTextures.size(); i++) {
 				if (loadedTextures[i].path == path)
@@ -193,7 +631,7 @@ namespace gps {
 
 		GLuint textureID;
 		glGenTextures(1, &textureID);
-		glBindTexture(GL_TEXTURE_2D, textureID);
+		GLState::bindTexture(GL_TEXTURE_2D, textureID);
 		glTexImage2D(
 			GL_TEXTURE_2D,
 			0,
@@ -211,7 +649,7 @@ namespace gps {
 		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_REPEAT);
 		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR_MIPMAP_LINEAR);
 		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
-		glBindTexture(GL_TEXTURE_2D, 0);
+		GLState::bindTexture(GL_TEXTURE_2D, 0);
 
 		return textureID;
 	}
@@ -229,5 +667,8 @@ namespace gps {
             glDeleteBuffers(1, &EBO);
             glDeleteVertexArrays(1, &VAO);
         }
+
+        if (instanceVBO != 0)
+            glDeleteBuffers(1, &instanceVBO);
 	}
 }
@@ -2,6 +2,10 @@
 #define Model3D_hpp
 
 #include "Mesh.hpp"
+#include "ShaderVariants.hpp"
+#include "GpuProfiler.hpp"
+
+#include <glm/gtc/matrix_inverse.hpp>
 
 #include "tiny_obj_loader.h"
 #include "stb_image.h"
@@ -16,19 +20,92 @@ namespace gps {
     {
 
     public:
+        Model3D();
         ~Model3D();
 
 		void LoadModel(std::string fileName);
 
 		void LoadModel(std::string fileName, std::string basePath);
 
-		void Draw(gps::Shader shaderProgram);
+		// Draws a single copy of the model
+		void Draw(gps::Shader shaderProgram, const glm::mat4& transform);
+
+		// Draws count copies of the model, one per transform, with one instanced call per mesh
+		// The same transforms can be drawn again (e.g. shadow pass, then main pass) without being re-uploaded
+		void DrawInstanced(gps::Shader shaderProgram, const glm::mat4* transforms, GLsizei count);
+
+		// Same as above, but each mesh is drawn with the cheapest variant for its material:
+		// the given features plus SPECULAR_MAP for meshes that have one
+		void Draw(gps::ShaderVariants& variants, unsigned int features, const glm::mat4& transform);
+		void DrawInstanced(gps::ShaderVariants& variants, unsigned int features, const glm::mat4* transforms, GLsizei count);
+
+		// Depth-only draws from the position stream, for the shadow and depth pre-passes
+		void DrawDepth(gps::Shader shaderProgram, const glm::mat4& transform);
+		void DrawDepthInstanced(gps::Shader shaderProgram, const glm::mat4* transforms, GLsizei count);
+
+		// Model space bounding sphere of all meshes, center in xyz and radius in w
+		glm::vec4 GetBounds();
+		// Model space bounding box of all meshes
+		void GetBoundingBox(glm::vec3* minimum, glm::vec3* maximum);
+
+		// Simplified occluder for the CPU occlusion culling, 3 model space vertices per triangle, all inside the
+		// model: the model itself when it is small enough, else a few boxes that fit in its volume.
+		// Empty when nothing fits (open or thin models).
+		const std::vector<glm::vec3>& GetOccluderTriangles();
+		// Every triangle of every mesh, 3 model space vertices each, mesh after mesh (what the ray BVH is built from)
+		void GetTriangles(std::vector<glm::vec3>* triangles);
+
+		// Mesh by mesh drawing, for callers that order the draws themselves (see DrawQueue):
+		// upload the instances once (normal matrices already computed, see DrawList),
+		// then draw any mesh with them with the program already bound
+		void PrepareInstances(const gps::InstanceData* instances, GLsizei count);
+		void DrawMesh(gps::Shader shaderProgram, int mesh, GLsizei count);
+		void DrawMeshDepth(int mesh, GLsizei count);
+		int GetMeshCount();
+		GLsizei GetMeshIndexCount(int mesh);
+
+		// Indirect drawing, for instances culled on the GPU (see GpuCulling): point the meshes' instance attributes
+		// at a buffer of gps::InstanceData filled there (0 for the model's own), then draw a mesh with the
+		// command at that offset of the bound GL_DRAW_INDIRECT_BUFFER
+		void UseInstanceBuffer(GLuint buffer);
+		void DrawMeshIndirect(gps::Shader shaderProgram, int mesh, GLintptr command);
+		void DrawMeshDepthIndirect(int mesh, GLintptr command);
+		// SPECULAR_MAP if the mesh's material has one, what the variant draws add per mesh
+		unsigned int GetMeshFeatures(int mesh);
+		const std::vector<gps::Texture>& GetMeshTextures(int mesh);
+		GLuint GetMeshVertexArray(int mesh, bool depthOnly);
+
+		// Times every mesh draw as a scope of its own (named after the .obj shape), NULL turns it off
+		void SetProfiler(gps::GpuProfiler* profiler);
 
     private:
 		// Component meshes - group of objects
         std::vector<gps::Mesh> meshes;
 		// Associated textures
         std::vector<gps::Texture> loadedTextures;
+		// Shape names, the per-mesh profiler scopes
+		std::vector<std::string> meshNames;
+		gps::GpuProfiler* profiler;
+		glm::vec4 bounds;
+		glm::vec3 boxMin;
+		glm::vec3 boxMax;
+		std::vector<glm::vec3> occluderTriangles;
+
+		// Per-instance model and normal matrices, shared by all meshes
+		GLuint instanceVBO;
+		GLsizeiptr instanceBufferSize;
+		// Buffer the meshes' instance attributes read from now
+		GLuint boundInstanceBuffer;
+		std::vector<gps::InstanceData> instanceData;
+		// Transforms currently in instanceVBO, to skip identical re-uploads
+		std::vector<glm::mat4> uploadedTransforms;
+
+		void UpdateInstances(const glm::mat4* transforms, GLsizei count);
+		void UploadInstances(const gps::InstanceData* instances, GLsizei count);
+		void DrawMeshes(gps::ShaderVariants& variants, unsigned int features, GLsizei count);
+		void DrawMeshesDepth(gps::Shader shaderProgram, GLsizei count);
+		void ComputeBounds();
+		void ComputeOccluder();
 
 		// Does the parsing of the .obj file and fills in the data structure
 		void ReadOBJ(std::string fileName, std::string basePath);
@@ -0,0 +1,285 @@
+#include "OcclusionBuffer.hpp"
+
+#include <emmintrin.h>
+
+#include <algorithm>
+#include <cfloat>
+#include <chrono>
+#include <cmath>
+#include <cstring>
+
+namespace gps {
+
+    // boxes this close (NDC) behind the occluders still count as visible, so an occluder never hides itself
+    const GLfloat DEPTH_EPSILON = 1.0e-5f;
+
+    void OcclusionBuffer::init(gps::ThreadPool* threadPool, int width, int height, bool clipToViewport)
+    {
+        this->threadPool = threadPool;
+        this->tilesX = (width + TILE_SIZE - 1) / TILE_SIZE;
+        this->tilesY = (height + TILE_SIZE - 1) / TILE_SIZE;
+        this->width = this->tilesX * TILE_SIZE;
+        this->height = this->tilesY * TILE_SIZE;
+        this->clipToViewport = clipToViewport;
+        this->viewProjection = glm::mat4(1.0f);
+        this->depth.assign(this->width * this->height, FLT_MAX);
+        this->tileDepth.assign(this->tilesX * this->tilesY, FLT_MAX);
+        std::memset(&this->stats, 0, sizeof(OcclusionStats));
+        this->setupMs = 0.0;
+    }
+
+    void OcclusionBuffer::begin(const glm::mat4& viewProjection)
+    {
+        this->viewProjection = viewProjection;
+        this->triangles.clear();
+        std::memset(&this->stats, 0, sizeof(OcclusionStats));
+        this->setupMs = 0.0;
+    }
+
+    void OcclusionBuffer::addOccluder(const glm::vec3* triangles, int vertexCount, const glm::mat4& transform)
+    {
+        std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+        glm::mat4 clipTransform = this->viewProjection * transform;
+        for (int v = 0; v + 2 < vertexCount; v += 3) {
+            glm::vec4 clip[3];
+            for (int k = 0; k < 3; k++)
+                clip[k] = clipTransform * glm::vec4(triangles[v + k], 1.0f);
+            addTriangle(clip);
+        }
+        this->stats.occluders++;
+        this->setupMs += std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+    }
+
+    // clips against the near plane (z = -w), the rest is left to the pixel bounds
+    void OcclusionBuffer::addTriangle(const glm::vec4* clip)
+    {
+        glm::vec4 polygon[4];
+        int count = 0;
+        for (int k = 0; k < 3; k++) {
+            const glm::vec4& a = clip[k];
+            const glm::vec4& b = clip[(k + 1) % 3];
+            GLfloat da = a.z + a.w;
+            GLfloat db = b.z + b.w;
+            if (da >= 0.0f)
+                polygon[count++] = a;
+            if ((da >= 0.0f) != (db >= 0.0f))
+                polygon[count++] = a + (b - a) * (da / (da - db));
+        }
+
+        for (int fan = 1; fan + 1 < count; fan++) {
+            const glm::vec4* corners[3] = { &polygon[0], &polygon[fan], &polygon[fan + 1] };
+            ScreenTriangle triangle;
+            GLfloat z[3];
+            bool behind = false;
+            for (int k = 0; k < 3; k++) {
+                const glm::vec4& c = *corners[k];
+                if (c.w <= 0.0f) {
+                    behind = true;
+                    break;
+                }
+                triangle.x[k] = (c.x / c.w * 0.5f + 0.5f) * this->width;
+                triangle.y[k] = (c.y / c.w * 0.5f + 0.5f) * this->height;
+                z[k] = c.z / c.w;
+            }
+            if (behind)
+                continue;
+
+            GLfloat area = (triangle.x[1] - triangle.x[0]) * (triangle.y[2] - triangle.y[0]) -
+                (triangle.x[2] - triangle.x[0]) * (triangle.y[1] - triangle.y[0]);
+            if (area == 0.0f)
+                continue;
+            // both windings occlude, make it counter-clockwise
+            if (area < 0.0f) {
+                std::swap(triangle.x[1], triangle.x[2]);
+                std::swap(triangle.y[1], triangle.y[2]);
+                std::swap(z[1], z[2]);
+                area = -area;
+            }
+
+            // pixel centers inside the bounds
+            GLfloat minX = std::min(triangle.x[0], std::min(triangle.x[1], triangle.x[2]));
+            GLfloat maxX = std::max(triangle.x[0], std::max(triangle.x[1], triangle.x[2]));
+            GLfloat minY = std::min(triangle.y[0], std::min(triangle.y[1], triangle.y[2]));
+            GLfloat maxY = std::max(triangle.y[0], std::max(triangle.y[1], triangle.y[2]));
+            triangle.minX = std::max(0, (int)ceilf(minX - 0.5f));
+            triangle.maxX = std::min(this->width - 1, (int)floorf(maxX - 0.5f));
+            triangle.minY = std::max(0, (int)ceilf(minY - 0.5f));
+            triangle.maxY = std::min(this->height - 1, (int)floorf(maxY - 0.5f));
+            if (triangle.minX > triangle.maxX || triangle.minY > triangle.maxY)
+                continue;
+
+            GLfloat x1 = triangle.x[1] - triangle.x[0];
+            GLfloat y1 = triangle.y[1] - triangle.y[0];
+            GLfloat x2 = triangle.x[2] - triangle.x[0];
+            GLfloat y2 = triangle.y[2] - triangle.y[0];
+            triangle.depthA = ((z[1] - z[0]) * y2 - (z[2] - z[0]) * y1) / area;
+            triangle.depthB = (x1 * (z[2] - z[0]) - x2 * (z[1] - z[0])) / area;
+            triangle.depthC = z[0] - triangle.depthA * triangle.x[0] - triangle.depthB * triangle.y[0];
+            this->triangles.push_back(triangle);
+        }
+    }
+
+    void OcclusionBuffer::rasterize()
+    {
+        std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+        this->threadPool->parallelFor(this->tilesY, [&](int begin, int end) {
+            for (int row = begin; row < end; row++)
+                rasterizeTileRow(row);
+        });
+        this->stats.triangles = (unsigned int)this->triangles.size();
+        this->stats.rasterMs = this->setupMs +
+            std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+    }
+
+    void OcclusionBuffer::rasterizeTileRow(int tileRow)
+    {
+        int rowBegin = tileRow * TILE_SIZE;
+        int rowEnd = rowBegin + TILE_SIZE - 1;
+        for (int y = rowBegin; y <= rowEnd; y++)
+            std::fill(&this->depth[y * this->width], &this->depth[y * this->width] + this->width, FLT_MAX);
+
+        const __m128 laneOffsets = _mm_setr_ps(0.5f, 1.5f, 2.5f, 3.5f);
+        for (size_t t = 0; t < this->triangles.size(); t++) {
+            const ScreenTriangle& triangle = this->triangles[t];
+            if (triangle.maxY < rowBegin || triangle.minY > rowEnd)
+                continue;
+
+            // edge k goes from corner k to the next one, inside is on its left
+            GLfloat edgeA[3], edgeB[3];
+            for (int k = 0; k < 3; k++) {
+                int next = (k + 1) % 3;
+                edgeA[k] = triangle.y[k] - triangle.y[next];
+                edgeB[k] = triangle.x[next] - triangle.x[k];
+            }
+            __m128 edgeAs[3] = { _mm_set1_ps(edgeA[0]), _mm_set1_ps(edgeA[1]), _mm_set1_ps(edgeA[2]) };
+            __m128 depthA = _mm_set1_ps(triangle.depthA);
+
+            int yBegin = std::max(triangle.minY, rowBegin);
+            int yEnd = std::min(triangle.maxY, rowEnd);
+            int xBegin = triangle.minX & ~3;
+            for (int y = yBegin; y <= yEnd; y++) {
+                GLfloat py = y + 0.5f;
+                __m128 rowEdges[3];
+                for (int k = 0; k < 3; k++)
+                    rowEdges[k] = _mm_set1_ps(edgeB[k] * (py - triangle.y[k]) - edgeA[k] * triangle.x[k]);
+                __m128 rowDepth = _mm_set1_ps(triangle.depthB * py + triangle.depthC);
+                GLfloat* pixels = &this->depth[y * this->width];
+
+                for (int x = xBegin; x <= triangle.maxX; x += 4) {
+                    __m128 px = _mm_add_ps(_mm_set1_ps((GLfloat)x), laneOffsets);
+                    __m128 inside = _mm_cmpge_ps(_mm_add_ps(_mm_mul_ps(edgeAs[0], px), rowEdges[0]), _mm_setzero_ps());
+                    inside = _mm_and_ps(inside, _mm_cmpge_ps(_mm_add_ps(_mm_mul_ps(edgeAs[1], px), rowEdges[1]), _mm_setzero_ps()));
+                    inside = _mm_and_ps(inside, _mm_cmpge_ps(_mm_add_ps(_mm_mul_ps(edgeAs[2], px), rowEdges[2]), _mm_setzero_ps()));
+                    if (_mm_movemask_ps(inside) == 0)
+                        continue;
+                    __m128 z = _mm_add_ps(_mm_mul_ps(depthA, px), rowDepth);
+                    __m128 old = _mm_loadu_ps(pixels + x);
+                    __m128 nearest = _mm_min_ps(old, z);
+                    _mm_storeu_ps(pixels + x, _mm_or_ps(_mm_and_ps(inside, nearest), _mm_andnot_ps(inside, old)));
+                }
+            }
+        }
+
+        for (int tx = 0; tx < this->tilesX; tx++) {
+            __m128 farthest = _mm_setzero_ps();
+            for (int y = rowBegin; y <= rowEnd; y++) {
+                const GLfloat* pixels = &this->depth[y * this->width + tx * TILE_SIZE];
+                farthest = _mm_max_ps(farthest, _mm_max_ps(_mm_loadu_ps(pixels), _mm_loadu_ps(pixels + 4)));
+            }
+            GLfloat lanes[4];
+            _mm_storeu_ps(lanes, farthest);
+            this->tileDepth[tileRow * this->tilesX + tx] = std::max(std::max(lanes[0], lanes[1]), std::max(lanes[2], lanes[3]));
+        }
+    }
+
+    bool OcclusionBuffer::isOccluded(const glm::vec3& boxMin, const glm::vec3& boxMax, const glm::mat4& transform) const
+    {
+        glm::mat4 clipTransform = this->viewProjection * transform;
+        GLfloat minX = FLT_MAX, maxX = -FLT_MAX, minY = FLT_MAX, maxY = -FLT_MAX;
+        GLfloat nearest = FLT_MAX;
+        for (int i = 0; i < 8; i++) {
+            glm::vec4 corner((i & 1) ? boxMax.x : boxMin.x, (i & 2) ? boxMax.y : boxMin.y, (i & 4) ? boxMax.z : boxMin.z, 1.0f);
+            glm::vec4 clip = clipTransform * corner;
+            // reaches the near plane
+            if (clip.w <= 0.0f || clip.z < -clip.w)
+                return false;
+            GLfloat x = (clip.x / clip.w * 0.5f + 0.5f) * this->width;
+            GLfloat y = (clip.y / clip.w * 0.5f + 0.5f) * this->height;
+            minX = std::min(minX, x);
+            maxX = std::max(maxX, x);
+            minY = std::min(minY, y);
+            maxY = std::max(maxY, y);
+            nearest = std::min(nearest, clip.z / clip.w);
+        }
+
+        // every pixel the rectangle touches
+        int x0 = (int)floorf(minX);
+        int x1 = (int)floorf(maxX);
+        int y0 = (int)floorf(minY);
+        int y1 = (int)floorf(maxY);
+        if (x0 < 0 || y0 < 0 || x1 >= this->width || y1 >= this->height) {
+            if (!this->clipToViewport)
+                return false;
+            x0 = std::max(x0, 0);
+            y0 = std::max(y0, 0);
+            x1 = std::min(x1, this->width - 1);
+            y1 = std::min(y1, this->height - 1);
+            if (x0 > x1 || y0 > y1)
+                return false;
+        }
+        nearest -= DEPTH_EPSILON;
+
+        __m128 boxDepth = _mm_set1_ps(nearest);
+        const __m128i laneIndices = _mm_setr_epi32(0, 1, 2, 3);
+        for (int ty = y0 / TILE_SIZE; ty <= y1 / TILE_SIZE; ty++) {
+            for (int tx = x0 / TILE_SIZE; tx <= x1 / TILE_SIZE; tx++) {
+                // the whole tile is nearer
+                if (this->tileDepth[ty * this->tilesX + tx] < nearest)
+                    continue;
+                int xa = std::max(x0, tx * TILE_SIZE);
+                int xb = std::min(x1, tx * TILE_SIZE + TILE_SIZE - 1);
+                int ya = std::max(y0, ty * TILE_SIZE);
+                int yb = std::min(y1, ty * TILE_SIZE + TILE_SIZE - 1);
+                __m128i first = _mm_set1_epi32(xa - 1);
+                __m128i last = _mm_set1_epi32(xb + 1);
+                for (int y = ya; y <= yb; y++) {
+                    const GLfloat* pixels = &this->depth[y * this->width];
+                    for (int x = xa & ~3; x <= xb; x += 4) {
+                        __m128i lanes = _mm_add_epi32(_mm_set1_epi32(x), laneIndices);
+                        __m128i inRange = _mm_and_si128(_mm_cmpgt_epi32(lanes, first), _mm_cmplt_epi32(lanes, last));
+                        __m128 visible = _mm_cmpge_ps(_mm_loadu_ps(pixels + x), boxDepth);
+                        if (_mm_movemask_ps(_mm_and_ps(visible, _mm_castsi128_ps(inRange))) != 0)
+                            return false;
+                    }
+                }
+            }
+        }
+        return true;
+    }
+
+    int OcclusionBuffer::getWidth()
+    {
+        return this->width;
+    }
+
+    int OcclusionBuffer::getHeight()
+    {
+        return this->height;
+    }
+
+    GLfloat OcclusionBuffer::getDepth(int x, int y)
+    {
+        return this->depth[y * this->width + x];
+    }
+
+    OcclusionStats OcclusionBuffer::getStats()
+    {
+        return this->stats;
+    }
+
+    void OcclusionBuffer::countTests(unsigned int tested, unsigned int occluded)
+    {
+        this->stats.tested += tested;
+        this->stats.occluded += occluded;
+    }
+}
@@ -0,0 +1,86 @@
+#ifndef OcclusionBuffer_hpp
+#define OcclusionBuffer_hpp
+
+#include <GL/glew.h>
+#include <glm/glm.hpp>
+
+#include "ThreadPool.hpp"
+
+#include <vector>
+
+namespace gps {
+
+struct OcclusionStats {
+    double rasterMs;                // occluder setup and rasterization
+    unsigned int occluders;
+    unsigned int triangles;         // after near plane clipping
+    unsigned int tested;            // boxes tested since the last begin
+    unsigned int occluded;
+};
+
+// Low resolution depth buffer on the CPU for occlusion culling, one per view.
+// A few big occluders are rasterized into it (nearest depth wins), then bounding boxes are tested against it:
+// a box is occluded if every pixel of its screen rectangle holds something nearer than its nearest corner.
+// The buffer is split in rows of tiles and each tile row is rasterized by one thread, 4 pixels at a time
+// with SSE; the farthest depth of every tile is kept next to it so most tests never look at the pixels.
+// Occluders are sampled at pixel centers, like the GPU does, so their edges can cover up to half a pixel more
+// than they really do; the occluder meshes are kept inside the models for that (see Model3D::ComputeOccluder).
+class OcclusionBuffer
+{
+public:
+    static const int TILE_SIZE = 8;
+
+    //width and height are rounded up to whole tiles. Boxes partly outside the buffer are only culled when
+    //clipToViewport is set (the camera, where nothing outside is seen).
+    void init(gps::ThreadPool* threadPool, int width, int height, bool clipToViewport);
+
+    //empties the buffer for a new view
+    void begin(const glm::mat4& viewProjection);
+    //model space triangles, 3 vertices each
+    void addOccluder(const glm::vec3* triangles, int vertexCount, const glm::mat4& transform);
+    //rasterizes the occluders added since begin
+    void rasterize();
+
+    //model space box under transform, thread safe once rasterized
+    bool isOccluded(const glm::vec3& boxMin, const glm::vec3& boxMax, const glm::mat4& transform) const;
+
+    int getWidth();
+    int getHeight();
+    //nearest depth of a pixel, NDC z, FLT_MAX where nothing was drawn
+    GLfloat getDepth(int x, int y);
+
+    //counters since the last begin, the test ones are counted by the caller through countTests
+    OcclusionStats getStats();
+    void countTests(unsigned int tested, unsigned int occluded);
+
+private:
+    // screen space triangle, counter-clockwise, depth as a plane over the screen
+    struct ScreenTriangle {
+        GLfloat x[3];
+        GLfloat y[3];
+        GLfloat depthA, depthB, depthC;     // z = depthA * x + depthB * y + depthC
+        int minX, maxX, minY, maxY;         // pixel bounds, inclusive
+    };
+
+    gps::ThreadPool* threadPool;
+    int width;
+    int height;
+    int tilesX;
+    int tilesY;
+    bool clipToViewport;
+    glm::mat4 viewProjection;
+
+    std::vector<GLfloat> depth;
+    // farthest depth of each tile
+    std::vector<GLfloat> tileDepth;
+    std::vector<ScreenTriangle> triangles;
+    OcclusionStats stats;
+    double setupMs;
+
+    void addTriangle(const glm::vec4* clip);
+    void rasterizeTileRow(int tileRow);
+};
+
+}
+
+#endif /* OcclusionBuffer_hpp */
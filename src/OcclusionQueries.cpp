@@ -0,0 +1,222 @@
+#include "OcclusionQueries.hpp"
+#include "GLState.hpp"
+
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+
+namespace gps {
+
+    // corners of the unit box (bit 0 x, bit 1 y, bit 2 z), two counter-clockwise triangles per face seen from outside
+    static const int BOX_CORNERS[36] = {
+        0, 4, 6, 0, 6, 2,   // -x
+        1, 3, 7, 1, 7, 5,   // +x
+        0, 1, 5, 0, 5, 4,   // -y
+        2, 6, 7, 2, 7, 3,   // +y
+        0, 2, 3, 0, 3, 1,   // -z
+        4, 5, 7, 4, 7, 6    // +z
+    };
+
+    static void addStats(OcclusionQueryStats& sum, const OcclusionQueryStats& stats)
+    {
+        sum.issued += stats.issued;
+        sum.edgeBoxes += stats.edgeBoxes;
+        sum.visible += stats.visible;
+        sum.occluded += stats.occluded;
+        sum.pending += stats.pending;
+        sum.hidden += stats.hidden;
+    }
+
+    void OcclusionQueries::init()
+    {
+        this->enabled = true;
+        this->conditional = false;
+        // the conservative target may answer visible for a box that only grazes a pixel, never the other way
+        this->target = (GLEW_VERSION_4_3 || GLEW_ARB_ES3_compatibility) ? GL_ANY_SAMPLES_PASSED_CONSERVATIVE : GL_ANY_SAMPLES_PASSED;
+        this->frame = 0;
+        this->boxBufferSize = 0;
+        std::memset(&this->frameStats, 0, sizeof(OcclusionQueryStats));
+        std::memset(&this->totalStats, 0, sizeof(OcclusionQueryStats));
+
+        glGenVertexArrays(1, &this->boxVAO);
+        glGenBuffers(1, &this->boxVBO);
+        GLState::bindVertexArray(this->boxVAO);
+        glBindBuffer(GL_ARRAY_BUFFER, this->boxVBO);
+        glEnableVertexAttribArray(0);
+        glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, sizeof(glm::vec3), (GLvoid*)0);
+        GLState::bindVertexArray(0);
+        glBindBuffer(GL_ARRAY_BUFFER, 0);
+    }
+
+    void OcclusionQueries::setEnabled(bool enabled)
+    {
+        this->enabled = enabled;
+    }
+
+    bool OcclusionQueries::isEnabled()
+    {
+        return this->enabled;
+    }
+
+    void OcclusionQueries::setConditional(bool conditional)
+    {
+        this->conditional = conditional;
+    }
+
+    bool OcclusionQueries::isConditional()
+    {
+        return this->conditional;
+    }
+
+    void OcclusionQueries::trackModel(int model)
+    {
+        if ((int)this->trackedModels.size() <= model)
+            this->trackedModels.resize(model + 1, false);
+        this->trackedModels[model] = true;
+    }
+
+    bool OcclusionQueries::isTracked(int model) const
+    {
+        return model < (int)this->trackedModels.size() && this->trackedModels[model];
+    }
+
+    void OcclusionQueries::beginFrame(const glm::mat4& viewProjection)
+    {
+        this->viewProjection = viewProjection;
+        addStats(this->totalStats, this->frameStats);
+        std::memset(&this->frameStats, 0, sizeof(OcclusionQueryStats));
+        this->boxIds.clear();
+        this->boxVertices.clear();
+
+        // the set issued last frame, it is issued again next frame
+        this->frame++;
+        int set = (this->frame - 1) % QUERY_SETS;
+        const std::vector<unsigned int>& ids = this->issuedIds[set];
+        for (size_t i = 0; i < ids.size(); i++) {
+            GLuint query = this->queries[set][ids[i]];
+            GLuint available = GL_FALSE;
+            glGetQueryObjectuiv(query, GL_QUERY_RESULT_AVAILABLE, &available);
+            if (!available) {
+                this->frameStats.pending++;
+                continue;
+            }
+            GLuint passed = GL_FALSE;
+            glGetQueryObjectuiv(query, GL_QUERY_RESULT, &passed);
+            this->occluded[ids[i]] = passed ? 0 : 1;
+            if (passed)
+                this->frameStats.visible++;
+            else
+                this->frameStats.occluded++;
+        }
+    }
+
+    bool OcclusionQueries::isHidden(unsigned int id) const
+    {
+        // an object out of the view last frame has no fresh result, it is drawn and tested again
+        return this->enabled && !this->conditional && id < this->occluded.size() && this->occluded[id] &&
+            this->issuedFrames[id] == this->frame - 1;
+    }
+
+    GLuint OcclusionQueries::getConditionalQuery(unsigned int id) const
+    {
+        if (!this->enabled || !this->conditional || id >= this->issuedFrames.size())
+            return 0;
+        if (this->issuedFrames[id] != this->frame - 1)
+            return 0;
+        return this->queries[(this->frame - 1) % QUERY_SETS][id];
+    }
+
+    void OcclusionQueries::countHidden(unsigned int hidden)
+    {
+        this->frameStats.hidden += hidden;
+    }
+
+    void OcclusionQueries::reserve(unsigned int id)
+    {
+        size_t count = this->issuedFrames.size();
+        if (id < count)
+            return;
+        size_t newCount = std::max((size_t)id + 1, count * 2);
+        for (int set = 0; set < QUERY_SETS; set++) {
+            this->queries[set].resize(newCount);
+            glGenQueries((GLsizei)(newCount - count), &this->queries[set][count]);
+        }
+        this->issuedFrames.resize(newCount, 0);
+        this->occluded.resize(newCount, 0);
+    }
+
+    void OcclusionQueries::addBox(unsigned int id, const glm::vec3& boxMin, const glm::vec3& boxMax,
+        const glm::mat4& transform)
+    {
+        reserve(id);
+
+        glm::vec3 corners[8];
+        bool inside = true;
+        for (int c = 0; c < 8; c++) {
+            glm::vec3 corner((c & 1) ? boxMax.x : boxMin.x, (c & 2) ? boxMax.y : boxMin.y, (c & 4) ? boxMax.z : boxMin.z);
+            corners[c] = glm::vec3(transform * glm::vec4(corner, 1.0f));
+            glm::vec4 clip = this->viewProjection * glm::vec4(corners[c], 1.0f);
+            inside = inside && clip.z >= -clip.w && fabsf(clip.x) <= clip.w && fabsf(clip.y) <= clip.w;
+        }
+
+        // Past the near plane, faces in front of the eye are clipped away. Past the screen edge, the part outside
+        // draws no samples, and an object walking in would be left out on the frame it shows up. Either way the
+        // object counts as seen.
+        if (!inside) {
+            this->occluded[id] = 0;
+            this->frameStats.edgeBoxes++;
+            return;
+        }
+
+        this->boxIds.push_back(id);
+        for (int v = 0; v < 36; v++)
+            this->boxVertices.push_back(corners[BOX_CORNERS[v]]);
+    }
+
+    void OcclusionQueries::issue()
+    {
+        int set = this->frame % QUERY_SETS;
+        this->issuedIds[set].clear();
+        if (this->boxIds.empty())
+            return;
+
+        GLState::bindVertexArray(this->boxVAO);
+        glBindBuffer(GL_ARRAY_BUFFER, this->boxVBO);
+        GLsizeiptr size = (GLsizeiptr)(this->boxVertices.size() * sizeof(glm::vec3));
+        if (size > this->boxBufferSize) {
+            this->boxBufferSize = size * 2;
+            glBufferData(GL_ARRAY_BUFFER, this->boxBufferSize, NULL, GL_STREAM_DRAW);
+        }
+        glBufferSubData(GL_ARRAY_BUFFER, 0, size, this->boxVertices.data());
+        glBindBuffer(GL_ARRAY_BUFFER, 0);
+
+        // the boxes are already in world space, the model matrix attribute stays at the identity
+        for (int column = 0; column < 4; column++)
+            glVertexAttrib4f(3 + column, column == 0 ? 1.0f : 0.0f, column == 1 ? 1.0f : 0.0f,
+                column == 2 ? 1.0f : 0.0f, column == 3 ? 1.0f : 0.0f);
+
+        for (size_t i = 0; i < this->boxIds.size(); i++) {
+            unsigned int id = this->boxIds[i];
+            glBeginQuery(this->target, this->queries[set][id]);
+            glDrawArrays(GL_TRIANGLES, (GLint)(i * 36), 36);
+            glEndQuery(this->target);
+            this->issuedFrames[id] = this->frame;
+            this->issuedIds[set].push_back(id);
+        }
+        this->frameStats.issued += (unsigned int)this->boxIds.size();
+        // the queries go to the GPU now rather than with the rest of the frame, so they are done by the next one
+        glFlush();
+    }
+
+    OcclusionQueryStats OcclusionQueries::getFrameStats()
+    {
+        return this->frameStats;
+    }
+
+    OcclusionQueryStats OcclusionQueries::getTotalStats()
+    {
+        OcclusionQueryStats total = this->totalStats;
+        addStats(total, this->frameStats);
+        return total;
+    }
+}
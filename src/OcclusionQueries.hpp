@@ -0,0 +1,92 @@
+#ifndef OcclusionQueries_hpp
+#define OcclusionQueries_hpp
+
+#include <GL/glew.h>
+#include <glm/glm.hpp>
+
+#include <vector>
+
+namespace gps {
+
+struct OcclusionQueryStats {
+    unsigned int issued;            // boxes drawn under a query
+    unsigned int edgeBoxes;         // crossing the near plane or the screen edge, visible without a query
+    unsigned int visible;           // results read back
+    unsigned int occluded;
+    unsigned int pending;           // results not back a frame later, the object keeps its last state
+    unsigned int hidden;            // objects skipped, or drawn under conditional render, because of a result
+};
+
+// Hardware occlusion culling for the camera, with one frame of latency so nothing waits on the GPU.
+// Every frame the bounding boxes of the tracked objects left after culling are drawn against the finished depth
+// buffer (no color, no depth writes), each inside a GL_ANY_SAMPLES_PASSED_CONSERVATIVE query (GL_ANY_SAMPLES_PASSED
+// before 4.3). The next frame either reads the results that are back (never waiting) and leaves the occluded objects
+// out, or, in conditional mode, hands the queries to glBeginConditionalRender and never reads them for the draws.
+// Queries are kept per object id in two sets used every other frame, so a query is never reissued before the
+// frame after the one that consumes it. An occluded object is still tested every frame and comes back one frame
+// after it shows up again.
+class OcclusionQueries
+{
+public:
+    void init();
+    void setEnabled(bool enabled);
+    bool isEnabled();
+    //conditional render instead of leaving the occluded objects out
+    void setConditional(bool conditional);
+    bool isConditional();
+    //objects of this model get queries, the others never pay for them
+    void trackModel(int model);
+    bool isTracked(int model) const;
+
+    //reads back the results of last frame's queries that are available, call before the lists are built.
+    //viewProjection is the camera's of the new frame.
+    void beginFrame(const glm::mat4& viewProjection);
+    //skip mode: the object was tested last frame and its last result was occluded. Thread safe between beginFrame and issue.
+    bool isHidden(unsigned int id) const;
+    //conditional mode: last frame's query of the object, 0 if it had none. Thread safe between beginFrame and issue.
+    GLuint getConditionalQuery(unsigned int id) const;
+    //counts the objects the draw lists left out or made conditional
+    void countHidden(unsigned int hidden);
+
+    //model space box under transform, tested this frame
+    void addBox(unsigned int id, const glm::vec3& boxMin, const glm::vec3& boxMax, const glm::mat4& transform);
+    //draws the boxes added since beginFrame with the bound program, which must take positions on location 0
+    //and a model matrix on locations 3 to 6 (depth.vert). Color and depth writes must be off.
+    void issue();
+
+    OcclusionQueryStats getFrameStats();
+    OcclusionQueryStats getTotalStats();
+
+private:
+    static const int QUERY_SETS = 2;
+
+    bool enabled;
+    bool conditional;
+    GLenum target;
+    glm::mat4 viewProjection;
+    std::vector<bool> trackedModels;
+
+    unsigned int frame;
+    // per id: query of each set, frame it was last issued in (0 for never, frames start at 1), last result
+    std::vector<GLuint> queries[QUERY_SETS];
+    std::vector<unsigned int> issuedFrames;
+    std::vector<unsigned char> occluded;
+    // ids issued in each set's last frame, what beginFrame reads
+    std::vector<unsigned int> issuedIds[QUERY_SETS];
+
+    // world space boxes of this frame, 36 vertices each
+    std::vector<unsigned int> boxIds;
+    std::vector<glm::vec3> boxVertices;
+    GLuint boxVAO;
+    GLuint boxVBO;
+    GLsizeiptr boxBufferSize;
+
+    OcclusionQueryStats frameStats;
+    OcclusionQueryStats totalStats;
+
+    void reserve(unsigned int id);
+};
+
+}
+
+#endif /* OcclusionQueries_hpp */
@@ -0,0 +1,130 @@
+#include "PointLights.hpp"
+#include "GLState.hpp"
+
+#include <cmath>
+#include <cstring>
+
+namespace gps {
+
+    // area the lights are scattered over, around the teapot and the nanosuit
+    static const glm::vec3 AREA_MIN(-10.0f, -0.5f, -12.0f);
+    static const glm::vec3 AREA_MAX(10.0f, 1.5f, 4.0f);
+    static const GLfloat MIN_RADIUS = 1.0f;
+    static const GLfloat MAX_RADIUS = 3.0f;
+    static const GLfloat INTENSITY = 0.6f;
+    static const int SPOT_LIGHT_EVERY = 4;
+    // spot cones (degrees), the inner one is SPOT_SOFT_EDGE narrower
+    static const GLfloat MIN_SPOT_ANGLE = 25.0f;
+    static const GLfloat MAX_SPOT_ANGLE = 45.0f;
+    static const GLfloat SPOT_SOFT_EDGE = 10.0f;
+
+    // deterministic [0, 1) value for light i, channel k (the standard generators differ between libraries)
+    static GLfloat lightRandom(unsigned int i, unsigned int k)
+    {
+        unsigned int h = i * 0x9E3779B1u + k * 0x85EBCA77u;
+        h ^= h >> 15;
+        h *= 0x2C1B3C6Du;
+        h ^= h >> 12;
+        h *= 0x297A2D39u;
+        h ^= h >> 15;
+        return (GLfloat)(h >> 8) / 16777216.0f;
+    }
+
+    // fully saturated color of the given hue
+    static glm::vec3 hueColor(GLfloat hue)
+    {
+        return glm::vec3(
+            glm::clamp(fabsf(hue * 6.0f - 3.0f) - 1.0f, 0.0f, 1.0f),
+            glm::clamp(2.0f - fabsf(hue * 6.0f - 2.0f), 0.0f, 1.0f),
+            glm::clamp(2.0f - fabsf(hue * 6.0f - 4.0f), 0.0f, 1.0f));
+    }
+
+    void PointLights::init()
+    {
+        this->dirty = true;
+
+        glGenBuffers(1, &this->buffer);
+        glBindBuffer(GL_TEXTURE_BUFFER, this->buffer);
+        glBufferData(GL_TEXTURE_BUFFER, MAX_POINT_LIGHTS * sizeof(PointLight), NULL, GL_DYNAMIC_DRAW);
+        glBindBuffer(GL_TEXTURE_BUFFER, 0);
+
+        glGenTextures(1, &this->texture);
+        GLState::bindTexture(GL_TEXTURE_BUFFER, this->texture);
+        glTexBuffer(GL_TEXTURE_BUFFER, GL_RGBA32F, this->buffer);
+    }
+
+    void PointLights::generate(int count)
+    {
+        count = glm::clamp(count, 0, MAX_POINT_LIGHTS);
+        this->lights.resize(count);
+        for (int i = 0; i < count; i++) {
+            PointLight& light = this->lights[i];
+            light.position = AREA_MIN + (AREA_MAX - AREA_MIN) *
+                glm::vec3(lightRandom(i, 0), lightRandom(i, 1), lightRandom(i, 2));
+            light.radius = glm::mix(MIN_RADIUS, MAX_RADIUS, lightRandom(i, 3));
+            light.color = hueColor(lightRandom(i, 4)) * INTENSITY;
+            if (i % SPOT_LIGHT_EVERY == SPOT_LIGHT_EVERY - 1) {
+                // pointing down, tilted up to 45 degrees, spots reach further than point lights
+                glm::vec3 tilt(lightRandom(i, 5) * 2.0f - 1.0f, 0.0f, lightRandom(i, 6) * 2.0f - 1.0f);
+                light.direction = glm::normalize(glm::vec3(0.0f, -1.0f, 0.0f) + tilt * 0.5f);
+                GLfloat angle = MIN_SPOT_ANGLE + (MAX_SPOT_ANGLE - MIN_SPOT_ANGLE) * lightRandom(i, 7);
+                light.spotCosOuter = cosf(glm::radians(angle));
+                light.spotCosInner = cosf(glm::radians(angle - SPOT_SOFT_EDGE));
+                light.radius *= 2.0f;
+            }
+            else {
+                // smoothstep(-2, -1, x) is 1 for every direction
+                light.direction = glm::vec3(0.0f, -1.0f, 0.0f);
+                light.spotCosOuter = -2.0f;
+                light.spotCosInner = -1.0f;
+            }
+        }
+        this->dirty = true;
+    }
+
+    void PointLights::update(const glm::mat4& view)
+    {
+        if (!this->dirty && std::memcmp(&this->uploadedView, &view, sizeof(glm::mat4)) == 0)
+            return;
+
+        this->viewSpaceLights = this->lights;
+        for (size_t i = 0; i < this->viewSpaceLights.size(); i++) {
+            this->viewSpaceLights[i].position = glm::vec3(view * glm::vec4(this->lights[i].position, 1.0f));
+            this->viewSpaceLights[i].direction = glm::vec3(view * glm::vec4(this->lights[i].direction, 0.0f));
+        }
+
+        if (!this->viewSpaceLights.empty()) {
+            glBindBuffer(GL_TEXTURE_BUFFER, this->buffer);
+            glBufferSubData(GL_TEXTURE_BUFFER, 0, this->viewSpaceLights.size() * sizeof(PointLight), this->viewSpaceLights.data());
+            glBindBuffer(GL_TEXTURE_BUFFER, 0);
+        }
+
+        this->uploadedView = view;
+        this->dirty = false;
+    }
+
+    int PointLights::getCount()
+    {
+        return (int)this->lights.size();
+    }
+
+    const std::vector<PointLight>& PointLights::getLights()
+    {
+        return this->lights;
+    }
+
+    const std::vector<PointLight>& PointLights::getViewSpaceLights()
+    {
+        return this->viewSpaceLights;
+    }
+
+    GLuint PointLights::getBuffer()
+    {
+        return this->buffer;
+    }
+
+    GLuint PointLights::getTexture()
+    {
+        return this->texture;
+    }
+}
@@ -0,0 +1,60 @@
+#ifndef PointLights_hpp
+#define PointLights_hpp
+
+#include <GL/glew.h>
+#include <glm/glm.hpp>
+
+#include <vector>
+
+namespace gps {
+
+// One light as the shaders read it: three vec4 texels of the light buffer, or three instance attributes.
+// A spot light is a point light with a cone, point lights have a cone that lets everything through.
+struct PointLight {
+    glm::vec3 position;   // world space here, view space in the GPU copy
+    GLfloat radius;       // no light at all past this distance
+    glm::vec3 color;
+    GLfloat spotCosOuter; // no light outside this cone
+    glm::vec3 direction;  // spot axis, same space as position
+    GLfloat spotCosInner; // full light inside this cone
+};
+
+// Point and spot lights scattered over the scene, on top of the directional sun light.
+// The GPU copy is in view space and is read by the forward shader as a texture buffer
+// (position + radius, color + outer cone, direction + inner cone) and by the deferred light volumes as instance data.
+class PointLights
+{
+public:
+    static const int MAX_POINT_LIGHTS = 1024;
+    // basic.frag reads the lights from this unit
+    static const GLuint TEXTURE_UNIT = 4;
+
+    //creates the buffer and its texture view, sized for MAX_POINT_LIGHTS
+    void init();
+    //scatters count lights over the scene, every fourth one a spot light
+    //light i is always the same so smaller sets are subsets of larger ones
+    void generate(int count);
+    //uploads the view space copy, skipped when neither the lights nor the view changed
+    void update(const glm::mat4& view);
+
+    int getCount();
+    //world space lights
+    const std::vector<PointLight>& getLights();
+    //view space lights, as uploaded by the last update()
+    const std::vector<PointLight>& getViewSpaceLights();
+    GLuint getBuffer();
+    GLuint getTexture();
+
+private:
+    std::vector<PointLight> lights;
+    std::vector<PointLight> viewSpaceLights;
+    glm::mat4 uploadedView;
+    bool dirty;
+
+    GLuint buffer;
+    GLuint texture;
+};
+
+}
+
+#endif /* PointLights_hpp */
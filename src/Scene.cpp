@@ -0,0 +1,307 @@
+#include "Scene.hpp"
+
+#include <glm/gtc/matrix_transform.hpp>
+
+#include <emmintrin.h>
+
+#include <algorithm>
+#include <cmath>
+
+namespace gps {
+
+    // sine and cosine of 4 angles in degrees: reduced to [-45, 45] degrees around the nearest quarter turn, where
+    // the polynomials are accurate to a float, then swapped and negated by the quarter
+    static inline void sinCos4(__m128 degrees, __m128* sine, __m128* cosine)
+    {
+        __m128 x = _mm_mul_ps(degrees, _mm_set1_ps(0.0174532925f));
+        __m128i quarter = _mm_cvtps_epi32(_mm_mul_ps(x, _mm_set1_ps(0.636619772f)));
+        __m128 q = _mm_cvtepi32_ps(quarter);
+        // pi / 2 in three parts, the first ones exact in a float
+        x = _mm_sub_ps(x, _mm_mul_ps(q, _mm_set1_ps(1.5703125f)));
+        x = _mm_sub_ps(x, _mm_mul_ps(q, _mm_set1_ps(4.837512969970703125e-4f)));
+        x = _mm_sub_ps(x, _mm_mul_ps(q, _mm_set1_ps(7.54978995489188216e-8f)));
+
+        __m128 z = _mm_mul_ps(x, x);
+        __m128 s = _mm_add_ps(_mm_mul_ps(_mm_set1_ps(-1.9515295891e-4f), z), _mm_set1_ps(8.3321608736e-3f));
+        s = _mm_add_ps(_mm_mul_ps(s, z), _mm_set1_ps(-1.6666654611e-1f));
+        s = _mm_add_ps(_mm_mul_ps(_mm_mul_ps(s, z), x), x);
+        __m128 c = _mm_add_ps(_mm_mul_ps(_mm_set1_ps(2.443315711809948e-5f), z), _mm_set1_ps(-1.388731625493765e-3f));
+        c = _mm_add_ps(_mm_mul_ps(c, z), _mm_set1_ps(4.166664568298827e-2f));
+        c = _mm_add_ps(_mm_sub_ps(_mm_mul_ps(_mm_mul_ps(c, z), z), _mm_mul_ps(z, _mm_set1_ps(0.5f))), _mm_set1_ps(1.0f));
+
+        // odd quarters swap sine and cosine, quarters 2 and 3 negate the sine, 1 and 2 the cosine
+        __m128 swap = _mm_castsi128_ps(_mm_cmpeq_epi32(_mm_and_si128(quarter, _mm_set1_epi32(1)), _mm_set1_epi32(1)));
+        __m128 sinePart = _mm_or_ps(_mm_and_ps(swap, c), _mm_andnot_ps(swap, s));
+        __m128 cosinePart = _mm_or_ps(_mm_and_ps(swap, s), _mm_andnot_ps(swap, c));
+        __m128 sineSign = _mm_castsi128_ps(_mm_slli_epi32(_mm_and_si128(quarter, _mm_set1_epi32(2)), 30));
+        __m128 cosineSign = _mm_castsi128_ps(_mm_slli_epi32(
+            _mm_and_si128(_mm_add_epi32(quarter, _mm_set1_epi32(1)), _mm_set1_epi32(2)), 30));
+        *sine = _mm_xor_ps(sinePart, sineSign);
+        *cosine = _mm_xor_ps(cosinePart, cosineSign);
+    }
+
+    Scene::Scene()
+    {
+        this->animationTime = 0.0f;
+        this->nextRevision = 0;
+    }
+
+    Entity Scene::create(int model, const glm::vec4& bounds, const glm::vec3& position, const glm::vec3& angles,
+        const glm::vec3& scale, unsigned char flags)
+    {
+        Entity entity = (Entity)this->positions.size();
+        this->positions.push_back(position);
+        this->angles.push_back(angles);
+        this->scales.push_back(scale);
+        this->restPositions.push_back(position);
+        this->restAngles.push_back(angles);
+        this->startPositions.push_back(position);
+        this->startAngles.push_back(angles);
+        this->models.push_back(model);
+        this->bounds.push_back(bounds);
+        this->entityFlags.push_back(flags);
+        this->animationKinds.push_back(ANIMATION_NONE);
+        this->animationStates.push_back(0);
+        this->animationPhases.push_back(0.0f);
+        this->dirty.push_back(0);
+        this->revisions.push_back(++this->nextRevision);
+        return entity;
+    }
+
+    void Scene::truncate(size_t count)
+    {
+        if (count >= size())
+            return;
+        this->positions.resize(count);
+        this->angles.resize(count);
+        this->scales.resize(count);
+        this->restPositions.resize(count);
+        this->restAngles.resize(count);
+        this->startPositions.resize(count);
+        this->startAngles.resize(count);
+        this->models.resize(count);
+        this->bounds.resize(count);
+        this->entityFlags.resize(count);
+        this->animationKinds.resize(count);
+        this->animationStates.resize(count);
+        this->animationPhases.resize(count);
+        this->dirty.resize(count);
+        this->revisions.resize(count);
+    }
+
+    size_t Scene::size()
+    {
+        return this->positions.size();
+    }
+
+    void Scene::setAnimation(Entity entity, AnimationKind kind, bool enabled, GLfloat phase)
+    {
+        this->animationKinds[entity] = (unsigned char)kind;
+        this->animationStates[entity] = enabled ? ANIMATION_ENABLED : 0;
+        this->animationPhases[entity] = phase;
+    }
+
+    void Scene::setStartPose(Entity entity, const glm::vec3& position, const glm::vec3& angles)
+    {
+        this->startPositions[entity] = position;
+        this->startAngles[entity] = angles;
+    }
+
+    void Scene::setPosition(Entity entity, const glm::vec3& position)
+    {
+        this->positions[entity] = position;
+        this->dirty[entity] = 1;
+    }
+
+    void Scene::setAngles(Entity entity, const glm::vec3& angles)
+    {
+        this->angles[entity] = angles;
+        this->dirty[entity] = 1;
+    }
+
+    void Scene::startAnimation(Entity entity)
+    {
+        if (this->animationStates[entity] & ANIMATION_ENABLED)
+            return;
+        setAngles(entity, this->startAngles[entity]);
+        if (this->animationKinds[entity] == ANIMATION_PATROL)
+            setPosition(entity, this->startPositions[entity]);
+        this->animationStates[entity] = ANIMATION_ENABLED;
+    }
+
+    void Scene::stopAnimation(Entity entity)
+    {
+        if (!(this->animationStates[entity] & ANIMATION_ENABLED))
+            return;
+        setAngles(entity, this->restAngles[entity]);
+        if (this->animationKinds[entity] == ANIMATION_PATROL)
+            setPosition(entity, this->restPositions[entity]);
+        this->animationStates[entity] = 0;
+    }
+
+    void Scene::pauseAnimation(Entity entity)
+    {
+        this->animationStates[entity] = 0;
+    }
+
+    void Scene::resetPose(Entity entity)
+    {
+        setPosition(entity, this->restPositions[entity]);
+        setAngles(entity, this->restAngles[entity]);
+        if (this->animationKinds[entity] == ANIMATION_ROCK)
+            this->animationStates[entity] &= ~ANIMATION_ENABLED;
+    }
+
+    void Scene::animate(GLfloat stepSeconds)
+    {
+        size_t count = size();
+        for (size_t i = 0; i < count; i++) {
+            unsigned char state = this->animationStates[i];
+            if (!(state & ANIMATION_ENABLED))
+                continue;
+
+            glm::vec3& position = this->positions[i];
+            glm::vec3& angle = this->angles[i];
+            switch (this->animationKinds[i]) {
+            case ANIMATION_ROCK:
+                if (angle.z >= 45.0f || angle.z <= -45.0f)
+                    state ^= ANIMATION_REVERSED;
+                angle.z += (state & ANIMATION_REVERSED) ? -1.0f : 1.0f;
+                break;
+            case ANIMATION_PATROL:
+                if (!(state & ANIMATION_TURNING)) {
+                    if (!(state & ANIMATION_REVERSED)) {
+                        position.x -= 0.01f;
+                        if (position.x <= -5.0f)
+                            state |= ANIMATION_TURNING;
+                    }
+                    else {
+                        position.x += 0.02f;
+                        if (position.x >= 5.0f)
+                            state |= ANIMATION_TURNING;
+                    }
+                }
+                else {
+                    angle.y += 1.0f;
+                    if (angle.y >= 360.0f)
+                        angle.y -= 360.0f;
+                    // facing along x again
+                    if (angle.y == 90.0f || angle.y == 270.0f)
+                        state = (state & ~ANIMATION_TURNING) ^ ANIMATION_REVERSED;
+                }
+                break;
+            case ANIMATION_SPIN_BOB: {
+                GLfloat phase = this->animationPhases[i];
+                position.y = this->restPositions[i].y + 0.1f * sinf(this->animationTime * 2.0f + phase);
+                angle.y = fmodf(this->animationTime * 60.0f + phase * 7.0f, 360.0f);
+                break;
+            }
+            default:
+                continue;
+            }
+            this->animationStates[i] = state;
+            this->dirty[i] = 1;
+        }
+        this->animationTime += stepSeconds;
+    }
+
+    void Scene::commit()
+    {
+        size_t count = size();
+        for (size_t i = 0; i < count; i++) {
+            if (this->dirty[i]) {
+                this->revisions[i] = ++this->nextRevision;
+                this->dirty[i] = 0;
+            }
+        }
+    }
+
+    glm::mat4 Scene::composeTransform(const glm::vec3& position, const glm::vec3& angles, const glm::vec3& scale)
+    {
+        glm::mat4 transform = glm::translate(glm::mat4(1.0f), position);
+        transform = glm::rotate(transform, glm::radians(angles.x), glm::vec3(1.0f, 0.0f, 0.0f));
+        transform = glm::rotate(transform, glm::radians(angles.y), glm::vec3(0.0f, 1.0f, 0.0f));
+        transform = glm::rotate(transform, glm::radians(angles.z), glm::vec3(0.0f, 0.0f, 1.0f));
+        return glm::scale(transform, scale);
+    }
+
+    void Scene::composeTransforms(const glm::vec3* positions, const glm::vec3* angles, const glm::vec3* scales, int count,
+        glm::mat4* transforms, glm::mat3* normalMatrices)
+    {
+        for (int first = 0; first < count; first += 4) {
+            // one lane per pose, the missing lanes of the last group repeat its last pose
+            int lanes = std::min(4, count - first);
+            GLfloat in[9][4];
+            for (int lane = 0; lane < 4; lane++) {
+                int i = first + std::min(lane, lanes - 1);
+                for (int k = 0; k < 3; k++) {
+                    in[k][lane] = positions[i][k];
+                    in[3 + k][lane] = angles[i][k];
+                    in[6 + k][lane] = scales[i][k];
+                }
+            }
+
+            __m128 sx, cx, sy, cy, sz, cz;
+            sinCos4(_mm_loadu_ps(in[3]), &sx, &cx);
+            sinCos4(_mm_loadu_ps(in[4]), &sy, &cy);
+            sinCos4(_mm_loadu_ps(in[5]), &sz, &cz);
+
+            // columns of rotate x * rotate y * rotate z
+            __m128 sxsy = _mm_mul_ps(sx, sy);
+            __m128 cxsy = _mm_mul_ps(cx, sy);
+            __m128 rotation[3][3] = {
+                { _mm_mul_ps(cy, cz), _mm_add_ps(_mm_mul_ps(cx, sz), _mm_mul_ps(sxsy, cz)), _mm_sub_ps(_mm_mul_ps(sx, sz), _mm_mul_ps(cxsy, cz)) },
+                { _mm_sub_ps(_mm_setzero_ps(), _mm_mul_ps(cy, sz)), _mm_sub_ps(_mm_mul_ps(cx, cz), _mm_mul_ps(sxsy, sz)), _mm_add_ps(_mm_mul_ps(sx, cz), _mm_mul_ps(cxsy, sz)) },
+                { sy, _mm_sub_ps(_mm_setzero_ps(), _mm_mul_ps(sx, cy)), _mm_mul_ps(cx, cy) }
+            };
+
+            // back to one pose per register, column by column
+            __m128 transformColumns[4][4];
+            __m128 normalColumns[3][4];
+            for (int column = 0; column < 3; column++) {
+                __m128 scale = _mm_loadu_ps(in[6 + column]);
+                __m128 inverseScale = _mm_div_ps(_mm_set1_ps(1.0f), scale);
+                __m128 t0 = _mm_mul_ps(rotation[column][0], scale);
+                __m128 t1 = _mm_mul_ps(rotation[column][1], scale);
+                __m128 t2 = _mm_mul_ps(rotation[column][2], scale);
+                __m128 t3 = _mm_setzero_ps();
+                _MM_TRANSPOSE4_PS(t0, t1, t2, t3);
+                transformColumns[column][0] = t0;
+                transformColumns[column][1] = t1;
+                transformColumns[column][2] = t2;
+                transformColumns[column][3] = t3;
+
+                __m128 n0 = _mm_mul_ps(rotation[column][0], inverseScale);
+                __m128 n1 = _mm_mul_ps(rotation[column][1], inverseScale);
+                __m128 n2 = _mm_mul_ps(rotation[column][2], inverseScale);
+                __m128 n3 = _mm_setzero_ps();
+                _MM_TRANSPOSE4_PS(n0, n1, n2, n3);
+                normalColumns[column][0] = n0;
+                normalColumns[column][1] = n1;
+                normalColumns[column][2] = n2;
+                normalColumns[column][3] = n3;
+            }
+            __m128 p0 = _mm_loadu_ps(in[0]);
+            __m128 p1 = _mm_loadu_ps(in[1]);
+            __m128 p2 = _mm_loadu_ps(in[2]);
+            __m128 p3 = _mm_set1_ps(1.0f);
+            _MM_TRANSPOSE4_PS(p0, p1, p2, p3);
+            transformColumns[3][0] = p0;
+            transformColumns[3][1] = p1;
+            transformColumns[3][2] = p2;
+            transformColumns[3][3] = p3;
+
+            for (int lane = 0; lane < lanes; lane++) {
+                glm::mat4& transform = transforms[first + lane];
+                for (int column = 0; column < 4; column++)
+                    _mm_storeu_ps(&transform[column][0], transformColumns[column][lane]);
+                // 3 floats per column, the last one must not write past the matrix
+                glm::mat3& normalMatrix = normalMatrices[first + lane];
+                _mm_storeu_ps(&normalMatrix[0][0], normalColumns[0][lane]);
+                _mm_storeu_ps(&normalMatrix[1][0], normalColumns[1][lane]);
+                _mm_storel_pi((__m64*)&normalMatrix[2][0], normalColumns[2][lane]);
+                _mm_store_ss(&normalMatrix[2][2], _mm_movehl_ps(normalColumns[2][lane], normalColumns[2][lane]));
+            }
+        }
+    }
+}
@@ -0,0 +1,108 @@
+#ifndef Scene_hpp
+#define Scene_hpp
+
+#include <GL/glew.h>
+#include <glm/glm.hpp>
+
+#include <vector>
+
+namespace gps {
+
+typedef unsigned int Entity;
+
+// motion an entity plays by itself, one step per simulation step
+enum AnimationKind {
+    ANIMATION_NONE,
+    ANIMATION_ROCK,         // swings about z between -45 and 45 degrees
+    ANIMATION_PATROL,       // walks along x between -5 and 5 and turns around at each end
+    ANIMATION_SPIN_BOB      // turns about y and bobs around its rest height, shifted by its phase
+};
+
+// animationStates bits
+enum AnimationState {
+    ANIMATION_ENABLED = 1 << 0,
+    ANIMATION_REVERSED = 1 << 1,
+    ANIMATION_TURNING = 1 << 2
+};
+
+// entityFlags bits
+enum EntityFlag {
+    ENTITY_STATIC = 1 << 0  // never moves, its shadow lives in the cached static layers
+};
+
+// Entity/component store of the simulation: an entity is an index into one array per component (SoA), so every
+// system walks the arrays it needs front to back and nothing else. Whatever changes an entity's pose marks it
+// dirty; commit() turns the dirty flags into fresh revisions, which is how the renderer knows which cached
+// transforms are still good. The mesh reference, bounds and flags are fixed when the entity is created.
+class Scene
+{
+public:
+    // transform, angles in degrees applied about x, then y, then z
+    std::vector<glm::vec3> positions;
+    std::vector<glm::vec3> angles;
+    std::vector<glm::vec3> scales;
+    // pose the object reset goes back to, and the one its animation starts from
+    std::vector<glm::vec3> restPositions;
+    std::vector<glm::vec3> restAngles;
+    std::vector<glm::vec3> startPositions;
+    std::vector<glm::vec3> startAngles;
+
+    // mesh reference (the caller's model table) and model space bounding sphere
+    std::vector<int> models;
+    std::vector<glm::vec4> bounds;
+    std::vector<unsigned char> entityFlags;
+
+    // animation state
+    std::vector<unsigned char> animationKinds;
+    std::vector<unsigned char> animationStates;
+    std::vector<GLfloat> animationPhases;
+
+    // pose changed since the last commit, and the revision of the pose as of the last commit
+    std::vector<unsigned char> dirty;
+    std::vector<unsigned int> revisions;
+
+    Scene();
+
+    //the entity starts at its rest pose, which is also where its animation starts
+    Entity create(int model, const glm::vec4& bounds, const glm::vec3& position, const glm::vec3& angles,
+        const glm::vec3& scale, unsigned char flags = 0);
+    //drops every entity from count on
+    void truncate(size_t count);
+    size_t size();
+
+    void setAnimation(Entity entity, AnimationKind kind, bool enabled, GLfloat phase = 0.0f);
+    void setStartPose(Entity entity, const glm::vec3& position, const glm::vec3& angles);
+    void setPosition(Entity entity, const glm::vec3& position);
+    void setAngles(Entity entity, const glm::vec3& angles);
+
+    //animation back to its start pose and running, if it wasn't. A patrol also takes the position back.
+    void startAnimation(Entity entity);
+    //animation off and angles at rest, if it was running. A patrol also leaves the object at its rest position.
+    void stopAnimation(Entity entity);
+    //animation off where it is, for manual control
+    void pauseAnimation(Entity entity);
+    //rest pose. A rocking animation stops, a patrol carries on from there.
+    void resetPose(Entity entity);
+
+    //animation system, every enabled animation one step forward
+    void animate(GLfloat stepSeconds);
+    //dirty entities get a new revision
+    void commit();
+
+    //translate * rotate x * rotate y * rotate z * scale
+    static glm::mat4 composeTransform(const glm::vec3& position, const glm::vec3& angles, const glm::vec3& scale);
+    //composeTransform of count poses and their normal matrices, 4 poses at a time with SSE. The rotation is
+    //orthonormal, so the inverse transpose of rotate * scale is rotate * inverse scale and no inverse is needed.
+    static void composeTransforms(const glm::vec3* positions, const glm::vec3* angles, const glm::vec3* scales, int count,
+        glm::mat4* transforms, glm::mat3* normalMatrices);
+
+private:
+    // shared clock of the time based animations
+    GLfloat animationTime;
+    // revisions are unique over all entities, a recreated entity never matches an old cached one
+    unsigned int nextRevision;
+};
+
+}
+
+#endif /* Scene_hpp */
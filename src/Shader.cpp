@@ -1,6 +1,47 @@
 #include "Shader.hpp"
+#include "CpuProfiler.hpp"
+#include "FrameUniforms.hpp"
+
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <vector>
 
 namespace gps {
+
+    //bump when the layout of the cache file changes
+    static const uint32_t PROGRAM_CACHE_MAGIC = 0x42535047; // "GPSB"
+    static const uint32_t PROGRAM_CACHE_VERSION = 1;
+
+    struct ProgramCacheHeader {
+        uint32_t magic;
+        uint32_t version;
+        unsigned long long key;
+        uint32_t binaryFormat;
+        uint32_t binaryLength;
+    };
+
+    //64 bit FNV-1a, chained over several strings
+    static unsigned long long fnv1a(const std::string& s, unsigned long long hash = 14695981039346656037ULL)
+    {
+        for (size_t i = 0; i < s.size(); i++) {
+            hash ^= (unsigned char)s[i];
+            hash *= 1099511628211ULL;
+        }
+        return hash;
+    }
+
+    static std::string glString(GLenum name)
+    {
+        const GLubyte* s = glGetString(name);
+        return s ? std::string((const char*)s) : std::string();
+    }
+
+    static double elapsedMs(std::chrono::steady_clock::time_point start)
+    {
+        return std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+    }
+
     std::string Shader::readShaderFile(std::string fileName)
     {
         std::ifstream shaderFile;
@@ -22,6 +63,18 @@ namespace gps {
         return shaderString;
     }
 
+    std::string Shader::injectDefines(const std::string& source, const std::string& defines)
+    {
+        if (defines.empty())
+            return source;
+
+        //#version has to stay the first line
+        size_t lineEnd = source.find('\n');
+        if (lineEnd == std::string::npos)
+            return source + "\n" + defines;
+        return source.substr(0, lineEnd + 1) + defines + source.substr(lineEnd + 1);
+    }
+
     void Shader::shaderCompileLog(GLuint shaderId)
     {
         GLint success;
@@ -36,7 +89,7 @@ namespace gps {
         }
     }
 
-    void Shader::shaderLinkLog(GLuint shaderProgramId)
+    bool Shader::shaderLinkLog(GLuint shaderProgramId)
     {
         GLint success;
         GLchar infoLog[512];
@@ -44,47 +97,266 @@ namespace gps {
         //check linking info
         glGetProgramiv(shaderProgramId, GL_LINK_STATUS, &success);
         if(!success) {
-            glGetProgramInfoLog(shaderProgram, 512, NULL, infoLog);
+            glGetProgramInfoLog(shaderProgramId, 512, NULL, infoLog);
             std::cout << "Shader linking error\n" << infoLog << std::endl;
         }
+        return success == GL_TRUE;
     }
 
-    void Shader::loadShader(std::string vertexShaderFileName, std::string fragmentShaderFileName)
-    {
-        //read, parse and compile the vertex shader
-        std::string v = readShaderFile(vertexShaderFileName);
-        const GLchar* vertexShaderString = v.c_str();
-        GLuint vertexShader;
-        vertexShader = glCreateShader(GL_VERTEX_SHADER);
-        glShaderSource(vertexShader, 1, &vertexShaderString, NULL);
-        glCompileShader(vertexShader);
-        //check compilation status
-        shaderCompileLog(vertexShader);
-
-        //read, parse and compile the vertex shader
-        std::string f = readShaderFile(fragmentShaderFileName);
-        const GLchar* fragmentShaderString = f.c_str();
-        GLuint fragmentShader;
-        fragmentShader = glCreateShader(GL_FRAGMENT_SHADER);
-        glShaderSource(fragmentShader, 1, &fragmentShaderString, NULL);
-        glCompileShader(fragmentShader);
-        //check compilation status
-        shaderCompileLog(fragmentShader);
-
-        //attach and link the shader programs
+    std::string Shader::cacheFileName(const PendingShaderLoad& load, const std::string& defines)
+    {
+        //only the identity of the program goes in the name, the contents are checked through the key in the header
+        unsigned long long name = fnv1a(load.geometryShaderFileName, fnv1a(load.fragmentShaderFileName));
+        char suffix[32];
+        snprintf(suffix, sizeof(suffix), ".%08x.bin", (unsigned int)(fnv1a(defines, name) & 0xFFFFFFFFu));
+        return load.vertexShaderFileName + suffix;
+    }
+
+    unsigned long long Shader::cacheKey(const PendingShaderLoad& load, const std::string& defines)
+    {
+        unsigned long long key = fnv1a(load.vertexSource);
+        key = fnv1a(load.geometrySource, key);
+        key = fnv1a(load.fragmentSource, key);
+        key = fnv1a(defines, key);
+        //a driver update or another GPU makes old binaries useless
+        key = fnv1a(glString(GL_VENDOR), key);
+        key = fnv1a(glString(GL_RENDERER), key);
+        key = fnv1a(glString(GL_VERSION), key);
+        return key;
+    }
+
+    bool Shader::submitProgramBinary(const std::string& fileName, unsigned long long key)
+    {
+        std::ifstream file(fileName.c_str(), std::ios::binary);
+        if (!file.is_open())
+            return false;
+
+        ProgramCacheHeader header;
+        if (!file.read((char*)&header, sizeof(header)))
+            return false;
+        if (header.magic != PROGRAM_CACHE_MAGIC || header.version != PROGRAM_CACHE_VERSION || header.key != key) {
+            std::cout << "Program cache " << fileName << " is stale" << std::endl;
+            return false;
+        }
+
+        std::vector<char> binary(header.binaryLength);
+        if (header.binaryLength == 0 || !file.read(binary.data(), header.binaryLength))
+            return false;
+
+        //whether the driver accepts it is only checked in finishLoad
+        glProgramBinary(this->shaderProgram, header.binaryFormat, binary.data(), (GLsizei)header.binaryLength);
+        return true;
+    }
+
+    void Shader::saveProgramBinary(const std::string& fileName, unsigned long long key)
+    {
+        GLint length = 0;
+        glGetProgramiv(this->shaderProgram, GL_PROGRAM_BINARY_LENGTH, &length);
+        if (length <= 0)
+            return;
+
+        std::vector<char> binary(length);
+        GLenum format = 0;
+        glGetProgramBinary(this->shaderProgram, length, NULL, &format, binary.data());
+
+        ProgramCacheHeader header;
+        header.magic = PROGRAM_CACHE_MAGIC;
+        header.version = PROGRAM_CACHE_VERSION;
+        header.key = key;
+        header.binaryFormat = format;
+        header.binaryLength = (uint32_t)length;
+
+        std::ofstream file(fileName.c_str(), std::ios::binary | std::ios::trunc);
+        if (!file.is_open()) {
+            std::cout << "Could not write program cache " << fileName << std::endl;
+            return;
+        }
+        file.write((const char*)&header, sizeof(header));
+        file.write(binary.data(), length);
+    }
+
+    void Shader::submitCompile(PendingShaderLoad& load)
+    {
+        //compile the vertex shader
+        const GLchar* vertexShaderString = load.vertexSource.c_str();
+        load.vertexShader = glCreateShader(GL_VERTEX_SHADER);
+        glShaderSource(load.vertexShader, 1, &vertexShaderString, NULL);
+        glCompileShader(load.vertexShader);
+
+        //compile the optional geometry shader
+        if (!load.geometrySource.empty()) {
+            const GLchar* geometryShaderString = load.geometrySource.c_str();
+            load.geometryShader = glCreateShader(GL_GEOMETRY_SHADER);
+            glShaderSource(load.geometryShader, 1, &geometryShaderString, NULL);
+            glCompileShader(load.geometryShader);
+        }
+
+        //compile the fragment shader
+        const GLchar* fragmentShaderString = load.fragmentSource.c_str();
+        load.fragmentShader = glCreateShader(GL_FRAGMENT_SHADER);
+        glShaderSource(load.fragmentShader, 1, &fragmentShaderString, NULL);
+        glCompileShader(load.fragmentShader);
+
+        //attach and link the shader programs, the compile status is checked in finishLoad
+        //so the driver doesn't have to finish the compile here
+        //ask the driver to keep a binary we can store
+        glProgramParameteri(this->shaderProgram, GL_PROGRAM_BINARY_RETRIEVABLE_HINT, GL_TRUE);
+        glAttachShader(this->shaderProgram, load.vertexShader);
+        if (load.geometryShader)
+            glAttachShader(this->shaderProgram, load.geometryShader);
+        glAttachShader(this->shaderProgram, load.fragmentShader);
+        glLinkProgram(this->shaderProgram);
+    }
+
+    void Shader::beginLoad(std::string vertexShaderFileName, std::string fragmentShaderFileName, std::string defines)
+    {
+        beginLoad(vertexShaderFileName, "", fragmentShaderFileName, defines);
+    }
+
+    void Shader::beginLoad(std::string vertexShaderFileName, std::string geometryShaderFileName, std::string fragmentShaderFileName, std::string defines)
+    {
+        std::shared_ptr<PendingShaderLoad> load = std::make_shared<PendingShaderLoad>();
+        load->submitted = std::chrono::steady_clock::now();
+        load->vertexShaderFileName = vertexShaderFileName;
+        load->geometryShaderFileName = geometryShaderFileName;
+        load->fragmentShaderFileName = fragmentShaderFileName;
+        load->vertexShader = 0;
+        load->geometryShader = 0;
+        load->fragmentShader = 0;
+        load->done = false;
+
+        //read and parse both stages, every stage gets the shared FrameData block after the defines
+        std::string preamble = defines + FrameUniforms::blockSource();
+        load->vertexSource = injectDefines(readShaderFile(vertexShaderFileName), preamble);
+        if (!geometryShaderFileName.empty())
+            load->geometrySource = injectDefines(readShaderFile(geometryShaderFileName), preamble);
+        load->fragmentSource = injectDefines(readShaderFile(fragmentShaderFileName), preamble);
+        load->cacheFile = cacheFileName(*load, defines);
+        load->cacheKey = cacheKey(*load, defines);
+
+        this->shaderProgram = glCreateProgram();
+
+        //without any binary format the driver can't give us anything to cache
+        GLint binaryFormats = 0;
+        glGetIntegerv(GL_NUM_PROGRAM_BINARY_FORMATS, &binaryFormats);
+        load->fromCache = binaryFormats > 0 && submitProgramBinary(load->cacheFile, load->cacheKey);
+        if (!load->fromCache)
+            submitCompile(*load);
+
+        load->submitMs = elapsedMs(load->submitted);
+        this->pending = load;
+    }
+
+    bool Shader::isLoadPending()
+    {
+        return this->pending && !this->pending->done;
+    }
+
+    bool Shader::isLoadComplete()
+    {
+        if (!isLoadPending())
+            return true;
+        if (!GLEW_KHR_parallel_shader_compile)
+            return true;
+
+        GLint complete = GL_FALSE;
+        glGetProgramiv(this->shaderProgram, GL_COMPLETION_STATUS_KHR, &complete);
+        return complete == GL_TRUE;
+    }
+
+    void Shader::finishLoad()
+    {
+        if (!isLoadPending())
+            return;
+        gps::CpuZone zone("Shader::finishLoad");
+
+        PendingShaderLoad& load = *this->pending;
+        std::chrono::steady_clock::time_point waitStart = std::chrono::steady_clock::now();
+
+        if (load.fromCache) {
+            //the driver is free to reject a binary it produced itself
+            GLint success;
+            glGetProgramiv(this->shaderProgram, GL_LINK_STATUS, &success);
+            if (!success) {
+                std::cout << "Program cache " << load.cacheFile << " was rejected by the driver" << std::endl;
+                load.fromCache = false;
+                submitCompile(load);
+            }
+        }
+
+        if (!load.fromCache) {
+            //check compilation status
+            shaderCompileLog(load.vertexShader);
+            if (load.geometryShader)
+                shaderCompileLog(load.geometryShader);
+            shaderCompileLog(load.fragmentShader);
+            //check linking info, this waits for the driver to finish the link
+            bool linked = shaderLinkLog(this->shaderProgram);
+            glDetachShader(this->shaderProgram, load.vertexShader);
+            glDetachShader(this->shaderProgram, load.fragmentShader);
+            glDeleteShader(load.vertexShader);
+            glDeleteShader(load.fragmentShader);
+            if (load.geometryShader) {
+                glDetachShader(this->shaderProgram, load.geometryShader);
+                glDeleteShader(load.geometryShader);
+            }
+
+            GLint binaryFormats = 0;
+            glGetIntegerv(GL_NUM_PROGRAM_BINARY_FORMATS, &binaryFormats);
+            if (linked && binaryFormats > 0)
+                saveProgramBinary(load.cacheFile, load.cacheKey);
+        }
+
+        std::cout << "Shader " << load.vertexShaderFileName
+            << (load.geometryShaderFileName.empty() ? "" : " + " + load.geometryShaderFileName) << " + " << load.fragmentShaderFileName
+            << (load.fromCache ? ": loaded from cache" : ": compiled")
+            << ", " << load.submitMs << " ms to submit, " << elapsedMs(waitStart) << " ms waiting for it, checked "
+            << elapsedMs(load.submitted) << " ms after submit" << std::endl;
+
+        load.done = true;
+        load.vertexSource.clear();
+        load.geometrySource.clear();
+        load.fragmentSource.clear();
+    }
+
+    void Shader::loadShader(std::string vertexShaderFileName, std::string fragmentShaderFileName, std::string defines)
+    {
+        beginLoad(vertexShaderFileName, fragmentShaderFileName, defines);
+        finishLoad();
+    }
+
+    void Shader::loadShader(std::string vertexShaderFileName, std::string geometryShaderFileName, std::string fragmentShaderFileName, std::string defines)
+    {
+        beginLoad(vertexShaderFileName, geometryShaderFileName, fragmentShaderFileName, defines);
+        finishLoad();
+    }
+
+    void Shader::loadComputeShader(std::string computeShaderFileName, std::string defines)
+    {
+        std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+        std::string source = injectDefines(readShaderFile(computeShaderFileName), defines);
+        const GLchar* computeShaderString = source.c_str();
+        GLuint computeShader = glCreateShader(GL_COMPUTE_SHADER);
+        glShaderSource(computeShader, 1, &computeShaderString, NULL);
+        glCompileShader(computeShader);
+        shaderCompileLog(computeShader);
+
         this->shaderProgram = glCreateProgram();
-        glAttachShader(this->shaderProgram, vertexShader);
-        glAttachShader(this->shaderProgram, fragmentShader);
+        glAttachShader(this->shaderProgram, computeShader);
         glLinkProgram(this->shaderProgram);
-        glDeleteShader(vertexShader);
-        glDeleteShader(fragmentShader);
-        //check linking info
         shaderLinkLog(this->shaderProgram);
+        glDetachShader(this->shaderProgram, computeShader);
+        glDeleteShader(computeShader);
+        this->pending.reset();
+
+        std::cout << "Shader " << computeShaderFileName << ": compiled, " << elapsedMs(start) << " ms" << std::endl;
     }
 
     void Shader::useShaderProgram()
     {
-        glUseProgram(this->shaderProgram);
+        //first use of a program submitted with beginLoad
+        finishLoad();
+        GLState::useProgram(this->shaderProgram);
     }
 
 }
@@ -3,25 +3,74 @@
 
 #include <GL/glew.h>
 
+#include "GLState.hpp"
+
 #include <iostream>
 #include <fstream>
 #include <sstream>
 #include <iostream>
 #include <string>
+#include <memory>
+#include <chrono>
 
 namespace gps {
 
+//state of a program whose compile/link was submitted but not checked yet
+struct PendingShaderLoad {
+    std::string vertexShaderFileName;
+    std::string geometryShaderFileName;
+    std::string fragmentShaderFileName;
+    std::string vertexSource;
+    std::string geometrySource;
+    std::string fragmentSource;
+    std::string cacheFile;
+    unsigned long long cacheKey;
+    bool fromCache;
+    GLuint vertexShader;
+    GLuint geometryShader;
+    GLuint fragmentShader;
+    std::chrono::steady_clock::time_point submitted;
+    double submitMs;
+    bool done;
+};
+
 class Shader
 {
 public:
     GLuint shaderProgram;
-    void loadShader(std::string vertexShaderFileName, std::string fragmentShaderFileName);
+    //defines are "#define ..." lines inserted right after the #version line of both stages
+    void loadShader(std::string vertexShaderFileName, std::string fragmentShaderFileName, std::string defines = "");
+    //same, with a geometry stage between the two
+    void loadShader(std::string vertexShaderFileName, std::string geometryShaderFileName, std::string fragmentShaderFileName, std::string defines);
     void useShaderProgram();
+    //compute program, compiled and linked right away (no binary cache, the compute programs are optional)
+    void loadComputeShader(std::string computeShaderFileName, std::string defines = "");
+
+    //split version of loadShader: beginLoad only submits the work to the driver (shaderProgram is valid right away),
+    //finishLoad checks the result and is the only place that waits for it. useShaderProgram finishes a pending load.
+    void beginLoad(std::string vertexShaderFileName, std::string fragmentShaderFileName, std::string defines = "");
+    //an empty geometryShaderFileName means no geometry stage
+    void beginLoad(std::string vertexShaderFileName, std::string geometryShaderFileName, std::string fragmentShaderFileName, std::string defines);
+    void finishLoad();
+    bool isLoadPending();
+    //true when finishLoad() will not block, always true without KHR_parallel_shader_compile (nothing to ask)
+    bool isLoadComplete();
 
 private:
+    //shared so copies of the shader (it is passed around by value) see the load finished only once
+    std::shared_ptr<PendingShaderLoad> pending;
+
     std::string readShaderFile(std::string fileName);
+    std::string injectDefines(const std::string& source, const std::string& defines);
+    void submitCompile(PendingShaderLoad& load);
     void shaderCompileLog(GLuint shaderId);
-    void shaderLinkLog(GLuint shaderProgramId);
+    bool shaderLinkLog(GLuint shaderProgramId);
+
+    //program binary cache, one file per shader files/defines combination stored next to the vertex shader
+    std::string cacheFileName(const PendingShaderLoad& load, const std::string& defines);
+    unsigned long long cacheKey(const PendingShaderLoad& load, const std::string& defines);
+    bool submitProgramBinary(const std::string& fileName, unsigned long long key);
+    void saveProgramBinary(const std::string& fileName, unsigned long long key);
 };
 
 }
@@ -0,0 +1,49 @@
+#include "ShaderBatch.hpp"
+
+namespace gps {
+
+    void ShaderBatch::enableParallelCompile()
+    {
+        if (GLEW_KHR_parallel_shader_compile) {
+            //0xFFFFFFFF means implementation specific maximum
+            glMaxShaderCompilerThreadsKHR(0xFFFFFFFFu);
+            std::cout << "Parallel shader compile enabled" << std::endl;
+        } else {
+            std::cout << "KHR_parallel_shader_compile not available, shaders finish at first use" << std::endl;
+        }
+    }
+
+    void ShaderBatch::add(gps::Shader& shader, std::string vertexShaderFileName, std::string fragmentShaderFileName, std::string defines)
+    {
+        shader.beginLoad(vertexShaderFileName, fragmentShaderFileName, defines);
+        this->shaders.push_back(&shader);
+    }
+
+    void ShaderBatch::add(gps::Shader& shader, std::string vertexShaderFileName, std::string geometryShaderFileName, std::string fragmentShaderFileName, std::string defines)
+    {
+        shader.beginLoad(vertexShaderFileName, geometryShaderFileName, fragmentShaderFileName, defines);
+        this->shaders.push_back(&shader);
+    }
+
+    size_t ShaderBatch::poll()
+    {
+        size_t pending = 0;
+        for (size_t i = 0; i < this->shaders.size(); i++) {
+            if (!this->shaders[i]->isLoadPending())
+                continue;
+            //without the extension we can't tell, so leave it for its first use
+            if (GLEW_KHR_parallel_shader_compile && this->shaders[i]->isLoadComplete())
+                this->shaders[i]->finishLoad();
+            else
+                pending++;
+        }
+        return pending;
+    }
+
+    void ShaderBatch::finish()
+    {
+        for (size_t i = 0; i < this->shaders.size(); i++)
+            this->shaders[i]->finishLoad();
+        this->shaders.clear();
+    }
+}
@@ -0,0 +1,36 @@
+#ifndef ShaderBatch_hpp
+#define ShaderBatch_hpp
+
+#include <GL/glew.h>
+
+#include "Shader.hpp"
+
+#include <string>
+#include <vector>
+
+namespace gps {
+
+// Submits the compile and link of several programs up front so the driver can work on them
+// (in its own threads with KHR_parallel_shader_compile) while the CPU loads models and textures.
+// Nothing here waits unless asked to, a program still pending at its first use is finished there.
+class ShaderBatch
+{
+public:
+    //lets the driver use as many compiler threads as it wants, call once after the context is created
+    static void enableParallelCompile();
+
+    //the shader object must outlive the batch
+    void add(gps::Shader& shader, std::string vertexShaderFileName, std::string fragmentShaderFileName, std::string defines = "");
+    void add(gps::Shader& shader, std::string vertexShaderFileName, std::string geometryShaderFileName, std::string fragmentShaderFileName, std::string defines);
+    //finishes the programs that are already done without blocking, returns how many are still pending
+    size_t poll();
+    //blocks until every program is finished
+    void finish();
+
+private:
+    std::vector<gps::Shader*> shaders;
+};
+
+}
+
+#endif /* ShaderBatch_hpp */
@@ -0,0 +1,98 @@
+#include "ShaderVariants.hpp"
+
+namespace gps {
+
+    void ShaderVariants::init(std::string vertexShaderFileName, std::string fragmentShaderFileName, GLint pcfTaps,
+        std::function<void(gps::Shader&)> onFirstUse)
+    {
+        this->vertexShaderFileName = vertexShaderFileName;
+        this->fragmentShaderFileName = fragmentShaderFileName;
+        this->pcfTaps = pcfTaps;
+        this->onFirstUse = onFirstUse;
+        this->variants.clear();
+    }
+
+    unsigned int ShaderVariants::normalize(unsigned int features)
+    {
+        features &= ALL_FEATURES;
+        if (!(features & FEATURE_SHADOWS))
+            features &= ~FEATURE_PCF;
+        if (!(features & FEATURE_POINT_LIGHTS))
+            features &= ~FEATURE_CLUSTERED;
+        return features;
+    }
+
+    std::string ShaderVariants::describe(unsigned int features)
+    {
+        static const char* names[] = { "FOG", "SHADOWS", "SPECULAR_MAP", "PCF", "POINT_LIGHTS", "CLUSTERED" };
+
+        std::string description;
+        for (int i = 0; i < 6; i++) {
+            if (!(features & (1u << i)))
+                continue;
+            if (!description.empty())
+                description += "|";
+            description += names[i];
+        }
+        return description.empty() ? "none" : description;
+    }
+
+    std::string ShaderVariants::definesFor(unsigned int features)
+    {
+        std::stringstream defines;
+        if (features & FEATURE_FOG)
+            defines << "#define FOG\n";
+        if (features & FEATURE_SHADOWS)
+            defines << "#define SHADOWS\n";
+        if (features & FEATURE_SPECULAR_MAP)
+            defines << "#define SPECULAR_MAP\n";
+        if (features & FEATURE_PCF)
+            defines << "#define PCF_TAPS " << this->pcfTaps << "\n";
+        if (features & FEATURE_POINT_LIGHTS)
+            defines << "#define POINT_LIGHTS\n";
+        if (features & FEATURE_CLUSTERED)
+            defines << "#define CLUSTERED\n";
+        return defines.str();
+    }
+
+    void ShaderVariants::prepare(gps::ShaderBatch& batch, unsigned int features)
+    {
+        features = normalize(features);
+        if (this->variants.count(features))
+            return;
+
+        Variant& variant = this->variants[features];
+        variant.configured = false;
+        batch.add(variant.shader, this->vertexShaderFileName, this->fragmentShaderFileName, definesFor(features));
+    }
+
+    void ShaderVariants::prepareAll(gps::ShaderBatch& batch, unsigned int features)
+    {
+        //every subset of the requested bits
+        for (unsigned int subset = 0; subset <= ALL_FEATURES; subset++)
+            if ((subset & features) == subset && normalize(subset) == subset)
+                prepare(batch, subset);
+    }
+
+    gps::Shader& ShaderVariants::use(unsigned int features)
+    {
+        features = normalize(features);
+
+        std::map<unsigned int, Variant>::iterator it = this->variants.find(features);
+        if (it == this->variants.end()) {
+            //never prepared, pay for the compile right here
+            it = this->variants.insert(std::make_pair(features, Variant())).first;
+            it->second.configured = false;
+            it->second.shader.loadShader(this->vertexShaderFileName, this->fragmentShaderFileName, definesFor(features));
+        }
+
+        Variant& variant = it->second;
+        variant.shader.useShaderProgram();
+        if (!variant.configured) {
+            if (this->onFirstUse)
+                this->onFirstUse(variant.shader);
+            variant.configured = true;
+        }
+        return variant.shader;
+    }
+}
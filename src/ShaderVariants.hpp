@@ -0,0 +1,66 @@
+#ifndef ShaderVariants_hpp
+#define ShaderVariants_hpp
+
+#include <GL/glew.h>
+
+#include "Shader.hpp"
+#include "ShaderBatch.hpp"
+
+#include <functional>
+#include <map>
+#include <string>
+
+namespace gps {
+
+// Compile-time features of a program, each one becomes a #define in both stages
+enum ShaderFeature {
+    FEATURE_FOG = 1 << 0,          // FOG
+    FEATURE_SHADOWS = 1 << 1,      // SHADOWS
+    FEATURE_SPECULAR_MAP = 1 << 2, // SPECULAR_MAP
+    FEATURE_PCF = 1 << 3,          // PCF_TAPS <n>, only together with SHADOWS
+    FEATURE_POINT_LIGHTS = 1 << 4, // POINT_LIGHTS
+    FEATURE_CLUSTERED = 1 << 5     // CLUSTERED, point lights from the cluster grid, only together with POINT_LIGHTS
+};
+
+// All the permutations of one vertex/fragment pair, built on demand and cached by feature bitmask.
+// Callers ask for exactly the features a draw needs, so no program pays for a branch or sampler it doesn't use.
+class ShaderVariants
+{
+public:
+    static const unsigned int ALL_FEATURES = FEATURE_FOG | FEATURE_SHADOWS | FEATURE_SPECULAR_MAP | FEATURE_PCF | FEATURE_POINT_LIGHTS | FEATURE_CLUSTERED;
+
+    //onFirstUse runs once per variant, after it is linked and bound (uniform block bindings, sampler units)
+    void init(std::string vertexShaderFileName, std::string fragmentShaderFileName, GLint pcfTaps,
+        std::function<void(gps::Shader&)> onFirstUse);
+
+    //submits the compile of a variant without waiting for it
+    void prepare(gps::ShaderBatch& batch, unsigned int features);
+    //submits every valid combination of the given features
+    void prepareAll(gps::ShaderBatch& batch, unsigned int features = ALL_FEATURES);
+
+    //returns the variant, bound and ready to draw with (compiles it now if it was never prepared)
+    gps::Shader& use(unsigned int features);
+
+    //drops combinations that make no sense (PCF without shadows, clusters without point lights)
+    static unsigned int normalize(unsigned int features);
+    //"FOG|SHADOWS", "none" for the base program
+    static std::string describe(unsigned int features);
+
+private:
+    struct Variant {
+        gps::Shader shader;
+        bool configured;
+    };
+
+    std::string vertexShaderFileName;
+    std::string fragmentShaderFileName;
+    GLint pcfTaps;
+    std::function<void(gps::Shader&)> onFirstUse;
+    std::map<unsigned int, Variant> variants;
+
+    std::string definesFor(unsigned int features);
+};
+
+}
+
+#endif /* ShaderVariants_hpp */
@@ -0,0 +1,328 @@
+#include "ShadowCascades.hpp"
+#include "GLState.hpp"
+
+#include <glm/gtc/matrix_transform.hpp>
+
+#include <cmath>
+#include <iostream>
+
+namespace gps {
+
+    // mix between logarithmic (1) and uniform (0) split distances
+    static const GLfloat SPLIT_LAMBDA = 0.75f;
+    // same world space bias as the old single map: 0.005 of its 20 units depth range
+    static const GLfloat WORLD_DEPTH_BIAS = 0.1f;
+    // fitted spheres are this much larger than the slice, so small camera moves don't force a refit
+    static const GLfloat FIT_MARGIN = 1.1f;
+
+    GLuint ShadowCascades::createDepthArray()
+    {
+        GLuint texture;
+        glGenTextures(1, &texture);
+        GLState::bindTexture(GL_TEXTURE_2D_ARRAY, texture);
+        glTexImage3D(GL_TEXTURE_2D_ARRAY, 0, GL_DEPTH_COMPONENT, this->resolution, this->resolution, this->cascadeCount,
+            0, GL_DEPTH_COMPONENT, GL_FLOAT, NULL);
+        glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+        glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+        float borderColor[] = { 1.0f, 1.0f, 1.0f, 1.0f };
+        glTexParameterfv(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_BORDER_COLOR, borderColor);
+        glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_BORDER);
+        glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_BORDER);
+        return texture;
+    }
+
+    void ShadowCascades::createLayerFramebuffers(GLuint texture, GLuint* framebuffers)
+    {
+        glGenFramebuffers(this->cascadeCount, framebuffers);
+        for (int i = 0; i < this->cascadeCount; i++) {
+            GLState::bindFramebuffer(framebuffers[i]);
+            glFramebufferTextureLayer(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, texture, 0, i);
+            glDrawBuffer(GL_NONE);
+            glReadBuffer(GL_NONE);
+        }
+    }
+
+    void ShadowCascades::init(int cascadeCount, GLsizei resolution, GLfloat shadowDistance)
+    {
+        this->cascadeCount = glm::clamp(cascadeCount, 1, MAX_SHADOW_CASCADES);
+        this->resolution = resolution;
+        this->shadowDistance = shadowDistance;
+        this->splits = glm::vec4(0.0f);
+        this->depthBias = glm::vec4(0.0f);
+        this->nextRefit = 0;
+        this->refreshMask = 0;
+        setLightChangeThreshold(1.0f);
+        setCascadeUpdatesPerFrame(1);
+        invalidateStatic();
+
+        this->depthTexture = createDepthArray();
+        this->staticDepthTexture = createDepthArray();
+
+        // attaching a whole array makes the framebuffer layered, gl_Layer picks the cascade
+        glGenFramebuffers(1, &this->framebuffer);
+        GLState::bindFramebuffer(this->framebuffer);
+        glFramebufferTexture(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, this->depthTexture, 0);
+        glDrawBuffer(GL_NONE);
+        glReadBuffer(GL_NONE);
+        if (glCheckFramebufferStatus(GL_FRAMEBUFFER) != GL_FRAMEBUFFER_COMPLETE)
+            std::cout << "Shadow cascade framebuffer is incomplete" << std::endl;
+
+        glGenFramebuffers(1, &this->staticFramebuffer);
+        GLState::bindFramebuffer(this->staticFramebuffer);
+        glFramebufferTexture(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, this->staticDepthTexture, 0);
+        glDrawBuffer(GL_NONE);
+        glReadBuffer(GL_NONE);
+        // nothing static is drawn yet, start from the far plane
+        glClear(GL_DEPTH_BUFFER_BIT);
+
+        createLayerFramebuffers(this->depthTexture, this->layerFramebuffers);
+        createLayerFramebuffers(this->staticDepthTexture, this->staticLayerFramebuffers);
+
+        GLState::bindFramebuffer(0);
+
+        glGenQueries(4, &this->queries[0][0]);
+        for (int i = 0; i < 2; i++)
+            this->queryIssued[i][0] = this->queryIssued[i][1] = false;
+        this->frameParity = 0;
+        this->pending[0] = this->pending[1] = this->lastFrame = this->total = ShadowStats();
+
+        std::cout << "Shadow maps: " << this->cascadeCount << " cascades of " << resolution << "x" << resolution
+            << " (" << (this->cascadeCount * resolution * resolution) / 1024 << "K texels) up to " << shadowDistance << " units" << std::endl;
+    }
+
+    void ShadowCascades::setLightChangeThreshold(GLfloat degrees)
+    {
+        this->lightChangeCos = cosf(glm::radians(degrees));
+    }
+
+    void ShadowCascades::setCascadeUpdatesPerFrame(int count)
+    {
+        this->cascadeUpdatesPerFrame = glm::max(count, 1);
+    }
+
+    void ShadowCascades::invalidateStatic()
+    {
+        for (int i = 0; i < MAX_SHADOW_CASCADES; i++)
+            this->fitted[i] = false;
+    }
+
+    void ShadowCascades::fitCascade(int cascade, const glm::vec3& center, GLfloat radius, const glm::vec3& lightDir)
+    {
+        glm::vec3 up = fabsf(lightDir.y) > 0.99f ? glm::vec3(0.0f, 0.0f, 1.0f) : glm::vec3(0.0f, 1.0f, 0.0f);
+        glm::mat4 lightView = glm::lookAt(center + lightDir * radius, center, up);
+        // casters in front of the near plane are kept by depth clamping in the shadow pass
+        glm::mat4 lightProjection = glm::ortho(-radius, radius, -radius, radius, 0.0f, 2.0f * radius);
+
+        // move the projection so the world origin falls on a texel corner, whole texel steps only
+        glm::mat4 lightSpaceTrMatrix = lightProjection * lightView;
+        glm::vec4 origin = lightSpaceTrMatrix * glm::vec4(0.0f, 0.0f, 0.0f, 1.0f);
+        GLfloat texelsPerUnit = this->resolution * 0.5f;
+        glm::vec2 originTexels = glm::vec2(origin.x, origin.y) * texelsPerUnit;
+        glm::vec2 offset = (glm::vec2(floorf(originTexels.x + 0.5f), floorf(originTexels.y + 0.5f)) - originTexels) / texelsPerUnit;
+        lightProjection[3][0] += offset.x;
+        lightProjection[3][1] += offset.y;
+
+        this->lightSpaceTrMatrices[cascade] = lightProjection * lightView;
+        this->depthBias[cascade] = WORLD_DEPTH_BIAS / (2.0f * radius);
+        this->fitted[cascade] = true;
+        this->fittedCenter[cascade] = center;
+        this->fittedRadius[cascade] = radius;
+        this->fittedLightDir[cascade] = lightDir;
+        this->refreshMask |= 1 << cascade;
+    }
+
+    void ShadowCascades::update(const glm::mat4& view, GLfloat fovy, GLfloat aspect, GLfloat zNear, const glm::vec3& lightDir)
+    {
+        collectQueries();
+
+        glm::mat4 inverseView = glm::inverse(view);
+        glm::vec3 lightDirN = glm::normalize(lightDir);
+        GLfloat tanHalfFovy = tanf(fovy * 0.5f);
+
+        glm::vec3 centers[MAX_SHADOW_CASCADES];
+        GLfloat radii[MAX_SHADOW_CASCADES];
+        bool stale[MAX_SHADOW_CASCADES];
+
+        GLfloat sliceNear = zNear;
+        for (int i = 0; i < this->cascadeCount; i++) {
+            // practical split scheme
+            GLfloat fraction = (GLfloat)(i + 1) / this->cascadeCount;
+            GLfloat logSplit = zNear * powf(this->shadowDistance / zNear, fraction);
+            GLfloat uniformSplit = zNear + (this->shadowDistance - zNear) * fraction;
+            GLfloat sliceFar = SPLIT_LAMBDA * logSplit + (1.0f - SPLIT_LAMBDA) * uniformSplit;
+            this->splits[i] = sliceFar;
+
+            // bounding sphere of the slice corners in world space, it doesn't change size when the camera turns
+            glm::vec3 corners[8];
+            glm::vec3 center(0.0f);
+            for (int c = 0; c < 8; c++) {
+                GLfloat z = (c < 4) ? sliceNear : sliceFar;
+                GLfloat y = ((c & 1) ? 1.0f : -1.0f) * z * tanHalfFovy;
+                GLfloat x = ((c & 2) ? 1.0f : -1.0f) * z * tanHalfFovy * aspect;
+                corners[c] = glm::vec3(inverseView * glm::vec4(x, y, -z, 1.0f));
+                center += corners[c];
+            }
+            center /= 8.0f;
+            GLfloat radius = 0.0f;
+            for (int c = 0; c < 8; c++)
+                radius = glm::max(radius, glm::length(corners[c] - center));
+            centers[i] = center;
+            radii[i] = ceilf(radius * FIT_MARGIN * 16.0f) / 16.0f;
+
+            stale[i] = !this->fitted[i] ||
+                glm::dot(lightDirN, this->fittedLightDir[i]) < this->lightChangeCos ||
+                glm::length(center - this->fittedCenter[i]) + radius > this->fittedRadius[i];
+
+            sliceNear = sliceFar;
+        }
+
+        // cascades that were never drawn can't wait, the others take turns
+        int budget = this->cascadeUpdatesPerFrame;
+        GLint refitNow = 0;
+        for (int i = 0; i < this->cascadeCount; i++) {
+            if (stale[i] && !this->fitted[i]) {
+                fitCascade(i, centers[i], radii[i], lightDirN);
+                refitNow |= 1 << i;
+            }
+        }
+        for (int n = 0; n < this->cascadeCount && budget > 0; n++) {
+            int i = (this->nextRefit + n) % this->cascadeCount;
+            if (stale[i] && !(refitNow & (1 << i))) {
+                fitCascade(i, centers[i], radii[i], lightDirN);
+                this->nextRefit = (i + 1) % this->cascadeCount;
+                budget--;
+            }
+        }
+    }
+
+    void ShadowCascades::collectQueries()
+    {
+        // the frame before the last one, a frame in between is normally enough for its results to be ready
+        int previous = this->frameParity ^ 1;
+        ShadowStats& stats = this->pending[previous];
+        // reading a result that isn't there yet would stall, the slot is reused right away so the frame is dropped instead
+        for (int q = 0; q < 2; q++) {
+            if (!this->queryIssued[previous][q])
+                continue;
+            GLint available = 0;
+            glGetQueryObjectiv(this->queries[previous][q], GL_QUERY_RESULT_AVAILABLE, &available);
+            if (!available)
+                stats.droppedFrames = 1;
+        }
+        for (int q = 0; q < 2; q++) {
+            if (!this->queryIssued[previous][q])
+                continue;
+            this->queryIssued[previous][q] = false;
+            if (stats.droppedFrames)
+                continue;
+            GLuint64 samples = 0;
+            glGetQueryObjectui64v(this->queries[previous][q], GL_QUERY_RESULT, &samples);
+            if (q == 0)
+                stats.staticTexels = samples;
+            else
+                stats.dynamicTexels = samples;
+        }
+        this->total.staticTexels += stats.staticTexels;
+        this->total.dynamicTexels += stats.dynamicTexels;
+        this->total.droppedFrames += stats.droppedFrames;
+        this->lastFrame = stats;
+
+        // its slot is reused by the frame that starts now
+        stats = ShadowStats();
+        this->frameParity = previous;
+    }
+
+    void ShadowCascades::beginStaticPass()
+    {
+        for (int i = 0; i < this->cascadeCount; i++) {
+            if (this->refreshMask & (1 << i)) {
+                GLState::bindFramebuffer(this->staticLayerFramebuffers[i]);
+                glClear(GL_DEPTH_BUFFER_BIT);
+                this->pending[this->frameParity].cascadesRefreshed++;
+                this->total.cascadesRefreshed++;
+            }
+        }
+        GLState::bindFramebuffer(this->staticFramebuffer);
+        glBeginQuery(GL_SAMPLES_PASSED, this->queries[this->frameParity][0]);
+    }
+
+    void ShadowCascades::endStaticPass()
+    {
+        // the refitted layers are drawn, refits while no static pass ran (shadows off) stayed in the mask until now
+        this->refreshMask = 0;
+        glEndQuery(GL_SAMPLES_PASSED);
+        this->queryIssued[this->frameParity][0] = true;
+    }
+
+    void ShadowCascades::beginDynamicPass()
+    {
+        // the static depth is the starting point of every layer
+        for (int i = 0; i < this->cascadeCount; i++) {
+            GLState::bindFramebuffers(this->staticLayerFramebuffers[i], this->layerFramebuffers[i]);
+            glBlitFramebuffer(0, 0, this->resolution, this->resolution, 0, 0, this->resolution, this->resolution,
+                GL_DEPTH_BUFFER_BIT, GL_NEAREST);
+        }
+        unsigned long long copied = (unsigned long long)this->cascadeCount * this->resolution * this->resolution;
+        this->pending[this->frameParity].copiedTexels += copied;
+        this->total.copiedTexels += copied;
+
+        GLState::bindFramebuffer(this->framebuffer);
+        glBeginQuery(GL_SAMPLES_PASSED, this->queries[this->frameParity][1]);
+    }
+
+    void ShadowCascades::endDynamicPass()
+    {
+        glEndQuery(GL_SAMPLES_PASSED);
+        this->queryIssued[this->frameParity][1] = true;
+    }
+
+    GLint ShadowCascades::getStaticRefreshMask()
+    {
+        return this->refreshMask;
+    }
+
+    int ShadowCascades::getCascadeCount()
+    {
+        return this->cascadeCount;
+    }
+
+    GLint ShadowCascades::getAllCascadesMask()
+    {
+        return (1 << this->cascadeCount) - 1;
+    }
+
+    GLsizei ShadowCascades::getResolution()
+    {
+        return this->resolution;
+    }
+
+    GLuint ShadowCascades::getDepthTexture()
+    {
+        return this->depthTexture;
+    }
+
+    const glm::mat4* ShadowCascades::getLightSpaceTrMatrices()
+    {
+        return this->lightSpaceTrMatrices;
+    }
+
+    glm::vec4 ShadowCascades::getSplits()
+    {
+        return this->splits;
+    }
+
+    glm::vec4 ShadowCascades::getDepthBias()
+    {
+        return this->depthBias;
+    }
+
+    ShadowStats ShadowCascades::getFrameStats()
+    {
+        return this->lastFrame;
+    }
+
+    ShadowStats ShadowCascades::getTotalStats()
+    {
+        return this->total;
+    }
+}
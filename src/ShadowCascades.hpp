@@ -0,0 +1,114 @@
+#ifndef ShadowCascades_hpp
+#define ShadowCascades_hpp
+
+#include <GL/glew.h>
+#include <glm/glm.hpp>
+
+namespace gps {
+
+// the FrameData block and shadow.geom are sized for this many cascades
+const int MAX_SHADOW_CASCADES = 4;
+
+struct ShadowStats {
+    unsigned int cascadesRefreshed;     // static layers re-rendered
+    unsigned long long staticTexels;    // depth samples written by static casters
+    unsigned long long dynamicTexels;   // depth samples written by dynamic casters
+    unsigned long long copiedTexels;    // static layers copied under the dynamic casters
+    unsigned int droppedFrames;         // frames whose sample counts weren't back when they were collected
+};
+
+// Directional light shadow maps split along the camera frustum.
+// Each cascade gets an orthographic projection around the bounding sphere of its slice of the frustum,
+// snapped to whole shadow texels so the map doesn't shimmer while the camera moves.
+// All cascades are layers of one depth texture array, rendered in a single layered pass (see shadow.geom).
+//
+// Static casters are kept in a second array that is only re-rendered when a cascade has to be refit:
+// the light turned past a threshold or the camera slice left the (slightly padded) fitted sphere.
+// Refits beyond the first one are spread round-robin over the next frames, a waiting cascade keeps its
+// old projection so its static layer stays valid. Every frame the static layers are copied into the
+// shadow map and the dynamic casters are drawn on top.
+class ShadowCascades
+{
+public:
+    //creates the depth texture arrays and framebuffers
+    void init(int cascadeCount, GLsizei resolution, GLfloat shadowDistance);
+    //refits the cascades that need it (fovy in radians), lightDir points towards the light
+    void update(const glm::mat4& view, GLfloat fovy, GLfloat aspect, GLfloat zNear, const glm::vec3& lightDir);
+
+    //light rotation (degrees) that forces the static layers to be redrawn
+    void setLightChangeThreshold(GLfloat degrees);
+    //how many already valid cascades may be refit in one frame
+    void setCascadeUpdatesPerFrame(int count);
+    //static casters moved, redraw every static layer
+    void invalidateStatic();
+
+    //cascades refitted since the last static pass, whose static layer must be re-rendered, bit i = cascade i
+    GLint getStaticRefreshMask();
+    //binds the static array and clears the layers in the refresh mask, draw the static casters after it
+    void beginStaticPass();
+    //clears the refresh mask
+    void endStaticPass();
+    //copies the static layers into the shadow map and binds it, draw the dynamic casters after it
+    void beginDynamicPass();
+    void endDynamicPass();
+
+    int getCascadeCount();
+    GLint getAllCascadesMask();
+    GLsizei getResolution();
+    GLuint getDepthTexture();
+    const glm::mat4* getLightSpaceTrMatrices();
+    //view space distance where each cascade ends
+    glm::vec4 getSplits();
+    //depth bias of each cascade, in its own [0, 1] depth range
+    glm::vec4 getDepthBias();
+
+    //counters of the last frame whose queries are back, and of the whole run
+    ShadowStats getFrameStats();
+    ShadowStats getTotalStats();
+
+private:
+    int cascadeCount;
+    GLsizei resolution;
+    GLfloat shadowDistance;
+    GLfloat lightChangeCos;
+    int cascadeUpdatesPerFrame;
+    int nextRefit;
+
+    // shadow map sampled by the main pass and its static-only copy
+    GLuint depthTexture;
+    GLuint staticDepthTexture;
+    GLuint framebuffer;
+    GLuint staticFramebuffer;
+    // single layer attachments, for clears and copies
+    GLuint layerFramebuffers[MAX_SHADOW_CASCADES];
+    GLuint staticLayerFramebuffers[MAX_SHADOW_CASCADES];
+
+    glm::mat4 lightSpaceTrMatrices[MAX_SHADOW_CASCADES];
+    glm::vec4 splits;
+    glm::vec4 depthBias;
+
+    // what each cascade is currently fitted to
+    bool fitted[MAX_SHADOW_CASCADES];
+    glm::vec3 fittedCenter[MAX_SHADOW_CASCADES];
+    GLfloat fittedRadius[MAX_SHADOW_CASCADES];
+    glm::vec3 fittedLightDir[MAX_SHADOW_CASCADES];
+    GLint refreshMask;
+
+    // samples passed queries, [frame parity][static/dynamic], read back one frame later
+    GLuint queries[2][2];
+    bool queryIssued[2][2];
+    int frameParity;
+    // counters of the frames whose queries are still in flight
+    ShadowStats pending[2];
+    ShadowStats lastFrame;
+    ShadowStats total;
+
+    GLuint createDepthArray();
+    void createLayerFramebuffers(GLuint texture, GLuint* framebuffers);
+    void fitCascade(int cascade, const glm::vec3& center, GLfloat radius, const glm::vec3& lightDir);
+    void collectQueries();
+};
+
+}
+
+#endif /* ShadowCascades_hpp */
@@ -11,6 +11,7 @@
 
 #include <stdio.h>
 #include "Shader.hpp"
+#include "GLState.hpp"
 #include <vector>
 #include "stb_image.h"
 #include "glm/glm.hpp"
@@ -22,7 +23,8 @@ namespace gps {
     public:
         SkyBox();
         void Load(std::vector<const GLchar*> cubeMapFaces);
-        void Draw(gps::Shader shader, glm::mat4 viewMatrix, glm::mat4 projectionMatrix);
+        // view and projection are read from the shared FrameData uniform block
+        void Draw(gps::Shader shader);
         GLuint GetTextureId();
     private:
         GLuint skyboxVAO;
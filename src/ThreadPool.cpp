@@ -0,0 +1,117 @@
+#include "ThreadPool.hpp"
+#include "CpuProfiler.hpp"
+
+#include <algorithm>
+
+namespace gps {
+
+    ThreadPool::ThreadPool()
+    {
+        this->job = NULL;
+        this->count = 0;
+        this->chunkCount = 0;
+        this->nextChunk = 0;
+        this->finishedChunks = 0;
+        this->generation = 0;
+        this->stopping = false;
+    }
+
+    ThreadPool::~ThreadPool()
+    {
+        {
+            std::lock_guard<std::mutex> lock(this->mutex);
+            this->stopping = true;
+        }
+        this->wake.notify_all();
+        for (size_t i = 0; i < this->workers.size(); i++)
+            this->workers[i].join();
+    }
+
+    void ThreadPool::init(int threadCount)
+    {
+        if (!this->workers.empty())
+            return;
+        if (threadCount <= 0)
+            threadCount = std::max(1, (int)std::thread::hardware_concurrency());
+        for (int i = 1; i < threadCount; i++)
+            this->workers.push_back(std::thread(&ThreadPool::workerLoop, this));
+    }
+
+    int ThreadPool::getThreadCount()
+    {
+        return (int)this->workers.size() + 1;
+    }
+
+    void ThreadPool::parallelFor(int count, const std::function<void(int, int)>& job, int minChunk)
+    {
+        if (count <= 0)
+            return;
+
+        int chunkCount = std::min(getThreadCount(), (count + minChunk - 1) / std::max(minChunk, 1));
+        if (chunkCount <= 1) {
+            // not worth waking anyone
+            job(0, count);
+            return;
+        }
+
+        {
+            std::lock_guard<std::mutex> lock(this->mutex);
+            this->job = &job;
+            this->count = count;
+            this->chunkCount = chunkCount;
+            this->nextChunk = 0;
+            this->finishedChunks = 0;
+            this->generation++;
+        }
+        this->wake.notify_all();
+
+        runChunks();
+
+        std::unique_lock<std::mutex> lock(this->mutex);
+        this->done.wait(lock, [this] { return this->finishedChunks == this->chunkCount; });
+        this->job = NULL;
+    }
+
+    // takes chunks of the current job until there are none left
+    void ThreadPool::runChunks()
+    {
+        while (true) {
+            int chunk;
+            const std::function<void(int, int)>* job;
+            {
+                std::lock_guard<std::mutex> lock(this->mutex);
+                if (this->job == NULL || this->nextChunk >= this->chunkCount)
+                    return;
+                chunk = this->nextChunk++;
+                job = this->job;
+            }
+
+            int begin = (int)((long long)this->count * chunk / this->chunkCount);
+            int end = (int)((long long)this->count * (chunk + 1) / this->chunkCount);
+            {
+                gps::CpuZone zone("ThreadPool chunk");
+                (*job)(begin, end);
+            }
+
+            std::lock_guard<std::mutex> lock(this->mutex);
+            if (++this->finishedChunks == this->chunkCount)
+                this->done.notify_one();
+        }
+    }
+
+    void ThreadPool::workerLoop()
+    {
+        gps::CpuProfiler::setThreadName("worker");
+        unsigned long long seenGeneration = 0;
+        while (true) {
+            {
+                std::unique_lock<std::mutex> lock(this->mutex);
+                this->wake.wait(lock, [&] { return this->stopping || this->generation != seenGeneration; });
+                if (this->stopping)
+                    return;
+                seenGeneration = this->generation;
+            }
+            runChunks();
+        }
+    }
+}
@@ -0,0 +1,49 @@
+#ifndef ThreadPool_hpp
+#define ThreadPool_hpp
+
+#include <condition_variable>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace gps {
+
+// Fixed set of worker threads for data parallel frame work.
+// parallelFor splits a range into one chunk per thread, the calling thread works on a chunk too
+// and the call returns once every chunk is done. Jobs must not call parallelFor themselves.
+class ThreadPool
+{
+public:
+    ThreadPool();
+    ~ThreadPool();
+
+    //starts threadCount - 1 workers, 0 picks one thread per hardware thread
+    void init(int threadCount = 0);
+    //runs job(begin, end) over [0, count), chunks are never smaller than minChunk items
+    void parallelFor(int count, const std::function<void(int, int)>& job, int minChunk = 1);
+    //workers + the calling thread
+    int getThreadCount();
+
+private:
+    std::vector<std::thread> workers;
+    std::mutex mutex;
+    std::condition_variable wake;
+    std::condition_variable done;
+
+    // current job, one chunk per thread
+    const std::function<void(int, int)>* job;
+    int count;
+    int chunkCount;
+    int nextChunk;
+    int finishedChunks;
+    unsigned long long generation;
+    bool stopping;
+
+    void workerLoop();
+    void runChunks();
+};
+
+}
+
+#endif /* ThreadPool_hpp */
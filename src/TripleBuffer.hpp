@@ -0,0 +1,53 @@
+#ifndef TripleBuffer_hpp
+#define TripleBuffer_hpp
+
+#include <atomic>
+
+namespace gps {
+
+// Hands values from one writer thread to one reader thread without locks or waiting.
+// The writer fills writeBuffer() and publishes it, the reader picks up the newest published value with update();
+// values published in between are skipped. Each side owns one slot, the third is swapped through an atomic.
+template <typename T>
+class TripleBuffer
+{
+public:
+    TripleBuffer() : shared(1), writeIndex(0), readIndex(2) {}
+
+    //writer side
+    T& writeBuffer() {
+        return slots[writeIndex];
+    }
+
+    void publish() {
+        unsigned int previous = shared.exchange(writeIndex | FRESH, std::memory_order_acq_rel);
+        writeIndex = previous & INDEX_MASK;
+    }
+
+    //reader side, true when a value newer than readBuffer() was published
+    bool update() {
+        if ((shared.load(std::memory_order_relaxed) & FRESH) == 0)
+            return false;
+        unsigned int previous = shared.exchange(readIndex, std::memory_order_acq_rel);
+        readIndex = previous & INDEX_MASK;
+        return true;
+    }
+
+    const T& readBuffer() const {
+        return slots[readIndex];
+    }
+
+private:
+    static const unsigned int INDEX_MASK = 3;
+    static const unsigned int FRESH = 4;
+
+    T slots[3];
+    // index of the slot in the middle, FRESH while the reader hasn't taken it
+    std::atomic<unsigned int> shared;
+    unsigned int writeIndex;
+    unsigned int readIndex;
+};
+
+}
+
+#endif /* TripleBuffer_hpp */
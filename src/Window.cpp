@@ -1,8 +1,19 @@
 #include "Window.h"
 
+#if defined(__linux__)
+#define GPS_SURFACELESS_EGL
+#include <EGL/egl.h>
+#include <EGL/eglext.h>
+#endif
+
 namespace gps {
 
     void Window::Create(int width, int height, const char *title) {
+        this->headless = false;
+        this->eglDisplay = NULL;
+        this->eglContext = NULL;
+        this->framebuffer = 0;
+
         if (!glfwInit()) {
             throw std::runtime_error("Could not start GLFW3!");
         }
@@ -28,6 +39,95 @@ namespace gps {
 
         glfwSwapInterval(1);
 
+        InitGLEW();
+
+        //for RETINA display
+        glfwGetFramebufferSize(window, &this->dimensions.width, &this->dimensions.height);
+    }
+
+    void Window::CreateHeadless(int width, int height) {
+        this->headless = true;
+        this->window = NULL;
+        this->eglDisplay = NULL;
+        this->eglContext = NULL;
+
+        if (!CreateSurfacelessContext()) {
+            // no EGL here, a window that is never shown does the same job
+            if (!glfwInit()) {
+                throw std::runtime_error("Could not start GLFW3!");
+            }
+            glfwWindowHint(GLFW_CONTEXT_VERSION_MAJOR, 4);
+            glfwWindowHint(GLFW_CONTEXT_VERSION_MINOR, 1);
+            glfwWindowHint(GLFW_OPENGL_FORWARD_COMPAT, GL_TRUE);
+            glfwWindowHint(GLFW_OPENGL_PROFILE, GLFW_OPENGL_CORE_PROFILE);
+            glfwWindowHint(GLFW_VISIBLE, GLFW_FALSE);
+
+            this->window = glfwCreateWindow(width, height, "OpenGL Project (headless)", NULL, NULL);
+            if (!this->window) {
+                throw std::runtime_error("Could not create a headless OpenGL context!");
+            }
+            glfwMakeContextCurrent(window);
+            glfwSwapInterval(0);
+        }
+
+        InitGLEW();
+
+        this->dimensions.width = width;
+        this->dimensions.height = height;
+        CreateOffscreenFramebuffer();
+    }
+
+    // Mesa's surfaceless platform needs neither a display server nor a GPU (llvmpipe)
+    bool Window::CreateSurfacelessContext() {
+#ifdef GPS_SURFACELESS_EGL
+        PFNEGLGETPLATFORMDISPLAYEXTPROC getPlatformDisplay =
+            (PFNEGLGETPLATFORMDISPLAYEXTPROC)eglGetProcAddress("eglGetPlatformDisplayEXT");
+        if (getPlatformDisplay == NULL)
+            return false;
+        EGLDisplay display = getPlatformDisplay(EGL_PLATFORM_SURFACELESS_MESA, EGL_DEFAULT_DISPLAY, NULL);
+        EGLint major, minor;
+        if (display == EGL_NO_DISPLAY || !eglInitialize(display, &major, &minor))
+            return false;
+
+        const EGLint configAttributes[] = {
+            EGL_SURFACE_TYPE, EGL_PBUFFER_BIT,
+            EGL_RENDERABLE_TYPE, EGL_OPENGL_BIT,
+            EGL_NONE
+        };
+        EGLConfig config;
+        EGLint configCount = 0;
+        if (!eglBindAPI(EGL_OPENGL_API) || !eglChooseConfig(display, configAttributes, &config, 1, &configCount) || configCount == 0) {
+            eglTerminate(display);
+            return false;
+        }
+
+        const EGLint contextAttributes[] = {
+            EGL_CONTEXT_MAJOR_VERSION, 4,
+            EGL_CONTEXT_MINOR_VERSION, 1,
+            EGL_CONTEXT_OPENGL_PROFILE_MASK, EGL_CONTEXT_OPENGL_CORE_PROFILE_BIT,
+            EGL_NONE
+        };
+        EGLContext context = eglCreateContext(display, config, EGL_NO_CONTEXT, contextAttributes);
+        if (context == EGL_NO_CONTEXT) {
+            eglTerminate(display);
+            return false;
+        }
+        // no surface at all, everything is drawn into the offscreen framebuffer
+        if (!eglMakeCurrent(display, EGL_NO_SURFACE, EGL_NO_SURFACE, context)) {
+            eglDestroyContext(display, context);
+            eglTerminate(display);
+            return false;
+        }
+
+        this->eglDisplay = display;
+        this->eglContext = context;
+        return true;
+#else
+        return false;
+#endif
+    }
+
+    void Window::InitGLEW() {
         // start GLEW extension handler
         glewExperimental = GL_TRUE;
         glewInit();
@@ -37,12 +137,45 @@ namespace gps {
         const GLubyte* version = glGetString(GL_VERSION); // version as a string
         std::cout << "Renderer: " << renderer << std::endl;
         std::cout << "OpenGL version: " << version << std::endl;
+    }
 
-        //for RETINA display
-        glfwGetFramebufferSize(window, &this->dimensions.width, &this->dimensions.height);
+    // same formats as the window: sRGB color, depth and stencil (the overdraw measurement counts in it)
+    void Window::CreateOffscreenFramebuffer() {
+        glGenRenderbuffers(1, &this->colorRenderbuffer);
+        glBindRenderbuffer(GL_RENDERBUFFER, this->colorRenderbuffer);
+        glRenderbufferStorage(GL_RENDERBUFFER, GL_SRGB8_ALPHA8, this->dimensions.width, this->dimensions.height);
+
+        glGenRenderbuffers(1, &this->depthRenderbuffer);
+        glBindRenderbuffer(GL_RENDERBUFFER, this->depthRenderbuffer);
+        glRenderbufferStorage(GL_RENDERBUFFER, GL_DEPTH24_STENCIL8, this->dimensions.width, this->dimensions.height);
+        glBindRenderbuffer(GL_RENDERBUFFER, 0);
+
+        glGenFramebuffers(1, &this->framebuffer);
+        glBindFramebuffer(GL_FRAMEBUFFER, this->framebuffer);
+        glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_RENDERBUFFER, this->colorRenderbuffer);
+        glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_DEPTH_STENCIL_ATTACHMENT, GL_RENDERBUFFER, this->depthRenderbuffer);
+        if (glCheckFramebufferStatus(GL_FRAMEBUFFER) != GL_FRAMEBUFFER_COMPLETE) {
+            throw std::runtime_error("Could not create the offscreen framebuffer!");
+        }
+        glBindFramebuffer(GL_FRAMEBUFFER, 0);
     }
 
     void Window::Delete() {
+        if (framebuffer) {
+            glDeleteFramebuffers(1, &framebuffer);
+            glDeleteRenderbuffers(1, &colorRenderbuffer);
+            glDeleteRenderbuffers(1, &depthRenderbuffer);
+            framebuffer = 0;
+        }
+#ifdef GPS_SURFACELESS_EGL
+        if (eglContext) {
+            eglMakeCurrent((EGLDisplay)eglDisplay, EGL_NO_SURFACE, EGL_NO_SURFACE, EGL_NO_CONTEXT);
+            eglDestroyContext((EGLDisplay)eglDisplay, (EGLContext)eglContext);
+            eglTerminate((EGLDisplay)eglDisplay);
+            eglContext = NULL;
+            eglDisplay = NULL;
+        }
+#endif
         if (window)
             glfwDestroyWindow(window);
         //close GL context and any other GLFW resources
@@ -53,6 +186,14 @@ namespace gps {
         return this->window;
     }
 
+    bool Window::isHeadless() {
+        return this->headless;
+    }
+
+    GLuint Window::getFramebuffer() {
+        return this->framebuffer;
+    }
+
     WindowDimensions Window::getWindowDimensions() {
         return this->dimensions;
     }
@@ -17,15 +17,34 @@ namespace gps {
 
     public:
         void Create(int width=800, int height=600, const char *title="OpenGL Project");
+        //no window and no vsync: a surfaceless EGL context where available (Mesa), a hidden GLFW window otherwise,
+        //rendering into an offscreen framebuffer of the given size
+        void CreateHeadless(int width, int height);
         void Delete();
 
+        //NULL for the surfaceless EGL context
         GLFWwindow* getWindow();
+        bool isHeadless();
+        //what the frame is rendered into, 0 for the window
+        GLuint getFramebuffer();
         WindowDimensions getWindowDimensions();
         void setWindowDimensions(WindowDimensions dimensions);
 
     private:
         WindowDimensions dimensions;
         GLFWwindow *window;
+
+        bool headless;
+        // EGLDisplay/EGLContext of the surfaceless context, NULL otherwise
+        void *eglDisplay;
+        void *eglContext;
+        GLuint framebuffer;
+        GLuint colorRenderbuffer;
+        GLuint depthRenderbuffer;
+
+        bool CreateSurfacelessContext();
+        void InitGLEW();
+        void CreateOffscreenFramebuffer();
     };
 }
 
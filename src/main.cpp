@@ -10,19 +10,89 @@
 
 #include "Window.h"
 #include "Shader.hpp"
+#include "ShaderBatch.hpp"
+#include "ShaderVariants.hpp"
 #include "Camera.hpp"
 #include "Model3D.hpp"
 #include "SkyBox.hpp"
+#include "GLState.hpp"
+#include "FrameUniforms.hpp"
+#include "ShadowCascades.hpp"
+#include "PointLights.hpp"
+#include "DeferredRenderer.hpp"
+#include "ThreadPool.hpp"
+#include "LightClusters.hpp"
+#include "GpuProfiler.hpp"
+#include "CpuProfiler.hpp"
+#include "InputRecorder.hpp"
+#include "TripleBuffer.hpp"
+#include "DrawList.hpp"
+#include "DrawQueue.hpp"
+#include "OcclusionBuffer.hpp"
+#include "OcclusionQueries.hpp"
+#include "GpuCulling.hpp"
+#include "Bvh.hpp"
+#include "Scene.hpp"
 
 #include <iostream>
+#include <vector>
+#include <cstring>
+#include <cmath>
+#include <cfloat>
+#include <chrono>
+#include <algorithm>
+#include <atomic>
+#include <thread>
+#include <map>
+#include <random>
 
 // structures
 enum SELECTED_OBJECT { TEAPOT, NANOSUIT};
+// shadow map and pre-pass only write depth, the main pass shades
+enum RENDER_PASS { SHADOW_PASS, DEPTH_PREPASS, MAIN_PASS, GBUFFER_PASS };
+
+// everything the renderer reads from the simulation, kept for the last two steps
+struct SimulationSnapshot {
+    // entity poses, indexed like the scene's components. A blended pose has revision NO_REVISION.
+    std::vector<glm::vec3> positions;
+    std::vector<glm::vec3> angles;
+    std::vector<glm::vec3> scales;
+    std::vector<unsigned int> revisions;
+    glm::vec3 cameraPosition;
+    glm::vec3 cameraTarget;
+    glm::vec3 cameraUp;
+    glm::vec3 lightDir;
+    GLfloat lightColorCoeff;
+};
+const unsigned int NO_REVISION = 0;
+
+// what the simulation thread hands to the renderer: its last two steps and when the newer one was taken
+struct SimulationFrame {
+    SimulationSnapshot previous;
+    SimulationSnapshot current;
+    std::chrono::steady_clock::time_point time;
+};
+
+// key state going the other way
+struct InputFrame {
+    GLboolean keys[1024];
+};
+
+// fragments the main pass shaded, counted per pixel in the stencil buffer
+struct OverdrawStats {
+    unsigned long long shadedFragments;
+    unsigned long long coveredPixels;
+    unsigned int maxPerPixel;
+};
 
 // constants
-const unsigned int SHADOW_WIDTH = 2048;
-const unsigned int SHADOW_HEIGHT = 2048;
-const GLfloat near_plane = -10.0f, far_plane = 10.0f;
+// 3 x 1024^2 cascades hold fewer texels than the old single 2048^2 map
+const int SHADOW_CASCADES = 3;
+const GLsizei SHADOW_RESOLUTION = 1024;
+const GLfloat SHADOW_DISTANCE = 30.0f;
+const GLfloat CAMERA_FOV = 45.0f;
+const GLfloat CAMERA_NEAR = 0.1f;
+const GLfloat CAMERA_FAR = 1000.0f;
 
 // window
 gps::Window myWindow;
@@ -31,7 +101,6 @@ gps::Window myWindow;
 glm::mat4 model;
 glm::mat4 view;
 glm::mat4 projection;
-glm::mat3 normalMatrix;
 
 // light parameters
 GLfloat lightRotationY;
@@ -41,23 +110,93 @@ glm::vec3 lightColor;
 GLfloat lightColorCoeff;
 
 // shadow parameters
-GLuint shadowMapFBO;
-GLuint depthMapTexture;
-glm::mat4 lightView;
-glm::mat4 lightProjection;
-glm::mat4 lightSpaceTrMatrix;
+gps::ShadowCascades shadowCascades;
+GLint cascadeMaskLoc;
+// light rotation that redraws the cached static casters, and how many cascades may be redrawn per frame
+const GLfloat SHADOW_LIGHT_THRESHOLD = 1.0f;
+const int SHADOW_CASCADE_UPDATES_PER_FRAME = 1;
 
 // fog parameters
 GLboolean fogEnabled; // I ran out of buttons so I won't bother with making the density and gradient uniforms
 
-// shader uniform locations
-GLint modelLoc;
-GLint viewLoc;
-GLint projectionLoc;
-GLint normalMatrixLoc;
-GLint lightDirLoc;
-GLint lightColorLoc;
-GLint lightSpaceTrMatrixLoc;
+// shadow quality, each combination is its own program variant
+bool shadowsEnabled = true;
+bool pcfEnabled = false;
+GLboolean shadowsKeyDown = false;
+GLboolean pcfKeyDown = false;
+const GLint PCF_TAPS = 9;
+
+// depth-only pass first, the main pass then shades only the visible fragment of each pixel
+bool depthPrepassEnabled = false;
+GLboolean prepassKeyDown = false;
+// counts the main pass fragments per pixel, printed every OVERDRAW_REPORT_FRAMES frames
+bool overdrawMeasurement = false;
+const int OVERDRAW_REPORT_FRAMES = 60;
+int overdrawFrame;
+// held down, key 3 would restart the measurement every frame
+GLboolean overdrawKeyDown = false;
+
+// deferred shading instead of the forward main pass, shares the shadow map
+bool deferredEnabled = false;
+gps::DeferredRenderer deferredRenderer;
+GLboolean deferredKeyDown = false;
+
+// point lights on top of the sun, 4 steps through these counts
+const int POINT_LIGHT_COUNTS[] = { 0, 1, 16, 128, 1024 };
+const int POINT_LIGHT_SETTINGS = 5;
+int pointLightSetting = 0;
+gps::PointLights pointLights;
+// key 4 steps once per press, however long it is held
+GLboolean pointLightKeyDown = false;
+// the composite only cares about the sun, fog and shadows
+const unsigned int DEFERRED_FEATURES = gps::FEATURE_FOG | gps::FEATURE_SHADOWS | gps::FEATURE_PCF;
+
+// clustered forward: fragments only loop over the lights of their froxel, assigned on the worker threads
+bool clusteredEnabled = false;
+GLboolean clusteredKeyDown = false;
+// depth where the last cluster slice starts, it reaches to infinity
+const GLfloat CLUSTER_SLICE_FAR = 100.0f;
+gps::ThreadPool threadPool;
+gps::LightClusters lightClusters;
+
+// GPU time of every pass, read back a few frames late; per-mesh scopes are optional (they add two queries per draw)
+gps::GpuProfiler gpuProfiler;
+GLboolean gpuProfileKeyDown = false;
+bool gpuMeshScopes = false;
+GLboolean meshScopesKeyDown = false;
+
+// CPU zones are always recorded, key 9 writes them out and --cpu-trace <file> does on exit
+const char* CPU_TRACE_FILE = "cpu_trace.json";
+// the trace is written once per press, not on every frame the key stays down
+GLboolean cpuTraceKeyDown = false;
+std::string cpuTraceOnExit;
+
+// --benchmark: no window and no vsync, a fixed number of frames rendered offscreen as fast as they go
+struct HeadlessBenchmarkSettings {
+    bool enabled;
+    int width;
+    int height;
+    int frames;
+    std::string jsonFile;
+};
+HeadlessBenchmarkSettings headlessBenchmark = { false, 1024, 768, 300, "" };
+
+// --record-input <file> logs the keys of every frame, --replay-input <file> plays them back instead of the keyboard
+gps::InputRecorder inputRecorder;
+
+// wall time of the init phases, the first frame finishes the shader programs still compiling
+struct LoadTimes {
+    double window;
+    double shaders;
+    double models;
+    double uniforms;
+    double framebuffers;
+    double firstFrame;
+};
+LoadTimes loadTimes = { 0.0, 0.0, 0.0, 0.0, 0.0, 0.0 };
+
+// view, projection, light and fog values shared by all programs, uploaded once per frame
+gps::FrameUniforms frameUniforms;
 
 // camera
 gps::Camera myCamera(
@@ -74,35 +213,123 @@ gps::Model3D teapot;
 gps::Model3D ground;
 gps::Model3D nanosuit;
 
-// transformation variables
-GLfloat teapotAngleX;
-GLfloat teapotAngleY;
-GLfloat teapotAngleZ;
-GLfloat teapotPositionX;
-GLfloat teapotPositionY;
-GLfloat teapotPositionZ;
-
-GLfloat nanosuitAngleX;
-GLfloat nanosuitAngleY = 270.0f;
-GLfloat nanosuitAngleZ;
-GLfloat nanosuitPositionX = 5.0f;
-GLfloat nanosuitPositionY = 0.25f;
-GLfloat nanosuitPositionZ = -3.0f;
+// model table of the draw lists
+enum SCENE_MODEL { MODEL_TEAPOT, MODEL_NANOSUIT, MODEL_GROUND, MODEL_COUNT };
+gps::Model3D* const sceneModels[MODEL_COUNT] = { &teapot, &nanosuit, &ground };
+
+// every object of the frame, the dynamic ones first, then the static ones
+std::vector<gps::RenderObject> sceneObjects;
+int dynamicObjectCount;
+// what the camera passes and the shadow pass draw this frame, prepared on the worker threads
+gps::DrawList cameraDrawList;
+gps::DrawList shadowDrawList;
+// CPU depth buffer of the biggest occluders seen from the camera, the camera's draw list tests the objects left
+// after frustum culling against it (--no-occlusion turns it off). The shadow casters have none: seen from the light,
+// the occluder meshes of these models never cover a whole box behind them.
+gps::OcclusionBuffer cameraOcclusion;
+bool occlusionCullingEnabled = true;
+const int OCCLUSION_WIDTH = 256;
+const int OCCLUSION_HEIGHT = 192;
+// an object goes into a buffer if its bounding sphere spans this many buffer pixels (radius), biggest first
+const GLfloat OCCLUDER_MIN_PIXELS = 12.0f;
+const int MAX_OCCLUDERS = 16;
+std::vector<std::pair<GLfloat, int> > occluderCandidates;
+// hardware occlusion queries on the bounding boxes of the nanosuits the camera keeps, read a frame later
+// (--occlusion-queries leaves the occluded ones out, --occlusion-queries conditional draws them under
+// conditional render)
+gps::OcclusionQueries occlusionQueries;
+bool occlusionQueriesEnabled = false;
+bool conditionalQueries = false;
+// --gpu-culling [hiz]: every entity is culled for the camera and the shadow views in a compute shader (with hiz, also
+// against last frame's depth pyramid) and drawn from the indirect commands it writes. The draw lists, the occlusion
+// buffers and the queries are left out.
+gps::GpuCulling gpuCulling;
+bool gpuCullingEnabled = false;
+bool gpuHiZEnabled = false;
+bool gpuCullingReady = false;
+gps::Shader myCullShader;
+gps::Shader myCullCommandsShader;
+gps::Shader myDepthPyramidShader;
+// the entities as last uploaded and the revision each was built from
+std::vector<gps::GpuInstance> gpuInstances;
+std::vector<unsigned int> gpuRevisions;
+// every mesh draw of the lists for every pass, ordered by sort key (off: model by model, mesh by mesh)
+gps::DrawQueue drawQueue;
+bool sortKeysEnabled = true;
+GLboolean sortKeysKeyDown = false;
+// texture set of each mesh, meshes binding the same textures share the id
+std::vector<unsigned int> meshMaterials[MODEL_COUNT];
+
+// every object the simulation moves or the renderer draws, owned by the simulation
+gps::Scene scene;
+gps::Entity teapotEntity;
+gps::Entity nanosuitEntity;
+gps::Entity groundEntity;
+// what 1 and 2 select for the object keys
+gps::Entity controlledEntities[2];
+
+// world transforms and normal matrices of the entities as last drawn, shared by every pass of the frame. An entry
+// is kept while the entity's revision doesn't change, renderedRevisions holds NO_REVISION for the ones drawn at a
+// blended pose.
+std::vector<glm::mat4> renderTransforms;
+std::vector<glm::mat3> renderNormalMatrices;
+std::vector<unsigned int> renderedRevisions;
+
+// Mouse picking: a BVH over the triangles of every model and one over the entities, brought up to date with the
+// transforms as last drawn when a click needs it. A picked object the keys can control becomes the active one with
+// the input of the next step, so recordings see it like a 1 or 2.
+gps::MeshBvh modelBvhs[MODEL_COUNT];
+gps::SceneBvh sceneBvh;
+const char* const MODEL_NAMES[MODEL_COUNT] = { "teapot", "nanosuit", "ground" };
+double cursorX = 0.0;
+double cursorY = 0.0;
+// SELECTED_OBJECT picked since the last step, -1 for none
+std::atomic<int> pickedObject(-1);
+
+// Input and animations advance in fixed steps (the per-step amounts were tuned for 60 Hz frames), as many as the
+// elapsed time pays for. The frame then draws the last two steps blended by what is left in the accumulator,
+// so motion is the same at any frame rate and the frame rate isn't tied to vsync anymore.
+const double SIMULATION_STEP = 1.0 / 60.0;
+// after a stall the simulation slows down instead of running hundreds of steps to catch up
+const double MAX_FRAME_SECONDS = 0.25;
+double simulationAccumulator = 0.0;
+SimulationSnapshot previousStep;
+SimulationSnapshot currentStep;
+SimulationSnapshot renderState;
+std::atomic<unsigned long long> simulationStepCount(0);
+
+// --threaded: the simulation steps in real time on its own thread, the main thread only renders (it owns the context).
+// Keys go to the simulation and snapshots come back through triple buffers, neither side ever waits for the other.
+// Replays run serially only, the render toggles read the keys on the main thread.
+bool simulationThreaded = false;
+std::thread simulationThread;
+std::atomic<bool> simulationStopping(false);
+gps::TripleBuffer<InputFrame> inputBuffer;
+gps::TripleBuffer<SimulationFrame> simulationBuffer;
+
+// --crowd N: extra small teapots in a grid behind the scene, spun by the simulation; the many-object load
+// of --bench-threads. They are the last entities of the scene, from crowdFirstEntity on.
+int crowdCount = 0;
+size_t crowdFirstEntity;
 
 GLfloat cameraYaw;
 GLfloat cameraPitch;
 
 // shaders
-gps::Shader myBasicShader;
+// basic.vert/basic.frag permutations, see sceneFeatures()
+gps::ShaderVariants myBasicShaders;
 gps::Shader myShadowShader;
+// position-only program of the depth pre-pass
+gps::Shader myDepthShader;
 gps::Shader mySkyBoxShader;
-
-// animations
-bool teapotAnimation = true;
-bool teapotAnimationDirection = false;
-bool nanosuitAnimation = true;
-bool nanosuitAnimationDirection = false;
-bool nanosuitAnimationTurning = false;
+// deferred path: G-buffer fill per material, sun + fog composite per scene features, point light volumes
+gps::ShaderVariants myGBufferShaders;
+gps::ShaderVariants myDeferredShaders;
+gps::Shader myLightVolumeShader;
+// compiles submitted in initShaders, finished at their first use
+gps::ShaderBatch shaderBatch;
+
+// animations, the objects' are in the scene
 bool lightAnimation = true;
 
 gps::SkyBox mySkyBox;
@@ -144,14 +371,17 @@ GLenum glCheckError_(const char *file, int line)
 }
 #define glCheckError() glCheckError_(__FILE__, __LINE__)
 
+glm::mat4 computeProjection(int width, int height) {
+    // the skybox pass used to leave its far plane of 1000 in the shared projection, keep it for everyone
+    return glm::perspective(glm::radians(CAMERA_FOV), (float)width / (float)height, CAMERA_NEAR, CAMERA_FAR);
+}
+
 void windowResizeCallback(GLFWwindow* window, int width, int height) {
 	fprintf(stdout, "Window resized! New width: %d , and height: %d\n", width, height);
 
-    glViewport(0, 0, width, height);
+    gps::GLState::viewport(0, 0, width, height);
 
-    projection = glm::perspective(glm::radians(45.0f), (float)width / (float)height, 0.1f, 20.0f);
-    myBasicShader.useShaderProgram();
-    glUniformMatrix4fv(projectionLoc, 1, GL_FALSE, glm::value_ptr(projection));
+    projection = computeProjection(width, height);
 
     WindowDimensions newDimensions;
     newDimensions.width = width;
@@ -173,376 +403,237 @@ void keyboardCallback(GLFWwindow* window, int key, int scancode, int action, int
     }
 }
 
+// ray from the eye through a point of a width x height window, origin at the top left, up to the far plane
+gps::Ray cursorRay(double x, double y, int width, int height) {
+    glm::mat4 inverseViewProjection = glm::inverse(projection * view);
+    float ndcX = 2.0f * (float)x / (float)std::max(width, 1) - 1.0f;
+    float ndcY = 1.0f - 2.0f * (float)y / (float)std::max(height, 1);
+    glm::vec4 nearPoint = inverseViewProjection * glm::vec4(ndcX, ndcY, -1.0f, 1.0f);
+    glm::vec4 farPoint = inverseViewProjection * glm::vec4(ndcX, ndcY, 1.0f, 1.0f);
+    gps::Ray ray;
+    ray.origin = glm::vec3(nearPoint) / nearPoint.w;
+    glm::vec3 toFar = glm::vec3(farPoint) / farPoint.w - ray.origin;
+    ray.maxDistance = glm::length(toFar);
+    ray.direction = toFar / ray.maxDistance;
+    return ray;
+}
+
+// the entity under the cursor as last drawn
+void pickObject(GLFWwindow* window, double x, double y) {
+    gps::CpuZone zone("pickObject");
+    if (renderTransforms.empty())
+        return;
+    sceneBvh.update(renderTransforms.data(), scene.models.data(), renderedRevisions.data(), (int)renderTransforms.size());
+
+    int width, height;
+    glfwGetWindowSize(window, &width, &height);
+    gps::RayHit hit;
+    if (!sceneBvh.intersect(cursorRay(x, y, width, height), &hit)) {
+        fprintf(stdout, "Picked nothing\n");
+        return;
+    }
+    fprintf(stdout, "Picked entity %d (%s) at %.2f\n", hit.instance, MODEL_NAMES[scene.models[hit.instance]], hit.distance);
+    for (int i = 0; i < 2; i++) {
+        if (controlledEntities[i] == (gps::Entity)hit.instance) {
+            fprintf(stdout, "Active object: %s\n", MODEL_NAMES[scene.models[hit.instance]]);
+            pickedObject = i;
+        }
+    }
+}
+
 void mouseCallback(GLFWwindow* window, double xpos, double ypos) {
-    //TODO
-    //not doing it
+    cursorX = xpos;
+    cursorY = ypos;
 }
 
-void processMovement() {
-	if (pressedKeys[GLFW_KEY_W]) {
+void mouseButtonCallback(GLFWwindow* window, int button, int action, int mods) {
+    if (button == GLFW_MOUSE_BUTTON_LEFT && action == GLFW_PRESS) {
+        pickObject(window, cursorX, cursorY);
+    }
+}
+
+// the key state this frame runs with, a replay overwrites whatever GLFW delivered since the last frame
+// and the time the frame advances the simulation by
+double updateInput(GLboolean* keys, double frameSeconds) {
+    if (inputRecorder.isReplaying()) {
+        int object = active_object;
+        float recordedSeconds = 0.0f;
+        if (inputRecorder.replayFrame(keys, &object, &recordedSeconds)) {
+            active_object = (SELECTED_OBJECT)object;
+            frameSeconds = recordedSeconds;
+        } else {
+            fprintf(stdout, "Input replay finished after %u frames\n", inputRecorder.getFrameCount());
+            if (myWindow.getWindow() != NULL)
+                glfwSetWindowShouldClose(myWindow.getWindow(), GL_TRUE);
+        }
+    } else {
+        int picked = pickedObject.exchange(-1);
+        if (picked >= 0)
+            active_object = (SELECTED_OBJECT)picked;
+        if (inputRecorder.isRecording())
+            inputRecorder.recordFrame(keys, active_object, (float)frameSeconds);
+    }
+    return frameSeconds;
+}
+
+// manual rotation about x (0) or y (1) in degrees, takes the object over from its animation
+void turnObject(gps::Entity entity, int axis, GLfloat degrees) {
+    scene.pauseAnimation(entity);
+    glm::vec3 angles = scene.angles[entity];
+    angles[axis] += degrees;
+    if (angles[axis] < 0.0f)
+        angles[axis] += 360.0f;
+    else if (angles[axis] >= 360.0f)
+        angles[axis] -= 360.0f;
+    angles.z = 0.0f;
+    scene.setAngles(entity, angles);
+}
+
+void moveObject(gps::Entity entity, const glm::vec3& offset) {
+    scene.setPosition(entity, scene.positions[entity] + offset);
+}
+
+// camera and object controls, part of the simulation step
+void processMovement(const GLboolean* keys) {
+    gps::CpuZone zone("processMovement");
+	if (keys[GLFW_KEY_W]) {
 		myCamera.move(gps::MOVE_FORWARD, cameraSpeed);
-		//update view matrix
-        view = myCamera.getViewMatrix();
-        myBasicShader.useShaderProgram();
-        glUniformMatrix4fv(viewLoc, 1, GL_FALSE, glm::value_ptr(view));
 	}
 
-	if (pressedKeys[GLFW_KEY_S]) {
+	if (keys[GLFW_KEY_S]) {
 		myCamera.move(gps::MOVE_BACKWARD, cameraSpeed);
-        //update view matrix
-        view = myCamera.getViewMatrix();
-        myBasicShader.useShaderProgram();
-        glUniformMatrix4fv(viewLoc, 1, GL_FALSE, glm::value_ptr(view));
 	}
 
-	if (pressedKeys[GLFW_KEY_A]) {
+	if (keys[GLFW_KEY_A]) {
 		myCamera.move(gps::MOVE_LEFT, cameraSpeed);
-        //update view matrix
-        view = myCamera.getViewMatrix();
-        myBasicShader.useShaderProgram();
-        glUniformMatrix4fv(viewLoc, 1, GL_FALSE, glm::value_ptr(view));
 	}
 
-	if (pressedKeys[GLFW_KEY_D]) {
+	if (keys[GLFW_KEY_D]) {
 		myCamera.move(gps::MOVE_RIGHT, cameraSpeed);
-        //update view matrix
-        view = myCamera.getViewMatrix();
-        myBasicShader.useShaderProgram();
-        glUniformMatrix4fv(viewLoc, 1, GL_FALSE, glm::value_ptr(view));
 	}
 
-    if (pressedKeys[GLFW_KEY_R]) {
+    if (keys[GLFW_KEY_R]) {
         myCamera.move(gps::MOVE_UP, cameraSpeed);
-        //update view matrix
-        view = myCamera.getViewMatrix();
-        myBasicShader.useShaderProgram();
-        glUniformMatrix4fv(viewLoc, 1, GL_FALSE, glm::value_ptr(view));
     }
 
-    if (pressedKeys[GLFW_KEY_F]) {
+    if (keys[GLFW_KEY_F]) {
         myCamera.move(gps::MOVE_DOWN, cameraSpeed);
-        //update view matrix
-        view = myCamera.getViewMatrix();
-        myBasicShader.useShaderProgram();
-        glUniformMatrix4fv(viewLoc, 1, GL_FALSE, glm::value_ptr(view));
     }
 
-    if (pressedKeys[GLFW_KEY_Q]) {
-        switch (active_object) {
-        case TEAPOT:
-            teapotAnimation = false;
-            teapotAngleY -= 1.0f;
-            if (teapotAngleY < 0.0f) {
-                teapotAngleY += 360.0f;
-            }
-            teapotAngleZ = 0.0f;
-            break;
-        case NANOSUIT:
-            nanosuitAnimation = false;
-            nanosuitAnimationDirection = false;
-            nanosuitAnimationTurning = false;
-            nanosuitAngleY -= 1.0f;
-            if (nanosuitAngleY < 0.0f) {
-                nanosuitAngleY += 360.0f;
-            }
-            nanosuitAngleZ = 0.0f;
-            break;
-        }
+    gps::Entity active = controlledEntities[active_object];
+    if (keys[GLFW_KEY_Q]) {
+        turnObject(active, 1, -1.0f);
     }
 
-    if (pressedKeys[GLFW_KEY_E]) {
-        switch (active_object) {
-        case TEAPOT:
-            teapotAnimation = false;
-            teapotAngleY += 1.0f;
-            if (teapotAngleY >= 360.0f) {
-                teapotAngleY -= 360.0f;
-            }
-            teapotAngleZ = 0.0f;
-            break;
-        case NANOSUIT:
-            nanosuitAnimation = false;
-            nanosuitAnimationDirection = false;
-            nanosuitAnimationTurning = false;
-            nanosuitAngleY += 1.0f;
-            if (nanosuitAngleY >= 360.0f) {
-                nanosuitAngleY -= 360.0f;
-            }
-            nanosuitAngleZ = 0.0f;
-            break;
-        }
+    if (keys[GLFW_KEY_E]) {
+        turnObject(active, 1, 1.0f);
     }
 
-    if (pressedKeys[GLFW_KEY_I]) {
-        switch (active_object) {
-        case TEAPOT:
-            teapotAnimation = false;
-            teapotAngleX -= 1.0f;
-            if (teapotAngleX < 0.0f) {
-                teapotAngleX += 360.0f;
-            }
-            teapotAngleZ = 0.0f;
-            break;
-        case NANOSUIT:
-            nanosuitAnimation = false;
-            nanosuitAnimationDirection = false;
-            nanosuitAnimationTurning = false;
-            nanosuitAngleX -= 1.0f;
-            if (nanosuitAngleX < 0.0f) {
-                nanosuitAngleX += 360.0f;
-            }
-            nanosuitAngleZ = 0.0f;
-            break;
-            break;
-        }
+    if (keys[GLFW_KEY_I]) {
+        turnObject(active, 0, -1.0f);
     }
 
-    if (pressedKeys[GLFW_KEY_K]) {
-        switch (active_object) {
-        case TEAPOT:
-            teapotAnimation = false;
-            teapotAngleX += 1.0f;
-            if (teapotAngleX >= 360.0f) {
-                teapotAngleX -= 360.0f;
-            }
-            teapotAngleZ = 0.0f;
-            break;
-        case NANOSUIT:
-            nanosuitAnimation = false;
-            nanosuitAnimationDirection = false;
-            nanosuitAnimationTurning = false;
-            nanosuitAngleX += 1.0f;
-            if (nanosuitAngleX >= 360.0f) {
-                nanosuitAngleX -= 360.0f;
-            }
-            nanosuitAngleZ = 0.0f;
-            break;
-            break;
-        }
-
+    if (keys[GLFW_KEY_K]) {
+        turnObject(active, 0, 1.0f);
     }
 
     //reset objects
-    if (pressedKeys[GLFW_KEY_Z]) {
-        teapotAnimation = false;
-        teapotAngleX = 0.0f;
-        teapotAngleY = 0.0f;
-        teapotAngleZ = 0.0f;
-        teapotPositionX = 0.0f;
-        teapotPositionY = 0.0f;
-        teapotPositionZ = 0.0f;
-        
-        nanosuitAngleX = 0.0f;
-        nanosuitAngleY = 0.0f;
-        nanosuitAngleZ = 0.0f;
-        nanosuitPositionX = 0.0f;
-        nanosuitPositionY = 0.25f;
-        nanosuitPositionZ = -3.0f;
-        
-        myBasicShader.useShaderProgram();
+    if (keys[GLFW_KEY_Z]) {
+        for (int i = 0; i < 2; i++)
+            scene.resetPose(controlledEntities[i]);
+
         lightDir = glm::vec3(0.0f, 1.0f, 1.0f);
-        glUniform3fv(lightDirLoc, 1, glm::value_ptr(lightDir));
         lightColorCoeff = 1.0f;
-        glUniform1f(glGetUniformLocation(myBasicShader.shaderProgram, "lightColorCoeff"), lightColorCoeff);
-        mySkyBoxShader.useShaderProgram();
-        glUniform1f(glGetUniformLocation(mySkyBoxShader.shaderProgram, "lightColorCoeff"), lightColorCoeff);
 
         lightRotationY = 0.0f;
         lightRotationZ = 0.0f;
     }
 
     // reset camera
-    if (pressedKeys[GLFW_KEY_X]) {
+    if (keys[GLFW_KEY_X]) {
         cameraPitch = 0.0f;
         cameraYaw = 0.0f;
         myCamera = gps::Camera(glm::vec3(0.0f, 0.0f, 3.0f),
             glm::vec3(0.0f, 0.0f, -10.0f),
             glm::vec3(0.0f, 1.0f, 0.0f));
-        view = myCamera.getViewMatrix();
-        myBasicShader.useShaderProgram();
-        glUniformMatrix4fv(viewLoc, 1, GL_FALSE, glm::value_ptr(view));
     }
 
-    if (pressedKeys[GLFW_KEY_UP]) {
+    if (keys[GLFW_KEY_UP]) {
         cameraYaw += 1.0f;
         myCamera.rotate(cameraPitch, cameraYaw);
-        //update view matrix
-        view = myCamera.getViewMatrix();
-        myBasicShader.useShaderProgram();
-        glUniformMatrix4fv(viewLoc, 1, GL_FALSE, glm::value_ptr(view));
     }
 
-    if (pressedKeys[GLFW_KEY_DOWN]) {
+    if (keys[GLFW_KEY_DOWN]) {
         cameraYaw -= 1.0f;
         myCamera.rotate(cameraPitch, cameraYaw);
-        view = myCamera.getViewMatrix();
-        myBasicShader.useShaderProgram();
-        glUniformMatrix4fv(viewLoc, 1, GL_FALSE, glm::value_ptr(view));
     }
 
-    if (pressedKeys[GLFW_KEY_LEFT]) {
+    if (keys[GLFW_KEY_LEFT]) {
         cameraPitch += 1.0f;
         myCamera.rotate(cameraPitch, cameraYaw);
-        //update view matrix
-        view = myCamera.getViewMatrix();
-        myBasicShader.useShaderProgram();
-        glUniformMatrix4fv(viewLoc, 1, GL_FALSE, glm::value_ptr(view));
     }
 
-    if (pressedKeys[GLFW_KEY_RIGHT]) {
+    if (keys[GLFW_KEY_RIGHT]) {
         cameraPitch -= 1.0f;
         myCamera.rotate(cameraPitch, cameraYaw);
-        //update view matrix
-        view = myCamera.getViewMatrix();
-        myBasicShader.useShaderProgram();
-        glUniformMatrix4fv(viewLoc, 1, GL_FALSE, glm::value_ptr(view));
     }
 
     // begin animations
-    if (pressedKeys[GLFW_KEY_V]) {
-        if (!teapotAnimation) {
-            teapotAngleX = 0.0f;
-            teapotAngleY = 0.0f;
-            teapotAngleZ = 0.0f;
-            teapotAnimation = true;
-            teapotAnimationDirection = false;
-        }
+    if (keys[GLFW_KEY_V]) {
+        for (int i = 0; i < 2; i++)
+            scene.startAnimation(controlledEntities[i]);
         if (!lightAnimation) {
             lightRotationY = 0.0f;
             lightRotationZ = 0.0f;
             lightAnimation = true;
 
-            myBasicShader.useShaderProgram();
             glm::mat4 transform = glm::rotate(glm::mat4(1.0f), glm::radians(lightRotationZ), glm::vec3(0.0f, 0.0f, 1.0f));
             lightDir = glm::normalize(glm::vec3(transform * glm::vec4(0.0f, 1.0f, 1.0f, 1.0f)));
-            glUniform3fv(lightDirLoc, 1, glm::value_ptr(lightDir));
             // based on sun's position
             lightColorCoeff = lightRotationZ > 180.0f ? -1.0f + (lightRotationZ / 180.0f) : 1.0f - (lightRotationZ / 180.0f);
-            glUniform1f(glGetUniformLocation(myBasicShader.shaderProgram, "lightColorCoeff"), lightColorCoeff);
-            mySkyBoxShader.useShaderProgram();
-            glUniform1f(glGetUniformLocation(mySkyBoxShader.shaderProgram, "lightColorCoeff"), lightColorCoeff);
         }
-        if (!nanosuitAnimation) {
-            nanosuitAngleX = 0.0f;
-            nanosuitAngleY = 270.0f;
-            nanosuitAngleZ = 0.0f;
-
-            nanosuitPositionX = 5.0f;
-            nanosuitPositionY = 0.25f;
-            nanosuitPositionZ = -3.0f;
-
-            nanosuitAnimation = true;
-            nanosuitAnimationDirection = false;
-            nanosuitAnimationTurning = false;
-        }
-
     }
 
-    if (pressedKeys[GLFW_KEY_B]) {
-        if (teapotAnimation) {
-            teapotAngleX = 0.0f;
-            teapotAngleY = 0.0f;
-            teapotAngleZ = 0.0f;
-            teapotAnimation = false;
-            teapotAnimationDirection = false;
-        }
+    if (keys[GLFW_KEY_B]) {
+        for (int i = 0; i < 2; i++)
+            scene.stopAnimation(controlledEntities[i]);
         if (lightAnimation) {
             lightRotationY = 0.0f;
             lightRotationZ = 0.0f;
             lightAnimation = false;
 
-            myBasicShader.useShaderProgram();
             glm::mat4 transform = glm::rotate(glm::mat4(1.0f), glm::radians(lightRotationZ), glm::vec3(0.0f, 0.0f, 1.0f));
             lightDir = glm::normalize(glm::vec3(transform * glm::vec4(0.0f, 1.0f, 1.0f, 1.0f)));
-            glUniform3fv(lightDirLoc, 1, glm::value_ptr(lightDir));
             // based on sun's position
             lightColorCoeff = lightRotationZ > 180.0f ? -1.0f + (lightRotationZ / 180.0f) : 1.0f - (lightRotationZ / 180.0f);
-            glUniform1f(glGetUniformLocation(myBasicShader.shaderProgram, "lightColorCoeff"), lightColorCoeff);
-            mySkyBoxShader.useShaderProgram();
-            glUniform1f(glGetUniformLocation(mySkyBoxShader.shaderProgram, "lightColorCoeff"), lightColorCoeff);
-        }
-        if (nanosuitAnimation) {
-            nanosuitAngleX = 0.0f;
-            nanosuitAngleY = 0.0f;
-            nanosuitAngleZ = 0.0f;
-
-            nanosuitPositionX = 0.0f;
-            nanosuitPositionY = 0.25f;
-            nanosuitPositionZ = -3.0f;
-
-            nanosuitAnimation = false;
-            nanosuitAnimationDirection = false;
-            nanosuitAnimationTurning = false;
         }
     }
 
-    if (pressedKeys[GLFW_KEY_M]) {
-        switch (active_object) {
-        case TEAPOT:
-            teapotPositionX += 0.1f;
-            break;
-        case NANOSUIT:
-            nanosuitPositionX += 0.1f;
-            break;
-        }
+    if (keys[GLFW_KEY_M]) {
+        moveObject(active, glm::vec3(0.1f, 0.0f, 0.0f));
     }
 
-    if (pressedKeys[GLFW_KEY_N]) {
-        switch (active_object) {
-        case TEAPOT:
-            teapotPositionX -= 0.1f;
-            break;
-        case NANOSUIT:
-            nanosuitPositionX -= 0.1f;
-            break;
-        }
+    if (keys[GLFW_KEY_N]) {
+        moveObject(active, glm::vec3(-0.1f, 0.0f, 0.0f));
     }
 
-    if (pressedKeys[GLFW_KEY_H]) {
-        switch (active_object) {
-        case TEAPOT:
-            teapotPositionZ += 0.1f;
-            break;
-        case NANOSUIT:
-            nanosuitPositionZ += 0.1f;
-            break;
-        }
+    if (keys[GLFW_KEY_H]) {
+        moveObject(active, glm::vec3(0.0f, 0.0f, 0.1f));
     }
 
-    if (pressedKeys[GLFW_KEY_Y]) {
-        switch (active_object) {
-        case TEAPOT:
-            teapotPositionZ -= 0.1f;
-            break;
-        case NANOSUIT:
-            nanosuitPositionZ -= 0.1f;
-            break;
-        }
+    if (keys[GLFW_KEY_Y]) {
+        moveObject(active, glm::vec3(0.0f, 0.0f, -0.1f));
     }
 
-    if (pressedKeys[GLFW_KEY_U]) {
-        switch (active_object) {
-        case TEAPOT:
-            teapotPositionY += 0.1f;
-            break;
-        case NANOSUIT:
-            nanosuitPositionY += 0.1f;
-            break;
-        }
+    if (keys[GLFW_KEY_U]) {
+        moveObject(active, glm::vec3(0.0f, 0.1f, 0.0f));
     }
 
-    if (pressedKeys[GLFW_KEY_J]) {
-        switch (active_object) {
-        case TEAPOT:
-            teapotPositionY -= 0.1f;
-            break;
-        case NANOSUIT:
-            nanosuitPositionY -= 0.1f;
-            break;
-        }
+    if (keys[GLFW_KEY_J]) {
+        moveObject(active, glm::vec3(0.0f, -0.1f, 0.0f));
     }
 
-    if (pressedKeys[GLFW_KEY_P]) {
+    if (keys[GLFW_KEY_P]) {
         lightAnimation = false;
 
         glm::mat4 transform;
@@ -554,82 +645,176 @@ void processMovement() {
                 lightRotationY -= 360.0f;
             transform = glm::rotate(glm::mat4(1.0f), glm::radians(lightRotationY), glm::vec3(0.0f, 1.0f, 0.0f));
             lightDir = glm::normalize(glm::vec3(transform * glm::vec4(0.0f, 1.0f, 1.0f, 1.0f)));
-            myBasicShader.useShaderProgram();
-            glUniform3fv(lightDirLoc, 1, glm::value_ptr(lightDir));
             lightColorCoeff = 1.0f;
-            glUniform1f(glGetUniformLocation(myBasicShader.shaderProgram, "lightColorCoeff"), lightColorCoeff);
-            mySkyBoxShader.useShaderProgram();
-            glUniform1f(glGetUniformLocation(mySkyBoxShader.shaderProgram, "lightColorCoeff"), lightColorCoeff);
             break;
         case NANOSUIT:
             lightRotationY = 0.0f;
             lightRotationZ += 1.0f;
             if (lightRotationZ >= 360.0f)
                 lightRotationZ -= 360.0f;
-            myBasicShader.useShaderProgram();
             transform = glm::rotate(glm::mat4(1.0f), glm::radians(lightRotationZ), glm::vec3(0.0f, 0.0f, 1.0f));
             lightDir = glm::normalize(glm::vec3(transform * glm::vec4(0.0f, 1.0f, 1.0f, 1.0f)));
-            glUniform3fv(lightDirLoc, 1, glm::value_ptr(lightDir));
             // change color if sun is under the ground
             lightColorCoeff = lightRotationZ > 180.0f ? -1.0f + (lightRotationZ / 180.0f) : 1.0f - (lightRotationZ / 180.0f);
-            glUniform1f(glGetUniformLocation(myBasicShader.shaderProgram, "lightColorCoeff"), lightColorCoeff);
-            mySkyBoxShader.useShaderProgram();
-            glUniform1f(glGetUniformLocation(mySkyBoxShader.shaderProgram, "lightColorCoeff"), lightColorCoeff);
             break;
         }
     }
 
-    if (pressedKeys[GLFW_KEY_1]) {
+    if (keys[GLFW_KEY_1]) {
         fprintf(stdout, "Active object: teapot\n");
         active_object = TEAPOT;
     }
 
-    if (pressedKeys[GLFW_KEY_2]) {
+    if (keys[GLFW_KEY_2]) {
         fprintf(stdout, "Active object: nanosuit\n");
         active_object = NANOSUIT;
     }
+}
 
+// render settings and tools, once per rendered frame on the thread that owns the GL context
+void processRenderToggles() {
     if (pressedKeys[GLFW_KEY_C]) {
         fogEnabled = !fogEnabled;
-        myBasicShader.useShaderProgram();
-        glUniform1i(glGetUniformLocation(myBasicShader.shaderProgram, "fogEnabled"), fogEnabled);
-        mySkyBoxShader.useShaderProgram();
-        glUniform1i(glGetUniformLocation(mySkyBoxShader.shaderProgram, "fogEnabled"), fogEnabled);
     }
 
+    if (pressedKeys[GLFW_KEY_G] && !shadowsKeyDown) {
+        shadowsEnabled = !shadowsEnabled;
+    }
+    shadowsKeyDown = pressedKeys[GLFW_KEY_G];
+
+    if (pressedKeys[GLFW_KEY_L] && !pcfKeyDown) {
+        pcfEnabled = !pcfEnabled;
+    }
+    pcfKeyDown = pressedKeys[GLFW_KEY_L];
+
+    if (pressedKeys[GLFW_KEY_T] && !prepassKeyDown) {
+        depthPrepassEnabled = !depthPrepassEnabled;
+    }
+    prepassKeyDown = pressedKeys[GLFW_KEY_T];
+
+    if (pressedKeys[GLFW_KEY_3] && !overdrawKeyDown) {
+        overdrawMeasurement = !overdrawMeasurement;
+        overdrawFrame = 0;
+    }
+    overdrawKeyDown = pressedKeys[GLFW_KEY_3];
+
+    if (pressedKeys[GLFW_KEY_4] && !pointLightKeyDown) {
+        pointLightSetting = (pointLightSetting + 1) % POINT_LIGHT_SETTINGS;
+        pointLights.generate(POINT_LIGHT_COUNTS[pointLightSetting]);
+        fprintf(stdout, "Point lights: %d\n", pointLights.getCount());
+    }
+    pointLightKeyDown = pressedKeys[GLFW_KEY_4];
+
+    if (pressedKeys[GLFW_KEY_5] && !deferredKeyDown) {
+        deferredEnabled = !deferredEnabled;
+        fprintf(stdout, "Renderer: %s\n", deferredEnabled ? "deferred" : "forward");
+    }
+    deferredKeyDown = pressedKeys[GLFW_KEY_5];
+
+    if (pressedKeys[GLFW_KEY_6] && !clusteredKeyDown) {
+        clusteredEnabled = !clusteredEnabled;
+        fprintf(stdout, "Clustered point lights: %s\n", clusteredEnabled ? "on" : "off");
+    }
+    clusteredKeyDown = pressedKeys[GLFW_KEY_6];
+
+    if (pressedKeys[GLFW_KEY_7] && !gpuProfileKeyDown) {
+        gpuProfiler.dumpStats(stdout);
+    }
+    gpuProfileKeyDown = pressedKeys[GLFW_KEY_7];
+
+    if (pressedKeys[GLFW_KEY_8] && !meshScopesKeyDown) {
+        gpuMeshScopes = !gpuMeshScopes;
+        gps::GpuProfiler* meshProfiler = gpuMeshScopes ? &gpuProfiler : NULL;
+        teapot.SetProfiler(meshProfiler);
+        ground.SetProfiler(meshProfiler);
+        nanosuit.SetProfiler(meshProfiler);
+        fprintf(stdout, "GPU mesh scopes: %s\n", gpuMeshScopes ? "on" : "off");
+    }
+    meshScopesKeyDown = pressedKeys[GLFW_KEY_8];
+
+    if (pressedKeys[GLFW_KEY_9] && !cpuTraceKeyDown) {
+        gps::CpuProfiler::writeChromeTrace(CPU_TRACE_FILE);
+    }
+    cpuTraceKeyDown = pressedKeys[GLFW_KEY_9];
+
+    if (pressedKeys[GLFW_KEY_0] && !sortKeysKeyDown) {
+        sortKeysEnabled = !sortKeysEnabled;
+        fprintf(stdout, "Draw sort keys: %s\n", sortKeysEnabled ? "on" : "off");
+    }
+    sortKeysKeyDown = pressedKeys[GLFW_KEY_0];
+
     if (pressedKeys[GLFW_KEY_O]) {
         if (!wireframeEnable) {
-            glPolygonMode(GL_FRONT_AND_BACK, GL_LINE);
+            gps::GLState::polygonMode(GL_LINE);
         }
         else {
-            glPolygonMode(GL_FRONT_AND_BACK, GL_FILL);
+            gps::GLState::polygonMode(GL_FILL);
         }
         wireframeEnable = !wireframeEnable;
     }
 }
 
 void initOpenGLWindow() {
-    myWindow.Create(1024, 768, "OpenGL Project Core");
+    gps::CpuZone zone("initOpenGLWindow");
+    if (headlessBenchmark.enabled)
+        myWindow.CreateHeadless(headlessBenchmark.width, headlessBenchmark.height);
+    else
+        myWindow.Create(1024, 768, "OpenGL Project Core");
 }
 
 void setWindowCallbacks() {
+    // no window, no input
+    if (myWindow.isHeadless()) {
+        return;
+    }
 	glfwSetWindowSizeCallback(myWindow.getWindow(), windowResizeCallback);
     glfwSetKeyCallback(myWindow.getWindow(), keyboardCallback);
     glfwSetCursorPosCallback(myWindow.getWindow(), mouseCallback);
+    glfwSetMouseButtonCallback(myWindow.getWindow(), mouseButtonCallback);
 }
 
 void initOpenGLState() {
+    gps::GLState::invalidate(); // fresh context, nothing is known yet
+    gps::GLState::setDefaultFramebuffer(myWindow.getFramebuffer()); // offscreen when headless
 	glClearColor(0.7f, 0.7f, 0.7f, 1.0f);
-	glViewport(0, 0, myWindow.getWindowDimensions().width, myWindow.getWindowDimensions().height);
+	gps::GLState::viewport(0, 0, myWindow.getWindowDimensions().width, myWindow.getWindowDimensions().height);
     glEnable(GL_FRAMEBUFFER_SRGB);
 	glEnable(GL_DEPTH_TEST); // enable depth-testing
-	glDepthFunc(GL_LESS); // depth-testing interprets a smaller value as "closer"
+	gps::GLState::depthFunc(GL_LESS); // depth-testing interprets a smaller value as "closer"
 	glEnable(GL_CULL_FACE); // cull face
 	glCullFace(GL_BACK); // cull back face
 	glFrontFace(GL_CCW); // GL_CCW for counter clock-wise
 }
 
+// material ids of the sort keys
+void initMaterialIds() {
+    std::map<std::vector<GLuint>, unsigned int> textureSets;
+    for (int m = 0; m < MODEL_COUNT; m++) {
+        meshMaterials[m].clear();
+        for (int mesh = 0; mesh < sceneModels[m]->GetMeshCount(); mesh++) {
+            const std::vector<gps::Texture>& textures = sceneModels[m]->GetMeshTextures(mesh);
+            std::vector<GLuint> textureSet;
+            for (size_t t = 0; t < textures.size(); t++)
+                textureSet.push_back(textures[t].id);
+            unsigned int id = (unsigned int)textureSets.size();
+            meshMaterials[m].push_back(textureSets.insert(std::make_pair(textureSet, id)).first->second);
+        }
+    }
+}
+
+// triangle BVHs of the models, the entities' tree is built at the first pick
+void initRayQueries() {
+    gps::CpuZone zone("initRayQueries");
+    std::vector<glm::vec3> triangles;
+    for (int m = 0; m < MODEL_COUNT; m++) {
+        sceneModels[m]->GetTriangles(&triangles);
+        modelBvhs[m].build(triangles);
+        sceneBvh.setModel(m, &modelBvhs[m]);
+    }
+}
+
 void initModels() {
+    gps::CpuZone zone("initModels");
     teapot.LoadModel("models/teapot/teapot20segUT.obj");
     ground.LoadModel("models/ground/ground.obj");
     nanosuit.LoadModel("models/nanosuit/nanosuit.obj");
@@ -643,331 +828,2167 @@ void initModels() {
     faces.push_back("models/skybox/front.tga");
     mySkyBox.Load(faces);
 
+    initMaterialIds();
+    initRayQueries();
+}
+
+// runs once for every basic shader variant, right after its first bind
+void configureBasicShader(gps::Shader& shader) {
+    frameUniforms.attach(shader);
+    // the shadow map always lives on unit 3
+    glUniform1i(glGetUniformLocation(shader.shaderProgram, "shadowMap"), 3);
+    glUniform1i(glGetUniformLocation(shader.shaderProgram, "pointLights"), gps::PointLights::TEXTURE_UNIT);
+    lightClusters.attach(shader);
+    glUniform1i(glGetUniformLocation(shader.shaderProgram, "clusterRanges"), gps::LightClusters::TEXTURE_UNIT);
+    glUniform1i(glGetUniformLocation(shader.shaderProgram, "clusterLights"), gps::LightClusters::TEXTURE_UNIT + 1);
+}
+
+// G-buffer targets, the same units for the composite and the light volume programs
+void bindGBufferSamplers(gps::Shader& shader) {
+    glUniform1i(glGetUniformLocation(shader.shaderProgram, "gAlbedoSpec"), gps::DeferredRenderer::TEXTURE_UNIT);
+    glUniform1i(glGetUniformLocation(shader.shaderProgram, "gNormal"), gps::DeferredRenderer::TEXTURE_UNIT + 1);
+    glUniform1i(glGetUniformLocation(shader.shaderProgram, "gDepth"), gps::DeferredRenderer::TEXTURE_UNIT + 2);
+    glUniform1i(glGetUniformLocation(shader.shaderProgram, "lightBuffer"), gps::DeferredRenderer::TEXTURE_UNIT + 3);
+}
+
+void configureDeferredShader(gps::Shader& shader) {
+    frameUniforms.attach(shader);
+    glUniform1i(glGetUniformLocation(shader.shaderProgram, "shadowMap"), 3);
+    bindGBufferSamplers(shader);
 }
 
 void initShaders() {
-	myBasicShader.loadShader(
+    gps::CpuZone zone("initShaders");
+    // only submits the work, the driver compiles while the models load
+    gps::ShaderBatch::enableParallelCompile();
+    myBasicShaders.init(
         "shaders/basic.vert",
-        "shaders/basic.frag");
-    myShadowShader.loadShader(
+        "shaders/basic.frag",
+        PCF_TAPS, configureBasicShader);
+    // every variant the keys can switch to, so toggling never stalls on a compile
+    myBasicShaders.prepareAll(shaderBatch);
+    shaderBatch.add(myShadowShader,
         "shaders/shadow.vert",
+        "shaders/shadow.geom",
+        "shaders/shadow.frag",
+        ""
+    );
+    shaderBatch.add(myDepthShader,
+        "shaders/depth.vert",
         "shaders/shadow.frag"
     );
-    mySkyBoxShader.loadShader(
+    // the G-buffer programs only differ by material, the composite ones by scene features
+    myGBufferShaders.init(
+        "shaders/basic.vert",
+        "shaders/gbuffer.frag",
+        PCF_TAPS, configureBasicShader);
+    myGBufferShaders.prepareAll(shaderBatch, gps::FEATURE_SPECULAR_MAP);
+    myDeferredShaders.init(
+        "shaders/fullscreen.vert",
+        "shaders/deferred.frag",
+        PCF_TAPS, configureDeferredShader);
+    myDeferredShaders.prepareAll(shaderBatch, DEFERRED_FEATURES);
+    shaderBatch.add(myLightVolumeShader,
+        "shaders/lightVolume.vert",
+        "shaders/lightVolume.frag"
+    );
+    shaderBatch.add(mySkyBoxShader,
         "shaders/skyboxShader.vert",
         "shaders/skyboxShader.frag"
     );
 }
 
 void initUniforms() {
-	myBasicShader.useShaderProgram();
-
-    // create model matrix for teapot
-    model = glm::rotate(glm::mat4(1.0f), glm::radians(teapotAngleX), glm::vec3(1.0f, 0.0f, 0.0f));
-    model = glm::rotate(model, glm::radians(teapotAngleY), glm::vec3(0.0f, 1.0f, 0.0f));
-    model = glm::rotate(model, glm::radians(teapotAngleZ), glm::vec3(0.0f, 0.0f, 1.0f));
-	modelLoc = glGetUniformLocation(myBasicShader.shaderProgram, "model");
+    gps::CpuZone zone("initUniforms");
+    frameUniforms.init();
+    frameUniforms.attach(myShadowShader);
+    cascadeMaskLoc = glGetUniformLocation(myShadowShader.shaderProgram, "cascadeMask");
+    frameUniforms.attach(myDepthShader);
+    frameUniforms.attach(myLightVolumeShader);
+    myLightVolumeShader.useShaderProgram();
+    bindGBufferSamplers(myLightVolumeShader);
+    frameUniforms.attach(mySkyBoxShader);
 
 	// get view matrix for current camera
 	view = myCamera.getViewMatrix();
-	viewLoc = glGetUniformLocation(myBasicShader.shaderProgram, "view");
-	// send view matrix to shader
-    glUniformMatrix4fv(viewLoc, 1, GL_FALSE, glm::value_ptr(view));
-
-    // compute normal matrix for teapot
-    normalMatrix = glm::mat3(glm::inverseTranspose(view*model));
-	normalMatrixLoc = glGetUniformLocation(myBasicShader.shaderProgram, "normalMatrix");
 
 	// create projection matrix
-	projection = glm::perspective(glm::radians(45.0f),
-                               (float)myWindow.getWindowDimensions().width / (float)myWindow.getWindowDimensions().height,
-                               0.1f, 20.0f);
-	projectionLoc = glGetUniformLocation(myBasicShader.shaderProgram, "projection");
-	// send projection matrix to shader
-	glUniformMatrix4fv(projectionLoc, 1, GL_FALSE, glm::value_ptr(projection));	
+	projection = computeProjection(myWindow.getWindowDimensions().width, myWindow.getWindowDimensions().height);
 
 	//set the light direction (direction towards the light)
 	lightDir = glm::vec3(0.0f, 1.0f, 1.0f);
-	lightDirLoc = glGetUniformLocation(myBasicShader.shaderProgram, "lightDir");
-	// send light dir to shader
-	glUniform3fv(lightDirLoc, 1, glm::value_ptr(lightDir));
 
 	//set light color
 	lightColor = glm::vec3(1.0f, 1.0f, 1.0f); //white light
-	lightColorLoc = glGetUniformLocation(myBasicShader.shaderProgram, "lightColor");
-	// send light color to shader
-	glUniform3fv(lightColorLoc, 1, glm::value_ptr(lightColor));
-
-    // set shadow stuff
-    lightView = glm::lookAt(lightDir, glm::vec3(0.0f), glm::vec3(0.0f, 1.0f, 0.0f));
-    lightProjection = glm::ortho(-1.0f, 1.0f, -1.0f, 1.0f, near_plane, far_plane);
-    lightSpaceTrMatrix = lightProjection * lightView;
-    lightSpaceTrMatrixLoc = glGetUniformLocation(myBasicShader.shaderProgram, "lightSpaceTrMatrix");
-    // send lightSpaceTrMatrix
-    glUniformMatrix4fv(lightSpaceTrMatrixLoc, 1, GL_FALSE, glm::value_ptr(lightSpaceTrMatrix));
-
-    myShadowShader.useShaderProgram();
-    glUniformMatrix4fv(glGetUniformLocation(myShadowShader.shaderProgram, "lightSpaceTrMatrix"), 1, GL_FALSE, glm::value_ptr(lightSpaceTrMatrix));
 
     // fog and daylight intensity
     lightColorCoeff = 1.0f;
     fogEnabled = false;
-    myBasicShader.useShaderProgram();
-    glUniform1i(glGetUniformLocation(myBasicShader.shaderProgram, "fogEnabled"), fogEnabled);
-    glUniform1f(glGetUniformLocation(myBasicShader.shaderProgram, "lightColorCoeff"), lightColorCoeff);
-    mySkyBoxShader.useShaderProgram();
-    glUniform1i(glGetUniformLocation(mySkyBoxShader.shaderProgram, "fogEnabled"), fogEnabled);
-    glUniform1f(glGetUniformLocation(mySkyBoxShader.shaderProgram, "lightColorCoeff"), lightColorCoeff);
+
+    // everything above ends up in the FrameData block on the first frame
+}
+
+// the compute programs are only built when something culls on the GPU
+void initGpuCulling() {
+    if (gpuCullingReady)
+        return;
+    std::string defines = gps::GpuCulling::shaderDefines();
+    myCullShader.loadComputeShader("shaders/cull.comp", defines);
+    myCullCommandsShader.loadComputeShader("shaders/cullCommands.comp", defines);
+    myDepthPyramidShader.loadComputeShader("shaders/depthPyramid.comp");
+    gpuCulling.init(myCullShader, myCullCommandsShader, myDepthPyramidShader);
+    for (int m = 0; m < MODEL_COUNT; m++) {
+        std::vector<GLsizei> indexCounts;
+        for (int mesh = 0; mesh < sceneModels[m]->GetMeshCount(); mesh++)
+            indexCounts.push_back(sceneModels[m]->GetMeshIndexCount(mesh));
+        gpuCulling.setModel(m, indexCounts);
+    }
+    gpuCulling.setHiZ(gpuHiZEnabled);
+    gpuCullingReady = true;
 }
 
 void initFBO() {
-    // Create the FBO, the depth texture and attach the depth texture to the FBO
+    gps::CpuZone zone("initFBO");
+    // depth texture array with one layer per cascade and the layered FBO rendering into it
+    shadowCascades.init(SHADOW_CASCADES, SHADOW_RESOLUTION, SHADOW_DISTANCE);
+    shadowCascades.setLightChangeThreshold(SHADOW_LIGHT_THRESHOLD);
+    shadowCascades.setCascadeUpdatesPerFrame(SHADOW_CASCADE_UPDATES_PER_FRAME);
+
+    // G-buffer and light buffer, the light volumes are instanced straight from the point light buffer
+    pointLights.init();
+    pointLights.generate(POINT_LIGHT_COUNTS[pointLightSetting]);
+    deferredRenderer.init(myWindow.getWindowDimensions().width, myWindow.getWindowDimensions().height, pointLights.getBuffer());
+
+    threadPool.init();
+    lightClusters.init(&threadPool, CAMERA_NEAR, CLUSTER_SLICE_FAR);
+    cameraDrawList.init(&threadPool);
+    shadowDrawList.init(&threadPool);
+    cameraOcclusion.init(&threadPool, OCCLUSION_WIDTH, OCCLUSION_HEIGHT, true);
+    // only the nanosuit is heavy enough for a query and its box draw to pay off
+    occlusionQueries.init();
+    occlusionQueries.trackModel(MODEL_NANOSUIT);
+    occlusionQueries.setEnabled(occlusionQueriesEnabled);
+    occlusionQueries.setConditional(conditionalQueries);
+    if (gpuCullingEnabled)
+        initGpuCulling();
+    gpuProfiler.init();
+}
 
-    //generate FBO ID
-    glGenFramebuffers(1, &shadowMapFBO);
+// the small teapots of --crowd in a grid behind the scene, replacing the previous ones
+void setCrowd(int count) {
+    crowdCount = count;
+    scene.truncate(crowdFirstEntity);
+    int side = (int)ceil(sqrt((double)count));
+    for (int i = 0; i < count; i++) {
+        glm::vec3 position((float)(i % side - side / 2) * 1.5f, -0.5f, -8.0f - (float)(i / side) * 1.5f);
+        gps::Entity entity = scene.create(MODEL_TEAPOT, teapot.GetBounds(), position, glm::vec3(0.0f), glm::vec3(0.2f));
+        scene.setAnimation(entity, gps::ANIMATION_SPIN_BOB, true, (float)i);
+    }
+}
 
-    // create depth texture for FBO
-    glGenTextures(1, &depthMapTexture);
-    glBindTexture(GL_TEXTURE_2D, depthMapTexture);
-    glTexImage2D(GL_TEXTURE_2D, 0, GL_DEPTH_COMPONENT, SHADOW_WIDTH, SHADOW_HEIGHT,
-        0, GL_DEPTH_COMPONENT, GL_FLOAT, NULL);
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
-    float borderColor[] = { 1.0f, 1.0f, 1.0f, 1.0f };
-    glTexParameterfv(GL_TEXTURE_2D, GL_TEXTURE_BORDER_COLOR, borderColor);
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_BORDER);
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_BORDER);
+void initScene() {
+    teapotEntity = scene.create(MODEL_TEAPOT, teapot.GetBounds(), glm::vec3(0.0f), glm::vec3(0.0f), glm::vec3(1.0f));
+    scene.setAnimation(teapotEntity, gps::ANIMATION_ROCK, true);
 
-    //attach texture to FBO
-    glBindFramebuffer(GL_FRAMEBUFFER, shadowMapFBO);
-    glFramebufferTexture2D(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, GL_TEXTURE_2D, depthMapTexture, 0);
+    // rests in front of the camera, patrols from the right facing left
+    nanosuitEntity = scene.create(MODEL_NANOSUIT, nanosuit.GetBounds(), glm::vec3(0.0f, 0.25f, -3.0f), glm::vec3(0.0f), glm::vec3(1.0f));
+    scene.setStartPose(nanosuitEntity, glm::vec3(5.0f, 0.25f, -3.0f), glm::vec3(0.0f, 270.0f, 0.0f));
+    scene.setPosition(nanosuitEntity, glm::vec3(5.0f, 0.25f, -3.0f));
+    scene.setAngles(nanosuitEntity, glm::vec3(0.0f, 270.0f, 0.0f));
+    scene.setAnimation(nanosuitEntity, gps::ANIMATION_PATROL, true);
 
-    glDrawBuffer(GL_NONE);
-    glReadBuffer(GL_NONE);
+    groundEntity = scene.create(MODEL_GROUND, ground.GetBounds(), glm::vec3(0.0f, -0.75f, 0.0f), glm::vec3(0.0f), glm::vec3(1.0f),
+        gps::ENTITY_STATIC);
 
-    glBindFramebuffer(GL_FRAMEBUFFER, 0);
+    controlledEntities[TEAPOT] = teapotEntity;
+    controlledEntities[NANOSUIT] = nanosuitEntity;
+    crowdFirstEntity = scene.size();
+    setCrowd(crowdCount);
 }
 
 void playAnimations() {
-    if (teapotAnimation) {
-        if (teapotAngleZ >= 45.0f || teapotAngleZ <= -45.0f)
-            teapotAnimationDirection = !teapotAnimationDirection;
-        if (!teapotAnimationDirection)
-            teapotAngleZ += 1.0f;
-        else
-            teapotAngleZ -= 1.0f;
-    }
+    gps::CpuZone zone("playAnimations");
+    scene.animate((GLfloat)SIMULATION_STEP);
     if (lightAnimation) {
         lightRotationZ += 0.1f;
         if (lightRotationZ >= 360.0f)
             lightRotationZ -= 360.0f;
-        myBasicShader.useShaderProgram();
         glm::mat4 transform = glm::rotate(glm::mat4(1.0f), glm::radians(lightRotationZ), glm::vec3(0.0f, 0.0f, 1.0f));
         lightDir = glm::normalize(glm::vec3(transform * glm::vec4(0.0f, 1.0f, 1.0f, 1.0f)));
-        glUniform3fv(lightDirLoc, 1, glm::value_ptr(lightDir));
         // based on sun's position
         lightColorCoeff = lightRotationZ > 180.0f ? -1.0f + (lightRotationZ / 180.0f) : 1.0f - (lightRotationZ / 180.0f);
-        glUniform1f(glGetUniformLocation(myBasicShader.shaderProgram, "lightColorCoeff"), lightColorCoeff);
-        mySkyBoxShader.useShaderProgram();
-        glUniform1f(glGetUniformLocation(mySkyBoxShader.shaderProgram, "lightColorCoeff"), lightColorCoeff);
-    }
-    if (nanosuitAnimation) {
-        if (!nanosuitAnimationTurning) {
-            if (!nanosuitAnimationDirection) {
-                nanosuitPositionX -= 0.01f;
-                if (nanosuitPositionX <= -5.0f) {
-                    nanosuitAnimationTurning = true;
-                }
-            }
-            else {
-                nanosuitPositionX += 0.02f;
-                if (nanosuitPositionX >= 5.0f) {
-                    nanosuitAnimationTurning = true;
-                }
-            }
+    }
+}
+
+// the scene's dirty entities get their new revision here, once per step
+SimulationSnapshot captureSimulation() {
+    scene.commit();
+    SimulationSnapshot snapshot;
+    snapshot.positions = scene.positions;
+    snapshot.angles = scene.angles;
+    snapshot.scales = scene.scales;
+    snapshot.revisions = scene.revisions;
+    snapshot.cameraPosition = myCamera.getPosition();
+    snapshot.cameraTarget = myCamera.getTarget();
+    snapshot.cameraUp = myCamera.getUpDirection();
+    snapshot.lightDir = lightDir;
+    snapshot.lightColorCoeff = lightColorCoeff;
+    return snapshot;
+}
+
+glm::vec3 lerp(const glm::vec3& a, const glm::vec3& b, float t) {
+    return a + (b - a) * t;
+}
+
+// degrees, the short way around (359 -> 1 goes through 0)
+glm::vec3 lerpAngles(const glm::vec3& a, const glm::vec3& b, float t) {
+    glm::vec3 delta = b - a;
+    for (int i = 0; i < 3; i++) {
+        if (delta[i] > 180.0f)
+            delta[i] -= 360.0f;
+        else if (delta[i] < -180.0f)
+            delta[i] += 360.0f;
+    }
+    return a + delta * t;
+}
+
+// only the entities whose pose changed between the two steps are blended, the others keep b's pose and revision
+SimulationSnapshot interpolateSimulation(const SimulationSnapshot& a, const SimulationSnapshot& b, float t) {
+    SimulationSnapshot snapshot;
+    snapshot.positions = b.positions;
+    snapshot.angles = b.angles;
+    snapshot.scales = b.scales;
+    snapshot.revisions = b.revisions;
+    size_t blendable = std::min(a.revisions.size(), b.revisions.size());
+    for (size_t i = 0; i < blendable; i++) {
+        if (a.revisions[i] == b.revisions[i])
+            continue;
+        snapshot.positions[i] = lerp(a.positions[i], b.positions[i], t);
+        snapshot.angles[i] = lerpAngles(a.angles[i], b.angles[i], t);
+        snapshot.revisions[i] = NO_REVISION;
+    }
+    snapshot.cameraPosition = lerp(a.cameraPosition, b.cameraPosition, t);
+    snapshot.cameraTarget = lerp(a.cameraTarget, b.cameraTarget, t);
+    snapshot.cameraUp = glm::normalize(lerp(a.cameraUp, b.cameraUp, t));
+    snapshot.lightDir = glm::normalize(lerp(a.lightDir, b.lightDir, t));
+    snapshot.lightColorCoeff = a.lightColorCoeff + (b.lightColorCoeff - a.lightColorCoeff) * t;
+    return snapshot;
+}
+
+// no motion to blend yet, the first frame draws the initial state
+void resetSimulation() {
+    simulationAccumulator = 0.0;
+    currentStep = captureSimulation();
+    previousStep = currentStep;
+    renderState = currentStep;
+}
+
+void simulationStep(const GLboolean* keys) {
+    processMovement(keys);
+    playAnimations();
+    previousStep = currentStep;
+    currentStep = captureSimulation();
+    simulationStepCount++;
+}
+
+// runs the steps the elapsed time pays for and blends the last two for rendering
+void advanceSimulation(double frameSeconds) {
+    simulationAccumulator += std::min(std::max(frameSeconds, 0.0), MAX_FRAME_SECONDS);
+    while (simulationAccumulator >= SIMULATION_STEP) {
+        simulationStep(pressedKeys);
+        simulationAccumulator -= SIMULATION_STEP;
+    }
+    renderState = interpolateSimulation(previousStep, currentStep, (float)(simulationAccumulator / SIMULATION_STEP));
+}
+
+void publishSimulationFrame() {
+    SimulationFrame& frame = simulationBuffer.writeBuffer();
+    frame.previous = previousStep;
+    frame.current = currentStep;
+    frame.time = std::chrono::steady_clock::now();
+    simulationBuffer.publish();
+}
+
+// one step every SIMULATION_STEP of real time, recordings and replays see one record per step
+void simulationThreadLoop() {
+    gps::CpuProfiler::setThreadName("simulation");
+    GLboolean keys[1024];
+    memset(keys, 0, sizeof(keys));
+    const std::chrono::steady_clock::duration step =
+        std::chrono::duration_cast<std::chrono::steady_clock::duration>(std::chrono::duration<double>(SIMULATION_STEP));
+    const std::chrono::steady_clock::duration maxBacklog =
+        std::chrono::duration_cast<std::chrono::steady_clock::duration>(std::chrono::duration<double>(MAX_FRAME_SECONDS));
+
+    std::chrono::steady_clock::time_point next = std::chrono::steady_clock::now() + step;
+    while (!simulationStopping.load(std::memory_order_relaxed)) {
+        std::this_thread::sleep_until(next);
+        {
+            gps::CpuZone zone("simulation step");
+            if (inputBuffer.update())
+                memcpy(keys, inputBuffer.readBuffer().keys, sizeof(keys));
+            updateInput(keys, SIMULATION_STEP);
+            simulationStep(keys);
+            publishSimulationFrame();
         }
-        else {
-            nanosuitAngleY += 1.0f;
-            if (nanosuitAngleY >= 360.0f) {
-                nanosuitAngleY -= 360.0f;
+        next += step;
+        // fell too far behind: carry on from now instead of a burst of catch-up steps
+        std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+        if (now - next > maxBacklog)
+            next = now;
+    }
+}
+
+void startSimulationThread() {
+    // the renderer has something to draw before the first step
+    publishSimulationFrame();
+    simulationStopping = false;
+    simulationThreaded = true;
+    simulationThread = std::thread(simulationThreadLoop);
+}
+
+void stopSimulationThread() {
+    if (!simulationThreaded)
+        return;
+    simulationStopping = true;
+    simulationThread.join();
+    simulationThreaded = false;
+}
+
+// newest snapshot from the simulation thread, blended by how far real time is into the step after it
+void receiveSimulation() {
+    simulationBuffer.update();
+    const SimulationFrame& frame = simulationBuffer.readBuffer();
+    double t = std::chrono::duration<double>(std::chrono::steady_clock::now() - frame.time).count() / SIMULATION_STEP;
+    renderState = interpolateSimulation(frame.previous, frame.current, (float)std::min(std::max(t, 0.0), 1.0));
+}
+
+// serial: input, the steps this frame pays for and the blend, all on this thread;
+// threaded: hand the keys over and take whatever the simulation thread has done by now
+void updateSimulation(double frameSeconds) {
+    if (simulationThreaded) {
+        InputFrame& input = inputBuffer.writeBuffer();
+        memcpy(input.keys, pressedKeys, sizeof(input.keys));
+        inputBuffer.publish();
+        receiveSimulation();
+    } else {
+        advanceSimulation(updateInput(pressedKeys, frameSeconds));
+    }
+}
+
+// features every basic shader draw needs this frame, the material adds SPECULAR_MAP per mesh
+unsigned int sceneFeatures() {
+    unsigned int features = 0;
+    if (fogEnabled)
+        features |= gps::FEATURE_FOG;
+    if (shadowsEnabled)
+        features |= gps::FEATURE_SHADOWS;
+    if (shadowsEnabled && pcfEnabled)
+        features |= gps::FEATURE_PCF;
+    if (pointLights.getCount() > 0)
+        features |= gps::FEATURE_POINT_LIGHTS;
+    if (pointLights.getCount() > 0 && clusteredEnabled)
+        features |= gps::FEATURE_CLUSTERED;
+    return features;
+}
+
+// the depth passes only read positions, the main pass picks the cheapest basic shader variant per mesh
+void drawModel(gps::Model3D& object, const glm::mat4& transform, RENDER_PASS pass) {
+    if (pass == SHADOW_PASS) {
+        object.DrawDepth(myShadowShader, transform);
+    }
+    else if (pass == DEPTH_PREPASS) {
+        object.DrawDepth(myDepthShader, transform);
+    }
+    else if (pass == GBUFFER_PASS) {
+        object.Draw(myGBufferShaders, 0, transform);
+    }
+    else {
+        object.Draw(myBasicShaders, sceneFeatures(), transform);
+    }
+}
+
+// The transforms are drawn from the interpolated state, not the simulation's. Entities whose pose has the
+// revision their cached transform was built from keep it (static objects, stopped animations), each run of
+// the others goes through the batched kernel.
+void updateRenderTransforms() {
+    gps::CpuZone zone("updateRenderTransforms");
+    size_t count = renderState.revisions.size();
+    renderTransforms.resize(count);
+    renderNormalMatrices.resize(count);
+    renderedRevisions.resize(count, NO_REVISION);
+    size_t i = 0;
+    while (i < count) {
+        unsigned int revision = renderState.revisions[i];
+        if (revision != NO_REVISION && renderedRevisions[i] == revision) {
+            i++;
+            continue;
+        }
+        size_t end = i;
+        for (; end < count; end++) {
+            revision = renderState.revisions[end];
+            if (revision != NO_REVISION && renderedRevisions[end] == revision)
+                break;
+            renderedRevisions[end] = revision;
+        }
+        gps::Scene::composeTransforms(&renderState.positions[i], &renderState.angles[i], &renderState.scales[i], (int)(end - i),
+            &renderTransforms[i], &renderNormalMatrices[i]);
+        i = end;
+    }
+}
+
+void renderGround(RENDER_PASS pass) {
+    model = renderTransforms[groundEntity];
+    drawModel(ground, model, pass);
+}
+
+void renderSkyBox(gps::Shader shader) {
+    // view and projection come from the FrameData block
+    mySkyBox.Draw(shader);
+}
+
+gps::DrawList& drawListOf(RENDER_PASS pass) {
+    return pass == SHADOW_PASS ? shadowDrawList : cameraDrawList;
+}
+
+// GPU culling: one entry per mesh of every model the view can draw, whatever the instance count. The payload holds
+// the model in its high 32 bits and the mesh in the low ones.
+void queueGpuPass(RENDER_PASS pass) {
+    bool depthOnly = pass == SHADOW_PASS || pass == DEPTH_PREPASS;
+    gps::GpuCulling::View cullView = pass == SHADOW_PASS ? gps::GpuCulling::SHADOW_VIEW : gps::GpuCulling::CAMERA_VIEW;
+    unsigned int features = sceneFeatures();
+    for (int m = 0; m < MODEL_COUNT; m++) {
+        if (gpuCulling.getInstanceCount(cullView, m) == 0)
+            continue;
+        gps::Model3D& object = *sceneModels[m];
+        for (int mesh = 0; mesh < object.GetMeshCount(); mesh++) {
+            unsigned int program = 0;
+            unsigned int material = 0;
+            if (!depthOnly) {
+                program = object.GetMeshFeatures(mesh);
+                if (pass == MAIN_PASS)
+                    program = gps::ShaderVariants::normalize(features | program);
+                material = meshMaterials[m][mesh];
             }
-            if (nanosuitAngleY == 90.0f || nanosuitAngleY == 270.0f) {
-                nanosuitAnimationTurning = false;
-                nanosuitAnimationDirection = !nanosuitAnimationDirection;
+            unsigned long long key = gps::DrawQueue::makeKey(pass, program, material,
+                object.GetMeshVertexArray(mesh, depthOnly), 0.0f, CAMERA_FAR);
+            drawQueue.push(key, (unsigned long long)m << 32 | (unsigned int)mesh);
+        }
+    }
+}
+
+// one entry per mesh of every batch, the payload holds the batch in its high 32 bits and the mesh in the low ones.
+// The depth passes bind no material and a single program, the program field of the others is the variant the draw
+// will use.
+void queuePass(RENDER_PASS pass) {
+    if (gpuCullingEnabled) {
+        queueGpuPass(pass);
+        return;
+    }
+    bool depthOnly = pass == SHADOW_PASS || pass == DEPTH_PREPASS;
+    unsigned int features = sceneFeatures();
+    const std::vector<gps::DrawBatch>& batches = drawListOf(pass).getBatches();
+    for (size_t b = 0; b < batches.size(); b++) {
+        gps::Model3D& object = *sceneModels[batches[b].model];
+        for (int mesh = 0; mesh < object.GetMeshCount(); mesh++) {
+            unsigned int program = 0;
+            unsigned int material = 0;
+            if (!depthOnly) {
+                program = object.GetMeshFeatures(mesh);
+                if (pass == MAIN_PASS)
+                    program = gps::ShaderVariants::normalize(features | program);
+                material = meshMaterials[batches[b].model][mesh];
             }
+            unsigned long long key = gps::DrawQueue::makeKey(pass, program, material,
+                object.GetMeshVertexArray(mesh, depthOnly), batches[b].depth, CAMERA_FAR);
+            drawQueue.push(key, (unsigned long long)b << 32 | (unsigned int)mesh);
+        }
+    }
+}
+
+// all passes go in one queue and one sort, each pass then runs its own range of it
+void queueDraws() {
+    gps::CpuZone zone("queueDraws");
+    drawQueue.clear();
+    queuePass(SHADOW_PASS);
+    queuePass(DEPTH_PREPASS);
+    queuePass(MAIN_PASS);
+    queuePass(GBUFFER_PASS);
+    if (sortKeysEnabled)
+        drawQueue.sort();
+}
+
+// The biggest objects with an occluder mesh in the view, at most MAX_OCCLUDERS, go into the buffer. The size is
+// the bounding sphere's radius in buffer pixels, from the scale of the view's y row (x row for the bounds).
+void rasterizeOccluders(gps::OcclusionBuffer& buffer, const glm::mat4& viewProjection, const gps::RenderObject* objects,
+    int objectCount) {
+    buffer.begin(viewProjection);
+    GLfloat columnScale = glm::length(glm::vec3(viewProjection[0][0], viewProjection[1][0], viewProjection[2][0]));
+    GLfloat rowScale = glm::length(glm::vec3(viewProjection[0][1], viewProjection[1][1], viewProjection[2][1]));
+    occluderCandidates.clear();
+    for (int i = 0; i < objectCount; i++) {
+        const gps::RenderObject& object = objects[i];
+        if (sceneModels[object.model]->GetOccluderTriangles().empty())
+            continue;
+        const glm::mat4& transform = object.transform;
+        glm::vec4 center = viewProjection * transform * glm::vec4(glm::vec3(object.bounds), 1.0f);
+        if (center.w <= 0.0f)
+            continue;
+        GLfloat scale = std::max(glm::length(glm::vec3(transform[0])),
+            std::max(glm::length(glm::vec3(transform[1])), glm::length(glm::vec3(transform[2]))));
+        GLfloat radius = object.bounds.w * scale / center.w;
+        if (fabsf(center.x / center.w) - radius * columnScale > 1.0f || fabsf(center.y / center.w) - radius * rowScale > 1.0f)
+            continue;
+        GLfloat pixels = radius * rowScale * 0.5f * buffer.getHeight();
+        if (pixels >= OCCLUDER_MIN_PIXELS)
+            occluderCandidates.push_back(std::make_pair(pixels, i));
+    }
+    std::sort(occluderCandidates.begin(), occluderCandidates.end(), std::greater<std::pair<GLfloat, int> >());
+    for (size_t c = 0; c < occluderCandidates.size() && c < (size_t)MAX_OCCLUDERS; c++) {
+        const gps::RenderObject& object = objects[occluderCandidates[c].second];
+        const std::vector<glm::vec3>& triangles = sceneModels[object.model]->GetOccluderTriangles();
+        buffer.addOccluder(triangles.data(), (int)triangles.size(), object.transform);
+    }
+    buffer.rasterize();
+}
+
+void prepareOcclusion(const glm::mat4& viewProjection) {
+    gps::CpuZone zone("prepareOcclusion");
+    if (!occlusionCullingEnabled) {
+        cameraDrawList.setOcclusion(NULL);
+        return;
+    }
+    rasterizeOccluders(cameraOcclusion, viewProjection, sceneObjects.data(), (int)sceneObjects.size());
+    cameraDrawList.setOcclusion(&cameraOcclusion);
+}
+
+// the entities with or without the given flags, in entity order
+void addRenderObjects(unsigned char flags, unsigned char values) {
+    size_t count = renderTransforms.size();
+    for (size_t i = 0; i < count; i++) {
+        if ((scene.entityFlags[i] & flags) != values)
+            continue;
+        gps::RenderObject object;
+        object.model = scene.models[i];
+        object.id = (unsigned int)i;
+        object.transform = renderTransforms[i];
+        object.normalMatrix = renderNormalMatrices[i];
+        object.bounds = scene.bounds[i];
+        sceneModels[object.model]->GetBoundingBox(&object.boxMin, &object.boxMax);
+        sceneObjects.push_back(object);
+    }
+}
+
+// an entity as the culling shader reads it
+void fillGpuInstance(size_t i) {
+    gps::GpuInstance& instance = gpuInstances[i];
+    instance.transform = renderTransforms[i];
+    for (int column = 0; column < 3; column++)
+        instance.normalMatrix[column] = glm::vec4(renderNormalMatrices[i][column], 0.0f);
+    glm::vec3 boxMin, boxMax;
+    sceneModels[scene.models[i]]->GetBoundingBox(&boxMin, &boxMax);
+    instance.boxMin = glm::vec4(boxMin, 1.0f);
+    instance.boxMax = glm::vec4(boxMax, 1.0f);
+    instance.model = scene.models[i];
+    // the static entities are already in the cached static shadow layers
+    instance.viewMask = 1u << gps::GpuCulling::CAMERA_VIEW;
+    if (!(scene.entityFlags[i] & gps::ENTITY_STATIC))
+        instance.viewMask |= 1u << gps::GpuCulling::SHADOW_VIEW;
+    gpuRevisions[i] = renderedRevisions[i];
+}
+
+// The entities go up whole when the set changed, otherwise only the runs whose transforms were rebuilt this frame,
+// then both views are culled on the GPU.
+void prepareGpuCulling() {
+    gps::CpuZone zone("prepareGpuCulling");
+    size_t count = renderTransforms.size();
+    bool rebuild = gpuInstances.size() != count;
+    if (rebuild) {
+        gpuInstances.resize(count);
+        gpuRevisions.assign(count, NO_REVISION);
+    }
+    size_t i = 0;
+    while (i < count) {
+        if (!rebuild && renderedRevisions[i] != NO_REVISION && gpuRevisions[i] == renderedRevisions[i]) {
+            i++;
+            continue;
+        }
+        size_t end = i;
+        for (; end < count; end++) {
+            if (!rebuild && renderedRevisions[end] != NO_REVISION && gpuRevisions[end] == renderedRevisions[end])
+                break;
+            // an entity that changed model moves to another model's range
+            if (gpuInstances[end].model != (GLuint)scene.models[end])
+                rebuild = true;
+            fillGpuInstance(end);
         }
+        if (!rebuild)
+            gpuCulling.updateInstances((int)i, &gpuInstances[i], (int)(end - i));
+        i = end;
     }
+    if (rebuild)
+        gpuCulling.setInstances(gpuInstances.data(), (int)count);
+
+    gpuCulling.cull(projection * view, shadowCascades.getLightSpaceTrMatrices(), shadowCascades.getCascadeCount());
 }
 
-void renderTeapot(gps::Shader shader, bool depthPass) {
-    // select active shader program
-    shader.useShaderProgram();
+// Gathers the objects of the interpolated state and builds the camera's draw list and the shadow casters' one.
+// The shadow list is culled against the cascades instead of the camera, casters outside the view still cast into it.
+void prepareDrawLists() {
+    gps::CpuZone zone("prepareDrawLists");
 
-    model = glm::translate(glm::mat4(1.0f), glm::vec3(teapotPositionX, teapotPositionY, teapotPositionZ));
-    model = glm::rotate(model, glm::radians(teapotAngleX), glm::vec3(1.0f, 0.0f, 0.0f));
-    model = glm::rotate(model, glm::radians(teapotAngleY), glm::vec3(0.0f, 1.0f, 0.0f));
-    model = glm::rotate(model, glm::radians(teapotAngleZ), glm::vec3(0.0f, 0.0f, 1.0f));
+    updateRenderTransforms();
+    if (gpuCullingEnabled) {
+        prepareGpuCulling();
+        queueDraws();
+        return;
+    }
+    sceneObjects.clear();
+    addRenderObjects(gps::ENTITY_STATIC, 0);
+    dynamicObjectCount = (int)sceneObjects.size();
+    addRenderObjects(gps::ENTITY_STATIC, gps::ENTITY_STATIC);
+
+    glm::mat4 viewProjection = projection * view;
+    GLfloat pixelScale = 0.5f * (GLfloat)myWindow.getWindowDimensions().height * projection[1][1];
+    prepareOcclusion(viewProjection);
+    if (occlusionQueries.isEnabled()) {
+        occlusionQueries.beginFrame(viewProjection);
+        cameraDrawList.setQueries(&occlusionQueries);
+    } else {
+        cameraDrawList.setQueries(NULL);
+    }
+    cameraDrawList.build(sceneObjects.data(), (int)sceneObjects.size(), &viewProjection, 1, true,
+        renderState.cameraPosition, pixelScale);
+    if (occlusionQueries.isEnabled()) {
+        const std::vector<int>& queryObjects = cameraDrawList.getQueryObjects();
+        for (size_t i = 0; i < queryObjects.size(); i++) {
+            const gps::RenderObject& object = sceneObjects[queryObjects[i]];
+            occlusionQueries.addBox(object.id, object.boxMin, object.boxMax, object.transform);
+        }
+    }
+
+    // the ground is already in the cached static layers. Distances are taken from a point out towards the light,
+    // so the casters sort front to back as the light sees them.
+    glm::vec3 lightEye = renderState.cameraPosition + renderState.lightDir * (2.0f * SHADOW_DISTANCE);
+    shadowDrawList.build(sceneObjects.data(), dynamicObjectCount, shadowCascades.getLightSpaceTrMatrices(),
+        shadowCascades.getCascadeCount(), false, lightEye, 0.0f);
 
-    //send teapot model matrix data to shader
-    glUniformMatrix4fv(glGetUniformLocation(shader.shaderProgram, "model"),
-        1, GL_FALSE, glm::value_ptr(model));
+    queueDraws();
+}
 
-    //send teapot normal matrix data to shader
-    if (!depthPass) {
-        normalMatrix = glm::mat3(glm::inverseTranspose(view * model));
-        glUniformMatrix3fv(glGetUniformLocation(shader.shaderProgram, "normalMatrix"),
-            1, GL_FALSE, glm::value_ptr(normalMatrix));
+// GPU culling: every model reads its instances from the view's buffer while the pass draws, each mesh with its
+// command. The models read their own buffers again after, for the draws outside the lists.
+void submitGpuDraws(RENDER_PASS pass) {
+    gps::GpuCulling::View cullView = pass == SHADOW_PASS ? gps::GpuCulling::SHADOW_VIEW : gps::GpuCulling::CAMERA_VIEW;
+    for (int m = 0; m < MODEL_COUNT; m++)
+        sceneModels[m]->UseInstanceBuffer(gpuCulling.getInstanceBuffer(cullView));
+    gpuCulling.bindCommands();
+
+    if (pass == SHADOW_PASS)
+        myShadowShader.useShaderProgram();
+    else if (pass == DEPTH_PREPASS)
+        myDepthShader.useShaderProgram();
+    unsigned int features = sceneFeatures();
+
+    int begin, end;
+    drawQueue.passRange(pass, &begin, &end);
+    for (int i = begin; i < end; i++) {
+        unsigned long long payload = drawQueue[i].payload;
+        int m = (int)(payload >> 32);
+        int mesh = (int)(payload & 0xffffffff);
+        gps::Model3D& object = *sceneModels[m];
+        GLintptr command = gpuCulling.getCommandOffset(cullView, m, mesh);
+        if (pass == SHADOW_PASS || pass == DEPTH_PREPASS)
+            object.DrawMeshDepthIndirect(mesh, command);
+        else if (pass == GBUFFER_PASS)
+            object.DrawMeshIndirect(myGBufferShaders.use(object.GetMeshFeatures(mesh)), mesh, command);
+        else
+            object.DrawMeshIndirect(myBasicShaders.use(features | object.GetMeshFeatures(mesh)), mesh, command);
     }
 
-    // draw teapot
-    teapot.Draw(shader);
+    glBindBuffer(GL_DRAW_INDIRECT_BUFFER, 0);
+    for (int m = 0; m < MODEL_COUNT; m++)
+        sceneModels[m]->UseInstanceBuffer(0);
+}
+
+// the instances of every batch go up once, then the pass's draws run in key order
+void submitDraws(RENDER_PASS pass) {
+    if (gpuCullingEnabled) {
+        submitGpuDraws(pass);
+        return;
+    }
+    gps::DrawList& list = drawListOf(pass);
+    const std::vector<gps::DrawBatch>& batches = list.getBatches();
+    for (size_t b = 0; b < batches.size(); b++)
+        sceneModels[batches[b].model]->PrepareInstances(list.getInstances() + batches[b].first, batches[b].count);
+
+    if (pass == SHADOW_PASS)
+        myShadowShader.useShaderProgram();
+    else if (pass == DEPTH_PREPASS)
+        myDepthShader.useShaderProgram();
+    unsigned int features = sceneFeatures();
+
+    int begin, end;
+    drawQueue.passRange(pass, &begin, &end);
+    for (int i = begin; i < end; i++) {
+        unsigned long long payload = drawQueue[i].payload;
+        const gps::DrawBatch& batch = batches[payload >> 32];
+        int mesh = (int)(payload & 0xffffffff);
+        gps::Model3D& object = *sceneModels[batch.model];
+        // the query is a frame old, waiting on it is a wait on the GPU that is already over. Without waiting, the
+        // pre-pass and the main pass could decide differently.
+        if (batch.query)
+            glBeginConditionalRender(batch.query, GL_QUERY_WAIT);
+        if (pass == SHADOW_PASS || pass == DEPTH_PREPASS)
+            object.DrawMeshDepth(mesh, batch.count);
+        else if (pass == GBUFFER_PASS)
+            object.DrawMesh(myGBufferShaders.use(object.GetMeshFeatures(mesh)), mesh, batch.count);
+        else
+            object.DrawMesh(myBasicShaders.use(features | object.GetMeshFeatures(mesh)), mesh, batch.count);
+        if (batch.query)
+            glEndConditionalRender();
+    }
 }
 
-void renderNanosuit(gps::Shader shader, bool depthPass) {
-    shader.useShaderProgram();
+// The boxes of this frame's tracked objects against the camera's finished depth buffer, nothing written.
+// The pass's depth func and mask are put back after.
+void issueOcclusionQueries(GLenum depthFunc, GLboolean depthMask) {
+    if (!occlusionQueries.isEnabled())
+        return;
+    gps::GpuScope scope(&gpuProfiler, "occlusion queries");
+    myDepthShader.useShaderProgram();
+    gps::GLState::colorMask(GL_FALSE);
+    gps::GLState::depthMask(GL_FALSE);
+    gps::GLState::depthFunc(GL_LEQUAL);
+    occlusionQueries.issue();
+    gps::GLState::colorMask(GL_TRUE);
+    gps::GLState::depthFunc(depthFunc);
+    gps::GLState::depthMask(depthMask);
+}
 
-    model = glm::translate(glm::mat4(1.0f), glm::vec3(nanosuitPositionX, nanosuitPositionY, nanosuitPositionZ));
-    model = glm::rotate(model, glm::radians(nanosuitAngleX), glm::vec3(1.0f, 0.0f, 0.0f));
-    model = glm::rotate(model, glm::radians(nanosuitAngleY), glm::vec3(0.0f, 1.0f, 0.0f));
-    model = glm::rotate(model, glm::radians(nanosuitAngleZ), glm::vec3(0.0f, 0.0f, 1.0f));
+void renderObjects(RENDER_PASS pass) {
+    submitDraws(pass);
+}
 
-    glUniformMatrix4fv(glGetUniformLocation(shader.shaderProgram, "model"),
-        1, GL_FALSE, glm::value_ptr(model));
+void updateShadowCascades() {
+    float aspect = (float)myWindow.getWindowDimensions().width / (float)myWindow.getWindowDimensions().height;
+    shadowCascades.update(view, glm::radians(CAMERA_FOV), aspect, CAMERA_NEAR, renderState.lightDir);
+}
 
-    if (!depthPass) {
-        normalMatrix = glm::mat3(glm::inverseTranspose(view * model));
-        glUniformMatrix3fv(glGetUniformLocation(shader.shaderProgram, "normalMatrix"),
-            1, GL_FALSE, glm::value_ptr(normalMatrix));
+// all cascades are drawn at once, shadow.geom sends each triangle to the layers it touches.
+// Static casters (the ground) only go into the cached static layers when a cascade was refit,
+// the dynamic ones are drawn every frame on top of a copy of those layers.
+void beginShadowPass() {
+    myShadowShader.useShaderProgram();
+    gps::GLState::viewport(0, 0, SHADOW_RESOLUTION, SHADOW_RESOLUTION);
+    // casters between the light and a cascade's near plane still have to land in the map
+    glEnable(GL_DEPTH_CLAMP);
+
+    GLint refreshMask = shadowCascades.getStaticRefreshMask();
+    if (refreshMask) {
+        shadowCascades.beginStaticPass();
+        glUniform1i(cascadeMaskLoc, refreshMask);
+        renderGround(SHADOW_PASS);
+        shadowCascades.endStaticPass();
     }
 
-    // draw teapot
-    nanosuit.Draw(shader);
+    shadowCascades.beginDynamicPass();
+    glUniform1i(cascadeMaskLoc, shadowCascades.getAllCascadesMask());
+}
+
+void endShadowPass() {
+    shadowCascades.endDynamicPass();
+    glDisable(GL_DEPTH_CLAMP);
+    gps::GLState::bindFramebuffer(0);
+}
+
+void renderShadowCasters() {
+    // the ground is static and already in the map
+    submitDraws(SHADOW_PASS);
 }
 
-void renderGround(gps::Shader shader, bool depthPass) {
-    shader.useShaderProgram();
+void updateFrameUniforms() {
+    view = glm::lookAt(renderState.cameraPosition, renderState.cameraTarget, renderState.cameraUp);
+
+    frameUniforms.setView(view);
+    frameUniforms.setProjection(projection);
+    updateShadowCascades();
+    frameUniforms.setShadowCascades(shadowCascades);
+    frameUniforms.setLightDir(renderState.lightDir);
+    frameUniforms.setLightColor(lightColor);
+    frameUniforms.setLightColorCoeff(renderState.lightColorCoeff);
+    frameUniforms.setFogEnabled(fogEnabled);
+    frameUniforms.setPointLightCount(pointLights.getCount());
+    pointLights.update(view);
+
+    // single upload for every program, skipped if nothing changed since last frame
+    frameUniforms.upload();
+
+    // culled against this frame's view and cascades
+    prepareDrawLists();
+}
 
-    model = glm::translate(glm::mat4(1.0f), glm::vec3(0.0f, -0.75f, 0.0f));
-    model = glm::scale(model, glm::vec3(1.0f));
+// every fragment that passes the depth test adds one to its pixel's stencil value (saturating at 255)
+void beginOverdrawMeasurement() {
+    glClear(GL_STENCIL_BUFFER_BIT);
+    glEnable(GL_STENCIL_TEST);
+    glStencilFunc(GL_ALWAYS, 0, 0xFF);
+    glStencilOp(GL_KEEP, GL_KEEP, GL_INCR);
+}
 
-    glUniformMatrix4fv(glGetUniformLocation(shader.shaderProgram, "model"),
-        1, GL_FALSE, glm::value_ptr(model));
+void endOverdrawMeasurement() {
+    glDisable(GL_STENCIL_TEST);
+}
 
-    if (!depthPass) {
-        normalMatrix = glm::mat3(glm::inverseTranspose(view * model));
-        glUniformMatrix3fv(glGetUniformLocation(shader.shaderProgram, "normalMatrix"),
-            1, GL_FALSE, glm::value_ptr(normalMatrix));
+// reads the counts of the last measured pass back, stalls until the frame is done
+OverdrawStats readOverdraw() {
+    int width = myWindow.getWindowDimensions().width;
+    int height = myWindow.getWindowDimensions().height;
+    std::vector<GLubyte> counts((size_t)width * height);
+
+    glPixelStorei(GL_PACK_ALIGNMENT, 1);
+    glReadPixels(0, 0, width, height, GL_STENCIL_INDEX, GL_UNSIGNED_BYTE, counts.data());
+
+    OverdrawStats stats = { 0, 0, 0 };
+    for (size_t i = 0; i < counts.size(); i++) {
+        if (counts[i] == 0)
+            continue;
+        stats.shadedFragments += counts[i];
+        stats.coveredPixels++;
+        if (counts[i] > stats.maxPerPixel)
+            stats.maxPerPixel = counts[i];
     }
+    return stats;
+}
 
-    ground.Draw(shader);
+void printOverdraw(const OverdrawStats& stats) {
+    fprintf(stdout, "overdraw (depth pre-pass %s): %llu fragments shaded on %llu pixels, %.2f per pixel, max %u\n",
+        depthPrepassEnabled ? "on" : "off", stats.shadedFragments, stats.coveredPixels,
+        stats.coveredPixels ? (double)stats.shadedFragments / stats.coveredPixels : 0.0, stats.maxPerPixel);
 }
 
-void renderSkyBox(gps::Shader shader) {
-    shader.useShaderProgram();
+// light lists per froxel for this frame's view, the point lights are already in view space
+void updateLightClusters() {
+    lightClusters.build(pointLights.getViewSpaceLights(), projection,
+        myWindow.getWindowDimensions().width, myWindow.getWindowDimensions().height);
+    lightClusters.bind();
+}
 
-    view = myCamera.getViewMatrix();
-    glUniformMatrix4fv(glGetUniformLocation(shader.shaderProgram, "view"), 1, GL_FALSE,
-        glm::value_ptr(view));
+void printDrawListStats(const char* label, const gps::DrawListStats& stats) {
+    fprintf(stdout, "Draw list, %s: %u objects, %u culled, %u too small, %u occluded, %u query hidden, %u instances in %u batches, %.3f ms prep, %.3f ms merge\n",
+        label, stats.objects, stats.culled, stats.tooSmall, stats.occluded, stats.queryHidden, stats.instances, stats.batches,
+        stats.prepMs, stats.mergeMs);
+}
 
-    projection = glm::perspective(glm::radians(45.0f),
-        (float)myWindow.getWindowDimensions().width / (float)myWindow.getWindowDimensions().height,
-        0.1f, 1000.0f);
-    glUniformMatrix4fv(glGetUniformLocation(shader.shaderProgram, "projection"), 1, GL_FALSE,
-        glm::value_ptr(projection));
+void printQueryStats(const char* label, const gps::OcclusionQueryStats& stats) {
+    fprintf(stdout, "Occlusion queries, %s: %u issued, %u edge boxes, %u visible, %u occluded, %u pending, %u objects %s\n",
+        label, stats.issued, stats.edgeBoxes, stats.visible, stats.occluded, stats.pending, stats.hidden,
+        occlusionQueries.isConditional() ? "drawn conditionally" : "skipped");
+}
 
-    mySkyBox.Draw(shader, view, projection);
+void printGpuCullingStats() {
+    gps::GpuCullingStats stats = gpuCulling.getStats();
+    unsigned int cameraCounts[gps::GpuCulling::MAX_MODELS];
+    unsigned int shadowCounts[gps::GpuCulling::MAX_MODELS];
+    gpuCulling.readVisibleCounts(gps::GpuCulling::CAMERA_VIEW, cameraCounts);
+    gpuCulling.readVisibleCounts(gps::GpuCulling::SHADOW_VIEW, shadowCounts);
+    unsigned int cameraVisible = 0;
+    unsigned int shadowVisible = 0;
+    for (int m = 0; m < MODEL_COUNT; m++) {
+        cameraVisible += cameraCounts[m];
+        shadowVisible += shadowCounts[m];
+    }
+    fprintf(stdout, "GPU culling, last frame: %u instances, %u visible to the camera, %u to the shadows, %u commands per view, "
+        "%.3f ms cull, %.3f ms pyramid (CPU)\n", stats.instances, cameraVisible, shadowVisible, stats.commands, stats.cullMs,
+        stats.pyramidMs);
 }
 
-void renderObjects(gps::Shader shader, bool depthPass) {
-    // render the teapot
-    renderTeapot(shader, depthPass);
+void printOcclusionStats(const char* label, const gps::OcclusionStats& stats) {
+    fprintf(stdout, "Occlusion buffer, %s: %u occluders, %u triangles, %.3f ms raster, %u of %u tested boxes occluded\n",
+        label, stats.occluders, stats.triangles, stats.rasterMs, stats.occluded, stats.tested);
+}
 
-    // render the nanosuit
-    renderNanosuit(shader, depthPass);
+void printClusterStats(const char* label, const gps::ClusterStats& stats, unsigned int builds) {
+    if (builds == 0)
+        return;
+    fprintf(stdout, "Light clusters, %s: %.3f ms assignment, %.2f lights per cluster, %.2f per non-empty cluster, max %u\n",
+        label, stats.assignMs / builds, (double)stats.lightIndices / ((double)gps::LightClusters::CLUSTER_COUNT * builds),
+        stats.occupiedClusters ? (double)stats.lightIndices / stats.occupiedClusters : 0.0, stats.maxLightsPerCluster);
+}
 
-   // render the ground
-    renderGround(shader, depthPass);
+// With the pre-pass the depth buffer is complete before anything is shaded, the main pass then
+// tests with GL_EQUAL and doesn't write depth, so hidden fragments never run the lighting shader.
+void renderForwardPass() {
+    gps::GLState::viewport(0, 0, myWindow.getWindowDimensions().width, myWindow.getWindowDimensions().height);
+    glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
 
-    // render skybox
+    //bind the shadow map, every basic shader variant reads it from unit 3
+    gps::GLState::bindTexture(3, GL_TEXTURE_2D_ARRAY, shadowCascades.getDepthTexture());
+    gps::GLState::bindTexture(gps::PointLights::TEXTURE_UNIT, GL_TEXTURE_BUFFER, pointLights.getTexture());
+    if (sceneFeatures() & gps::FEATURE_CLUSTERED)
+        updateLightClusters();
+
+    if (depthPrepassEnabled) {
+        gps::GpuScope scope(&gpuProfiler, "depth pre-pass");
+        gps::GLState::colorMask(GL_FALSE);
+        renderObjects(DEPTH_PREPASS);
+        gps::GLState::colorMask(GL_TRUE);
+        gps::GLState::depthFunc(GL_EQUAL);
+        gps::GLState::depthMask(GL_FALSE);
+    }
+
+    // only the shading pass is counted, the skybox isn't part of the scene's overdraw
+    if (overdrawMeasurement)
+        beginOverdrawMeasurement();
+    gpuProfiler.beginScope("main pass");
+    renderObjects(MAIN_PASS);
+    gpuProfiler.endScope();
+    if (overdrawMeasurement)
+        endOverdrawMeasurement();
+
+    issueOcclusionQueries(depthPrepassEnabled ? GL_EQUAL : GL_LESS, depthPrepassEnabled ? GL_FALSE : GL_TRUE);
+
+    // render skybox, it casts no shadows (it sets its own depth func)
+    gpuProfiler.beginScope("skybox");
     renderSkyBox(mySkyBoxShader);
+    gpuProfiler.endScope();
+
+    // the next clear must write depth again
+    gps::GLState::depthFunc(GL_LESS);
+    gps::GLState::depthMask(GL_TRUE);
 }
 
-glm::mat4 computeLightSpaceTrMatrix() {
-    lightView = glm::lookAt(lightDir, glm::vec3(0.0f), glm::vec3(0.0f, 1.0f, 0.0f));
-    lightProjection = glm::ortho(-10.0f, 10.0f, -10.0f, 10.0f, near_plane, far_plane);
-    lightSpaceTrMatrix = lightProjection * lightView;
-    return lightSpaceTrMatrix;
+// The scene is drawn once into the G-buffer, every point light then only shades the pixels inside its volume
+// and the composite adds the sun on top, so the geometry cost doesn't depend on the number of lights.
+void renderDeferredPass() {
+    deferredRenderer.resize(myWindow.getWindowDimensions().width, myWindow.getWindowDimensions().height);
+
+    gpuProfiler.beginScope("geometry pass");
+    deferredRenderer.beginGeometryPass();
+    renderObjects(GBUFFER_PASS);
+    issueOcclusionQueries(GL_LESS, GL_TRUE);
+    deferredRenderer.endGeometryPass();
+    gpuProfiler.endScope();
+
+    gpuProfiler.beginScope("light pass");
+    deferredRenderer.beginLightPass();
+    if (pointLights.getCount() > 0) {
+        myLightVolumeShader.useShaderProgram();
+        deferredRenderer.drawLightVolumes(pointLights.getCount());
+    }
+    deferredRenderer.endLightPass();
+    gpuProfiler.endScope();
+
+    gpuProfiler.beginScope("composite");
+    deferredRenderer.beginCompositePass();
+    gps::GLState::bindTexture(3, GL_TEXTURE_2D_ARRAY, shadowCascades.getDepthTexture());
+    myDeferredShaders.use(sceneFeatures() & DEFERRED_FEATURES);
+    deferredRenderer.drawFullScreen();
+    deferredRenderer.endCompositePass();
+    gpuProfiler.endScope();
+
+    // render skybox behind the composited depth
+    gpuProfiler.beginScope("skybox");
+    renderSkyBox(mySkyBoxShader);
+    gpuProfiler.endScope();
 }
 
 void renderScene() {
+    gps::CpuZone zone("renderScene");
 
-    playAnimations();
+    updateFrameUniforms();
 
     // Prepare the shadows
     glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
 
-    myShadowShader.useShaderProgram();
+    // without shadows no variant samples the shadow map, so the pass can go
+    if (shadowsEnabled) {
+        gps::GpuScope scope(&gpuProfiler, "shadow pass");
+        beginShadowPass();
+        renderShadowCasters();
+        endShadowPass();
+    }
 
-    glUniformMatrix4fv(glGetUniformLocation(myShadowShader.shaderProgram, "lightSpaceTrMatrix"),
-        1, GL_FALSE, glm::value_ptr(computeLightSpaceTrMatrix()));
+    // Draw with shadows
+    if (deferredEnabled)
+        renderDeferredPass();
+    else
+        renderForwardPass();
+
+    // what next frame's Hi-Z test reads
+    if (gpuCullingEnabled && gpuCulling.isHiZEnabled()) {
+        gps::GpuScope scope(&gpuProfiler, "depth pyramid");
+        gpuCulling.buildDepthPyramid(projection * view, myWindow.getWindowDimensions().width,
+            myWindow.getWindowDimensions().height);
+    }
 
-    glViewport(0, 0, SHADOW_WIDTH, SHADOW_HEIGHT);
-    glBindFramebuffer(GL_FRAMEBUFFER, shadowMapFBO);
-    glClear(GL_DEPTH_BUFFER_BIT);
-    renderObjects(myShadowShader, true);
+    if (overdrawMeasurement && ++overdrawFrame % OVERDRAW_REPORT_FRAMES == 0)
+        printOverdraw(readOverdraw());
+}
 
-    glBindFramebuffer(GL_FRAMEBUFFER, 0);
+void renderInstancingBenchmarkFrame(gps::Model3D& benchmarkModel, const std::vector<glm::mat4>& transforms) {
+    // shadow pass
+    beginShadowPass();
+    benchmarkModel.DrawDepthInstanced(myShadowShader, transforms.data(), (GLsizei)transforms.size());
+    endShadowPass();
 
-    // Draw with shadows
-    glViewport(0, 0, myWindow.getWindowDimensions().width, myWindow.getWindowDimensions().height);
+    // main pass
+    gps::GLState::viewport(0, 0, myWindow.getWindowDimensions().width, myWindow.getWindowDimensions().height);
     glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+    gps::GLState::bindTexture(3, GL_TEXTURE_2D_ARRAY, shadowCascades.getDepthTexture());
+    benchmarkModel.DrawInstanced(myBasicShaders, sceneFeatures(), transforms.data(), (GLsizei)transforms.size());
+}
+
+// Draws 1, 100, 10k and 100k copies of a model in a grid (shadow + main pass) and prints the average frame time.
+// "static" reuses the uploaded instances, "animated" changes every transform each frame.
+void runInstancingBenchmark(const char* modelName) {
+    const GLsizei instanceCounts[] = { 1, 100, 10000, 100000 };
+    const int benchmarkFrames = 20;
+
+    gps::Model3D& benchmarkModel = strcmp(modelName, "nanosuit") == 0 ? nanosuit : teapot;
+
+    updateFrameUniforms();
+
+    for (int c = 0; c < 4; c++) {
+        GLsizei count = instanceCounts[c];
+
+        // square grid, 2 units apart, going away from the camera
+        std::vector<glm::mat4> transforms(count);
+        int side = (int)ceil(sqrt((double)count));
+        for (GLsizei i = 0; i < count; i++) {
+            float x = (float)(i % side - side / 2) * 2.0f;
+            float z = -(float)(i / side) * 2.0f;
+            transforms[i] = glm::translate(glm::mat4(1.0f), glm::vec3(x, 0.0f, z));
+        }
+
+        for (int animated = 0; animated < 2; animated++) {
+            // warm-up frame, uploads the instances
+            renderInstancingBenchmarkFrame(benchmarkModel, transforms);
+            glFinish();
+
+            double start = glfwGetTime();
+            for (int f = 0; f < benchmarkFrames; f++) {
+                if (animated) {
+                    for (GLsizei i = 0; i < count; i++)
+                        transforms[i] = glm::rotate(transforms[i], glm::radians(1.0f), glm::vec3(0.0f, 1.0f, 0.0f));
+                }
+                renderInstancingBenchmarkFrame(benchmarkModel, transforms);
+            }
+            glFinish();
+            double frameTime = (glfwGetTime() - start) * 1000.0 / benchmarkFrames;
+
+            fprintf(stdout, "instancing benchmark: %s x %d (%s): %.3f ms/frame\n",
+                modelName, count, animated ? "animated" : "static", frameTime);
+        }
+    }
+}
+
+void renderVariantBenchmarkFrame(unsigned int features) {
+    glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+    gps::Shader& shader = myBasicShaders.use(features);
+    teapot.Draw(shader, renderTransforms[teapotEntity]);
+    nanosuit.Draw(shader, renderTransforms[nanosuitEntity]);
+    ground.Draw(shader, renderTransforms[groundEntity]);
+}
+
+// Draws the scene's main pass with each basic shader variant forced on every mesh and prints the cost per frame and per pixel.
+// The shadow map is rendered once up front and the vertex work is the same for all variants, so the differences are fragment cost.
+void runVariantBenchmark() {
+    const int benchmarkFrames = 50;
+    int width = myWindow.getWindowDimensions().width;
+    int height = myWindow.getWindowDimensions().height;
+
+    updateFrameUniforms();
+
+    beginShadowPass();
+    renderShadowCasters();
+    endShadowPass();
+
+    gps::GLState::viewport(0, 0, width, height);
+    gps::GLState::bindTexture(3, GL_TEXTURE_2D_ARRAY, shadowCascades.getDepthTexture());
+
+    for (unsigned int features = 0; features <= gps::ShaderVariants::ALL_FEATURES; features++) {
+        if (gps::ShaderVariants::normalize(features) != features)
+            continue;
+
+        // warm-up frame, finishes the variant if it is still compiling
+        renderVariantBenchmarkFrame(features);
+        glFinish();
+
+        double start = glfwGetTime();
+        for (int f = 0; f < benchmarkFrames; f++)
+            renderVariantBenchmarkFrame(features);
+        glFinish();
+        double frameTime = (glfwGetTime() - start) * 1000.0 / benchmarkFrames;
+
+        fprintf(stdout, "variant benchmark: %-28s %.3f ms/frame, %.2f ns/pixel\n",
+            gps::ShaderVariants::describe(features).c_str(), frameTime, frameTime * 1000000.0 / ((double)width * height));
+    }
+}
+
+// Renders the main pass of the scene with and without the depth pre-pass and prints the frame time
+// and how many fragments were shaded per covered pixel. The shadow map is rendered once up front.
+void runPrepassBenchmark() {
+    const int benchmarkFrames = 50;
+
+    updateFrameUniforms();
+
+    beginShadowPass();
+    renderShadowCasters();
+    endShadowPass();
+
+    for (int prepass = 0; prepass < 2; prepass++) {
+        depthPrepassEnabled = prepass != 0;
+
+        // warm-up frame, finishes the programs if they are still compiling
+        overdrawMeasurement = false;
+        renderForwardPass();
+        glFinish();
+
+        double start = glfwGetTime();
+        for (int f = 0; f < benchmarkFrames; f++)
+            renderForwardPass();
+        glFinish();
+        double frameTime = (glfwGetTime() - start) * 1000.0 / benchmarkFrames;
+
+        // one more frame, counted
+        overdrawMeasurement = true;
+        renderForwardPass();
+        OverdrawStats stats = readOverdraw();
+        overdrawMeasurement = false;
+
+        fprintf(stdout, "pre-pass benchmark: depth pre-pass %-3s %.3f ms/frame, %.2f fragments shaded per pixel (%llu total, max %u)\n",
+            depthPrepassEnabled ? "on" : "off", frameTime,
+            stats.coveredPixels ? (double)stats.shadedFragments / stats.coveredPixels : 0.0,
+            stats.shadedFragments, stats.maxPerPixel);
+    }
+}
+
+// Renders the main pass forward and deferred with 1, 16, 128 and 1024 point lights and prints the frame times.
+// The shadow map is rendered once up front, both paths sample the same one.
+void runDeferredBenchmark() {
+    const int lightCounts[] = { 1, 16, 128, 1024 };
+    const int benchmarkFrames = 20;
+
+    // the shadow casters come from the draw lists
+    updateFrameUniforms();
+    beginShadowPass();
+    renderShadowCasters();
+    endShadowPass();
+
+    for (int c = 0; c < 4; c++) {
+        pointLights.generate(lightCounts[c]);
+        updateFrameUniforms();
+
+        double frameTimes[2];
+        for (int deferred = 0; deferred < 2; deferred++) {
+            // warm-up frame, finishes the programs if they are still compiling
+            if (deferred)
+                renderDeferredPass();
+            else
+                renderForwardPass();
+            glFinish();
+
+            double start = glfwGetTime();
+            for (int f = 0; f < benchmarkFrames; f++) {
+                if (deferred)
+                    renderDeferredPass();
+                else
+                    renderForwardPass();
+            }
+            glFinish();
+            frameTimes[deferred] = (glfwGetTime() - start) * 1000.0 / benchmarkFrames;
+        }
+
+        fprintf(stdout, "deferred benchmark: %4d point lights: forward %.3f ms/frame, deferred %.3f ms/frame\n",
+            lightCounts[c], frameTimes[0], frameTimes[1]);
+    }
+}
+
+// Renders the shadow and forward passes with the draws in queue order (model by model, mesh by mesh) and sorted
+// by key, and prints the frame time, the GL state calls issued and the fragments shaded per covered pixel.
+// The depth pre-pass stays off, the front to back order is all that keeps hidden fragments from being shaded.
+void runSortKeyBenchmark() {
+    const int benchmarkFrames = 20;
+    depthPrepassEnabled = false;
+
+    for (int sorted = 0; sorted < 2; sorted++) {
+        sortKeysEnabled = sorted != 0;
+        updateFrameUniforms();
+
+        // warm-up frame, finishes the programs if they are still compiling
+        renderScene();
+        glFinish();
+
+        double start = glfwGetTime();
+        for (int f = 0; f < benchmarkFrames; f++)
+            renderScene();
+        glFinish();
+        double frameTime = (glfwGetTime() - start) * 1000.0 / benchmarkFrames;
+
+        // one more frame, counted
+        gps::GLState::beginFrame();
+        overdrawMeasurement = true;
+        // not a report frame, renderScene leaves the counts to us
+        overdrawFrame = 1;
+        renderScene();
+        OverdrawStats stats = readOverdraw();
+        overdrawMeasurement = false;
+        gps::GLState::beginFrame();
+        gps::GLStateStats calls = gps::GLState::getFrameStats();
+
+        fprintf(stdout, "sort key benchmark: %-8s %d draws, %.3f ms/frame, %u state calls issued (%u skipped), "
+            "%.2f fragments shaded per pixel (%llu total)\n",
+            sortKeysEnabled ? "sorted" : "unsorted", drawQueue.size(), frameTime, calls.issued, calls.skipped,
+            stats.coveredPixels ? (double)stats.shadedFragments / stats.coveredPixels : 0.0, stats.shadedFragments);
+    }
+}
+
+// Renders the forward main pass with 1, 16, 128 and 1024 point lights, looping over every light and then
+// over the lights of each fragment's cluster, and prints the frame times and the assignment cost.
+void runClusterBenchmark() {
+    const int lightCounts[] = { 1, 16, 128, 1024 };
+    const int benchmarkFrames = 20;
+
+    // the shadow casters come from the draw lists
+    updateFrameUniforms();
+    beginShadowPass();
+    renderShadowCasters();
+    endShadowPass();
+
+    for (int c = 0; c < 4; c++) {
+        pointLights.generate(lightCounts[c]);
+        updateFrameUniforms();
+
+        double frameTimes[2];
+        for (int clustered = 0; clustered < 2; clustered++) {
+            clusteredEnabled = clustered != 0;
+            gps::ClusterStats before = lightClusters.getTotalStats();
+            unsigned int buildsBefore = lightClusters.getBuildCount();
+
+            // warm-up frame
+            renderForwardPass();
+            glFinish();
+
+            double start = glfwGetTime();
+            for (int f = 0; f < benchmarkFrames; f++)
+                renderForwardPass();
+            glFinish();
+            frameTimes[clustered] = (glfwGetTime() - start) * 1000.0 / benchmarkFrames;
+
+            if (clustered) {
+                gps::ClusterStats after = lightClusters.getTotalStats();
+                unsigned int builds = lightClusters.getBuildCount() - buildsBefore;
+                gps::ClusterStats last = lightClusters.getFrameStats();
+                fprintf(stdout, "cluster benchmark: %4d lights: all lights %.3f ms/frame, clustered %.3f ms/frame, "
+                    "assignment %.3f ms on %d threads, %.2f lights per cluster (%.2f per non-empty cluster, max %u)\n",
+                    lightCounts[c], frameTimes[0], frameTimes[1], (after.assignMs - before.assignMs) / builds,
+                    threadPool.getThreadCount(), (double)last.lightIndices / gps::LightClusters::CLUSTER_COUNT,
+                    last.occupiedClusters ? (double)last.lightIndices / last.occupiedClusters : 0.0, last.maxLightsPerCluster);
+            }
+        }
+    }
+}
+
+// Builds the camera draw list of objectCount teapots spread on a square around the camera with 1, 2, 4 and 8
+// threads and prints the time of the parallel prep and of the serial merge. No GL work, only the CPU side.
+void runDrawListBenchmark(int objectCount) {
+    const int threadCounts[] = { 1, 2, 4, 8 };
+    const int benchmarkBuilds = 20;
+
+    std::vector<gps::RenderObject> objects(objectCount);
+    int side = (int)ceil(sqrt((double)objectCount));
+    for (int i = 0; i < objectCount; i++) {
+        glm::vec3 position((float)(i % side - side / 2) * 2.0f, 0.0f, (float)(i / side - side / 2) * 2.0f);
+        objects[i].model = MODEL_TEAPOT;
+        objects[i].id = (unsigned int)i;
+        objects[i].transform = glm::rotate(glm::translate(glm::mat4(1.0f), position), (float)i, glm::vec3(0.0f, 1.0f, 0.0f));
+        // rotation only, its own normal matrix
+        objects[i].normalMatrix = glm::mat3(objects[i].transform);
+        objects[i].bounds = teapot.GetBounds();
+        teapot.GetBoundingBox(&objects[i].boxMin, &objects[i].boxMax);
+    }
+
+    glm::mat4 viewProjection = projection * view;
+    GLfloat pixelScale = 0.5f * (GLfloat)myWindow.getWindowDimensions().height * projection[1][1];
+    double singleThreadMs = 0.0;
+    for (int t = 0; t < 4; t++) {
+        gps::ThreadPool pool;
+        pool.init(threadCounts[t]);
+        gps::DrawList list;
+        list.init(&pool);
+
+        // warm-up build, sizes the lists
+        list.build(objects.data(), objectCount, &viewProjection, 1, true, renderState.cameraPosition, pixelScale);
+        double prepMs = 0.0;
+        double mergeMs = 0.0;
+        for (int b = 0; b < benchmarkBuilds; b++) {
+            list.build(objects.data(), objectCount, &viewProjection, 1, true, renderState.cameraPosition, pixelScale);
+            prepMs += list.getStats().prepMs;
+            mergeMs += list.getStats().mergeMs;
+        }
+        prepMs /= benchmarkBuilds;
+        mergeMs /= benchmarkBuilds;
+        if (t == 0)
+            singleThreadMs = prepMs;
+
+        gps::DrawListStats stats = list.getStats();
+        fprintf(stdout, "draw list benchmark: %d objects, %d threads: %.3f ms prep (%.2fx), %.3f ms merge, %u visible, %u culled, %u too small\n",
+            objectCount, threadCounts[t], prepMs, singleThreadMs / prepMs, mergeMs, stats.instances, stats.culled, stats.tooSmall);
+    }
+    fprintf(stdout, "draw list benchmark: %u hardware threads\n", std::thread::hardware_concurrency());
+}
+
+// A dense field of teapots and nanosuits on the ground in front of the camera, every other row shifted by half a
+// step so the next row fills the gaps. Culled for the camera with and without the occlusion buffer, on growing
+// thread counts.
+void runOcclusionBenchmark(int objectCount) {
+    const int threadCounts[] = { 1, 2, 4, 8 };
+    const int benchmarkBuilds = 20;
+
+    std::vector<gps::RenderObject> objects(objectCount + 1);
+    int side = (int)ceil(sqrt((double)objectCount));
+    for (int i = 0; i < objectCount; i++) {
+        int row = i / side;
+        int column = i % side;
+        SCENE_MODEL model = (row + column) % 2 == 0 ? MODEL_TEAPOT : MODEL_NANOSUIT;
+        glm::vec3 position(((float)(column - side / 2) + 0.5f * (row % 2)) * 1.2f, model == MODEL_NANOSUIT ? 0.25f : 0.0f,
+            -4.0f - (float)row * 1.2f);
+        objects[i].model = model;
+        objects[i].transform = glm::rotate(glm::translate(glm::mat4(1.0f), position), (float)i, glm::vec3(0.0f, 1.0f, 0.0f));
+        // rotation only, its own normal matrix
+        objects[i].normalMatrix = glm::mat3(objects[i].transform);
+    }
+    objects[objectCount].model = MODEL_GROUND;
+    objects[objectCount].transform = glm::translate(glm::mat4(1.0f), glm::vec3(0.0f, -0.75f, 0.0f));
+    objects[objectCount].normalMatrix = glm::mat3(1.0f);
+    for (size_t i = 0; i < objects.size(); i++) {
+        objects[i].id = (unsigned int)i;
+        objects[i].bounds = sceneModels[objects[i].model]->GetBounds();
+        sceneModels[objects[i].model]->GetBoundingBox(&objects[i].boxMin, &objects[i].boxMax);
+    }
+
+    // eye level, looking down the rows
+    glm::vec3 eye(0.0f, 0.5f, 0.0f);
+    glm::mat4 viewProjection = projection * glm::lookAt(eye, eye + glm::vec3(0.0f, 0.0f, -1.0f), glm::vec3(0.0f, 1.0f, 0.0f));
+    GLfloat pixelScale = 0.5f * (GLfloat)myWindow.getWindowDimensions().height * projection[1][1];
+    for (int t = 0; t < 4; t++) {
+        gps::ThreadPool pool;
+        pool.init(threadCounts[t]);
+        gps::DrawList cameraList;
+        gps::OcclusionBuffer cameraBuffer;
+        cameraList.init(&pool);
+        cameraBuffer.init(&pool, OCCLUSION_WIDTH, OCCLUSION_HEIGHT, true);
+
+        unsigned int drawn[2];
+        double prepMs[2];
+        double rasterMs = 0.0;
+        for (int occlusion = 0; occlusion < 2; occlusion++) {
+            cameraList.setOcclusion(occlusion ? &cameraBuffer : NULL);
+            prepMs[occlusion] = 0.0;
+            for (int b = 0; b <= benchmarkBuilds; b++) {
+                if (occlusion)
+                    rasterizeOccluders(cameraBuffer, viewProjection, objects.data(), (int)objects.size());
+                cameraList.build(objects.data(), (int)objects.size(), &viewProjection, 1, true, eye, pixelScale);
+                // the first build is the warm-up
+                if (b == 0)
+                    continue;
+                prepMs[occlusion] += cameraList.getStats().prepMs;
+                if (occlusion)
+                    rasterMs += cameraBuffer.getStats().rasterMs;
+            }
+            drawn[occlusion] = cameraList.getStats().instances;
+        }
 
-    myBasicShader.useShaderProgram();
+        gps::OcclusionStats bufferStats = cameraBuffer.getStats();
+        fprintf(stdout, "occlusion benchmark: %d objects, %d threads, camera: %u -> %u drawn, %u occluders (%u triangles), "
+            "%.3f ms raster, %.3f -> %.3f ms prep\n",
+            objectCount, threadCounts[t], drawn[0], drawn[1], bufferStats.occluders, bufferStats.triangles,
+            rasterMs / benchmarkBuilds, prepMs[0] / benchmarkBuilds, prepMs[1] / benchmarkBuilds);
+    }
+    fprintf(stdout, "occlusion benchmark: %u hardware threads\n", std::thread::hardware_concurrency());
+}
+
+// Cost of one CPU zone (both clock reads and the store), the zones stay compiled in so this has to stay small.
+// The chunks are reserved first, so the zones are timed apart from the allocation and page faults of their buffer,
+// and the clock reads alone are timed too since they set the floor.
+void runCpuZoneBenchmark() {
+    const int zoneCount = 1000000;
+
+    unsigned long long zonesBefore = gps::CpuProfiler::getZoneCount();
+    double start = glfwGetTime();
+    gps::CpuProfiler::reserve(zoneCount);
+    double reserved = glfwGetTime() - start;
+
+    start = glfwGetTime();
+    for (int i = 0; i < zoneCount; i++) {
+        gps::CpuZone zone("benchmark zone");
+    }
+    double elapsed = glfwGetTime() - start;
+
+    unsigned long long ticks = 0;
+    start = glfwGetTime();
+    for (int i = 0; i < zoneCount; i++) {
+        unsigned long long zoneStart = gps::CpuProfiler::now();
+        ticks += gps::CpuProfiler::now() - zoneStart;
+    }
+    double clockReads = glfwGetTime() - start;
+
+    fprintf(stdout, "CPU zone benchmark: %d zones, %.1f ns per zone (%llu recorded), %.1f ns for the clock reads alone, %.2f ms to reserve the chunks (%llu ticks)\n",
+        zoneCount, elapsed * 1.0e9 / zoneCount, gps::CpuProfiler::getZoneCount() - zonesBefore,
+        clockReads * 1.0e9 / zoneCount, reserved * 1000.0, ticks);
+}
+
+double percentile(const std::vector<double>& sorted, double p) {
+    return sorted[std::min(sorted.size() - 1, (size_t)(sorted.size() * p))];
+}
+
+// milliseconds since lap, and restarts it
+double lapMilliseconds(std::chrono::steady_clock::time_point& lap) {
+    std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+    double ms = std::chrono::duration<double, std::milli>(now - lap).count();
+    lap = now;
+    return ms;
+}
+
+// average per-step cost of the scene systems, from the simulation's animation to the render transforms
+void timeSceneSteps(const char* label, int steps) {
+    double animateMs = 0.0;
+    double captureMs = 0.0;
+    double interpolateMs = 0.0;
+    double transformMs = 0.0;
+    std::chrono::steady_clock::time_point lap = std::chrono::steady_clock::now();
+    for (int i = 0; i < steps; i++) {
+        scene.animate((GLfloat)SIMULATION_STEP);
+        animateMs += lapMilliseconds(lap);
+        previousStep = currentStep;
+        currentStep = captureSimulation();
+        captureMs += lapMilliseconds(lap);
+        renderState = interpolateSimulation(previousStep, currentStep, 0.5f);
+        interpolateMs += lapMilliseconds(lap);
+        updateRenderTransforms();
+        transformMs += lapMilliseconds(lap);
+    }
+    fprintf(stdout, "scene benchmark: %d entities %s: %.3f ms animate, %.3f ms commit and capture, %.3f ms interpolate, %.3f ms transforms\n",
+        (int)scene.size(), label, animateMs / steps, captureMs / steps, interpolateMs / steps, transformMs / steps);
+}
+
+// The scene systems over a crowd of entityCount, with every entity moving and then with every one at rest
+// (the render transforms come from the cache)
+void runSceneBenchmark(int entityCount) {
+    const int benchmarkSteps = 20;
+
+    setCrowd(entityCount);
+    resetSimulation();
+    timeSceneSteps("moving", benchmarkSteps);
+
+    for (size_t i = crowdFirstEntity; i < scene.size(); i++)
+        scene.pauseAnimation((gps::Entity)i);
+    timeSceneSteps("at rest", benchmarkSteps);
+}
+
+// The batched transform kernel against one glm composition and inverse transpose per pose, on scattered poses
+// with non-uniform scales
+void runTransformBenchmark(int count) {
+    std::vector<glm::vec3> positions(count);
+    std::vector<glm::vec3> angles(count);
+    std::vector<glm::vec3> scales(count);
+    for (int i = 0; i < count; i++) {
+        positions[i] = glm::vec3((float)(i % 1000), (float)(i % 7) * 0.5f, -(float)(i / 1000));
+        angles[i] = glm::vec3((float)((i * 37) % 360), (float)((i * 101) % 720) - 360.0f, (float)((i * 13) % 90) - 45.0f);
+        scales[i] = glm::vec3(0.5f + (float)(i % 5) * 0.25f, 1.0f, 0.25f + (float)(i % 3) * 0.5f);
+    }
+    std::vector<glm::mat4> transforms(count);
+    std::vector<glm::mat3> normalMatrices(count);
+    std::vector<glm::mat4> referenceTransforms(count);
+    std::vector<glm::mat3> referenceNormalMatrices(count);
+
+    // best of a few runs of each
+    double glmMs = 0.0;
+    double kernelMs = 0.0;
+    for (int run = 0; run < 3; run++) {
+        std::chrono::steady_clock::time_point lap = std::chrono::steady_clock::now();
+        for (int i = 0; i < count; i++) {
+            referenceTransforms[i] = gps::Scene::composeTransform(positions[i], angles[i], scales[i]);
+            referenceNormalMatrices[i] = glm::mat3(glm::inverseTranspose(referenceTransforms[i]));
+        }
+        double ms = lapMilliseconds(lap);
+        glmMs = run == 0 ? ms : std::min(glmMs, ms);
+        gps::Scene::composeTransforms(positions.data(), angles.data(), scales.data(), count, transforms.data(), normalMatrices.data());
+        ms = lapMilliseconds(lap);
+        kernelMs = run == 0 ? ms : std::min(kernelMs, ms);
+    }
+
+    // largest difference to glm, relative to the largest element of each matrix
+    float transformError = 0.0f;
+    float normalError = 0.0f;
+    for (int i = 0; i < count; i++) {
+        float transformSize = 0.0f;
+        float normalSize = 0.0f;
+        float transformDifference = 0.0f;
+        float normalDifference = 0.0f;
+        for (int c = 0; c < 3; c++) {
+            for (int r = 0; r < 3; r++) {
+                transformSize = std::max(transformSize, fabsf(referenceTransforms[i][c][r]));
+                normalSize = std::max(normalSize, fabsf(referenceNormalMatrices[i][c][r]));
+                transformDifference = std::max(transformDifference, fabsf(transforms[i][c][r] - referenceTransforms[i][c][r]));
+                normalDifference = std::max(normalDifference, fabsf(normalMatrices[i][c][r] - referenceNormalMatrices[i][c][r]));
+            }
+        }
+        transformError = std::max(transformError, transformDifference / transformSize);
+        normalError = std::max(normalError, normalDifference / normalSize);
+    }
 
-    view = myCamera.getViewMatrix();
-    glUniformMatrix4fv(viewLoc, 1, GL_FALSE, glm::value_ptr(view));
-    glUniformMatrix4fv(projectionLoc, 1, GL_FALSE, glm::value_ptr(projection));
-    glUniform3fv(lightDirLoc, 1, glm::value_ptr(lightDir));
-    glUniformMatrix4fv(glGetUniformLocation(myBasicShader.shaderProgram, "lightSpaceTrMatrix"),
-        1, GL_FALSE, glm::value_ptr(computeLightSpaceTrMatrix()));
-   
-    //bind the shadow map
-    glActiveTexture(GL_TEXTURE3);
-    glBindTexture(GL_TEXTURE_2D, depthMapTexture);
-    glUniform1i(glGetUniformLocation(myBasicShader.shaderProgram, "shadowMap"), 3);
+    fprintf(stdout, "transform benchmark: %d poses, glm %.2f ms (%.1f ns each), SSE kernel %.2f ms (%.1f ns each), %.2fx\n",
+        count, glmMs, glmMs * 1.0e6 / count, kernelMs, kernelMs * 1.0e6 / count, glmMs / kernelMs);
+    fprintf(stdout, "transform benchmark: max relative error %.2e model, %.2e normal matrix\n", transformError, normalError);
+}
 
-    renderObjects(myBasicShader, false);
+// one frame of the application loop without the window, glFinish makes the frame time include the GPU work.
+// Every frame advances the simulation by exactly one step, so runs see the same motion however fast they go.
+double renderHeadlessFrame() {
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    gps::GLState::beginFrame();
+    updateSimulation(SIMULATION_STEP);
+    processRenderToggles();
+    gpuProfiler.beginFrame();
+    renderScene();
+    gpuProfiler.endFrame();
+    glFinish();
+    return lapMilliseconds(start);
+}
 
+// Renders the crowd for the given number of frames with the simulation on this thread and then on its own thread.
+// Frames take real time (glFinish) and the simulation keeps up with it either way, only where the steps run changes.
+void runThreadBenchmark(int frames) {
+    const char* modes[] = { "serial", "threaded" };
+    for (int threaded = 0; threaded < 2; threaded++) {
+        resetSimulation();
+        if (threaded)
+            startSimulationThread();
+        unsigned long long stepsBefore = simulationStepCount;
+
+        std::vector<double> frameTimes;
+        std::chrono::steady_clock::time_point lastFrame = std::chrono::steady_clock::now();
+        std::chrono::steady_clock::time_point start = lastFrame;
+        for (int f = 0; f < frames; f++) {
+            std::chrono::steady_clock::time_point frameStart = std::chrono::steady_clock::now();
+            gps::GLState::beginFrame();
+            updateSimulation(lapMilliseconds(lastFrame) / 1000.0);
+            renderScene();
+            glFinish();
+            frameTimes.push_back(lapMilliseconds(frameStart));
+        }
+        double elapsed = lapMilliseconds(start);
+        stopSimulationThread();
+
+        std::sort(frameTimes.begin(), frameTimes.end());
+        double sum = 0.0;
+        for (size_t i = 0; i < frameTimes.size(); i++)
+            sum += frameTimes[i];
+        fprintf(stdout, "thread benchmark: %d objects, %-8s %.3f ms/frame avg, %.3f ms p99, %llu simulation steps in %.0f ms\n",
+            (int)scene.size(), modes[threaded], sum / frames, percentile(frameTimes, 0.99),
+            simulationStepCount - stepsBefore, elapsed);
+    }
+    fprintf(stdout, "thread benchmark: %u hardware threads\n", std::thread::hardware_concurrency());
+}
+
+// A wall of big teapots between the camera and a field of small nanosuits behind it, rendered without queries, with
+// the occluded nanosuits left out and with them drawn under conditional render. The occlusion buffer is off so only
+// the queries cull.
+void runQueryBenchmark(int count, int frames) {
+    const char* modes[] = { "off", "skip", "conditional" };
+    const int wallTeapots = 9;
+
+    scene.truncate(crowdFirstEntity);
+    for (int i = 0; i < wallTeapots; i++) {
+        glm::vec3 position((float)(i - wallTeapots / 2) * 1.2f, -0.25f, 1.0f);
+        scene.create(MODEL_TEAPOT, teapot.GetBounds(), position, glm::vec3(0.0f), glm::vec3(1.5f));
+    }
+    int side = (int)ceil(sqrt((double)count));
+    for (int i = 0; i < count; i++) {
+        glm::vec3 position((float)(i % side - side / 2) * 0.4f, -0.5f, -0.5f - (float)(i / side) * 0.25f);
+        scene.create(MODEL_NANOSUIT, nanosuit.GetBounds(), position, glm::vec3(0.0f), glm::vec3(0.15f));
+    }
+    bool occlusionWasEnabled = occlusionCullingEnabled;
+    occlusionCullingEnabled = false;
+
+    for (int mode = 0; mode < 3; mode++) {
+        occlusionQueries.setEnabled(mode != 0);
+        occlusionQueries.setConditional(mode == 2);
+        resetSimulation();
+        // the first frame has no results yet
+        renderHeadlessFrame();
+        gps::OcclusionQueryStats before = occlusionQueries.getTotalStats();
+        unsigned int instances = 0;
+
+        std::vector<double> frameTimes;
+        for (int f = 0; f < frames; f++) {
+            frameTimes.push_back(renderHeadlessFrame());
+            instances += cameraDrawList.getStats().instances;
+        }
+        gps::OcclusionQueryStats after = occlusionQueries.getTotalStats();
+
+        std::sort(frameTimes.begin(), frameTimes.end());
+        double sum = 0.0;
+        for (size_t i = 0; i < frameTimes.size(); i++)
+            sum += frameTimes[i];
+        fprintf(stdout, "query benchmark: %d nanosuits, %-11s %.3f ms/frame avg, %.3f ms p99, %.1f instances drawn, "
+            "per frame %.1f queries, %.1f occluded, %.1f objects hidden\n",
+            count, modes[mode], sum / frames, percentile(frameTimes, 0.99), (double)instances / frames,
+            (double)(after.issued - before.issued) / frames, (double)(after.occluded - before.occluded) / frames,
+            (double)(after.hidden - before.hidden) / frames);
+    }
+
+    occlusionQueries.setEnabled(occlusionQueriesEnabled);
+    occlusionQueries.setConditional(conditionalQueries);
+    occlusionCullingEnabled = occlusionWasEnabled;
+    setCrowd(crowdCount);
+}
+
+// Small teapots on a grid on the ground around the camera, 1k up to maxCount of them, culled for the camera and the
+// shadow cascades by the draw lists on every worker and by the compute shader, with and without the Hi-Z test against
+// the pyramid of a rendered frame (the scene with the wall of --bench-queries in front of the camera). Both are timed
+// from the entities as a frame runs them: the draw lists gather the objects, the GPU culling walks the entities for
+// the ones to upload (every entity still, or every one moved) before the dispatches. The GPU time waits for them
+// (glFinish).
+void runGpuCullingBenchmark(int maxCount) {
+    const int benchmarkBuilds = 20;
+    const int wallTeapots = 9;
+
+    scene.truncate(crowdFirstEntity);
+    for (int i = 0; i < wallTeapots; i++) {
+        glm::vec3 position((float)(i - wallTeapots / 2) * 1.2f, -0.25f, 1.0f);
+        scene.create(MODEL_TEAPOT, teapot.GetBounds(), position, glm::vec3(0.0f), glm::vec3(1.5f));
+    }
+    resetSimulation();
+
+    // a frame of the scene for the pyramid, the matrices of its view are the ones culled with
+    initGpuCulling();
+    gpuCulling.setHiZ(true);
+    gpuCullingEnabled = true;
+    renderHeadlessFrame();
+    gpuCullingEnabled = false;
+
+    glm::mat4 viewProjection = projection * view;
+    GLfloat pixelScale = 0.5f * (GLfloat)myWindow.getWindowDimensions().height * projection[1][1];
+    for (int count = 1000; count <= maxCount; count *= 10) {
+        scene.truncate(crowdFirstEntity + wallTeapots);
+        int side = (int)ceil(sqrt((double)count));
+        for (int i = 0; i < count; i++) {
+            glm::vec3 position((float)(i % side - side / 2) * 0.5f, -0.5f, (float)(i / side - side / 2) * 0.5f);
+            scene.create(MODEL_TEAPOT, teapot.GetBounds(), position, glm::vec3(0.0f, glm::degrees((float)i), 0.0f),
+                glm::vec3(0.2f));
+        }
+        resetSimulation();
+        updateRenderTransforms();
+
+        // both lists, as prepareDrawLists gathers and builds them
+        double listMs = 0.0;
+        for (int b = 0; b <= benchmarkBuilds; b++) {
+            std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+            sceneObjects.clear();
+            addRenderObjects(gps::ENTITY_STATIC, 0);
+            dynamicObjectCount = (int)sceneObjects.size();
+            addRenderObjects(gps::ENTITY_STATIC, gps::ENTITY_STATIC);
+            cameraDrawList.build(sceneObjects.data(), (int)sceneObjects.size(), &viewProjection, 1, true,
+                renderState.cameraPosition, pixelScale);
+            shadowDrawList.build(sceneObjects.data(), dynamicObjectCount, shadowCascades.getLightSpaceTrMatrices(),
+                shadowCascades.getCascadeCount(), false, renderState.cameraPosition, 0.0f);
+            double built = lapMilliseconds(start);
+            // the first build sizes the lists
+            if (b == 0)
+                continue;
+            listMs += built;
+        }
+        fprintf(stdout, "GPU culling benchmark: %7d instances, draw lists           %9.3f ms CPU, %7u visible to the camera\n",
+            count, listMs / benchmarkBuilds, cameraDrawList.getStats().instances);
+
+        for (int hiZ = 0; hiZ < 2; hiZ++) {
+            gpuCulling.setHiZ(hiZ != 0);
+            for (int moved = 0; moved < 2; moved++) {
+                double cpuMs = 0.0;
+                double gpuMs = 0.0;
+                for (int b = 0; b <= benchmarkBuilds; b++) {
+                    // as if every entity got a new pose, they all go up again
+                    if (moved)
+                        gpuRevisions.assign(gpuRevisions.size(), NO_REVISION);
+                    glFinish();
+                    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+                    prepareGpuCulling();
+                    double submitted = lapMilliseconds(start);
+                    glFinish();
+                    // the first one uploads the new entity set
+                    if (b == 0)
+                        continue;
+                    cpuMs += submitted;
+                    gpuMs += submitted + lapMilliseconds(start);
+                }
+                unsigned int visible[gps::GpuCulling::MAX_MODELS];
+                gpuCulling.readVisibleCounts(gps::GpuCulling::CAMERA_VIEW, visible);
+                fprintf(stdout, "GPU culling benchmark: %7d instances, compute %-7s %-5s %9.3f ms CPU, %7u visible to the camera, %.3f ms until done\n",
+                    count, hiZ ? "hi-z" : "frustum", moved ? "moved" : "still", cpuMs / benchmarkBuilds,
+                    visible[MODEL_TEAPOT], gpuMs / benchmarkBuilds);
+            }
+        }
+    }
+    gpuCulling.setHiZ(gpuHiZEnabled);
+    gpuInstances.clear();
+    gpuRevisions.clear();
+    setCrowd(crowdCount);
+}
+
+// closest hit on every triangle, the reference of the ray benchmark
+bool intersectTriangles(const std::vector<glm::vec3>& triangles, const gps::Ray& ray, GLfloat* distance) {
+    bool found = false;
+    *distance = ray.maxDistance;
+    for (size_t i = 0; i + 2 < triangles.size(); i += 3) {
+        glm::vec3 edge1 = triangles[i + 1] - triangles[i];
+        glm::vec3 edge2 = triangles[i + 2] - triangles[i];
+        glm::vec3 p = glm::cross(ray.direction, edge2);
+        GLfloat det = glm::dot(edge1, p);
+        if (det == 0.0f)
+            continue;
+        glm::vec3 s = ray.origin - triangles[i];
+        GLfloat u = glm::dot(s, p) / det;
+        glm::vec3 q = glm::cross(s, edge1);
+        GLfloat v = glm::dot(ray.direction, q) / det;
+        GLfloat t = glm::dot(edge2, q) / det;
+        if (u >= 0.0f && v >= 0.0f && u + v <= 1.0f && t > 0.0f && t < *distance) {
+            *distance = t;
+            found = true;
+        }
+    }
+    return found;
+}
+
+// Rays per second on one core through the BVHs of the teapot and the nanosuit, from random points on a sphere
+// around the model towards random points of its box, then through the scene's tree from the camera. The first
+// rays of each model are checked against every triangle.
+void runRayBenchmark(int rayCount) {
+    const int checkedRays = 1000;
+    const int models[] = { MODEL_TEAPOT, MODEL_NANOSUIT };
+    std::mt19937 random(1);
+    std::uniform_real_distribution<float> unit(0.0f, 1.0f);
+
+    for (int m = 0; m < 2; m++) {
+        int model = models[m];
+        std::vector<glm::vec3> triangles;
+        sceneModels[model]->GetTriangles(&triangles);
+        gps::MeshBvh bvh;
+        bvh.build(triangles);
+        gps::BvhStats stats = bvh.getStats();
+        fprintf(stdout, "ray benchmark: %s, %d triangles, built in %.2f ms (%u nodes, %u leaves)\n",
+            MODEL_NAMES[model], bvh.getTriangleCount(), stats.buildMs, stats.nodes, stats.leaves);
+
+        glm::vec3 boxMin, boxMax;
+        bvh.getBounds(&boxMin, &boxMax);
+        glm::vec3 center = (boxMin + boxMax) * 0.5f;
+        GLfloat radius = glm::length(boxMax - center) * 2.0f;
+        std::vector<gps::Ray> rays(rayCount);
+        for (int r = 0; r < rayCount; r++) {
+            // uniform on the sphere
+            GLfloat z = 2.0f * unit(random) - 1.0f;
+            GLfloat angle = 6.2831853f * unit(random);
+            GLfloat ring = sqrtf(std::max(0.0f, 1.0f - z * z));
+            rays[r].origin = center + radius * glm::vec3(ring * cosf(angle), ring * sinf(angle), z);
+            glm::vec3 target = boxMin + (boxMax - boxMin) * glm::vec3(unit(random), unit(random), unit(random));
+            rays[r].direction = glm::normalize(target - rays[r].origin);
+            rays[r].maxDistance = FLT_MAX;
+        }
+
+        std::chrono::steady_clock::time_point lap = std::chrono::steady_clock::now();
+        int hits = 0;
+        gps::RayHit hit;
+        for (int r = 0; r < rayCount; r++)
+            hits += bvh.intersect(rays[r], &hit) ? 1 : 0;
+        double closestMs = lapMilliseconds(lap);
+        int occluded = 0;
+        for (int r = 0; r < rayCount; r++)
+            occluded += bvh.occluded(rays[r]) ? 1 : 0;
+        double anyMs = lapMilliseconds(lap);
+
+        int checked = std::min(rayCount, checkedRays);
+        int mismatches = 0;
+        for (int r = 0; r < checked; r++) {
+            GLfloat distance;
+            bool found = intersectTriangles(triangles, rays[r], &distance);
+            bool bvhFound = bvh.intersect(rays[r], &hit);
+            if (found != bvhFound || (found && fabsf(distance - hit.distance) > 1e-4f * std::max(1.0f, distance)))
+                mismatches++;
+        }
+        fprintf(stdout, "ray benchmark: %s, %d rays, closest hit %.2f Mrays/s (%.1f%% hit), any hit %.2f Mrays/s (%d hit), "
+            "%d of %d differ from every triangle\n", MODEL_NAMES[model], rayCount, rayCount / closestMs / 1000.0,
+            100.0 * hits / rayCount, rayCount / anyMs / 1000.0, occluded, mismatches, checked);
+    }
+
+    // the scene as loaded (--crowd adds entities): build, refit of every entity, rays through random pixels
+    updateRenderTransforms();
+    int entityCount = (int)renderTransforms.size();
+    gps::SceneBvh bvh;
+    for (int model = 0; model < MODEL_COUNT; model++)
+        bvh.setModel(model, &modelBvhs[model]);
+    bvh.update(renderTransforms.data(), scene.models.data(), renderedRevisions.data(), entityCount);
+    std::vector<unsigned int> movedRevisions(entityCount, NO_REVISION);
+    bvh.update(renderTransforms.data(), scene.models.data(), movedRevisions.data(), entityCount);
+    gps::BvhStats stats = bvh.getStats();
+
+    WindowDimensions dimensions = myWindow.getWindowDimensions();
+    std::vector<gps::Ray> rays(rayCount);
+    for (int r = 0; r < rayCount; r++)
+        rays[r] = cursorRay(unit(random) * dimensions.width, unit(random) * dimensions.height, dimensions.width, dimensions.height);
+    std::chrono::steady_clock::time_point lap = std::chrono::steady_clock::now();
+    int hits = 0;
+    gps::RayHit hit;
+    for (int r = 0; r < rayCount; r++)
+        hits += bvh.intersect(rays[r], &hit) ? 1 : 0;
+    double closestMs = lapMilliseconds(lap);
+    fprintf(stdout, "ray benchmark: scene, %d entities, built in %.3f ms, all refitted in %.3f ms, "
+        "camera rays %.2f Mrays/s (%.1f%% hit)\n", entityCount, stats.buildMs, stats.refitMs,
+        rayCount / closestMs / 1000.0, 100.0 * hits / rayCount);
+}
+
+// Renders the configured number of frames and returns the results as JSON: load times, frame time percentiles
+// and the GPU time of every profiler scope (over the last GpuProfiler::HISTORY frames)
+std::string runHeadlessBenchmark() {
+    loadTimes.firstFrame = renderHeadlessFrame();
+    // the warm-up frame doesn't count in the pass timings either
+    gpuProfiler.flush();
+    gpuProfiler.init();
+
+    std::vector<double> frameTimes;
+    for (int f = 0; f < headlessBenchmark.frames; f++)
+        frameTimes.push_back(renderHeadlessFrame());
+    gpuProfiler.flush();
+
+    std::sort(frameTimes.begin(), frameTimes.end());
+    double sum = 0.0;
+    for (size_t i = 0; i < frameTimes.size(); i++)
+        sum += frameTimes[i];
+
+    std::ostringstream json;
+    json.setf(std::ios::fixed);
+    json.precision(3);
+    json << "{\n";
+    json << "  \"renderer\": \"" << (const char*)glGetString(GL_RENDERER) << "\",\n";
+    json << "  \"width\": " << headlessBenchmark.width << ",\n";
+    json << "  \"height\": " << headlessBenchmark.height << ",\n";
+    json << "  \"frames\": " << frameTimes.size() << ",\n";
+    json << "  \"load_ms\": { \"window\": " << loadTimes.window << ", \"shaders\": " << loadTimes.shaders
+        << ", \"models\": " << loadTimes.models << ", \"uniforms\": " << loadTimes.uniforms
+        << ", \"framebuffers\": " << loadTimes.framebuffers << ", \"first_frame\": " << loadTimes.firstFrame
+        << ", \"total\": " << loadTimes.window + loadTimes.shaders + loadTimes.models + loadTimes.uniforms
+            + loadTimes.framebuffers + loadTimes.firstFrame << " },\n";
+    json << "  \"frame_ms\": { \"min\": " << frameTimes.front() << ", \"avg\": " << sum / frameTimes.size()
+        << ", \"p50\": " << percentile(frameTimes, 0.50) << ", \"p90\": " << percentile(frameTimes, 0.90)
+        << ", \"p95\": " << percentile(frameTimes, 0.95) << ", \"p99\": " << percentile(frameTimes, 0.99)
+        << ", \"max\": " << frameTimes.back() << " },\n";
+
+    // scopes as "frame/shadow pass", depth first
+    std::vector<gps::GpuScopeStats> passes = gpuProfiler.getStats();
+    std::vector<std::string> path;
+    json << "  \"gpu_ms\": [";
+    for (size_t i = 0; i < passes.size(); i++) {
+        path.resize(passes[i].depth);
+        path.push_back(passes[i].name);
+        std::string name;
+        for (size_t p = 0; p < path.size(); p++)
+            name += (p ? "/" : "") + path[p];
+        json << (i ? ",\n" : "\n") << "    { \"scope\": \"" << name << "\", \"min\": " << passes[i].minMs
+            << ", \"avg\": " << passes[i].avgMs << ", \"p99\": " << passes[i].p99Ms
+            << ", \"frames\": " << passes[i].samples << " }";
+    }
+    json << "\n  ]\n}\n";
+
+    if (!headlessBenchmark.jsonFile.empty()) {
+        std::ofstream file(headlessBenchmark.jsonFile.c_str());
+        file << json.str();
+    }
+    return json.str();
+}
+
+// returns the position of the argument on the command line, 0 if it's not there
+int findArgument(int argc, const char * argv[], const char* name) {
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], name) == 0)
+            return i;
+    }
+    return 0;
 }
 
 void cleanup() {
+    stopSimulationThread();
+
+    gps::GLStateStats frameStats = gps::GLState::getFrameStats();
+    gps::GLStateStats totalStats = gps::GLState::getTotalStats();
+    fprintf(stdout, "GL state calls, last frame: %u issued, %u skipped\n", frameStats.issued, frameStats.skipped);
+    fprintf(stdout, "GL state calls, total: %u issued, %u skipped\n", totalStats.issued, totalStats.skipped);
+
+    gps::ShadowStats shadowFrameStats = shadowCascades.getFrameStats();
+    gps::ShadowStats shadowTotalStats = shadowCascades.getTotalStats();
+    fprintf(stdout, "Shadow texels, last frame: %llu static (%u cascades redrawn), %llu dynamic, %llu copied\n",
+        shadowFrameStats.staticTexels, shadowFrameStats.cascadesRefreshed, shadowFrameStats.dynamicTexels, shadowFrameStats.copiedTexels);
+    fprintf(stdout, "Shadow texels, total: %llu static (%u cascades redrawn), %llu dynamic, %llu copied, %u frames dropped\n",
+        shadowTotalStats.staticTexels, shadowTotalStats.cascadesRefreshed, shadowTotalStats.dynamicTexels, shadowTotalStats.copiedTexels,
+        shadowTotalStats.droppedFrames);
+
+    printClusterStats("last frame", lightClusters.getFrameStats(), lightClusters.getBuildCount() ? 1 : 0);
+    if (gpuCullingEnabled) {
+        printGpuCullingStats();
+    } else {
+        printDrawListStats("camera", cameraDrawList.getStats());
+        printDrawListStats("shadow", shadowDrawList.getStats());
+    }
+    printOcclusionStats("camera", cameraOcclusion.getStats());
+    if (occlusionQueries.isEnabled()) {
+        printQueryStats("last frame", occlusionQueries.getFrameStats());
+        printQueryStats("total", occlusionQueries.getTotalStats());
+    }
+    printClusterStats("average", lightClusters.getTotalStats(), lightClusters.getBuildCount());
+
+    if (gpuProfiler.getStats().size() > 0)
+        gpuProfiler.dumpStats(stdout);
+    if (!cpuTraceOnExit.empty())
+        gps::CpuProfiler::writeChromeTrace(cpuTraceOnExit);
+    if (inputRecorder.isRecording())
+        fprintf(stdout, "Input recording: %u frames\n", inputRecorder.getFrameCount());
+    inputRecorder.stop();
+
     myWindow.Delete();
     //cleanup code for your own data
 }
 
 int main(int argc, const char * argv[]) {
 
+    gps::CpuProfiler::init();
+    // --cpu-trace <file>
+    int traceArgument = findArgument(argc, argv, "--cpu-trace");
+    if (traceArgument && traceArgument + 1 < argc)
+        cpuTraceOnExit = argv[traceArgument + 1];
+
+    // --benchmark [--frames N] [--resolution WxH] [--json <file>]
+    headlessBenchmark.enabled = findArgument(argc, argv, "--benchmark") != 0;
+    int framesArgument = findArgument(argc, argv, "--frames");
+    if (framesArgument && framesArgument + 1 < argc)
+        headlessBenchmark.frames = std::max(1, atoi(argv[framesArgument + 1]));
+    int resolutionArgument = findArgument(argc, argv, "--resolution");
+    if (resolutionArgument && resolutionArgument + 1 < argc)
+        sscanf(argv[resolutionArgument + 1], "%dx%d", &headlessBenchmark.width, &headlessBenchmark.height);
+    int jsonArgument = findArgument(argc, argv, "--json");
+    if (jsonArgument && jsonArgument + 1 < argc)
+        headlessBenchmark.jsonFile = argv[jsonArgument + 1];
+
+    std::chrono::steady_clock::time_point lap = std::chrono::steady_clock::now();
     try {
         initOpenGLWindow();
     } catch (const std::exception& e) {
         std::cerr << e.what() << std::endl;
         return EXIT_FAILURE;
     }
+    loadTimes.window = lapMilliseconds(lap);
 
     initOpenGLState();
-	initModels();
 	initShaders();
+    loadTimes.shaders = lapMilliseconds(lap);
+	initModels();
+    loadTimes.models = lapMilliseconds(lap);
+    fprintf(stdout, "%u shader programs still compiling after model loading\n", (unsigned int)shaderBatch.poll());
+    // --crowd N
+    int crowdArgument = findArgument(argc, argv, "--crowd");
+    if (crowdArgument && crowdArgument + 1 < argc) {
+        crowdCount = std::max(0, atoi(argv[crowdArgument + 1]));
+    }
+    occlusionCullingEnabled = findArgument(argc, argv, "--no-occlusion") == 0;
+    // --occlusion-queries [conditional]
+    int queriesArgument = findArgument(argc, argv, "--occlusion-queries");
+    occlusionQueriesEnabled = queriesArgument != 0;
+    conditionalQueries = queriesArgument && queriesArgument + 1 < argc && strcmp(argv[queriesArgument + 1], "conditional") == 0;
+    // --gpu-culling [hiz]
+    int gpuCullingArgument = findArgument(argc, argv, "--gpu-culling");
+    if (gpuCullingArgument && !gps::GpuCulling::isSupported()) {
+        fprintf(stdout, "GPU culling needs OpenGL 4.3 (compute shaders, storage buffers and indirect draws), culling on the CPU\n");
+    } else if (gpuCullingArgument) {
+        gpuCullingEnabled = true;
+        gpuHiZEnabled = gpuCullingArgument + 1 < argc && strcmp(argv[gpuCullingArgument + 1], "hiz") == 0;
+    }
+    initScene();
 	initUniforms();
+    resetSimulation();
+    loadTimes.uniforms = lapMilliseconds(lap);
     initFBO();
+    loadTimes.framebuffers = lapMilliseconds(lap);
     setWindowCallbacks();
 
+    // --record-input <file> | --replay-input <file>
+    int recordArgument = findArgument(argc, argv, "--record-input");
+    int replayArgument = findArgument(argc, argv, "--replay-input");
+    if (replayArgument && replayArgument + 1 < argc) {
+        // the render toggles read the keys on this thread, a threaded replay would only reach the simulation's
+        if (findArgument(argc, argv, "--threaded")) {
+            fprintf(stderr, "--replay-input can't be used with --threaded, the replayed keys wouldn't reach the render toggles\n");
+            return EXIT_FAILURE;
+        }
+        if (!inputRecorder.startReplay(argv[replayArgument + 1]))
+            return EXIT_FAILURE;
+    } else if (recordArgument && recordArgument + 1 < argc) {
+        if (!inputRecorder.startRecording(argv[recordArgument + 1]))
+            return EXIT_FAILURE;
+    }
+
+    if (headlessBenchmark.enabled) {
+        std::string results = runHeadlessBenchmark();
+        cleanup();
+        fputs(results.c_str(), stdout);
+        return EXIT_SUCCESS;
+    }
+
+    // --bench-instances [teapot|nanosuit]
+    int benchArgument = findArgument(argc, argv, "--bench-instances");
+    if (benchArgument) {
+        runInstancingBenchmark(benchArgument + 1 < argc ? argv[benchArgument + 1] : "teapot");
+        cleanup();
+        return EXIT_SUCCESS;
+    }
+
+    // --bench-threads [crowd size] [--frames N]
+    int threadsArgument = findArgument(argc, argv, "--bench-threads");
+    if (threadsArgument) {
+        setCrowd(threadsArgument + 1 < argc ? std::max(0, atoi(argv[threadsArgument + 1])) : 2000);
+        runThreadBenchmark(headlessBenchmark.frames);
+        cleanup();
+        return EXIT_SUCCESS;
+    }
+
+    // --bench-drawlist [object count]
+    int drawListArgument = findArgument(argc, argv, "--bench-drawlist");
+    if (drawListArgument) {
+        updateFrameUniforms();
+        runDrawListBenchmark(drawListArgument + 1 < argc ? std::max(1, atoi(argv[drawListArgument + 1])) : 50000);
+        cleanup();
+        return EXIT_SUCCESS;
+    }
+
+    // --bench-occlusion [object count]
+    int occlusionArgument = findArgument(argc, argv, "--bench-occlusion");
+    if (occlusionArgument) {
+        updateFrameUniforms();
+        runOcclusionBenchmark(occlusionArgument + 1 < argc ? std::max(1, atoi(argv[occlusionArgument + 1])) : 10000);
+        cleanup();
+        return EXIT_SUCCESS;
+    }
+
+    // --bench-queries [nanosuit count] [--frames N]
+    int queriesBenchArgument = findArgument(argc, argv, "--bench-queries");
+    if (queriesBenchArgument) {
+        runQueryBenchmark(queriesBenchArgument + 1 < argc ? std::max(1, atoi(argv[queriesBenchArgument + 1])) : 100,
+            headlessBenchmark.frames);
+        cleanup();
+        return EXIT_SUCCESS;
+    }
+
+    // --bench-gpu-culling [max instance count]
+    int gpuCullingBenchArgument = findArgument(argc, argv, "--bench-gpu-culling");
+    if (gpuCullingBenchArgument) {
+        if (!gps::GpuCulling::isSupported()) {
+            fprintf(stdout, "GPU culling benchmark: not supported by this context\n");
+            cleanup();
+            return EXIT_FAILURE;
+        }
+        runGpuCullingBenchmark(gpuCullingBenchArgument + 1 < argc ? std::max(1000, atoi(argv[gpuCullingBenchArgument + 1])) : 1000000);
+        cleanup();
+        return EXIT_SUCCESS;
+    }
+
+    // --bench-rays [ray count] [--crowd N]
+    int raysArgument = findArgument(argc, argv, "--bench-rays");
+    if (raysArgument) {
+        updateFrameUniforms();
+        runRayBenchmark(raysArgument + 1 < argc ? std::max(1, atoi(argv[raysArgument + 1])) : 1000000);
+        cleanup();
+        return EXIT_SUCCESS;
+    }
+
+    // --bench-transforms [pose count]
+    int transformsArgument = findArgument(argc, argv, "--bench-transforms");
+    if (transformsArgument) {
+        runTransformBenchmark(transformsArgument + 1 < argc ? std::max(1, atoi(argv[transformsArgument + 1])) : 1000000);
+        cleanup();
+        return EXIT_SUCCESS;
+    }
+
+    // --bench-scene [entity count]
+    int sceneArgument = findArgument(argc, argv, "--bench-scene");
+    if (sceneArgument) {
+        runSceneBenchmark(sceneArgument + 1 < argc ? std::max(0, atoi(argv[sceneArgument + 1])) : 100000);
+        cleanup();
+        return EXIT_SUCCESS;
+    }
+
+    // --bench-sortkeys [--crowd N]
+    if (findArgument(argc, argv, "--bench-sortkeys")) {
+        runSortKeyBenchmark();
+        cleanup();
+        return EXIT_SUCCESS;
+    }
+
+    // --bench-cpu-zones
+    if (findArgument(argc, argv, "--bench-cpu-zones")) {
+        runCpuZoneBenchmark();
+        cleanup();
+        return EXIT_SUCCESS;
+    }
+
+    // --bench-variants
+    if (findArgument(argc, argv, "--bench-variants")) {
+        runVariantBenchmark();
+        cleanup();
+        return EXIT_SUCCESS;
+    }
+
+    // --bench-clusters
+    if (findArgument(argc, argv, "--bench-clusters")) {
+        runClusterBenchmark();
+        cleanup();
+        return EXIT_SUCCESS;
+    }
+
+    // --bench-deferred
+    if (findArgument(argc, argv, "--bench-deferred")) {
+        runDeferredBenchmark();
+        cleanup();
+        return EXIT_SUCCESS;
+    }
+
+    // --bench-prepass
+    if (findArgument(argc, argv, "--bench-prepass")) {
+        runPrepassBenchmark();
+        cleanup();
+        return EXIT_SUCCESS;
+    }
+
+    if (findArgument(argc, argv, "--no-vsync"))
+        glfwSwapInterval(0);
+    if (findArgument(argc, argv, "--threaded"))
+        startSimulationThread();
+
 	// application loop
+    std::chrono::steady_clock::time_point lastFrame = std::chrono::steady_clock::now();
 	while (!glfwWindowShouldClose(myWindow.getWindow())) {
-        processMovement();
+        gps::CpuZone frameZone("frame");
+        gps::GLState::beginFrame();
+        updateSimulation(lapMilliseconds(lastFrame) / 1000.0);
+        processRenderToggles();
+        gpuProfiler.beginFrame();
 	    renderScene();
+        gpuProfiler.endFrame();
 
-		glfwPollEvents();
-		glfwSwapBuffers(myWindow.getWindow());
+        {
+            gps::CpuZone zone("glfwPollEvents");
+		    glfwPollEvents();
+        }
+        {
+            gps::CpuZone zone("glfwSwapBuffers");
+		    glfwSwapBuffers(myWindow.getWindow());
+        }
 
 		glCheckError();
 	}
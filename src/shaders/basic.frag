@@ -1,28 +1,42 @@
 #version 410 core
 
-in vec3 fPosition;
-in vec3 fNormal;
+in vec3 fPosEye;
+in vec3 fNormalEye;
 in vec2 fTexCoords;
-in vec4 fragPosLightSpace;
+#ifdef SHADOWS
+in vec3 fPosWorld;
+#endif
+#ifdef FOG
 in float visibility;
+#endif
 
 out vec4 fColor;
 
-//matrices
-uniform mat4 model;
-uniform mat4 view;
-uniform mat3 normalMatrix;
-//lighting
-uniform vec3 lightDir;
-uniform vec3 lightColor;
+// the FrameData block is inserted by gps::Shader, see gps::FrameUniforms::blockSource()
+// compile-time features (see gps::ShaderVariants): FOG, SHADOWS, SPECULAR_MAP, PCF_TAPS, POINT_LIGHTS, CLUSTERED
+#ifdef SHADOWS
 //shdaows
-uniform sampler2D shadowMap;
+// one layer per cascade
+uniform sampler2DArray shadowMap;
+#endif
+#ifdef POINT_LIGHTS
+// view space position + radius, color + outer cone, direction + inner cone, three texels per light (see gps::PointLights)
+uniform samplerBuffer pointLights;
+#endif
+#ifdef CLUSTERED
+// froxel grid built on the CPU, see gps::LightClusters
+layout(std140) uniform ClusterData {
+    uvec4 clusterGrid;  // tiles in x and y, depth slices
+    vec4 clusterScale;  // tiles per pixel in x and y, log(depth) to slice scale and bias
+};
+uniform usamplerBuffer clusterRanges; // first index and light count of every cluster
+uniform usamplerBuffer clusterLights; // light indices of all the clusters, back to back
+#endif
 // textures
 uniform sampler2D diffuseTexture;
+#ifdef SPECULAR_MAP
 uniform sampler2D specularTexture;
-// other
-uniform bool fogEnabled;
-uniform float lightColorCoeff;
+#endif
 
 //components
 vec3 ambient;
@@ -31,63 +45,158 @@ vec3 diffuse;
 vec3 specular;
 float specularStrength = 0.5f;
 float shadow;
+vec3 pointDiffuse = vec3(0.0f);
+vec3 pointSpecular = vec3(0.0f);
 
 void computeDirLight()
 {
-    //compute eye space coordinates
-    vec4 fPosEye = view * model * vec4(fPosition, 1.0f);
-    vec3 normalEye = normalize(normalMatrix * fNormal);
+    //eye space coordinates come from the vertex shader
+    vec3 normalEye = normalize(fNormalEye);
 
     //normalize light direction
-    vec3 lightDirN = vec3(normalize(view * vec4(lightDir, 0.0f)));
+    vec3 lightDirN = vec3(normalize(view * vec4(lightDir.xyz, 0.0f)));
 
     //compute view direction (in eye coordinates, the viewer is situated at the origin
-    vec3 viewDir = normalize(- fPosEye.xyz);
+    vec3 viewDir = normalize(- fPosEye);
 
     //compute ambient light
-    ambient = ambientStrength * lightColor;
+    ambient = ambientStrength * lightColor.rgb;
 
     //compute diffuse light
-    diffuse = max(dot(normalEye, lightDirN), 0.0f) * lightColor;
+    diffuse = max(dot(normalEye, lightDirN), 0.0f) * lightColor.rgb;
 
+#ifdef SPECULAR_MAP
     //compute specular light
     vec3 reflectDir = reflect(-lightDirN, normalEye);
     float specCoeff = pow(max(dot(viewDir, reflectDir), 0.0f), 32);
-    specular = specularStrength * specCoeff * lightColor;
+    specular = specularStrength * specCoeff * lightColor.rgb;
+#endif
+}
+
+#ifdef POINT_LIGHTS
+void addPointLight(int i, vec3 normalEye, vec3 viewDir)
+{
+    vec4 posRadius = texelFetch(pointLights, 3 * i);
+    vec3 toLight = posRadius.xyz - fPosEye;
+    float distance = length(toLight);
+    if (distance >= posRadius.w)
+        return;
+    vec4 colorCone = texelFetch(pointLights, 3 * i + 1);
+    vec4 directionCone = texelFetch(pointLights, 3 * i + 2);
+
+    // smooth falloff that reaches 0 at the radius, and at the edge of a spot light's cone
+    float falloff = 1.0f - (distance * distance) / (posRadius.w * posRadius.w);
+    falloff *= falloff;
+    vec3 lightDirN = toLight / distance;
+    falloff *= smoothstep(colorCone.w, directionCone.w, dot(-lightDirN, directionCone.xyz));
+    vec3 color = colorCone.rgb;
+    pointDiffuse += max(dot(normalEye, lightDirN), 0.0f) * falloff * color;
+#ifdef SPECULAR_MAP
+    float specCoeff = pow(max(dot(viewDir, reflect(-lightDirN, normalEye)), 0.0f), 32);
+    pointSpecular += specularStrength * specCoeff * falloff * color;
+#endif
+}
+
+#ifdef CLUSTERED
+// only the lights assigned to the fragment's froxel
+void computePointLights()
+{
+    vec3 normalEye = normalize(fNormalEye);
+    vec3 viewDir = normalize(- fPosEye);
+    ivec3 cluster = ivec3(gl_FragCoord.xy * clusterScale.xy, log(-fPosEye.z) * clusterScale.z + clusterScale.w);
+    cluster = clamp(cluster, ivec3(0), ivec3(clusterGrid.xyz) - 1);
+    uvec2 range = texelFetch(clusterRanges, (cluster.z * int(clusterGrid.y) + cluster.y) * int(clusterGrid.x) + cluster.x).rg;
+    for (uint k = 0u; k < range.y; k++)
+        addPointLight(int(texelFetch(clusterLights, int(range.x + k)).r), normalEye, viewDir);
+}
+#else
+// every light for every fragment, the cost grows with pointLightCount times the shaded pixels
+void computePointLights()
+{
+    vec3 normalEye = normalize(fNormalEye);
+    vec3 viewDir = normalize(- fPosEye);
+    for (int i = 0; i < pointLightCount; i++)
+        addPointLight(i, normalEye, viewDir);
+}
+#endif
+#endif
+
+#ifdef SHADOWS
+// first cascade whose slice of the camera frustum contains the fragment, -1 past the shadow distance
+int selectCascade()
+{
+    float depth = -fPosEye.z;
+    for (int i = 0; i < cascadeCount; i++) {
+        if (depth < cascadeSplits[i])
+            return i;
+    }
+    return -1;
 }
 
 void computeShadow() {
+    shadow = 0.0f;
+    int cascade = selectCascade();
+    if (cascade < 0)
+        return;
+    vec4 fragPosLightSpace = lightSpaceTrMatrices[cascade] * vec4(fPosWorld, 1.0f);
+
     // perform perspective divide
     vec3 normalizedCoords = fragPosLightSpace.xyz / fragPosLightSpace.w;
 
     // Transform to [0,1] range
     normalizedCoords = normalizedCoords * 0.5 + 0.5;
 
-    // Get closest depth value from light's perspective
-    float closestDepth = texture(shadowMap, normalizedCoords.xy).r;
-
     // Get depth of current fragment from light's perspective
     float currentDepth = normalizedCoords.z;
 
     // Check whether current frag pos is in shadow
-    float bias = 0.005f;
+    float bias = cascadeDepthBias[cascade];
+#ifdef PCF_TAPS
+    // average PCF_TAPS comparisons on a square grid around the fragment (9 = 3x3, 25 = 5x5)
+    int radius = (int(sqrt(float(PCF_TAPS))) - 1) / 2;
+    vec2 texelSize = 1.0f / vec2(textureSize(shadowMap, 0).xy);
+    shadow = 0.0f;
+    for (int x = -radius; x <= radius; x++) {
+        for (int y = -radius; y <= radius; y++) {
+            float closestDepth = texture(shadowMap, vec3(normalizedCoords.xy + vec2(x, y) * texelSize, cascade)).r;
+            shadow += (currentDepth - bias) > closestDepth ? 1.0f : 0.0f;
+        }
+    }
+    shadow /= float((2 * radius + 1) * (2 * radius + 1));
+#else
+    // Get closest depth value from light's perspective
+    float closestDepth = texture(shadowMap, vec3(normalizedCoords.xy, cascade)).r;
     shadow = (currentDepth - bias) > closestDepth ? 1.0f : 0.0f;
+#endif
 
     if (currentDepth > 1.0f)
         shadow = 0.0f;
 }
+#endif
 
 void main() 
 {
     computeDirLight();
 
+#ifdef SHADOWS
     computeShadow();
+#else
+    shadow = 0.0f;
+#endif
+
+#ifdef POINT_LIGHTS
+    computePointLights();
+#endif
 
     //compute final vertex color
-    vec3 color = min((ambient + (1.0f - shadow) * diffuse) * texture(diffuseTexture, fTexCoords).rgb + (1.0f - shadow) * specular * texture(specularTexture, fTexCoords).rgb, 1.0f);
-    if (fogEnabled) {
-        color = vec3(mix(vec4(0.5f, 0.5f, 0.5f, 1.0f), vec4(color, 1.0f), visibility));
-    }
+    vec3 color = (ambient + (1.0f - shadow) * diffuse + pointDiffuse) * texture(diffuseTexture, fTexCoords).rgb;
+#ifdef SPECULAR_MAP
+    color += ((1.0f - shadow) * specular + pointSpecular) * texture(specularTexture, fTexCoords).rgb;
+#endif
+    color = min(color, 1.0f);
+#ifdef FOG
+    color = vec3(mix(vec4(0.5f, 0.5f, 0.5f, 1.0f), vec4(color, 1.0f), visibility));
+#endif
     color = vec3(mix(vec4(0.0f, 0.0f, 0.0f, 1.0f), vec4(color, 1.0f), lightColorCoeff));
     fColor = vec4(color, 1.0f);
 }
@@ -3,32 +3,45 @@
 layout(location=0) in vec3 vPosition;
 layout(location=1) in vec3 vNormal;
 layout(location=2) in vec2 vTexCoords;
+// per-instance transform, see gps::InstanceData
+layout(location=3) in mat4 instanceModel;
+layout(location=7) in mat3 instanceNormalMatrix;
 
-out vec3 fPosition;
-out vec3 fNormal;
+out vec3 fPosEye;
+out vec3 fNormalEye;
 out vec2 fTexCoords;
-out vec4 fragPosLightSpace;
+#ifdef SHADOWS
+out vec3 fPosWorld;
+#endif
+#ifdef FOG
 out float visibility;
+#endif
 
+// the FrameData block is inserted by gps::Shader, see gps::FrameUniforms::blockSource()
 
-uniform mat4 model;
-uniform mat4 view;
-uniform mat4 projection;
-uniform mat4 lightSpaceTrMatrix;
+// depth.vert writes the pre-pass depth the main pass is compared against with GL_EQUAL
+invariant gl_Position;
 
 const float density = 0.1f;
 const float gradient = 1.5f;
 
 void main()
 {
-	fragPosLightSpace = lightSpaceTrMatrix * model * vec4(vPosition, 1.0f);
-	vec4 posCamSpace = view * model * vec4(vPosition, 1.0f);
-	gl_Position = projection * view * model * vec4(vPosition, 1.0f);
-	fPosition = vPosition;
-	fNormal = vNormal;
+	vec4 posWorld = instanceModel * vec4(vPosition, 1.0f);
+#ifdef SHADOWS
+	// the cascade is only known per fragment, it projects into light space itself
+	fPosWorld = posWorld.xyz;
+#endif
+	vec4 posCamSpace = view * posWorld;
+	gl_Position = projection * posCamSpace;
+	//eye space position and normal, the view matrix is rigid so its rotation is enough for normals
+	fPosEye = posCamSpace.xyz;
+	fNormalEye = mat3(view) * instanceNormalMatrix * vNormal;
 	fTexCoords = vTexCoords;
 
+#ifdef FOG
 	float distance = length(posCamSpace.xyz);
 	visibility = exp(-pow((distance * density), gradient));
 	visibility = clamp(visibility, 0.0f, 1.0f);
+#endif
 }
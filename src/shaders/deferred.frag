@@ -0,0 +1,120 @@
+#version 410 core
+
+in vec2 fTexCoords;
+
+out vec4 fColor;
+
+// the FrameData block is inserted by gps::Shader, see gps::FrameUniforms::blockSource()
+// compile-time features (see gps::ShaderVariants): FOG, SHADOWS, PCF_TAPS
+#ifdef SHADOWS
+// one layer per cascade, shared with the forward path
+uniform sampler2DArray shadowMap;
+#endif
+// G-buffer and the point lights already added up by the light volumes
+uniform sampler2D gAlbedoSpec;
+uniform sampler2D gNormal;
+uniform sampler2D gDepth;
+uniform sampler2D lightBuffer;
+
+// same constants as basic.vert/basic.frag
+const float density = 0.1f;
+const float gradient = 1.5f;
+float ambientStrength = 0.2f;
+float specularStrength = 0.5f;
+
+vec3 octDecode(vec2 e)
+{
+    vec3 n = vec3(e, 1.0f - abs(e.x) - abs(e.y));
+    if (n.z < 0.0f)
+        n.xy = (1.0f - abs(n.yx)) * vec2(n.x >= 0.0f ? 1.0f : -1.0f, n.y >= 0.0f ? 1.0f : -1.0f);
+    return normalize(n);
+}
+
+// inverse of the perspective projection, only the terms of a symmetric frustum
+vec3 reconstructPosEye(vec2 texCoords, float depth)
+{
+    float z = -projection[3][2] / (depth * 2.0f - 1.0f + projection[2][2]);
+    vec2 ndc = texCoords * 2.0f - 1.0f;
+    return vec3(-ndc.x * z / projection[0][0], -ndc.y * z / projection[1][1], z);
+}
+
+#ifdef SHADOWS
+// same lookup as basic.frag, from the rebuilt positions
+float computeShadow(vec3 posEye, vec3 posWorld)
+{
+    int cascade = -1;
+    for (int i = 0; i < cascadeCount; i++) {
+        if (-posEye.z < cascadeSplits[i]) {
+            cascade = i;
+            break;
+        }
+    }
+    if (cascade < 0)
+        return 0.0f;
+
+    vec4 fragPosLightSpace = lightSpaceTrMatrices[cascade] * vec4(posWorld, 1.0f);
+    vec3 normalizedCoords = fragPosLightSpace.xyz / fragPosLightSpace.w;
+    normalizedCoords = normalizedCoords * 0.5 + 0.5;
+    float currentDepth = normalizedCoords.z;
+    if (currentDepth > 1.0f)
+        return 0.0f;
+
+    float bias = cascadeDepthBias[cascade];
+#ifdef PCF_TAPS
+    int radius = (int(sqrt(float(PCF_TAPS))) - 1) / 2;
+    vec2 texelSize = 1.0f / vec2(textureSize(shadowMap, 0).xy);
+    float shadow = 0.0f;
+    for (int x = -radius; x <= radius; x++) {
+        for (int y = -radius; y <= radius; y++) {
+            float closestDepth = texture(shadowMap, vec3(normalizedCoords.xy + vec2(x, y) * texelSize, cascade)).r;
+            shadow += (currentDepth - bias) > closestDepth ? 1.0f : 0.0f;
+        }
+    }
+    return shadow / float((2 * radius + 1) * (2 * radius + 1));
+#else
+    float closestDepth = texture(shadowMap, vec3(normalizedCoords.xy, cascade)).r;
+    return (currentDepth - bias) > closestDepth ? 1.0f : 0.0f;
+#endif
+}
+#endif
+
+void main()
+{
+    ivec2 pixel = ivec2(gl_FragCoord.xy);
+    float depth = texelFetch(gDepth, pixel, 0).r;
+    // nothing was drawn here, the skybox fills it
+    if (depth == 1.0f)
+        discard;
+    gl_FragDepth = depth;
+
+    vec4 albedoSpec = texelFetch(gAlbedoSpec, pixel, 0);
+    vec3 normalEye = octDecode(texelFetch(gNormal, pixel, 0).rg * 2.0f - 1.0f);
+    vec3 posEye = reconstructPosEye(gl_FragCoord.xy / vec2(textureSize(gDepth, 0)), depth);
+
+    // directional light, as computeDirLight() in basic.frag
+    vec3 lightDirN = vec3(normalize(view * vec4(lightDir.xyz, 0.0f)));
+    vec3 viewDir = normalize(-posEye);
+    vec3 ambient = ambientStrength * lightColor.rgb;
+    vec3 diffuse = max(dot(normalEye, lightDirN), 0.0f) * lightColor.rgb;
+    vec3 reflectDir = reflect(-lightDirN, normalEye);
+    vec3 specular = specularStrength * pow(max(dot(viewDir, reflectDir), 0.0f), 32) * lightColor.rgb;
+
+#ifdef SHADOWS
+    // the view matrix is rigid, its inverse is the transposed rotation
+    vec3 posWorld = transpose(mat3(view)) * (posEye - view[3].xyz);
+    float shadow = computeShadow(posEye, posWorld);
+#else
+    float shadow = 0.0f;
+#endif
+
+    vec3 color = (ambient + (1.0f - shadow) * diffuse) * albedoSpec.rgb;
+    color += (1.0f - shadow) * specular * albedoSpec.a;
+    color += texelFetch(lightBuffer, pixel, 0).rgb;
+    color = min(color, 1.0f);
+#ifdef FOG
+    float visibility = clamp(exp(-pow((length(posEye) * density), gradient)), 0.0f, 1.0f);
+    color = vec3(mix(vec4(0.5f, 0.5f, 0.5f, 1.0f), vec4(color, 1.0f), visibility));
+#endif
+    color = vec3(mix(vec4(0.0f, 0.0f, 0.0f, 1.0f), vec4(color, 1.0f), lightColorCoeff));
+    fColor = vec4(color, 1.0f);
+}
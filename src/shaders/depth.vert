@@ -0,0 +1,18 @@
+#version 410 core
+
+layout(location=0) in vec3 vPosition;
+// per-instance transform, see gps::InstanceData
+layout(location=3) in mat4 instanceModel;
+
+// the FrameData block is inserted by gps::Shader, see gps::FrameUniforms::blockSource()
+
+// the main pass tests against this depth with GL_EQUAL, so both must compute the exact same value
+invariant gl_Position;
+
+void main()
+{
+	// same operations, in the same order, as basic.vert
+	vec4 posWorld = instanceModel * vec4(vPosition, 1.0f);
+	vec4 posCamSpace = view * posWorld;
+	gl_Position = projection * posCamSpace;
+}
@@ -0,0 +1,11 @@
+#version 410 core
+
+out vec2 fTexCoords;
+
+void main()
+{
+    // one triangle covering the screen, made from the vertex index alone
+    vec2 position = vec2((gl_VertexID << 1) & 2, gl_VertexID & 2);
+    fTexCoords = position;
+    gl_Position = vec4(position * 2.0f - 1.0f, 0.0f, 1.0f);
+}
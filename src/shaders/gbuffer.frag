@@ -0,0 +1,37 @@
+#version 410 core
+
+in vec3 fPosEye;
+in vec3 fNormalEye;
+in vec2 fTexCoords;
+
+// see gps::DeferredRenderer for the layout
+layout(location=0) out vec4 fAlbedoSpec;
+layout(location=1) out vec2 fNormal;
+
+// compile-time features (see gps::ShaderVariants): SPECULAR_MAP
+uniform sampler2D diffuseTexture;
+#ifdef SPECULAR_MAP
+uniform sampler2D specularTexture;
+#endif
+
+// octahedral mapping of a unit vector to [-1, 1]^2
+vec2 octEncode(vec3 n)
+{
+    n /= abs(n.x) + abs(n.y) + abs(n.z);
+    vec2 e = n.xy;
+    if (n.z < 0.0f)
+        e = (1.0f - abs(n.yx)) * vec2(n.x >= 0.0f ? 1.0f : -1.0f, n.y >= 0.0f ? 1.0f : -1.0f);
+    return e;
+}
+
+void main()
+{
+    fAlbedoSpec.rgb = texture(diffuseTexture, fTexCoords).rgb;
+#ifdef SPECULAR_MAP
+    // one channel is enough for grey specular maps
+    fAlbedoSpec.a = dot(texture(specularTexture, fTexCoords).rgb, vec3(1.0f / 3.0f));
+#else
+    fAlbedoSpec.a = 0.0f;
+#endif
+    fNormal = octEncode(normalize(fNormalEye)) * 0.5f + 0.5f;
+}
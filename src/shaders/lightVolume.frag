@@ -0,0 +1,58 @@
+#version 410 core
+
+flat in vec4 fLightPosRadius;
+flat in vec4 fLightColorCone;
+flat in vec4 fLightDirectionCone;
+
+out vec4 fColor;
+
+// the FrameData block is inserted by gps::Shader, see gps::FrameUniforms::blockSource()
+uniform sampler2D gAlbedoSpec;
+uniform sampler2D gNormal;
+uniform sampler2D gDepth;
+
+float specularStrength = 0.5f;
+
+vec3 octDecode(vec2 e)
+{
+    vec3 n = vec3(e, 1.0f - abs(e.x) - abs(e.y));
+    if (n.z < 0.0f)
+        n.xy = (1.0f - abs(n.yx)) * vec2(n.x >= 0.0f ? 1.0f : -1.0f, n.y >= 0.0f ? 1.0f : -1.0f);
+    return normalize(n);
+}
+
+vec3 reconstructPosEye(vec2 texCoords, float depth)
+{
+    float z = -projection[3][2] / (depth * 2.0f - 1.0f + projection[2][2]);
+    vec2 ndc = texCoords * 2.0f - 1.0f;
+    return vec3(-ndc.x * z / projection[0][0], -ndc.y * z / projection[1][1], z);
+}
+
+void main()
+{
+    ivec2 pixel = ivec2(gl_FragCoord.xy);
+    float depth = texelFetch(gDepth, pixel, 0).r;
+    if (depth == 1.0f)
+        discard;
+
+    // the depth test of the volume, done here against the surface stored in the G-buffer
+    vec3 posEye = reconstructPosEye(gl_FragCoord.xy / vec2(textureSize(gDepth, 0)), depth);
+    vec3 toLight = fLightPosRadius.xyz - posEye;
+    float distance = length(toLight);
+    if (distance >= fLightPosRadius.w)
+        discard;
+
+    vec4 albedoSpec = texelFetch(gAlbedoSpec, pixel, 0);
+    vec3 normalEye = octDecode(texelFetch(gNormal, pixel, 0).rg * 2.0f - 1.0f);
+
+    // same falloff and terms as the POINT_LIGHTS loop of basic.frag
+    float falloff = 1.0f - (distance * distance) / (fLightPosRadius.w * fLightPosRadius.w);
+    falloff *= falloff;
+    vec3 lightDirN = toLight / distance;
+    falloff *= smoothstep(fLightColorCone.w, fLightDirectionCone.w, dot(-lightDirN, fLightDirectionCone.xyz));
+    vec3 viewDir = normalize(-posEye);
+    float diffuse = max(dot(normalEye, lightDirN), 0.0f);
+    float specular = specularStrength * pow(max(dot(viewDir, reflect(-lightDirN, normalEye)), 0.0f), 32);
+
+    fColor = vec4((diffuse * albedoSpec.rgb + specular * albedoSpec.a) * falloff * fLightColorCone.rgb, 0.0f);
+}
@@ -0,0 +1,22 @@
+#version 410 core
+
+layout(location=0) in vec3 vPosition;
+// one gps::PointLight per instance, already in view space
+layout(location=3) in vec4 instancePosRadius;
+layout(location=4) in vec4 instanceColorCone;
+layout(location=5) in vec4 instanceDirectionCone;
+
+flat out vec4 fLightPosRadius;
+flat out vec4 fLightColorCone;
+flat out vec4 fLightDirectionCone;
+
+// the FrameData block is inserted by gps::Shader, see gps::FrameUniforms::blockSource()
+
+void main()
+{
+    fLightPosRadius = instancePosRadius;
+    fLightColorCone = instanceColorCone;
+    fLightDirectionCone = instanceDirectionCone;
+    // unit sphere scaled to the light's radius
+    gl_Position = projection * vec4(instancePosRadius.xyz + vPosition * instancePosRadius.w, 1.0f);
+}
@@ -1,11 +1,13 @@
 #version 410 core
 
 layout(location=0) in vec3 vPosition;
+// per-instance transform, see gps::InstanceData
+layout(location=3) in mat4 instanceModel;
 
-uniform mat4 lightSpaceTrMatrix;
-uniform mat4 model;
+// the FrameData block is inserted by gps::Shader, see gps::FrameUniforms::blockSource()
 
 void main()
 {
-	gl_Position = lightSpaceTrMatrix * model * vec4(vPosition, 1.0f);
+	// world space, shadow.geom projects it once per cascade
+	gl_Position = instanceModel * vec4(vPosition, 1.0f);
 }
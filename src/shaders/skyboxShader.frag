@@ -4,8 +4,8 @@ in vec3 textureCoordinates;
 out vec4 color;
 
 uniform samplerCube skybox;
-uniform bool fogEnabled;
-uniform float lightColorCoeff;
+
+// the FrameData block is inserted by gps::Shader, see gps::FrameUniforms::blockSource()
 
 void main()
 {